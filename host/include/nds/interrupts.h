@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - Host build of sgIP
+
+#ifndef HOST_NDS_INTERRUPTS_H
+#define HOST_NDS_INTERRUPTS_H
+
+// The interrupt threading model of sgIP uses the critical sections of libnds. In the host build
+// they are implemented by sgIP_Host.c with a lock that behaves like REG_IME: the first call in a
+// thread takes it and returns 1, nested calls return 0, and leaveCriticalSection(1) releases it.
+
+int enterCriticalSection(void);
+void leaveCriticalSection(int oldIME);
+
+#endif // HOST_NDS_INTERRUPTS_H
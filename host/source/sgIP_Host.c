@@ -0,0 +1,363 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - Host build of sgIP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arm9/sgIP/sgIP.h"
+#include "sgIP_Host.h"
+
+// Largest frame that can be sent or received, Ethernet header included.
+#define SGIP_HOST_MAXFRAME 16384
+
+// Longest time that sgIP_IntrWaitEvent() waits for a notification.
+#define SGIP_HOST_MAXWAITMS 20
+
+// Time that sgIP_IntrWaitEvent() spins in busy-wait mode. It's about what swiDelay(20000) takes on
+// the DS, which is what the DS does when the application hasn't set any wait handler.
+#define SGIP_HOST_BUSYWAITUS 2400
+
+//////////////////////////////////////////////////////////////////////////
+// Platform functions required by sgIP
+
+void *sgIP_malloc(int size)
+{
+    return malloc(size);
+}
+
+void sgIP_free(void *ptr)
+{
+    free(ptr);
+}
+
+#ifdef SGIP_DEBUG
+void sgIP_dbgprint(char *msg, ...)
+{
+    va_list args;
+    va_start(args, msg);
+    vfprintf(stderr, msg, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+#endif
+
+// Notifications are counted. Every thread remembers the count when it releases the stack lock, so
+// a notification that happens between that moment and the call to sgIP_IntrWaitEvent() isn't
+// missed.
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond  = PTHREAD_COND_INITIALIZER;
+static unsigned int event_count;
+static __thread unsigned int event_seen;
+
+static void sgIP_Host_EventSnapshot(void)
+{
+    pthread_mutex_lock(&event_lock);
+    event_seen = event_count;
+    pthread_mutex_unlock(&event_lock);
+}
+
+#ifdef SGIP_INTERRUPT_THREADING_MODEL
+
+// Lock that replaces REG_IME. host_lock_held is set in the thread that holds it.
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int host_lock_held;
+
+int enterCriticalSection(void)
+{
+    if (host_lock_held)
+        return 0;
+
+    pthread_mutex_lock(&host_lock);
+    host_lock_held = 1;
+    return 1;
+}
+
+void leaveCriticalSection(int oldIME)
+{
+    if (!oldIME)
+        return;
+
+    sgIP_Host_EventSnapshot();
+
+    host_lock_held = 0;
+    pthread_mutex_unlock(&host_lock);
+}
+
+#else // SGIP_MULTITHREADED_THREADING_MODEL
+
+void *sgIP_MutexCreate(void)
+{
+    pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+    if (!mutex)
+        abort();
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    return mutex;
+}
+
+void sgIP_MutexLock(void *mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+void sgIP_MutexUnlock(void *mutex)
+{
+    if (mutex == sgIP_stack_mutex)
+        sgIP_Host_EventSnapshot();
+
+    pthread_mutex_unlock(mutex);
+}
+
+#endif
+
+static int busy_wait;
+
+void sgIP_Host_SetBusyWait(int enable)
+{
+    busy_wait = enable;
+}
+
+void sgIP_IntrWaitEvent(const void *event)
+{
+    (void)event;
+
+    if (busy_wait)
+    {
+        struct timespec start, ts;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+        while ((ts.tv_sec - start.tv_sec) * 1000000L + (ts.tv_nsec - start.tv_nsec) / 1000
+               < SGIP_HOST_BUSYWAITUS);
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += SGIP_HOST_MAXWAITMS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_nsec -= 1000000000L;
+        ts.tv_sec++;
+    }
+
+    pthread_mutex_lock(&event_lock);
+    if (event_count == event_seen)
+        pthread_cond_timedwait(&event_cond, &event_lock, &ts);
+    event_seen = event_count;
+    pthread_mutex_unlock(&event_lock);
+}
+
+void sgIP_IntrNotifyEvent(const void *event)
+{
+    (void)event;
+
+    pthread_mutex_lock(&event_lock);
+    event_count++;
+    pthread_cond_broadcast(&event_cond);
+    pthread_mutex_unlock(&event_lock);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Timer
+
+static void *sgIP_Host_TimerThread(void *arg)
+{
+    int timer_ms = (int)(intptr_t)arg;
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (;;)
+    {
+        next.tv_nsec += timer_ms * 1000000L;
+        while (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        SGIP_INTR_PROTECT();
+        sgIP_Timer(timer_ms);
+        SGIP_INTR_UNPROTECT();
+    }
+
+    return NULL;
+}
+
+void sgIP_Host_Init(int timer_ms)
+{
+    if (timer_ms < 1)
+        timer_ms = 1;
+
+    sgIP_Init();
+
+    uint32_t seed[4];
+    if (getentropy(seed, sizeof(seed)) == 0)
+    {
+        for (int i = 0; i < 4; i++)
+            sgIP_Random_AddEntropy(seed[i]);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sgIP_Host_TimerThread, (void *)(intptr_t)timer_ms) == 0)
+        pthread_detach(thread);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// File descriptor interfaces
+
+// Configuration of the interface that is being added, used by sgIP_Host_InterfaceInit().
+static int pending_fd;
+static int pending_mtu;
+static unsigned char pending_hwaddr[6];
+
+static int sgIP_Host_InterfaceInit(sgIP_Hub_HWInterface *hw)
+{
+    hw->MTU       = pending_mtu;
+    hw->hwaddrlen = 6;
+    memcpy(hw->hwaddr, pending_hwaddr, 6);
+    hw->userdata = (void *)(intptr_t)pending_fd;
+    return 0;
+}
+
+static int sgIP_Host_Transmit(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
+{
+    // Transmission happens with the stack locked, so one buffer is enough.
+    static unsigned char frame[SGIP_HOST_MAXFRAME];
+
+    int fd  = (int)(intptr_t)hw->userdata;
+    int len = 0;
+
+    if (mb->totallength <= SGIP_HOST_MAXFRAME)
+        len = sgIP_memblock_CopyToLinear(mb, frame, 0, mb->totallength);
+
+    sgIP_memblock_free(mb);
+
+    // Like a radio, a frame that can't be sent is simply lost. The file descriptor is non-blocking:
+    // waiting here would hold the stack lock, which the thread that reads the other end of a
+    // packet pipe may need before it can read more frames.
+    if (len > 0 && write(fd, frame, len) != len)
+    {
+        SGIP_DEBUG_MESSAGE(("host: frame lost (%d)", errno));
+    }
+
+    return 0;
+}
+
+static void *sgIP_Host_ReceiveThread(void *arg)
+{
+    sgIP_Hub_HWInterface *hw = arg;
+    int fd                   = (int)(intptr_t)hw->userdata;
+
+    static const unsigned char broadcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    unsigned char frame[SGIP_HOST_MAXFRAME];
+
+    for (;;)
+    {
+        ssize_t len = read(fd, frame, sizeof(frame));
+        if (len < 0 && errno == EAGAIN)
+        {
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            break;
+        if (len < (ssize_t)sizeof(sgIP_Header_Ethernet))
+            continue;
+
+        SGIP_INTR_PROTECT();
+
+        // Only accept frames addressed to this interface, to everyone, or to a multicast group
+        // that has been joined, like the DS wifi interface.
+        if (memcmp(frame, hw->hwaddr, 6) == 0 || memcmp(frame, broadcast, 6) == 0
+            || sgIP_IGMP_IsMemberMAC(frame))
+        {
+            sgIP_memblock *mb = sgIP_memblock_allocHW(sizeof(sgIP_Header_Ethernet),
+                                                      len - sizeof(sgIP_Header_Ethernet));
+            if (mb)
+            {
+                sgIP_memblock_CopyFromLinear(mb, frame, 0, len);
+                sgIP_Hub_ReceiveHardwarePacket(hw, mb);
+            }
+        }
+
+        SGIP_INTR_UNPROTECT();
+    }
+
+    return NULL;
+}
+
+sgIP_Hub_HWInterface *sgIP_Host_AddInterface(int fd, const unsigned char *hwaddr, int mtu)
+{
+    SGIP_INTR_PROTECT();
+
+    pending_fd  = fd;
+    pending_mtu = mtu;
+    if (hwaddr)
+    {
+        memcpy(pending_hwaddr, hwaddr, 6);
+    }
+    else
+    {
+        // Locally administered unicast address
+        srand(time(NULL) ^ getpid() ^ fd);
+        for (int i = 0; i < 6; i++)
+            pending_hwaddr[i] = rand();
+        pending_hwaddr[0] = (pending_hwaddr[0] & 0xFC) | 0x02;
+    }
+
+    sgIP_Hub_HWInterface *hw = sgIP_Hub_AddHardwareInterface(&sgIP_Host_Transmit,
+                                                             &sgIP_Host_InterfaceInit);
+
+    SGIP_INTR_UNPROTECT();
+
+    if (!hw)
+        return NULL;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sgIP_Host_ReceiveThread, hw) != 0)
+        return NULL;
+    pthread_detach(thread);
+
+    return hw;
+}
+
+void sgIP_Host_SetIP(sgIP_Hub_HWInterface *hw, unsigned long ipaddr, unsigned long gateway,
+                     unsigned long snmask, unsigned long dns)
+{
+    SGIP_INTR_PROTECT();
+
+    hw->ipaddr  = ipaddr;
+    hw->gateway = gateway;
+    hw->snmask  = snmask;
+    hw->dns[0]  = dns;
+    sgIP_ARP_FlushInterface(hw);
+    if (ipaddr)
+        sgIP_ARP_Announce(hw);
+
+    SGIP_INTR_UNPROTECT();
+}
@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - Host build of sgIP
+
+#ifndef SGIP_HOST_H
+#define SGIP_HOST_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "arm9/sgIP/sgIP_Hub.h"
+
+// Initializes sgIP and starts a thread that calls sgIP_Timer() every timer_ms milliseconds. The
+// receive threads of the interfaces and the timer thread run the stack holding the stack lock, like
+// the interrupt handlers of the DS do. In the interrupt model that lock is the one of
+// enterCriticalSection(), and in the multithreaded model it's the stack mutex.
+void sgIP_Host_Init(int timer_ms);
+
+// Makes blocking socket calls spin between checks instead of waiting for a notification, like
+// on the DS when the application hasn't called Wifi_SetWaitHandlers(). It must be called when no
+// thread is using the sockets.
+void sgIP_Host_SetBusyWait(int enable);
+
+// Adds a hardware interface that exchanges Ethernet frames with a file descriptor, one frame per
+// read() or write(), like a TAP device or a packet pipe. A thread is started to receive frames.
+// The file descriptor is made non-blocking, and frames that can't be written right away are lost.
+// If hwaddr is NULL a random locally administered address is used. Returns NULL on error.
+sgIP_Hub_HWInterface *sgIP_Host_AddInterface(int fd, const unsigned char *hwaddr, int mtu);
+
+// Sets the IP configuration of an interface (addresses in network byte order), like
+// Wifi_SetIP(), and announces it to the network.
+void sgIP_Host_SetIP(sgIP_Hub_HWInterface *hw, unsigned long ipaddr, unsigned long gateway,
+                     unsigned long snmask, unsigned long dns);
+
+// Opens the TAP device with the given name (it is created if it doesn't exist, which requires
+// CAP_NET_ADMIN). Returns the file descriptor, or -1 on error.
+int sgIP_Host_OpenTap(const char *name);
+
+// Creates a packet pipe. fds[0] is meant for sgIP_Host_AddInterface() and fds[1] for the other
+// end of the link (another interface, or a test that reads and writes raw Ethernet frames).
+// Returns 0 on success, or -1 on error.
+int sgIP_Host_OpenPipe(int fds[2]);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // SGIP_HOST_H
@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - Host build of sgIP
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arm9/sgIP/sgIP.h"
+#include "sgIP_Sim.h"
+
+// Largest frame that can be sent or received, Ethernet header included.
+#define SGIP_SIM_MAXFRAME 2048
+
+// Bookkeeping of every allocation in the heap of the DS (the size of wHeapRecord on the ARM9).
+#define SGIP_SIM_HEAPRECORD 12
+
+// Header added to every allocation to remember its size. It keeps the alignment of malloc().
+#define SGIP_SIM_ALLOCHEADER 16
+
+static int heap_size;
+static int heap_used;
+static int heap_peak;
+
+static sgIP_Sim_TransmitFn sim_transmit;
+static void *sim_link;
+
+static unsigned char pending_hwaddr[6];
+
+//////////////////////////////////////////////////////////////////////////
+// Platform functions required by sgIP
+
+void *sgIP_malloc(int size)
+{
+    // Same rounding as wHeapAlloc()
+    int charged = SGIP_SIM_HEAPRECORD + (size > 0 ? (size + 3) & ~3 : 4);
+
+    if (heap_size > 0 && heap_used + charged > heap_size)
+        return NULL;
+
+    unsigned char *ptr = malloc(SGIP_SIM_ALLOCHEADER + size);
+    if (!ptr)
+        return NULL;
+
+    *(int *)ptr = charged;
+    heap_used += charged;
+    if (heap_used > heap_peak)
+        heap_peak = heap_used;
+
+    return ptr + SGIP_SIM_ALLOCHEADER;
+}
+
+void sgIP_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    unsigned char *block = (unsigned char *)ptr - SGIP_SIM_ALLOCHEADER;
+    heap_used -= *(int *)block;
+    free(block);
+}
+
+#ifdef SGIP_DEBUG
+void sgIP_dbgprint(char *msg, ...)
+{
+    va_list args;
+    va_start(args, msg);
+    vfprintf(stderr, msg, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+#endif
+
+// Everything runs in one thread, so there is nothing to protect.
+#ifdef SGIP_INTERRUPT_THREADING_MODEL
+
+int enterCriticalSection(void)
+{
+    return 0;
+}
+
+void leaveCriticalSection(int oldIME)
+{
+    (void)oldIME;
+}
+
+#else // SGIP_MULTITHREADED_THREADING_MODEL
+
+void *sgIP_MutexCreate(void)
+{
+    static int dummy;
+    return &dummy;
+}
+
+void sgIP_MutexLock(void *mutex)
+{
+    (void)mutex;
+}
+
+void sgIP_MutexUnlock(void *mutex)
+{
+    (void)mutex;
+}
+
+#endif
+
+void sgIP_IntrWaitEvent(const void *event)
+{
+    (void)event;
+
+    // The clock of the simulator can't advance while a call waits, so it would wait forever.
+    fprintf(stderr, "sgIP_Sim: blocking socket call, use non-blocking sockets\n");
+    abort();
+}
+
+void sgIP_IntrNotifyEvent(const void *event)
+{
+    (void)event;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Interface
+
+static int sgIP_Sim_InterfaceInit(sgIP_Hub_HWInterface *hw)
+{
+    hw->MTU       = 1500;
+    hw->hwaddrlen = 6;
+    memcpy(hw->hwaddr, pending_hwaddr, 6);
+    return 0;
+}
+
+static int sgIP_Sim_Transmit(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
+{
+    (void)hw;
+
+    unsigned char frame[SGIP_SIM_MAXFRAME];
+    int len = 0;
+
+    if (mb->totallength <= SGIP_SIM_MAXFRAME)
+        len = sgIP_memblock_CopyToLinear(mb, frame, 0, mb->totallength);
+
+    sgIP_memblock_free(mb);
+
+    if (len > 0)
+        sim_transmit(sim_link, frame, len);
+
+    return 0;
+}
+
+static sgIP_Hub_HWInterface *sim_hw;
+
+void sgIP_Sim_Init(const unsigned char *hwaddr, unsigned long ipaddr, unsigned long snmask,
+                   int heap, sgIP_Sim_TransmitFn transmit, void *link)
+{
+    heap_size    = heap;
+    sim_transmit = transmit;
+    sim_link     = link;
+    memcpy(pending_hwaddr, hwaddr, 6);
+
+    sgIP_Init();
+    if (heap > 0)
+        sgIP_TCP_SetHeapSize(heap);
+
+    // The seed only depends on the node, so the simulation can be repeated.
+    sgIP_Random_AddEntropy((hwaddr[2] << 24) | (hwaddr[3] << 16) | (hwaddr[4] << 8) | hwaddr[5]);
+    sgIP_Random_AddEntropy(ipaddr);
+
+    sim_hw = sgIP_Hub_AddHardwareInterface(&sgIP_Sim_Transmit, &sgIP_Sim_InterfaceInit);
+    if (!sim_hw)
+        abort();
+
+    sim_hw->ipaddr = ipaddr;
+    sim_hw->snmask = snmask;
+    sgIP_ARP_Announce(sim_hw);
+}
+
+void sgIP_Sim_SetIP(unsigned long ipaddr, unsigned long gateway, int announce)
+{
+    sim_hw->ipaddr  = ipaddr;
+    sim_hw->gateway = gateway;
+    sgIP_ARP_FlushInterface(sim_hw);
+    if (ipaddr && announce)
+        sgIP_ARP_Announce(sim_hw);
+}
+
+void sgIP_Sim_Receive(const void *frame, int len)
+{
+    static const unsigned char broadcast[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+    if (len < (int)sizeof(sgIP_Header_Ethernet))
+        return;
+
+    // Only accept frames addressed to this interface, like the DS wifi interface.
+    if (memcmp(frame, sim_hw->hwaddr, 6) != 0 && memcmp(frame, broadcast, 6) != 0
+        && !sgIP_IGMP_IsMemberMAC(frame))
+        return;
+
+    sgIP_memblock *mb = sgIP_memblock_allocHW(sizeof(sgIP_Header_Ethernet),
+                                              len - sizeof(sgIP_Header_Ethernet));
+    if (!mb)
+        return;
+
+    sgIP_memblock_CopyFromLinear(mb, (void *)frame, 0, len);
+    sgIP_Hub_ReceiveHardwarePacket(sim_hw, mb);
+}
+
+void sgIP_Sim_Timer(int num_ms)
+{
+    sgIP_Timer(num_ms);
+}
+
+void sgIP_Sim_GetHeapUsage(int *used, int *peak)
+{
+    if (used)
+        *used = heap_used;
+    if (peak)
+        *peak = heap_peak;
+}
+
+void sgIP_Sim_ResetHeapPeak(void)
+{
+    heap_peak = heap_used;
+}
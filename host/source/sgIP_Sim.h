@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - Host build of sgIP
+
+#ifndef SGIP_SIM_H
+#define SGIP_SIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Node of the link simulator (tools/sgip_sim.c). sgIP keeps all its state in global variables, so
+// every node is a copy of a shared library with the stack and this interface, loaded with
+// dlopen(). Everything runs in the thread of the simulator, and time only advances when it calls
+// sgIP_Sim_Timer(), so blocking socket calls can't be used: all sockets must be non-blocking.
+
+// Called for every frame sent by the node. "link" is the value passed to sgIP_Sim_Init().
+typedef void (*sgIP_Sim_TransmitFn)(void *link, const void *frame, int len);
+
+// Initializes the stack with one Ethernet interface (addresses in network byte order). Allocations
+// fail when they would make the heap usage go over heap_size bytes, like in the heap of the DS.
+void sgIP_Sim_Init(const unsigned char *hwaddr, unsigned long ipaddr, unsigned long snmask,
+                   int heap_size, sgIP_Sim_TransmitFn transmit, void *link);
+
+// Changes the IP address and the gateway of the interface, like Wifi_SetIP() does on the DS once
+// it's connected. An address of 0 means that the node doesn't have one yet. If "announce" is 0, the
+// new address isn't announced with sgIP_ARP_Announce(), to measure what that saves.
+void sgIP_Sim_SetIP(unsigned long ipaddr, unsigned long gateway, int announce);
+
+// Passes a received Ethernet frame to the stack.
+void sgIP_Sim_Receive(const void *frame, int len);
+
+// Advances the clock of the stack.
+void sgIP_Sim_Timer(int num_ms);
+
+// Returns the heap usage of the node, counted like Wifi_GetHeapUsage() does on the DS, and the
+// highest usage since the start or since the last call to sgIP_Sim_ResetHeapPeak().
+void sgIP_Sim_GetHeapUsage(int *used, int *peak);
+void sgIP_Sim_ResetHeapPeak(void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // SGIP_SIM_H
@@ -0,0 +1,1172 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - Host build of sgIP
+
+// CPU cost of the packet paths of sgIP. The stack runs in this thread with the interface of the
+// link simulator (sgIP_Sim.c): one copy is linked with the benchmark, and the builds that are
+// compared with each other are loaded as libraries. The benchmark plays the role of a peer: it
+// builds the frames that the stack receives, and the frames sent by the stack are discarded. The
+// clock of the stack doesn't advance.
+//
+// Every case is run several times, alternating with the cases it's compared with, and the fastest
+// run of each one is reported, which removes most of the noise of the host. Times are CPU time of
+// the thread.
+//
+// Benchmarks:
+//
+// - batch: UDP datagrams sent and received in batches with sendmmsg() and recvmmsg(), and one at a
+//   time with sendto() and recvfrom().
+// - capture: UDP datagrams received and sent with the capture of frames stopped and running.
+// - connected: UDP datagrams sent with sendto() and with send() on a connected socket.
+// - counters: TCP requests received and answered by a build of the stack with the counters of
+//   TCP_INFO and by a build without them (SGIP_TCP_NOSTATS).
+// - demux: UDP datagrams received and read with up to 30 other sockets open, half of them
+//   connected.
+// - ports: Ephemeral ports bound and released while thousands of other ports are in use, like
+//   sockets and connections in TIME_WAIT.
+// - rxcheck: UDP datagrams of several sizes received and read without a checksum, with the
+//   checksum verified while the data is copied, and with a checksum that the socket doesn't verify
+//   (SO_RCVNOCHECK).
+
+#include <dlfcn.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "arm9/sgIP/sgIP.h"
+#include "sgIP_Sim.h"
+
+#define ADDR_NODE "10.0.0.1"
+#define ADDR_PEER "10.0.0.2"
+#define ADDR_MASK "255.255.255.0"
+
+#define PORT_NODE 7000
+#define PORT_PEER 7001
+
+#define MAX_FRAME 2048
+
+static const unsigned char hwaddr_node[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+static const unsigned char hwaddr_peer[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+
+static int iterations = 100000;
+static int runs       = 5;
+static int msg_size   = 64;
+
+static unsigned long frames_sent;
+
+// Frames sent by the stack
+static void discard_frame(void *link, const void *frame, int len)
+{
+    (void)link;
+    (void)frame;
+    (void)len;
+
+    frames_sent++;
+}
+
+static int64_t time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Frames
+// ------
+
+static void put16(unsigned char *p, unsigned int value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static void put_addr(unsigned char *p, const char *ip)
+{
+    uint32_t addr = inet_addr(ip); // network byte order
+    memcpy(p, &addr, 4);
+}
+
+static unsigned int checksum_add(unsigned int sum, const unsigned char *data, int len)
+{
+    for (int i = 0; i + 1 < len; i += 2)
+        sum += (data[i] << 8) | data[i + 1];
+    if (len & 1)
+        sum += data[len - 1] << 8;
+    return sum;
+}
+
+static unsigned int checksum_end(unsigned int sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum & 0xFFFF;
+}
+
+// Builds an Ethernet frame with a UDP datagram from the peer to the node. The UDP checksum is
+// only calculated if "checksum" isn't 0. Returns the length of the frame.
+static int make_udp_frame(unsigned char *frame, int srcport, int destport, const void *data,
+                          int len, int checksum)
+{
+    unsigned char *ip  = frame + 14;
+    unsigned char *udp = ip + 20;
+
+    memcpy(frame, hwaddr_node, 6);
+    memcpy(frame + 6, hwaddr_peer, 6);
+    put16(frame + 12, 0x0800);
+
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    put16(ip + 2, 20 + 8 + len);
+    ip[8] = 64; // TTL
+    ip[9] = 17; // UDP
+    put_addr(ip + 12, ADDR_PEER);
+    put_addr(ip + 16, ADDR_NODE);
+    put16(ip + 10, checksum_end(checksum_add(0, ip, 20)));
+
+    put16(udp, srcport);
+    put16(udp + 2, destport);
+    put16(udp + 4, 8 + len);
+    put16(udp + 6, 0);
+    memcpy(udp + 8, data, len);
+
+    if (checksum)
+    {
+        unsigned int sum = checksum_add(0, ip + 12, 8); // addresses of the pseudo-header
+        sum += 17 + 8 + len;
+        sum = checksum_end(checksum_add(sum, udp, 8 + len));
+        put16(udp + 6, sum ? sum : 0xFFFF);
+    }
+
+    return 14 + 20 + 8 + len;
+}
+
+// Builds an Ethernet frame with a TCP segment without options from the peer to the node. Returns
+// the length of the frame.
+static int make_tcp_frame(unsigned char *frame, uint32_t seq, uint32_t ack, int flags,
+                          const void *data, int len)
+{
+    unsigned char *ip  = frame + 14;
+    unsigned char *tcp = ip + 20;
+
+    memcpy(frame, hwaddr_node, 6);
+    memcpy(frame + 6, hwaddr_peer, 6);
+    put16(frame + 12, 0x0800);
+
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    put16(ip + 2, 20 + 20 + len);
+    ip[8] = 64; // TTL
+    ip[9] = 6;  // TCP
+    put_addr(ip + 12, ADDR_PEER);
+    put_addr(ip + 16, ADDR_NODE);
+    put16(ip + 10, checksum_end(checksum_add(0, ip, 20)));
+
+    memset(tcp, 0, 20);
+    put16(tcp, PORT_PEER);
+    put16(tcp + 2, PORT_NODE);
+    put16(tcp + 4, seq >> 16);
+    put16(tcp + 6, seq);
+    put16(tcp + 8, ack >> 16);
+    put16(tcp + 10, ack);
+    tcp[12] = 5 << 4; // header length
+    tcp[13] = flags;
+    put16(tcp + 14, 65535); // window
+    memcpy(tcp + 20, data, len);
+
+    unsigned int sum = checksum_add(0, ip + 12, 8); // addresses of the pseudo-header
+    sum += 6 + 20 + len;
+    put16(tcp + 16, checksum_end(checksum_add(sum, tcp, 20 + len)));
+
+    return 14 + 20 + 20 + len;
+}
+
+// Builds the ARP reply of the peer to a request of the node. Returns the length of the frame.
+static int make_arp_reply(unsigned char *frame)
+{
+    memcpy(frame, hwaddr_node, 6);
+    memcpy(frame + 6, hwaddr_peer, 6);
+    put16(frame + 12, 0x0806);
+    put16(frame + 14, 1);      // Ethernet
+    put16(frame + 16, 0x0800); // IPv4
+    frame[18] = 6;
+    frame[19] = 4;
+    put16(frame + 20, 2); // reply
+    memcpy(frame + 22, hwaddr_peer, 6);
+    put_addr(frame + 28, ADDR_PEER);
+    memcpy(frame + 32, hwaddr_node, 6);
+    put_addr(frame + 38, ADDR_NODE);
+    return 42;
+}
+
+// Answers the ARP request that the stack sends the first time it sends something to the peer, so
+// that the rest of the frames are sent right away.
+static void resolve_peer(int sock)
+{
+    struct sockaddr_in peer;
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family      = AF_INET;
+    peer.sin_port        = htons(PORT_PEER);
+    peer.sin_addr.s_addr = inet_addr(ADDR_PEER);
+    sendto(sock, "", 0, 0, (struct sockaddr *)&peer, sizeof(peer));
+
+    unsigned char frame[42];
+    sgIP_Sim_Receive(frame, make_arp_reply(frame));
+}
+
+static int open_udp(int port)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return -1;
+
+    int nonblocking = 1;
+    ioctl(sock, FIONBIO, &nonblocking);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        closesocket(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// Benchmarks
+// ----------
+
+// Receives a datagram, reads it, and sends it back to the peer.
+static int64_t run_echo(int sock, const unsigned char *frame, int frame_len, void *scratch,
+                        int scratch_size)
+{
+    unsigned char buffer[MAX_FRAME];
+    struct sockaddr_in from;
+    unsigned long sent = frames_sent;
+
+    int64_t start = time_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        sgIP_Sim_Receive(frame, frame_len);
+
+        int from_len = sizeof(from);
+        int len = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &from_len);
+        if (len != msg_size)
+            return -1;
+        sendto(sock, buffer, len, 0, (struct sockaddr *)&from, from_len);
+
+        // The application reads the captured frames from time to time
+        if (scratch && (i & 31) == 31)
+            sgIP_Hub_CaptureRead(scratch, scratch_size);
+    }
+    int64_t end = time_ns();
+
+    return frames_sent - sent == iterations ? end - start : -1;
+}
+
+static int bench_capture(void)
+{
+    int sock = open_udp(PORT_NODE);
+    if (sock < 0)
+        return 0;
+    resolve_peer(sock);
+
+    unsigned char data[MAX_FRAME];
+    unsigned char frame[MAX_FRAME];
+    memset(data, 0x5A, msg_size);
+    int frame_len = make_udp_frame(frame, PORT_PEER, PORT_NODE, data, msg_size, 1);
+
+    // Enough for the frames captured between two reads
+    int ring_size = 64 * (sizeof(sgIP_Hub_CaptureRecord) + MAX_FRAME);
+    void *ring    = malloc(ring_size);
+    void *scratch = malloc(ring_size);
+    if (!ring || !scratch)
+        abort();
+
+    int64_t best_stopped = INT64_MAX, worst_stopped = 0, best_running = INT64_MAX;
+    for (int r = 0; r < runs; r++)
+    {
+        int64_t t = run_echo(sock, frame, frame_len, NULL, 0);
+        if (t < 0)
+            goto error;
+        if (t < best_stopped)
+            best_stopped = t;
+        if (t > worst_stopped)
+            worst_stopped = t;
+
+        sgIP_Hub_CaptureStart(ring, ring_size, MAX_FRAME);
+        t = run_echo(sock, frame, frame_len, scratch, ring_size);
+        sgIP_Hub_CaptureStop();
+        if (t < 0)
+            goto error;
+        if (t < best_running)
+            best_running = t;
+    }
+
+    printf("capture: %d datagrams of %d bytes received and sent back, best of %d runs\n",
+           iterations, msg_size, runs);
+    printf("    stopped: %.1f ns per datagram (slowest run %.1f%% slower)\n",
+           (double)best_stopped / iterations,
+           (worst_stopped - best_stopped) * 100.0 / best_stopped);
+    printf("    running: %.1f ns per datagram (%+.1f%%)\n", (double)best_running / iterations,
+           (best_running - best_stopped) * 100.0 / best_stopped);
+    printf("    frames dropped by the capture: %u\n", sgIP_Hub_CaptureDropped());
+
+    closesocket(sock);
+    free(ring);
+    free(scratch);
+    return 1;
+
+error:
+    printf("capture: FAIL: datagram not echoed\n");
+    closesocket(sock);
+    free(ring);
+    free(scratch);
+    return 0;
+}
+
+// Builds of the stack loaded as libraries, to compare them running the same code. The copy of the
+// stack linked with sgip_bench isn't used for this, calls to a library cost a bit more.
+typedef struct
+{
+    const char *file;
+    const char *name;
+    void *lib;
+
+    unsigned long frames;   // frames sent by the stack
+    unsigned char last[64]; // headers of the last frame sent by the stack
+
+    // TCP connection opened by the peer
+    int listener, sock;
+    uint32_t seq_peer, seq_node; // next sequence number of each side
+
+    int (*socket)(int domain, int type, int protocol);
+    int (*bind)(int socket, const struct sockaddr *addr, int addr_len);
+    int (*listen)(int socket, int max_connections);
+    int (*accept)(int socket, struct sockaddr *addr, int *addr_len);
+    int (*send)(int socket, const void *data, int sendlength, int flags);
+    int (*recv)(int socket, void *data, int recvlength, int flags);
+    int (*ioctl)(int socket, long cmd, void *arg);
+    int (*closesocket)(int socket);
+    void (*sgIP_Sim_Init)(const unsigned char *hwaddr, unsigned long ipaddr, unsigned long snmask,
+                          int heap_size, sgIP_Sim_TransmitFn transmit, void *link);
+    void (*sgIP_Sim_Receive)(const void *frame, int len);
+} stack;
+
+#define SYMBOL(name) { #name, offsetof(stack, name) }
+
+static const struct
+{
+    const char *name;
+    size_t offset;
+} symbols[] = {
+    SYMBOL(socket),
+    SYMBOL(bind),
+    SYMBOL(listen),
+    SYMBOL(accept),
+    SYMBOL(send),
+    SYMBOL(recv),
+    SYMBOL(ioctl),
+    SYMBOL(closesocket),
+    SYMBOL(sgIP_Sim_Init),
+    SYMBOL(sgIP_Sim_Receive),
+};
+
+// The libraries are in the same directory as sgip_bench.
+static int load_stack(stack *s)
+{
+    char path[4096];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 64);
+    if (len < 0)
+        return -1;
+    path[len] = '\0';
+
+    char *slash = strrchr(path, '/');
+    strcpy(slash ? slash + 1 : path, s->file);
+
+    s->lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!s->lib)
+    {
+        fprintf(stderr, "%s\n", dlerror());
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof(symbols) / sizeof(symbols[0]); i++)
+    {
+        void *ptr = dlsym(s->lib, symbols[i].name);
+        if (!ptr)
+        {
+            fprintf(stderr, "%s: %s not found\n", path, symbols[i].name);
+            return -1;
+        }
+        memcpy((char *)s + symbols[i].offset, &ptr, sizeof(ptr));
+    }
+
+    return 0;
+}
+
+// Frames sent by a stack loaded as a library
+static void keep_frame(void *link, const void *frame, int len)
+{
+    stack *s = link;
+
+    s->frames++;
+    memcpy(s->last, frame, len < (int)sizeof(s->last) ? len : (int)sizeof(s->last));
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Starts the stack and opens a TCP connection from the peer to it.
+static int open_tcp(stack *s)
+{
+    s->sgIP_Sim_Init(hwaddr_node, inet_addr(ADDR_NODE), inet_addr(ADDR_MASK), 0, keep_frame, s);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(PORT_NODE);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    int nonblocking = 1;
+    s->listener     = s->socket(AF_INET, SOCK_STREAM, 0);
+    if (s->listener < 0 || s->bind(s->listener, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || s->listen(s->listener, 1) < 0 || s->ioctl(s->listener, FIONBIO, &nonblocking) < 0)
+        return -1;
+
+    // The SYN-ACK is sent when the ARP reply arrives
+    unsigned char frame[MAX_FRAME];
+    s->seq_peer = 1000;
+    s->sgIP_Sim_Receive(frame, make_tcp_frame(frame, s->seq_peer, 0, SGIP_TCP_FLAG_SYN, NULL, 0));
+    s->sgIP_Sim_Receive(frame, make_arp_reply(frame));
+
+    const unsigned char *tcp = s->last + 14 + 20;
+    if (s->last[14 + 9] != 6 || tcp[13] != (SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK))
+        return -1;
+    s->seq_peer++;
+    s->seq_node = get32(tcp + 4) + 1;
+    s->sgIP_Sim_Receive(frame, make_tcp_frame(frame, s->seq_peer, s->seq_node, SGIP_TCP_FLAG_ACK,
+                                              NULL, 0));
+
+    int addr_len = sizeof(addr);
+    s->sock      = s->accept(s->listener, (struct sockaddr *)&addr, &addr_len);
+    if (s->sock < 0 || s->ioctl(s->sock, FIONBIO, &nonblocking) < 0)
+        return -1;
+
+    return 0;
+}
+
+// The peer sends a request, the node reads it and sends it back, and the peer acknowledges the
+// response. Nothing is in flight when the response is sent, so it's sent right away.
+static int64_t run_requests(stack *s)
+{
+    unsigned char request[MAX_FRAME];
+    unsigned char buffer[MAX_FRAME];
+    unsigned char frame[MAX_FRAME];
+    unsigned long sent = s->frames;
+
+    memset(request, 0x5A, msg_size);
+
+    int64_t start = time_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        int flags = SGIP_TCP_FLAG_ACK | SGIP_TCP_FLAG_PSH;
+        s->sgIP_Sim_Receive(frame, make_tcp_frame(frame, s->seq_peer, s->seq_node, flags,
+                                                  request, msg_size));
+        s->seq_peer += msg_size;
+
+        if (s->recv(s->sock, buffer, sizeof(buffer), 0) != msg_size
+            || s->send(s->sock, buffer, msg_size, 0) != msg_size)
+            return -1;
+        s->seq_node += msg_size;
+
+        s->sgIP_Sim_Receive(frame, make_tcp_frame(frame, s->seq_peer, s->seq_node,
+                                                  SGIP_TCP_FLAG_ACK, NULL, 0));
+    }
+    int64_t end = time_ns();
+
+    // At least one segment with the response
+    return s->frames - sent >= (unsigned long)iterations ? end - start : -1;
+}
+
+static stack stacks[] = {
+    { .file = "libsgip_sim.so", .name = "counters" },
+    { .file = "libsgip_sim_nostats.so", .name = "no counters" },
+};
+
+#define NUM_STACKS (int)(sizeof(stacks) / sizeof(stacks[0]))
+
+static int bench_counters(void)
+{
+    int64_t best[NUM_STACKS], worst[NUM_STACKS];
+
+    // Smaller responses wait for the timer, and bigger ones need more than one segment.
+    if (msg_size <= SGIP_TCP_TRANSMIT_IMMTHRESH || msg_size > SGIP_MTU_OVERRIDE - 40)
+    {
+        printf("counters: skipped, requests must be from %d to %d bytes\n",
+               SGIP_TCP_TRANSMIT_IMMTHRESH + 1, SGIP_MTU_OVERRIDE - 40);
+        return 1;
+    }
+
+    for (int i = 0; i < NUM_STACKS; i++)
+    {
+        if (load_stack(&stacks[i]) < 0 || open_tcp(&stacks[i]) < 0)
+        {
+            printf("counters: FAIL: can't open a connection to %s\n", stacks[i].file);
+            return 0;
+        }
+        best[i]  = INT64_MAX;
+        worst[i] = 0;
+    }
+
+    for (int r = 0; r < runs; r++)
+    {
+        // The order changes in every run, so the first stack doesn't always run with cold caches
+        for (int k = 0; k < NUM_STACKS; k++)
+        {
+            int i     = (r & 1) ? NUM_STACKS - 1 - k : k;
+            int64_t t = run_requests(&stacks[i]);
+            if (t < 0)
+            {
+                printf("counters: FAIL: request not answered by %s\n", stacks[i].file);
+                return 0;
+            }
+            if (t < best[i])
+                best[i] = t;
+            if (t > worst[i])
+                worst[i] = t;
+        }
+    }
+
+    printf("counters: %d TCP requests of %d bytes received and sent back, best of %d runs\n",
+           iterations, msg_size, runs);
+    for (int i = 0; i < NUM_STACKS; i++)
+    {
+        printf("    %-11s %.1f ns per request (slowest run %.1f%% slower)\n", stacks[i].name,
+               (double)best[i] / iterations, (worst[i] - best[i]) * 100.0 / best[i]);
+    }
+    printf("    cost of the counters: %.1f ns per request (%+.1f%%)\n",
+           (double)(best[0] - best[1]) / iterations, (best[0] - best[1]) * 100.0 / best[1]);
+
+    for (int i = 0; i < NUM_STACKS; i++)
+    {
+        stacks[i].closesocket(stacks[i].sock);
+        stacks[i].closesocket(stacks[i].listener);
+    }
+    return 1;
+}
+
+// Sends datagrams to the peer with send() if "dest" is NULL, or with sendto().
+static int64_t run_send(int sock, const struct sockaddr_in *dest)
+{
+    unsigned char data[MAX_FRAME];
+    memset(data, 0x5A, msg_size);
+    unsigned long sent = frames_sent;
+
+    int64_t start = time_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        if (dest)
+            sendto(sock, data, msg_size, 0, (const struct sockaddr *)dest, sizeof(*dest));
+        else
+            send(sock, data, msg_size, 0);
+    }
+    int64_t end = time_ns();
+
+    return frames_sent - sent == iterations ? end - start : -1;
+}
+
+static int bench_connected(void)
+{
+    struct sockaddr_in peer;
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family      = AF_INET;
+    peer.sin_port        = htons(PORT_PEER);
+    peer.sin_addr.s_addr = inet_addr(ADDR_PEER);
+
+    int unconnected = open_udp(PORT_NODE);
+    int connected   = open_udp(PORT_NODE + 1);
+    if (unconnected < 0 || connected < 0
+        || connect(connected, (struct sockaddr *)&peer, sizeof(peer)) < 0)
+    {
+        printf("connected: FAIL: can't open the sockets\n");
+        return 0;
+    }
+    resolve_peer(unconnected);
+
+    int64_t best_unconnected = INT64_MAX, best_connected = INT64_MAX;
+    for (int r = 0; r < runs; r++)
+    {
+        int64_t t = run_send(unconnected, &peer);
+        if (t < 0)
+            goto error;
+        if (t < best_unconnected)
+            best_unconnected = t;
+
+        t = run_send(connected, NULL);
+        if (t < 0)
+            goto error;
+        if (t < best_connected)
+            best_connected = t;
+    }
+
+    printf("connected: %d datagrams of %d bytes sent, best of %d runs\n", iterations, msg_size,
+           runs);
+    printf("    sendto(): %.1f ns per datagram\n", (double)best_unconnected / iterations);
+    printf("    send():   %.1f ns per datagram (%+.1f%%)\n", (double)best_connected / iterations,
+           (best_connected - best_unconnected) * 100.0 / best_unconnected);
+
+    closesocket(unconnected);
+    closesocket(connected);
+    return 1;
+
+error:
+    printf("connected: FAIL: datagram not sent\n");
+    closesocket(unconnected);
+    closesocket(connected);
+    return 0;
+}
+
+// Datagrams sent or received together by sendmmsg() and recvmmsg(), like the updates that a game
+// sends to its peers every frame
+#define BATCH 10
+
+// Sends datagrams to "dest" in batches, with one call to sendmmsg() for each batch if "batched" is
+// set, or with one call to sendto() for each datagram.
+static int64_t run_batch_send(int sock, struct sockaddr_in *dest, int batched)
+{
+    unsigned char data[MAX_FRAME];
+    struct iovec iov[BATCH];
+    struct mmsghdr msgs[BATCH];
+
+    memset(data, 0x5A, msg_size);
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BATCH; i++)
+    {
+        iov[i].iov_base             = data;
+        iov[i].iov_len              = msg_size;
+        msgs[i].msg_hdr.msg_name    = dest;
+        msgs[i].msg_hdr.msg_namelen = sizeof(*dest);
+        msgs[i].msg_hdr.msg_iov     = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    int batches        = iterations / BATCH;
+    unsigned long sent = frames_sent;
+
+    int64_t start = time_ns();
+    for (int b = 0; b < batches; b++)
+    {
+        if (batched)
+        {
+            sendmmsg(sock, msgs, BATCH, 0);
+            continue;
+        }
+        for (int i = 0; i < BATCH; i++)
+            sendto(sock, data, msg_size, 0, (struct sockaddr *)dest, sizeof(*dest));
+    }
+    int64_t end = time_ns();
+
+    return frames_sent - sent == (unsigned long)batches * BATCH ? end - start : -1;
+}
+
+// Receives datagrams in batches and reads them, with one call to recvmmsg() for each batch if
+// "batched" is set, or with one call to recvfrom() for each datagram.
+static int64_t run_batch_receive(int sock, const unsigned char *frame, int frame_len, int batched)
+{
+    static unsigned char buffers[BATCH][MAX_FRAME];
+    struct sockaddr_in from[BATCH];
+    struct iovec iov[BATCH];
+    struct mmsghdr msgs[BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BATCH; i++)
+    {
+        iov[i].iov_base            = buffers[i];
+        iov[i].iov_len             = MAX_FRAME;
+        msgs[i].msg_hdr.msg_name   = &from[i];
+        msgs[i].msg_hdr.msg_iov    = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int batches = iterations / BATCH;
+
+    int64_t start = time_ns();
+    for (int b = 0; b < batches; b++)
+    {
+        for (int i = 0; i < BATCH; i++)
+            sgIP_Sim_Receive(frame, frame_len);
+
+        if (batched)
+        {
+            for (int i = 0; i < BATCH; i++)
+                msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            if (recvmmsg(sock, msgs, BATCH, 0, NULL) != BATCH)
+                return -1;
+            continue;
+        }
+        for (int i = 0; i < BATCH; i++)
+        {
+            int from_len = sizeof(from[i]);
+            if (recvfrom(sock, buffers[i], MAX_FRAME, 0, (struct sockaddr *)&from[i], &from_len)
+                != msg_size)
+                return -1;
+        }
+    }
+    int64_t end = time_ns();
+
+    return end - start;
+}
+
+static int bench_batch(void)
+{
+    if (iterations < BATCH)
+    {
+        printf("batch: skipped, it needs at least %d iterations\n", BATCH);
+        return 1;
+    }
+
+    struct sockaddr_in peer;
+    memset(&peer, 0, sizeof(peer));
+    peer.sin_family      = AF_INET;
+    peer.sin_port        = htons(PORT_PEER);
+    peer.sin_addr.s_addr = inet_addr(ADDR_PEER);
+
+    int sock = open_udp(PORT_NODE);
+    if (sock < 0)
+    {
+        printf("batch: FAIL: can't open socket\n");
+        return 0;
+    }
+    resolve_peer(sock);
+
+    // Room for a whole batch in the receive queue
+    int rcvbuf = BATCH * SGIP_MEMBLOCK_DATASIZE;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    unsigned char data[MAX_FRAME];
+    unsigned char frame[MAX_FRAME];
+    memset(data, 0x5A, msg_size);
+    int frame_len = make_udp_frame(frame, PORT_PEER, PORT_NODE, data, msg_size, 1);
+
+    // Sent with sendto(), with sendmmsg(), received with recvfrom() and with recvmmsg()
+    int64_t best[4] = { INT64_MAX, INT64_MAX, INT64_MAX, INT64_MAX };
+    for (int r = 0; r < runs; r++)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            int64_t t = i < 2 ? run_batch_send(sock, &peer, i & 1)
+                              : run_batch_receive(sock, frame, frame_len, i & 1);
+            if (t < 0)
+            {
+                printf("batch: FAIL: datagram not %s\n", i < 2 ? "sent" : "received");
+                closesocket(sock);
+                return 0;
+            }
+            if (t < best[i])
+                best[i] = t;
+        }
+    }
+
+    static const char *const names[4] = { "sendto():", "sendmmsg():", "recvfrom():",
+                                          "recvmmsg():" };
+    int count = iterations / BATCH * BATCH;
+
+    printf("batch: %d datagrams of %d bytes in batches of %d, best of %d runs\n", count, msg_size,
+           BATCH, runs);
+    for (int i = 0; i < 4; i++)
+    {
+        printf("    %-12s %.0f datagrams/s, %.1f ns per datagram", names[i],
+               count * 1000000000.0 / best[i], (double)best[i] / count);
+        if (i & 1)
+            printf(" (%+.1f%%)", (best[i] - best[i - 1]) * 100.0 / best[i - 1]);
+        printf("\n");
+    }
+    printf("    the receive times include the reception of the frames by the stack\n");
+
+    closesocket(sock);
+    return 1;
+}
+
+// Receives a datagram and reads it.
+static int64_t run_receive(int sock, const unsigned char *frame, int frame_len)
+{
+    unsigned char buffer[MAX_FRAME];
+
+    int64_t start = time_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        sgIP_Sim_Receive(frame, frame_len);
+        if (recv(sock, buffer, sizeof(buffer), 0) != msg_size)
+            return -1;
+    }
+    int64_t end = time_ns();
+
+    return end - start;
+}
+
+// Sockets opened next to the one that receives the datagrams, up to SGIP_SOCKET_MAXSOCKETS
+#define DEMUX_OTHERS 30
+
+static int bench_demux(void)
+{
+    int others[DEMUX_OTHERS];
+    int opened = 0;
+    int ok     = 0;
+
+    // The receiver is the oldest socket, the last one that a list of sockets would reach
+    int sock = open_udp(PORT_NODE);
+    if (sock < 0)
+    {
+        printf("demux: FAIL: can't open socket\n");
+        return 0;
+    }
+
+    unsigned char data[MAX_FRAME];
+    unsigned char frame[MAX_FRAME];
+    memset(data, 0x5A, msg_size);
+    int frame_len = make_udp_frame(frame, PORT_PEER, PORT_NODE, data, msg_size, 1);
+
+    const int counts[] = { 0, 1, 3, 7, 15, DEMUX_OTHERS };
+    const int cases    = sizeof(counts) / sizeof(counts[0]);
+    int64_t first      = 0;
+
+    printf("demux: %d datagrams of %d bytes received and read, best of %d runs\n", iterations,
+           msg_size, runs);
+    for (int k = 0; k < cases; k++)
+    {
+        // Half of the other sockets are connected to other ports of the peer
+        while (opened < counts[k])
+        {
+            int other = open_udp(PORT_NODE + 100 + opened);
+            if (other < 0)
+            {
+                printf("demux: FAIL: can't open socket %d\n", opened + 1);
+                goto end;
+            }
+            others[opened++] = other;
+
+            if (opened & 1)
+            {
+                struct sockaddr_in peer;
+                memset(&peer, 0, sizeof(peer));
+                peer.sin_family      = AF_INET;
+                peer.sin_port        = htons(PORT_PEER + opened);
+                peer.sin_addr.s_addr = inet_addr(ADDR_PEER);
+                connect(other, (struct sockaddr *)&peer, sizeof(peer));
+            }
+        }
+
+        int64_t best = INT64_MAX;
+        for (int r = 0; r < runs; r++)
+        {
+            int64_t t = run_receive(sock, frame, frame_len);
+            if (t < 0)
+            {
+                printf("demux: FAIL: datagram not received\n");
+                goto end;
+            }
+            if (t < best)
+                best = t;
+        }
+        if (k == 0)
+            first = best;
+
+        printf("    %2d other sockets: %.1f ns per datagram (%+.1f%%)\n", counts[k],
+               (double)best / iterations, (best - first) * 100.0 / first);
+    }
+    ok = 1;
+
+end:
+    for (int i = 0; i < opened; i++)
+        closesocket(others[i]);
+    closesocket(sock);
+    return ok;
+}
+
+// Binds a socket to a new ephemeral port and releases it, like a connection that is opened and
+// closed, while other ports stay in use. "used" marks the ports that are in use.
+static int64_t run_ports(sgIP_PortSet *set, const unsigned char *used)
+{
+    int64_t start = time_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        int port = sgIP_Ports_Alloc(set);
+        if (port == 0 || used[port - set->first])
+            return -1;
+        sgIP_Ports_Release(set, port);
+    }
+    int64_t end = time_ns();
+
+    return end - start;
+}
+
+static int bench_ports(void)
+{
+    static uint32_t
+        bits[SGIP_PORTS_WORDS(SGIP_TCP_FIRSTOUTGOINGPORT, SGIP_TCP_LASTOUTGOINGPORT)];
+
+    sgIP_PortSet set;
+    sgIP_Ports_Init(&set, bits, SGIP_TCP_FIRSTOUTGOINGPORT, SGIP_TCP_LASTOUTGOINGPORT);
+
+    unsigned char *used = calloc(set.count, 1);
+    if (!used)
+        abort();
+
+    // The last case leaves one port free, which is the longest search
+    const int in_use[] = { 0, 100, 1000, 10000, 20000, 24000, set.count - 1 };
+    const int cases    = sizeof(in_use) / sizeof(in_use[0]);
+
+    printf("ports: %d ephemeral ports of %d bound and released, best of %d runs\n", iterations,
+           set.count, runs);
+    for (int k = 0; k < cases; k++)
+    {
+        while (set.used < in_use[k])
+        {
+            int port = sgIP_Ports_Alloc(&set);
+            if (port == 0 || used[port - set.first])
+                goto error;
+            used[port - set.first] = 1;
+        }
+
+        int64_t best = INT64_MAX;
+        for (int r = 0; r < runs; r++)
+        {
+            int64_t t = run_ports(&set, used);
+            if (t < 0)
+                goto error;
+            if (t < best)
+                best = t;
+        }
+        printf("    %5d in use: %.1f ns per port\n", in_use[k], (double)best / iterations);
+    }
+
+    // Take the last one
+    int port = sgIP_Ports_Alloc(&set);
+    if (port == 0 || used[port - set.first] || sgIP_Ports_Alloc(&set) != 0)
+        goto error;
+
+    free(used);
+    return 1;
+
+error:
+    printf("ports: FAIL: port in use given, or no port given while some were free\n");
+    free(used);
+    return 0;
+}
+
+// Cycles of the host, or nanoseconds of CPU time where there is no cycle counter that can be read
+// from user space.
+#if defined(__x86_64__) || defined(__i386__)
+#    include <x86intrin.h>
+#    define CYCLES_UNIT "cycles"
+static int64_t cycles(void)
+{
+    return __rdtsc();
+}
+#else
+#    define CYCLES_UNIT "ns"
+static int64_t cycles(void)
+{
+    return time_ns();
+}
+#endif
+
+// Receives a datagram and reads it. Returns the cycles used.
+static int64_t run_receive_cycles(int sock, const unsigned char *frame, int frame_len, int len)
+{
+    unsigned char buffer[MAX_FRAME];
+
+    int64_t start = cycles();
+    for (int i = 0; i < iterations; i++)
+    {
+        sgIP_Sim_Receive(frame, frame_len);
+        if (recv(sock, buffer, sizeof(buffer), 0) != len)
+            return -1;
+    }
+    int64_t end = cycles();
+
+    return end - start;
+}
+
+static void set_nocheck(int sock, int nocheck)
+{
+    setsockopt(sock, SOL_SOCKET, SO_RCVNOCHECK, &nocheck, sizeof(nocheck));
+}
+
+static int bench_rxcheck(void)
+{
+    static const int sizes[]   = { 64, 512, 1472 };
+    static const char *names[] = { "no checksum", "verified", "SO_RCVNOCHECK" };
+    const int num_sizes        = sizeof(sizes) / sizeof(sizes[0]);
+    const int num_cases        = sizeof(names) / sizeof(names[0]);
+
+    int sock = open_udp(PORT_NODE);
+    if (sock < 0)
+    {
+        printf("rxcheck: FAIL: can't open socket\n");
+        return 0;
+    }
+
+    unsigned char data[MAX_FRAME];
+    unsigned char with_sum[MAX_FRAME], without_sum[MAX_FRAME];
+    for (int i = 0; i < MAX_FRAME; i++)
+        data[i] = i * 7;
+
+    // A datagram with a wrong checksum must be dropped, unless the socket doesn't verify them
+    int len = make_udp_frame(with_sum, PORT_PEER, PORT_NODE, data, 64, 1);
+    with_sum[len - 1] ^= 0xFF;
+    for (int nocheck = 0; nocheck < 2; nocheck++)
+    {
+        set_nocheck(sock, nocheck);
+        sgIP_Sim_Receive(with_sum, len);
+        if ((recv(sock, data + MAX_FRAME / 2, 64, 0) == 64) != nocheck)
+        {
+            printf("rxcheck: FAIL: wrong checksum %s\n", nocheck ? "not ignored" : "accepted");
+            closesocket(sock);
+            return 0;
+        }
+    }
+
+    printf("rxcheck: %d datagrams received and read, " CYCLES_UNIT
+           " per byte of data, best of %d runs\n",
+           iterations, runs);
+    for (int s = 0; s < num_sizes; s++)
+    {
+        int size        = sizes[s];
+        int len_with    = make_udp_frame(with_sum, PORT_PEER, PORT_NODE, data, size, 1);
+        int len_without = make_udp_frame(without_sum, PORT_PEER, PORT_NODE, data, size, 0);
+        int64_t best[3] = { INT64_MAX, INT64_MAX, INT64_MAX };
+
+        for (int r = 0; r < runs; r++)
+        {
+            for (int c = 0; c < num_cases; c++)
+            {
+                set_nocheck(sock, c == 2);
+                int64_t t = c == 0 ? run_receive_cycles(sock, without_sum, len_without, size)
+                                   : run_receive_cycles(sock, with_sum, len_with, size);
+                if (t < 0)
+                {
+                    printf("rxcheck: FAIL: datagram not received\n");
+                    closesocket(sock);
+                    return 0;
+                }
+                if (t < best[c])
+                    best[c] = t;
+            }
+        }
+
+        printf("    %4d bytes:", size);
+        for (int c = 0; c < num_cases; c++)
+        {
+            printf(" %s %.2f%s", names[c], (double)best[c] / iterations / size,
+                   c + 1 < num_cases ? "," : "\n");
+        }
+        printf("               verification: %+.2f " CYCLES_UNIT " per byte\n",
+               (double)(best[1] - best[2]) / iterations / size);
+    }
+
+    closesocket(sock);
+    return 1;
+}
+
+// Main
+// ----
+
+static const struct
+{
+    const char *name;
+    int (*run)(void);
+} benchmarks[] = {
+    { "batch", bench_batch },
+    { "capture", bench_capture },
+    { "connected", bench_connected },
+    { "counters", bench_counters },
+    { "demux", bench_demux },
+    { "ports", bench_ports },
+    { "rxcheck", bench_rxcheck },
+};
+
+#define NUM_BENCHMARKS (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] [benchmark|all]\n"
+           "\n"
+           "  -n count    Iterations of each run (%d)\n"
+           "  -r runs     Runs of each case (%d)\n"
+           "  -S bytes    Size of the datagrams (%d)\n"
+           "\n"
+           "Benchmarks:",
+           name, iterations, runs, msg_size);
+    for (int i = 0; i < NUM_BENCHMARKS; i++)
+        printf(" %s", benchmarks[i].name);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:S:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'r':
+                runs = atoi(optarg);
+                break;
+            case 'S':
+                msg_size = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (iterations < 1 || runs < 1 || msg_size < 1 || msg_size > 1472)
+    {
+        fprintf(stderr, "Invalid options\n");
+        return 1;
+    }
+
+    const char *test = optind < argc ? argv[optind] : "all";
+    int all          = strcmp(test, "all") == 0;
+    int found        = all;
+    for (int i = 0; i < NUM_BENCHMARKS; i++)
+        found |= strcmp(test, benchmarks[i].name) == 0;
+    if (!found)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // No heap limit
+    sgIP_Sim_Init(hwaddr_node, inet_addr(ADDR_NODE), inet_addr(ADDR_MASK), 0, discard_frame,
+                  NULL);
+
+    int failed = 0;
+    for (int i = 0; i < NUM_BENCHMARKS; i++)
+    {
+        if (all || strcmp(test, benchmarks[i].name) == 0)
+            failed += !benchmarks[i].run();
+    }
+
+    return failed;
+}
@@ -0,0 +1,3631 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - Host build of sgIP
+
+// Deterministic link simulator and benchmark. Two copies of the stack (nodes A and B) are
+// connected by a simulated link, and everything runs in one thread with a virtual clock, so the
+// same options and seed always give the same results, and tests of minutes of network time take
+// a fraction of a second.
+//
+// The link has a bandwidth, a round-trip time, jitter, losses, reordering, duplication, and a
+// transmit queue with tail drop. sgIP_Timer() is called every 50 ms, like on the DS, and the heap
+// of each node is limited and measured like the heap of DSWifi.
+//
+// Benchmarks:
+//
+// - bulk: A sends data to B over TCP. Goodput, retransmissions and peak heap usage.
+// - rr: A sends requests to B over TCP and B echoes them. Latency of the round trips.
+// - udp: A sends datagrams to B at a fixed rate. Delivery ratio and one-way latency.
+// - vanish: B stops answering without closing its connections. A must drop them with ETIMEDOUT.
+// - slowread: A sends data to B over TCP, and B reads it a few bytes at a time. Size of segments.
+// - winupdate: B closes its window, and the update that opens it again is lost.
+// - pmtu: A sends data to B through a router with a smaller MTU, which answers with ICMP messages
+//   or is a black hole.
+// - refused: A connects to a port of B without a listener, with and without data in the SYN (TCP
+//   Fast Open). The RST of B must make the connection fail with ECONNREFUSED right away.
+// - crr: like rr, but every request uses a new connection, with and without TCP Fast Open.
+// - mixed: A sends datagrams to B at 60 Hz while it sends bulk data over TCP, with and without
+//   pacing. One-way latency of the datagrams.
+// - rxmem: A opens idle connections to B and then sends bulk data over one more. Size of the
+//   receive buffers of B and peak heap usage.
+// - churn: A opens connections to B and closes them right away, gracefully and with a RST
+//   (SO_LINGER with a timeout of 0). Connections per second and peak heap usage.
+// - flood: A floods a UDP socket of B that is never read, with the default limit of its queue and
+//   with SO_RCVDROPOLDEST, while it sends TCP requests and 60 Hz updates to other sockets of B.
+//   Datagrams dropped, latency of the requests and peak heap usage.
+// - igmp: A joins a multicast group before it has an address, and B joins it too. A multicast
+//   router in the middle of the link checks the IGMP reports sent when the address arrives, and the
+//   answers to its queries. Datagrams sent to the group must reach B.
+// - fragments: Fragmented UDP datagrams sent to B in order, reordered, duplicated, overlapping and
+//   split in tiny fragments. Overlapping fragments drop the datagram, and tiny fragments of
+//   datagrams that are never completed can't pin more memory than the limit of reassembly.
+// - fragsend: A sends UDP datagrams of many sizes up to the largest one that B can reassemble. A
+//   reference reassembler checks the fragments sent by A, and B must receive the same datagrams.
+// - arpburst: A forgets the hardware address of B and sends it a burst of datagrams right away,
+//   first a datagram with as many fragments as the ARP queue fits, and then more datagrams than
+//   that. They must be sent in order once B answers, and only the oldest ones may be dropped.
+// - linkup: The link of A comes up with B as its gateway, and A connects to B 100 ms later. Time
+//   to the first byte sent by B, with and without sgIP_ARP_Announce() resolving the gateway first.
+//
+// The data is checked by the receiver, and bulk and rr check that the sender doesn't need too many
+// segments. On a clean link, bulk also checks the RTT measured by the sender. It returns the
+// number of tests that failed.
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "sgIP_Sim.h"
+
+#define ADDR_A    "10.0.0.1"
+#define ADDR_B    "10.0.0.2"
+#define ADDR_MASK "255.255.255.0"
+
+#define PORT_BULK   5001
+#define PORT_RR     5002
+#define PORT_UDP    5003
+#define PORT_VANISH 5004
+#define PORT_SLOW   5005
+#define PORT_WINDOW 5006
+#define PORT_PMTU   5007
+#define PORT_CLOSED 5008
+#define PORT_TFO    5009
+#define PORT_CRR    5010
+#define PORT_MIXED  5011
+#define PORT_RXMEM  5012
+#define PORT_CHURN  5013
+#define PORT_FLOOD  5014 // and the next one
+#define PORT_IGMP   5016
+#define PORT_FRAG   5017
+#define PORT_ARP    5018
+#define PORT_LINKUP 5019
+
+#define MAX_FRAME 2048
+
+#define NEVER INT64_MAX
+
+// Options
+// -------
+
+static struct
+{
+    int bandwidth;    // kbit/s
+    int rtt_ms;       // round-trip time, without the time needed to send the frames
+    int jitter_ms;    // extra delay of each frame, from 0 to this value
+    double loss;      // percentage of frames lost
+    double reorder;   // percentage of frames delayed half a round trip more than the rest
+    double duplicate; // percentage of frames delivered twice
+    int queue_bytes;  // size of the transmit queue of each direction of the link
+    unsigned long long seed;
+
+    int timer_ms;  // period of sgIP_Timer()
+    int heap_size; // heap of each node
+    int limit_s;   // max. duration of each test in virtual time
+
+    int bulk_bytes;
+    int messages; // number of requests of rr and datagrams of udp
+    int cycles;   // connections opened and closed by churn
+    int msg_size;
+    int interval_ms; // time between datagrams of udp
+} cfg = {
+    .bandwidth   = 2000,
+    .rtt_ms      = 10,
+    .queue_bytes = 8192,
+    .seed        = 1,
+    .timer_ms    = 50,
+    .heap_size   = 128 * 1024,
+    .limit_s     = 600,
+    .bulk_bytes  = 1024 * 1024,
+    .messages    = 200,
+    .cycles      = 10000,
+    .msg_size    = 256,
+    .interval_ms = 10,
+};
+
+// Nodes
+// -----
+
+typedef struct
+{
+    unsigned int frames;      // frames sent by the node
+    unsigned int queue_drops; // frames dropped because the transmit queue was full
+    unsigned int lost;
+    unsigned int reordered;
+    unsigned int duplicated;
+} link_stats;
+
+typedef struct node node;
+
+struct node
+{
+    const char *name;
+    void *lib;
+
+    // Frames sent by this node are delivered to "peer".
+    node *peer;
+    int down;           // the node has vanished: nothing it sends or is sent to it arrives
+    int drop_acks;      // TCP segments without data or SYN/FIN/RST to drop from the next ones sent
+    int64_t busy_until; // time when the link finishes sending the frames queued so far
+    link_stats stats;
+
+    int (*socket)(int domain, int type, int protocol);
+    int (*bind)(int socket, const struct sockaddr *addr, int addr_len);
+    int (*listen)(int socket, int max_connections);
+    int (*accept)(int socket, struct sockaddr *addr, int *addr_len);
+    int (*connect)(int socket, const struct sockaddr *addr, int addr_len);
+    int (*send)(int socket, const void *data, int sendlength, int flags);
+    int (*recv)(int socket, void *data, int recvlength, int flags);
+    int (*sendto)(int socket, const void *data, int sendlength, int flags,
+                  const struct sockaddr *addr, int addr_len);
+    int (*recvfrom)(int socket, void *data, int recvlength, int flags, struct sockaddr *addr,
+                    int *addr_len);
+    int (*ioctl)(int socket, long cmd, void *arg);
+    int (*getsockopt)(int socket, int level, int option_name, void *data, int *data_len);
+    int (*setsockopt)(int socket, int level, int option_name, const void *data, int data_len);
+    int (*closesocket)(int socket);
+    unsigned short (*htons)(unsigned short num);
+    unsigned long (*inet_addr)(const char *cp);
+
+    void (*sgIP_Sim_Init)(const unsigned char *hwaddr, unsigned long ipaddr, unsigned long snmask,
+                          int heap_size, sgIP_Sim_TransmitFn transmit, void *link);
+    void (*sgIP_Sim_SetIP)(unsigned long ipaddr, unsigned long gateway, int announce);
+    void (*sgIP_Sim_Receive)(const void *frame, int len);
+    void (*sgIP_Sim_Timer)(int num_ms);
+    void (*sgIP_Sim_GetHeapUsage)(int *used, int *peak);
+    void (*sgIP_Sim_ResetHeapPeak)(void);
+};
+
+static node nodes[2] = { { .name = "A" }, { .name = "B" } };
+
+#define SYMBOL(name) { #name, offsetof(node, name) }
+
+static const struct
+{
+    const char *name;
+    size_t offset;
+} symbols[] = {
+    SYMBOL(socket),
+    SYMBOL(bind),
+    SYMBOL(listen),
+    SYMBOL(accept),
+    SYMBOL(connect),
+    SYMBOL(send),
+    SYMBOL(recv),
+    SYMBOL(sendto),
+    SYMBOL(recvfrom),
+    SYMBOL(ioctl),
+    SYMBOL(getsockopt),
+    SYMBOL(setsockopt),
+    SYMBOL(closesocket),
+    SYMBOL(htons),
+    SYMBOL(inet_addr),
+    SYMBOL(sgIP_Sim_Init),
+    SYMBOL(sgIP_Sim_SetIP),
+    SYMBOL(sgIP_Sim_Receive),
+    SYMBOL(sgIP_Sim_Timer),
+    SYMBOL(sgIP_Sim_GetHeapUsage),
+    SYMBOL(sgIP_Sim_ResetHeapPeak),
+};
+
+// Every node needs its own copy of the library, dlopen() would return the same handle otherwise.
+static int load_node(node *n, int index)
+{
+    char path[4096];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 32);
+    if (len < 0)
+        return -1;
+    path[len] = '\0';
+
+    char *slash = strrchr(path, '/');
+    sprintf(slash ? slash + 1 : path, "sgip_node%d.so", index);
+
+    n->lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!n->lib)
+    {
+        fprintf(stderr, "%s\n", dlerror());
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof(symbols) / sizeof(symbols[0]); i++)
+    {
+        void *ptr = dlsym(n->lib, symbols[i].name);
+        if (!ptr)
+        {
+            fprintf(stderr, "%s: %s not found\n", path, symbols[i].name);
+            return -1;
+        }
+        memcpy((char *)n + symbols[i].offset, &ptr, sizeof(ptr));
+    }
+
+    return 0;
+}
+
+// Random numbers
+// --------------
+
+static unsigned long long random_state;
+
+static unsigned long long random_next(void)
+{
+    // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545F4914F6CDD1DULL;
+}
+
+static int random_chance(double percentage)
+{
+    if (percentage <= 0)
+        return 0;
+    return (random_next() >> 11) * (100.0 / 9007199254740992.0) < percentage;
+}
+
+// Events and clock
+// ----------------
+
+typedef struct
+{
+    int64_t time;
+    unsigned long long order; // frames that arrive at the same time keep the order they were sent
+    node *dst;
+    int len;
+    unsigned char *data;
+} frame_event;
+
+static struct
+{
+    frame_event *heap;
+    int count;
+    int size;
+    unsigned long long order;
+} events;
+
+static int64_t now; // microseconds
+static int64_t next_timer;
+static int64_t time_limit;
+
+static int event_before(const frame_event *a, const frame_event *b)
+{
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+static void event_push(int64_t time, node *dst, const void *data, int len)
+{
+    if (events.count == events.size)
+    {
+        events.size = events.size ? events.size * 2 : 256;
+        events.heap = realloc(events.heap, events.size * sizeof(frame_event));
+        if (!events.heap)
+            abort();
+    }
+
+    frame_event ev = { time, events.order++, dst, len, malloc(len) };
+    if (!ev.data)
+        abort();
+    memcpy(ev.data, data, len);
+
+    int i = events.count++;
+    while (i > 0 && event_before(&ev, &events.heap[(i - 1) / 2]))
+    {
+        events.heap[i] = events.heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    events.heap[i] = ev;
+}
+
+static frame_event event_pop(void)
+{
+    frame_event top  = events.heap[0];
+    frame_event last = events.heap[--events.count];
+
+    int i = 0;
+    for (;;)
+    {
+        int child = i * 2 + 1;
+        if (child >= events.count)
+            break;
+        if (child + 1 < events.count && event_before(&events.heap[child + 1], &events.heap[child]))
+            child++;
+        if (!event_before(&events.heap[child], &last))
+            break;
+        events.heap[i] = events.heap[child];
+        i              = child;
+    }
+    if (events.count > 0)
+        events.heap[i] = last;
+
+    return top;
+}
+
+// Router in the middle of the link with a smaller MTU than the nodes, if "mtu" isn't 0. It drops
+// the packets that don't fit and can't be fragmented, and answers them with an ICMP
+// "fragmentation needed" message, unless it's a black hole.
+static struct
+{
+    int mtu;
+    int blackhole;
+    unsigned int drops;
+    unsigned int icmp_sent;
+} router;
+
+static unsigned short ip_checksum(const unsigned char *data, int len)
+{
+    unsigned int sum = 0;
+    for (int i = 0; i + 1 < len; i += 2)
+        sum += (data[i] << 8) | data[i + 1];
+    if (len & 1)
+        sum += data[len - 1] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+static void put16(unsigned char *p, unsigned int value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+// Returns 1 if the router drops the frame sent by node "n".
+static int router_drops(node *n, const unsigned char *frame, int len)
+{
+    if (router.mtu == 0 || len < 14 + 20 || frame[12] != 0x08 || frame[13] != 0x00)
+        return 0;
+
+    const unsigned char *ip = frame + 14;
+    int ip_len              = (ip[2] << 8) | ip[3];
+    if (ip_len <= router.mtu || !(ip[6] & 0x40)) // DF
+        return 0;
+
+    router.drops++;
+    if (router.blackhole)
+        return 1;
+
+    // The ICMP message carries the IP header and 8 bytes of the packet (RFC 792), and the MTU of
+    // the next hop (RFC 1191).
+    int ihl = (ip[0] & 0xF) * 4;
+    unsigned char reply[14 + 20 + 8 + 60 + 8];
+    int icmp_len = 8 + ihl + 8;
+
+    memcpy(reply, frame + 6, 6);
+    memcpy(reply + 6, frame, 6);
+    put16(reply + 12, 0x0800);
+
+    unsigned char *rip = reply + 14;
+    memset(rip, 0, 20);
+    rip[0] = 0x45;
+    put16(rip + 2, 20 + icmp_len);
+    rip[8] = 64;
+    rip[9] = 1; // ICMP
+    memcpy(rip + 12, ip + 16, 4); // the router uses the address of the destination
+    memcpy(rip + 16, ip + 12, 4);
+    put16(rip + 10, ip_checksum(rip, 20));
+
+    unsigned char *icmp = rip + 20;
+    memset(icmp, 0, 8);
+    icmp[0] = 3; // destination unreachable
+    icmp[1] = 4; // fragmentation needed and DF set
+    put16(icmp + 6, router.mtu);
+    memcpy(icmp + 8, ip, ihl + 8);
+    put16(icmp + 2, ip_checksum(icmp, icmp_len));
+
+    event_push(now + cfg.rtt_ms * 500, n, reply, 14 + 20 + icmp_len);
+    router.icmp_sent++;
+    return 1;
+}
+
+// Multicast router in the middle of the link, the IGMP querier of the network. It sees the IGMP
+// messages sent by the nodes about "group", and sends queries when a test asks for them.
+static struct
+{
+    unsigned long group; // network byte order, or 0 if the router isn't watching
+    unsigned int reports;
+    unsigned int leaves;
+    int64_t first_report; // time of the first report since the last reset of the counts
+    node *last_reporter;
+} querier;
+
+#define IGMP_QUERY  0x11
+#define IGMP_REPORT 0x16
+#define IGMP_LEAVE  0x17
+
+static void querier_watch(node *n, const unsigned char *frame, int len)
+{
+    if (querier.group == 0 || len < 14 + 20 || frame[12] != 0x08 || frame[13] != 0x00
+        || frame[14 + 9] != 2)
+        return;
+
+    int ihl = (frame[14] & 0xF) * 4;
+    if (14 + ihl + 8 > len)
+        return;
+
+    const unsigned char *igmp = frame + 14 + ihl;
+    if (memcmp(igmp + 4, &querier.group, 4) != 0)
+        return;
+
+    if (igmp[0] == IGMP_REPORT)
+    {
+        if (querier.reports++ == 0)
+            querier.first_report = now;
+        querier.last_reporter = n;
+    }
+    else if (igmp[0] == IGMP_LEAVE)
+    {
+        querier.leaves++;
+    }
+}
+
+// Sends a general query if "group" is 0, or a query about that group, to both nodes.
+static void querier_send(unsigned long group, int max_resp_ms)
+{
+    static const unsigned char all_hosts[4]  = { 224, 0, 0, 1 };
+    static const unsigned char router_ip[4]  = { 10, 0, 0, 254 };
+    static const unsigned char router_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0xFE };
+
+    unsigned char frame[14 + 20 + 8];
+    const unsigned char *dest = group ? (const unsigned char *)&group : all_hosts;
+
+    // Multicast MAC address of the destination (RFC 1112)
+    frame[0] = 0x01;
+    frame[1] = 0x00;
+    frame[2] = 0x5E;
+    frame[3] = dest[1] & 0x7F;
+    frame[4] = dest[2];
+    frame[5] = dest[3];
+    memcpy(frame + 6, router_mac, 6);
+    put16(frame + 12, 0x0800);
+
+    unsigned char *ip = frame + 14;
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    put16(ip + 2, 20 + 8);
+    ip[8] = 1;
+    ip[9] = 2; // IGMP
+    memcpy(ip + 12, router_ip, 4);
+    memcpy(ip + 16, dest, 4);
+    put16(ip + 10, ip_checksum(ip, 20));
+
+    unsigned char *igmp = ip + 20;
+    memset(igmp, 0, 8);
+    igmp[0] = IGMP_QUERY;
+    igmp[1] = max_resp_ms / 100;
+    memcpy(igmp + 4, &group, 4);
+    put16(igmp + 2, ip_checksum(igmp, 8));
+
+    for (int i = 0; i < 2; i++)
+        event_push(now + cfg.rtt_ms * 500, &nodes[i], frame, sizeof(frame));
+}
+
+// Reassembles the UDP datagrams sent by A as a reference, independent of the reassembly of sgIP,
+// and checks that the fragments are valid: they fit in the MTU, they don't overlap, and all of them
+// but the last one carry a multiple of 8 bytes. It sees the frames before the link loses them.
+static struct
+{
+    int active;
+    int mtu;
+    const unsigned char *expected; // datagram that A should send, with its UDP header
+    int expected_len;
+
+    int id;    // IP identification of the datagram, or -1 until its first fragment is seen
+    int total; // length of the datagram, or -1 until its last fragment is seen
+    int received;
+    unsigned int fragments;
+    unsigned int complete; // datagrams that matched the expected one
+    unsigned int errors;
+    unsigned char data[65536];
+    unsigned char have[65536];
+} reference;
+
+static void reference_error(const char *message)
+{
+    printf("fragsend: FAIL: reference: %s\n", message);
+    reference.errors++;
+}
+
+static void reference_reset(const unsigned char *expected, int len)
+{
+    reference.expected     = expected;
+    reference.expected_len = len;
+    reference.id           = -1;
+    reference.total        = -1;
+    reference.received     = 0;
+    reference.fragments    = 0;
+    memset(reference.have, 0, sizeof(reference.have));
+}
+
+static void reference_watch(node *n, const unsigned char *frame, int len)
+{
+    if (!reference.active || n != &nodes[0] || len < 14 + 20 || frame[12] != 0x08
+        || frame[13] != 0x00 || frame[14 + 9] != 17)
+        return;
+
+    const unsigned char *ip = frame + 14;
+    int ihl                 = (ip[0] & 0xF) * 4;
+    int ip_len              = (ip[2] << 8) | ip[3];
+    int id                  = (ip[4] << 8) | ip[5];
+    int flags               = (ip[6] << 8) | ip[7];
+    int offset              = (flags & 0x1FFF) * 8;
+    int more                = flags & 0x2000;
+    int size                = ip_len - ihl;
+
+    if (ip_len > reference.mtu || 14 + ip_len > len || size < 0)
+        return reference_error("fragment larger than the MTU or the frame");
+    if (ip_checksum(ip, ihl) != 0)
+        return reference_error("wrong header checksum");
+    if ((more || offset) && (flags & 0x4000))
+        return reference_error("fragment with DF set");
+    if (more && (size & 7))
+        return reference_error("fragment that isn't a multiple of 8 bytes");
+    if (offset + size > 65535)
+        return reference_error("datagram longer than 65535 bytes");
+    if (reference.id != -1 && reference.id != id)
+        return reference_error("fragments of two datagrams");
+    reference.id = id;
+
+    for (int i = 0; i < size; i++)
+    {
+        if (reference.have[offset + i])
+            return reference_error("overlapping fragments");
+        reference.have[offset + i] = 1;
+    }
+    memcpy(reference.data + offset, ip + ihl, size);
+    reference.received += size;
+    reference.fragments++;
+    if (!more)
+        reference.total = offset + size;
+
+    if (reference.received == reference.total)
+    {
+        if (reference.total != reference.expected_len
+            || memcmp(reference.data, reference.expected, reference.total) != 0)
+            return reference_error("datagram different from the one sent");
+        reference.complete++;
+    }
+}
+
+// Returns 1 if the Ethernet frame is a TCP segment without data that only has the ACK flag set.
+static int is_tcp_ack(const unsigned char *frame, int len)
+{
+    if (len < 14 + 20 + 20 || frame[12] != 0x08 || frame[13] != 0x00 || frame[14 + 9] != 6)
+        return 0;
+
+    int ip_len  = (frame[14 + 2] << 8) | frame[14 + 3];
+    int ihl     = (frame[14] & 0xF) * 4;
+    const unsigned char *tcp = frame + 14 + ihl;
+    if (14 + ihl + 20 > len)
+        return 0;
+
+    return tcp[13] == 0x10 && ip_len == ihl + (tcp[12] >> 4) * 4;
+}
+
+// Called by the stack of a node for every frame it sends.
+static void link_transmit(void *link, const void *frame, int len)
+{
+    node *n = link;
+    n->stats.frames++;
+
+    reference_watch(n, frame, len);
+
+    if (n->down || n->peer->down)
+        return;
+    if (n->drop_acks > 0 && is_tcp_ack(frame, len))
+    {
+        n->drop_acks--;
+        n->stats.lost++;
+        return;
+    }
+    if (router_drops(n, frame, len))
+        return;
+
+    // Frames are sent one after the other at the speed of the link, and the ones that don't fit
+    // in the queue while they wait are dropped.
+    int64_t start = n->busy_until > now ? n->busy_until : now;
+    if ((start - now) * cfg.bandwidth / 8000 + len > cfg.queue_bytes)
+    {
+        n->stats.queue_drops++;
+        return;
+    }
+    int64_t end   = start + (int64_t)len * 8000 / cfg.bandwidth;
+    n->busy_until = end;
+
+    if (random_chance(cfg.loss))
+    {
+        n->stats.lost++;
+        return;
+    }
+    querier_watch(n, frame, len);
+
+    int64_t arrival = end + cfg.rtt_ms * 500;
+    if (cfg.jitter_ms > 0)
+        arrival += random_next() % (cfg.jitter_ms * 1000 + 1);
+    if (random_chance(cfg.reorder))
+    {
+        arrival += cfg.rtt_ms * 500 + 1000;
+        n->stats.reordered++;
+    }
+
+    event_push(arrival, n->peer, frame, len);
+
+    if (random_chance(cfg.duplicate))
+    {
+        event_push(arrival + (end - start), n->peer, frame, len);
+        n->stats.duplicated++;
+    }
+}
+
+// Advances the clock to the next frame arrival, call to sgIP_Timer() or "wakeup", whatever happens
+// first, and processes everything due at that time. Returns -1 if the time limit of the test has
+// been reached.
+static int advance(int64_t wakeup)
+{
+    int64_t next = next_timer < wakeup ? next_timer : wakeup;
+    if (events.count > 0 && events.heap[0].time < next)
+        next = events.heap[0].time;
+
+    if (next > time_limit)
+        return -1;
+    now = next;
+
+    // The stack may send frames while it handles a received one, so the event has to be removed
+    // from the heap first.
+    while (events.count > 0 && events.heap[0].time <= now)
+    {
+        frame_event ev = event_pop();
+        ev.dst->sgIP_Sim_Receive(ev.data, ev.len);
+        free(ev.data);
+    }
+
+    if (next_timer <= now)
+    {
+        for (int i = 0; i < 2; i++)
+            nodes[i].sgIP_Sim_Timer(cfg.timer_ms);
+        next_timer += cfg.timer_ms * 1000;
+    }
+
+    return 0;
+}
+
+// Helpers
+// -------
+
+static struct sockaddr_in make_addr(node *n, const char *ip, int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = n->htons(port);
+    addr.sin_addr.s_addr = ip ? n->inet_addr(ip) : INADDR_ANY;
+    return addr;
+}
+
+static int open_socket(node *n, int type, int port)
+{
+    int sock = n->socket(AF_INET, type, 0);
+    if (sock < 0)
+        return -1;
+
+    int nonblocking = 1;
+    n->ioctl(sock, FIONBIO, &nonblocking);
+
+    if (port)
+    {
+        struct sockaddr_in addr = make_addr(n, NULL, port);
+        if (n->bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || (type == SOCK_STREAM && n->listen(sock, 2) < 0))
+        {
+            n->closesocket(sock);
+            return -1;
+        }
+    }
+
+    return sock;
+}
+
+static int tcp_connect(node *n, const char *ip, int port)
+{
+    int sock = open_socket(n, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+
+    struct sockaddr_in addr = make_addr(n, ip, port);
+    if (n->connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+    {
+        n->closesocket(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static int tcp_accept(node *n, int listener)
+{
+    struct sockaddr_in addr;
+    int addr_len = sizeof(addr);
+    int sock     = n->accept(listener, (struct sockaddr *)&addr, &addr_len);
+    if (sock < 0)
+        return -1;
+
+    int nonblocking = 1;
+    n->ioctl(sock, FIONBIO, &nonblocking);
+    return sock;
+}
+
+static void get_tcp_info(node *n, int sock, struct tcp_info *info)
+{
+    int len = sizeof(*info);
+    memset(info, 0, sizeof(*info));
+    n->getsockopt(sock, SOL_TCP, TCP_INFO, info, &len);
+}
+
+static unsigned char pattern(unsigned int offset)
+{
+    return offset ^ (offset >> 8) ^ (offset >> 16);
+}
+
+static void print_heap(void)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        int used, peak;
+        nodes[i].sgIP_Sim_GetHeapUsage(&used, &peak);
+        printf("    heap %s: peak %d bytes, %d in use at the end\n", nodes[i].name, peak, used);
+        nodes[i].sgIP_Sim_ResetHeapPeak();
+    }
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latency(const char *label, int64_t *values, int count)
+{
+    if (count == 0)
+    {
+        printf("    %s: no samples\n", label);
+        return;
+    }
+
+    qsort(values, count, sizeof(int64_t), compare_int64);
+    printf("    %s: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms\n", label,
+           values[count * 50 / 100] / 1000.0, values[count * 90 / 100] / 1000.0,
+           values[count * 99 / 100] / 1000.0, values[count - 1] / 1000.0);
+}
+
+// Checks the number of segments that a TCP sender needed. On a link that doesn't lose, reorder or
+// duplicate frames, a segment that only repeats an ACK must not get an answer: if it did, two
+// nodes would keep answering each other, and every answer would resend the data in flight.
+static int check_segments(const char *test, unsigned int segments, int max_segments)
+{
+    if (cfg.loss > 0 || cfg.reorder > 0 || cfg.duplicate > 0 || segments <= (unsigned)max_segments)
+        return 1;
+
+    printf("%s: FAIL: %u segments sent, expected at most %d\n", test, segments, max_segments);
+    return 0;
+}
+
+// On a clean link, the RTT measured by the sender must be the RTT of the link plus the time needed
+// to send a full segment and its ACK. Frames are sent one at a time, so they never wait in the
+// queue. The clock of the stack advances a whole timer period at a time, so each measurement is a
+// multiple of it, and only their smoothed average is close to the real RTT.
+static int check_rtt(const char *test, const struct tcp_info *info)
+{
+    if (cfg.jitter_ms > 0 || cfg.loss > 0 || cfg.reorder > 0 || cfg.duplicate > 0)
+        return 1;
+
+    int frames     = (14 + 40 + info->tcpi_snd_mss) + (14 + 40);
+    double rtt     = cfg.rtt_ms + frames * 8.0 / cfg.bandwidth;
+    double error   = info->tcpi_rtt - rtt;
+    double allowed = cfg.timer_ms / 10.0 + rtt / 10 + 1;
+    if (error > -allowed && error < allowed)
+        return 1;
+
+    printf("%s: FAIL: srtt %u ms, expected %.1f ms\n", test, info->tcpi_rtt, rtt);
+    return 0;
+}
+
+// Runs the simulation for some time, ignoring the time limit of the test.
+static void run_for(int64_t us)
+{
+    int64_t until = now + us;
+    time_limit    = until;
+    while (advance(until) == 0 && now < until)
+        ;
+}
+
+// Sends the test pattern from offset "*sent" up to "total", as much as the socket takes.
+static void send_pattern(node *n, int sock, int *sent, int total)
+{
+    unsigned char buffer[4096];
+    while (*sent < total)
+    {
+        int len = total - *sent;
+        if (len > (int)sizeof(buffer))
+            len = sizeof(buffer);
+        for (int i = 0; i < len; i++)
+            buffer[i] = pattern(*sent + i);
+
+        int r = n->send(sock, buffer, len, 0);
+        if (r <= 0)
+            break;
+        *sent += r;
+    }
+}
+
+// Receives everything that is available and checks it against the test pattern. Returns 0 if the
+// data is wrong.
+static int recv_pattern(const char *test, node *n, int sock, int *received)
+{
+    unsigned char buffer[4096];
+    for (;;)
+    {
+        int r = n->recv(sock, buffer, sizeof(buffer), 0);
+        if (r <= 0)
+            return 1;
+        for (int i = 0; i < r; i++)
+        {
+            if (buffer[i] != pattern(*received + i))
+            {
+                printf("%s: FAIL: wrong data at offset %d\n", test, *received + i);
+                return 0;
+            }
+        }
+        *received += r;
+    }
+}
+
+// Lets the connections that have just been closed finish before the next test.
+static void settle(void)
+{
+    run_for(2000000);
+}
+
+// Opens a TCP connection from A to B. The socket of A is returned, and the one of B is stored in
+// "server".
+static int tcp_pair(int listener, int port, int *server)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+
+    int client = tcp_connect(a, ADDR_B, port);
+    if (client < 0)
+        return -1;
+
+    time_limit = now + 10000000;
+    while ((*server = tcp_accept(b, listener)) < 0)
+    {
+        if (advance(NEVER) < 0)
+        {
+            a->closesocket(client);
+            return -1;
+        }
+    }
+
+    // Let the handshake finish on both sides
+    run_for(200000);
+    return client;
+}
+
+// Benchmarks
+// ----------
+
+static int test_bulk(void)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    int ok = 1;
+
+    int listener = open_socket(b, SOCK_STREAM, PORT_BULK);
+    int client   = tcp_connect(a, ADDR_B, PORT_BULK);
+    int server   = -1;
+    if (listener < 0 || client < 0)
+    {
+        printf("bulk: FAIL: can't open the sockets\n");
+        return 0;
+    }
+
+    int64_t start = now;
+    time_limit    = now + (int64_t)cfg.limit_s * 1000000;
+
+    int sent = 0, received = 0;
+    unsigned char buffer[4096];
+
+    for (;;)
+    {
+        if (server < 0)
+            server = tcp_accept(b, listener);
+
+        while (sent < cfg.bulk_bytes)
+        {
+            int len = cfg.bulk_bytes - sent;
+            if (len > (int)sizeof(buffer))
+                len = sizeof(buffer);
+            for (int i = 0; i < len; i++)
+                buffer[i] = pattern(sent + i);
+
+            int r = a->send(client, buffer, len, 0);
+            if (r <= 0)
+                break;
+            sent += r;
+        }
+
+        while (server >= 0)
+        {
+            int r = b->recv(server, buffer, sizeof(buffer), 0);
+            if (r <= 0)
+                break;
+            for (int i = 0; i < r && ok; i++)
+            {
+                if (buffer[i] != pattern(received + i))
+                {
+                    printf("bulk: FAIL: wrong data at offset %d\n", received + i);
+                    ok = 0;
+                }
+            }
+            received += r;
+        }
+
+        if (!ok || received >= cfg.bulk_bytes)
+            break;
+
+        if (advance(NEVER) < 0)
+        {
+            printf("bulk: FAIL: timeout, %d of %d bytes received\n", received, cfg.bulk_bytes);
+            ok = 0;
+            break;
+        }
+    }
+
+    int64_t elapsed = now - start;
+    if (ok && elapsed > 0)
+    {
+        printf("bulk: %d bytes in %.3f s, goodput %.1f kbit/s\n", received, elapsed / 1000000.0,
+               received * 8000.0 / elapsed);
+    }
+
+    struct tcp_info info;
+    get_tcp_info(a, client, &info);
+    printf("    A: %u segments sent, %u with retransmitted data (%.1f%%), %u duplicate ACKs, "
+           "srtt %u ms\n",
+           info.tcpi_segs_out, info.tcpi_total_retrans,
+           info.tcpi_segs_out ? info.tcpi_total_retrans * 100.0 / info.tcpi_segs_out : 0.0,
+           info.tcpi_dup_acks, info.tcpi_rtt);
+    // Twice the number of full segments needed for the data
+    ok = ok && check_segments("bulk", info.tcpi_segs_out, 2 * (cfg.bulk_bytes / 1460 + 1) + 8);
+    ok = ok && check_rtt("bulk", &info);
+    if (server >= 0)
+    {
+        get_tcp_info(b, server, &info);
+        printf("    B: %u segments received, %u duplicate segments, %u out of order drops\n",
+               info.tcpi_segs_in, info.tcpi_dup_segs, info.tcpi_ooo_drops);
+        b->closesocket(server);
+    }
+
+    a->closesocket(client);
+    b->closesocket(listener);
+    settle();
+    print_heap();
+
+    return ok;
+}
+
+static int test_rr(void)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    int ok = 1;
+
+    int listener = open_socket(b, SOCK_STREAM, PORT_RR);
+    int client   = tcp_connect(a, ADDR_B, PORT_RR);
+    int server   = -1;
+    if (listener < 0 || client < 0)
+    {
+        printf("rr: FAIL: can't open the sockets\n");
+        return 0;
+    }
+
+    int64_t *latency = calloc(cfg.messages, sizeof(int64_t));
+    unsigned char *request  = malloc(cfg.msg_size);
+    unsigned char *response = malloc(cfg.msg_size);
+    if (!latency || !request || !response)
+        abort();
+
+    // Data received by B that hasn't been echoed yet
+    unsigned char echo[4096];
+    int echo_len = 0, echo_done = 0;
+
+    int64_t start = now;
+    time_limit    = now + (int64_t)cfg.limit_s * 1000000;
+
+    int done = 0, req_sent = 0, resp_received = 0;
+    int64_t req_time = now;
+
+    while (done < cfg.messages)
+    {
+        if (req_sent == 0 && resp_received == 0)
+        {
+            for (int i = 0; i < cfg.msg_size; i++)
+                request[i] = pattern(done * 7 + i);
+            req_time = now;
+        }
+
+        while (req_sent < cfg.msg_size)
+        {
+            int r = a->send(client, request + req_sent, cfg.msg_size - req_sent, 0);
+            if (r <= 0)
+                break;
+            req_sent += r;
+        }
+
+        if (server < 0)
+            server = tcp_accept(b, listener);
+
+        while (server >= 0)
+        {
+            if (echo_done == echo_len)
+            {
+                echo_len = b->recv(server, echo, sizeof(echo), 0);
+                echo_done = 0;
+                if (echo_len <= 0)
+                {
+                    echo_len = 0;
+                    break;
+                }
+            }
+
+            int r = b->send(server, echo + echo_done, echo_len - echo_done, 0);
+            if (r <= 0)
+                break;
+            echo_done += r;
+        }
+
+        for (;;)
+        {
+            int r = a->recv(client, response + resp_received, cfg.msg_size - resp_received, 0);
+            if (r <= 0)
+                break;
+            resp_received += r;
+        }
+
+        if (resp_received == cfg.msg_size)
+        {
+            if (memcmp(request, response, cfg.msg_size) != 0)
+            {
+                printf("rr: FAIL: wrong response to request %d\n", done);
+                ok = 0;
+                break;
+            }
+
+            latency[done++] = now - req_time;
+            req_sent = resp_received = 0;
+            continue;
+        }
+
+        if (advance(NEVER) < 0)
+        {
+            printf("rr: FAIL: timeout, %d of %d requests answered\n", done, cfg.messages);
+            ok = 0;
+            break;
+        }
+    }
+
+    int64_t elapsed = now - start;
+    if (ok && elapsed > 0)
+    {
+        printf("rr: %d requests of %d bytes in %.3f s, %.1f requests/s\n", done, cfg.msg_size,
+               elapsed / 1000000.0, done * 1000000.0 / elapsed);
+    }
+    print_latency("latency", latency, done);
+
+    struct tcp_info info;
+    get_tcp_info(a, client, &info);
+    printf("    A: %u segments sent, %u with retransmitted data\n", info.tcpi_segs_out,
+           info.tcpi_total_retrans);
+    // A few segments per request: the request, and ACKs of the response
+    ok = ok && check_segments("rr", info.tcpi_segs_out,
+                              4 * cfg.messages * ((cfg.msg_size + 1459) / 1460) + 8);
+
+    if (server >= 0)
+        b->closesocket(server);
+    a->closesocket(client);
+    b->closesocket(listener);
+    settle();
+    print_heap();
+
+    free(latency);
+    free(request);
+    free(response);
+    return ok;
+}
+
+typedef struct
+{
+    uint32_t seq;
+    uint32_t pad;
+    int64_t time;
+} udp_header;
+
+static int test_udp(void)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    int ok = 1;
+
+    int size = cfg.msg_size;
+    if (size < (int)sizeof(udp_header))
+        size = sizeof(udp_header);
+
+    int receiver = open_socket(b, SOCK_DGRAM, PORT_UDP);
+    int sender   = open_socket(a, SOCK_DGRAM, 0);
+    if (receiver < 0 || sender < 0)
+    {
+        printf("udp: FAIL: can't open the sockets\n");
+        return 0;
+    }
+
+    int64_t *latency = calloc(cfg.messages, sizeof(int64_t));
+    unsigned char *seen = calloc(cfg.messages, 1);
+    unsigned char *buffer = malloc(MAX_FRAME);
+    if (!latency || !seen || !buffer || size > MAX_FRAME)
+        abort();
+
+    struct sockaddr_in dest = make_addr(a, ADDR_B, PORT_UDP);
+
+    int64_t start = now;
+    time_limit    = now + (int64_t)cfg.limit_s * 1000000;
+
+    int sent = 0, delivered = 0, duplicates = 0, blocked = 0;
+    int64_t next_send = now;
+    int64_t end       = NEVER; // time to stop waiting for the last datagrams
+
+    while (now < end)
+    {
+        if (sent < cfg.messages && now >= next_send)
+        {
+            udp_header header = { sent, 0, now };
+            memcpy(buffer, &header, sizeof(header));
+            for (int i = sizeof(header); i < size; i++)
+                buffer[i] = pattern(sent * 7 + i);
+
+            if (a->sendto(sender, buffer, size, 0, (struct sockaddr *)&dest, sizeof(dest)) == size)
+            {
+                sent++;
+                next_send += cfg.interval_ms * 1000;
+                if (sent == cfg.messages)
+                    end = now + cfg.rtt_ms * 1000 + cfg.jitter_ms * 1000 + 1000000;
+            }
+            else
+            {
+                // Try again in the next tick of the clock
+                blocked++;
+                next_send = now + 1000;
+            }
+        }
+
+        for (;;)
+        {
+            struct sockaddr_in from;
+            int from_len = sizeof(from);
+            int r = b->recvfrom(receiver, buffer, MAX_FRAME, 0, (struct sockaddr *)&from,
+                                &from_len);
+            if (r < 0)
+                break;
+
+            udp_header header;
+            int valid = r == size;
+            if (valid)
+            {
+                memcpy(&header, buffer, sizeof(header));
+                valid = header.seq < (uint32_t)cfg.messages;
+            }
+            for (int i = sizeof(header); valid && i < size; i++)
+                valid = buffer[i] == pattern(header.seq * 7 + i);
+
+            if (!valid)
+            {
+                printf("udp: FAIL: wrong datagram of %d bytes\n", r);
+                ok = 0;
+            }
+            else if (seen[header.seq])
+            {
+                duplicates++;
+            }
+            else
+            {
+                seen[header.seq]     = 1;
+                latency[delivered++] = now - header.time;
+            }
+        }
+
+        if (advance(sent < cfg.messages ? next_send : end) < 0)
+        {
+            printf("udp: FAIL: timeout, %d of %d datagrams sent\n", sent, cfg.messages);
+            ok = 0;
+            break;
+        }
+    }
+
+    int64_t elapsed = now - start;
+    if (elapsed > 0)
+    {
+        printf("udp: %d of %d datagrams of %d bytes delivered (%.1f%%), %d duplicates, "
+               "goodput %.1f kbit/s\n",
+               delivered, sent, size, sent ? delivered * 100.0 / sent : 0.0, duplicates,
+               (double)delivered * size * 8000.0 / elapsed);
+    }
+    if (blocked)
+        printf("    sendto() failed %d times\n", blocked);
+    print_latency("one-way latency", latency, delivered);
+
+    a->closesocket(sender);
+    b->closesocket(receiver);
+    settle();
+    print_heap();
+
+    free(latency);
+    free(seen);
+    free(buffer);
+    return ok;
+}
+
+static int test_vanish(void)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    int ok = 1;
+
+    // Connections of A that are idle with keepalive enabled, that have data in flight, and that
+    // have data waiting for B to open its window.
+    enum { IDLE, SENDING, PROBING, NUM_CONNS };
+    static const char *names[NUM_CONNS] = { "keepalive", "retransmissions", "window probes" };
+    int client[NUM_CONNS], server[NUM_CONNS];
+    int64_t dropped[NUM_CONNS];
+
+    int listener = open_socket(b, SOCK_STREAM, PORT_VANISH);
+    if (listener < 0)
+    {
+        printf("vanish: FAIL: can't open the sockets\n");
+        return 0;
+    }
+    for (int i = 0; i < NUM_CONNS; i++)
+    {
+        client[i]  = tcp_pair(listener, PORT_VANISH, &server[i]);
+        dropped[i] = -1;
+        if (client[i] < 0)
+        {
+            printf("vanish: FAIL: can't connect\n");
+            return 0;
+        }
+    }
+
+    int on = 1, idle = 10, interval = 2, count = 3;
+    a->setsockopt(client[IDLE], SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    a->setsockopt(client[IDLE], SOL_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    a->setsockopt(client[IDLE], SOL_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    a->setsockopt(client[IDLE], SOL_TCP, TCP_KEEPCNT, &count, sizeof(count));
+
+    // B doesn't read anything, so its window closes eventually. The transmit buffer of A may be
+    // empty by then, if it was as large as the receive buffer of B, so it's filled once more.
+    unsigned char buffer[4096];
+    memset(buffer, 0x5A, sizeof(buffer));
+    struct tcp_info info;
+    for (int i = 0; i < 100; i++)
+    {
+        while (a->send(client[PROBING], buffer, sizeof(buffer), 0) > 0)
+            ;
+        run_for(100000);
+        get_tcp_info(a, client[PROBING], &info);
+        if (info.tcpi_snd_wnd == 0 && info.tcpi_notsent > 0)
+            break;
+    }
+    if (info.tcpi_snd_wnd != 0 || info.tcpi_notsent == 0)
+    {
+        printf("vanish: FAIL: the window of B doesn't close\n");
+        ok = 0;
+    }
+
+    int64_t start = now;
+    time_limit    = now + (int64_t)cfg.limit_s * 1000000;
+    b->down       = 1;
+
+    a->send(client[SENDING], buffer, 1000, 0);
+
+    int remaining = NUM_CONNS;
+    while (ok && remaining > 0)
+    {
+        for (int i = 0; i < NUM_CONNS; i++)
+        {
+            if (dropped[i] >= 0)
+                continue;
+
+            int r = a->recv(client[i], buffer, sizeof(buffer), 0);
+            if (r < 0 && errno == EWOULDBLOCK)
+                continue;
+            if (r >= 0 || errno != ETIMEDOUT)
+            {
+                printf("vanish: FAIL: %s: recv() returned %d (errno %d)\n", names[i], r, errno);
+                ok = 0;
+            }
+            dropped[i] = now - start;
+            remaining--;
+        }
+
+        if (ok && remaining > 0 && advance(NEVER) < 0)
+        {
+            printf("vanish: FAIL: timeout, %d connections not dropped\n", remaining);
+            ok = 0;
+        }
+    }
+
+    printf("vanish: B stops answering\n");
+    for (int i = 0; i < NUM_CONNS; i++)
+    {
+        if (dropped[i] >= 0)
+            printf("    %s: dropped after %.1f s\n", names[i], dropped[i] / 1000000.0);
+    }
+
+    b->down = 0;
+    for (int i = 0; i < NUM_CONNS; i++)
+    {
+        a->closesocket(client[i]);
+        b->closesocket(server[i]);
+    }
+    b->closesocket(listener);
+    settle();
+    print_heap();
+
+    return ok;
+}
+
+static int test_slowread(void)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    int ok = 1;
+
+    int listener = open_socket(b, SOCK_STREAM, PORT_SLOW);
+    int server   = -1;
+    int client   = listener < 0 ? -1 : tcp_pair(listener, PORT_SLOW, &server);
+    if (client < 0)
+    {
+        printf("slowread: FAIL: can't open the sockets\n");
+        return 0;
+    }
+
+    // B reads 100 bytes every 20 ms, 5000 bytes/s
+    const int total = 64 * 1024, chunk = 100, period = 20000;
+
+    int64_t start = now;
+    time_limit    = now + (int64_t)cfg.limit_s * 1000000;
+
+    int sent = 0, received = 0;
+    int64_t next_read = now;
+    unsigned char buffer[4096];
+    while (ok && received < total)
+    {
+        while (sent < total)
+        {
+            int len = total - sent;
+            if (len > (int)sizeof(buffer))
+                len = sizeof(buffer);
+            for (int i = 0; i < len; i++)
+                buffer[i] = pattern(sent + i);
+            int r = a->send(client, buffer, len, 0);
+            if (r <= 0)
+                break;
+            sent += r;
+        }
+
+        if (now >= next_read)
+        {
+            int r = b->recv(server, buffer, chunk, 0);
+            for (int i = 0; i < r && ok; i++)
+            {
+                if (buffer[i] != pattern(received + i))
+                {
+                    printf("slowread: FAIL: wrong data at offset %d\n", received + i);
+                    ok = 0;
+                }
+            }
+            if (r > 0)
+                received += r;
+            next_read += period;
+        }
+
+        if (ok && advance(next_read) < 0)
+        {
+            printf("slowread: FAIL: timeout, %d of %d bytes received\n", received, total);
+            ok = 0;
+        }
+    }
+
+    struct tcp_info info;
+    get_tcp_info(a, client, &info);
+    double average = info.tcpi_segs_out ? (double)info.tcpi_bytes_sent / info.tcpi_segs_out : 0;
+    printf("slowread: %d bytes read %d at a time in %.3f s\n", received, chunk,
+           (now - start) / 1000000.0);
+    printf("    A: %u segments sent, %.0f bytes of data per segment on average\n",
+           info.tcpi_segs_out, average);
+
+    // Without silly window syndrome avoidance, every read of B opens the window by 100 bytes and
+    // A sends a segment of 100 bytes.
+    if (ok && average < 4 * chunk)
+    {
+        printf("slowread: FAIL: segments too small\n");
+        ok = 0;
+    }
+
+    a->closesocket(client);
+    b->closesocket(server);
+    b->closesocket(listener);
+    settle();
+    print_heap();
+
+    return ok;
+}
+
+static int test_winupdate(void)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    int ok = 1;
+
+    int listener = open_socket(b, SOCK_STREAM, PORT_WINDOW);
+    int server   = -1;
+    int client   = listener < 0 ? -1 : tcp_pair(listener, PORT_WINDOW, &server);
+    if (client < 0)
+    {
+        printf("winupdate: FAIL: can't open the sockets\n");
+        return 0;
+    }
+
+    const int total = 256 * 1024;
+    unsigned char buffer[4096];
+    int sent = 0, received = 0;
+
+    time_limit = now + (int64_t)cfg.limit_s * 1000000;
+
+    // A fills the window of B, which doesn't read anything.
+    struct tcp_info info;
+    for (;;)
+    {
+        while (sent < total)
+        {
+            int len = total - sent;
+            if (len > (int)sizeof(buffer))
+                len = sizeof(buffer);
+            for (int i = 0; i < len; i++)
+                buffer[i] = pattern(sent + i);
+            int r = a->send(client, buffer, len, 0);
+            if (r <= 0)
+                break;
+            sent += r;
+        }
+
+        get_tcp_info(a, client, &info);
+        if (info.tcpi_snd_wnd == 0 && info.tcpi_unacked == 0)
+            break;
+        if (advance(NEVER) < 0)
+        {
+            printf("winupdate: FAIL: the window of B doesn't close\n");
+            ok = 0;
+            break;
+        }
+    }
+
+    // B reads everything, and the segments that tell A about the new window are lost.
+    get_tcp_info(b, server, &info);
+    unsigned int stalled_at = info.tcpi_bytes_received;
+    int64_t stall_start     = now;
+    int64_t stall           = -1;
+    int updates             = 0;
+    b->drop_acks            = INT_MAX;
+
+    while (ok && received < total)
+    {
+        while (sent < total)
+        {
+            int len = total - sent;
+            if (len > (int)sizeof(buffer))
+                len = sizeof(buffer);
+            for (int i = 0; i < len; i++)
+                buffer[i] = pattern(sent + i);
+            int r = a->send(client, buffer, len, 0);
+            if (r <= 0)
+                break;
+            sent += r;
+        }
+
+        for (;;)
+        {
+            int r = b->recv(server, buffer, sizeof(buffer), 0);
+            if (r <= 0)
+                break;
+            for (int i = 0; i < r && ok; i++)
+            {
+                if (buffer[i] != pattern(received + i))
+                {
+                    printf("winupdate: FAIL: wrong data at offset %d\n", received + i);
+                    ok = 0;
+                }
+            }
+            received += r;
+        }
+        if (b->drop_acks != 0)
+        {
+            updates      = INT_MAX - b->drop_acks;
+            b->drop_acks = 0;
+        }
+
+        // The first data that arrives after the window opened again ends the stall.
+        get_tcp_info(b, server, &info);
+        if (stall < 0 && info.tcpi_bytes_received > stalled_at)
+            stall = now - stall_start;
+
+        if (ok && received < total && advance(NEVER) < 0)
+        {
+            printf("winupdate: FAIL: timeout, %d of %d bytes received\n", received, total);
+            ok = 0;
+        }
+    }
+
+    if (ok && updates == 0)
+    {
+        printf("winupdate: FAIL: no window update was sent\n");
+        ok = 0;
+    }
+
+    printf("winupdate: %d window updates of B lost, %d bytes received\n", updates, received);
+    if (stall >= 0)
+        printf("    A resumed sending after %.3f s\n", stall / 1000000.0);
+
+    a->closesocket(client);
+    b->closesocket(server);
+    b->closesocket(listener);
+    settle();
+    print_heap();
+
+    return ok;
+}
+
+static int pmtu_transfer(int blackhole)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    const char *test = blackhole ? "pmtu (black hole)" : "pmtu (ICMP)";
+    int ok = 1;
+
+    router.mtu       = 1280;
+    router.blackhole = blackhole;
+    router.drops     = 0;
+    router.icmp_sent = 0;
+
+    int listener = open_socket(b, SOCK_STREAM, PORT_PMTU);
+    int server   = -1;
+    int client   = listener < 0 ? -1 : tcp_pair(listener, PORT_PMTU, &server);
+    if (client < 0)
+    {
+        printf("%s: FAIL: can't open the sockets\n", test);
+        router.mtu = 0;
+        return 0;
+    }
+
+    const int total = 128 * 1024;
+    int sent = 0, received = 0;
+
+    int64_t start = now;
+    time_limit    = now + (int64_t)cfg.limit_s * 1000000;
+
+    while (ok && received < total)
+    {
+        send_pattern(a, client, &sent, total);
+        ok = recv_pattern(test, b, server, &received);
+
+        if (ok && received < total && advance(NEVER) < 0)
+        {
+            printf("%s: FAIL: timeout, %d of %d bytes received\n", test, received, total);
+            ok = 0;
+        }
+    }
+
+    struct tcp_info info;
+    get_tcp_info(a, client, &info);
+    printf("%s: MTU %d, %d bytes in %.3f s\n", test, router.mtu, received,
+           (now - start) / 1000000.0);
+    printf("    A: MSS %u, %u packets dropped by the router, %u ICMP messages\n", info.tcpi_snd_mss,
+           router.drops, router.icmp_sent);
+    if (ok && info.tcpi_snd_mss > (unsigned)router.mtu - 40)
+    {
+        printf("%s: FAIL: MSS too large for the path\n", test);
+        ok = 0;
+    }
+
+    router.mtu = 0;
+    a->closesocket(client);
+    b->closesocket(server);
+    b->closesocket(listener);
+    settle();
+    print_heap();
+
+    // Wait until A forgets the path MTU (SGIP_IP_PMTU_AGEMS) before the next test.
+    run_for(11 * 60 * 1000000LL);
+
+    return ok;
+}
+
+static int test_pmtu(void)
+{
+    int ok = pmtu_transfer(0);
+    return pmtu_transfer(1) && ok;
+}
+
+// Listener of B that accepts connections with TCP Fast Open.
+static int open_tfo_listener(int port)
+{
+    node *b      = &nodes[1];
+    int listener = open_socket(b, SOCK_STREAM, port);
+    int qlen     = 2;
+    if (listener >= 0 && b->setsockopt(listener, SOL_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) < 0)
+    {
+        b->closesocket(listener);
+        return -1;
+    }
+
+    return listener;
+}
+
+// A opens a connection with B to get a Fast Open cookie. Returns 0 if it isn't accepted.
+static int get_tfo_cookie(int listener, int port)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+
+    int client = open_socket(a, SOCK_STREAM, 0);
+    if (client < 0)
+        return 0;
+
+    struct sockaddr_in addr = make_addr(a, ADDR_B, port);
+    a->sendto(client, "cookie", 6, MSG_FASTOPEN, (struct sockaddr *)&addr, sizeof(addr));
+
+    int server = -1;
+    time_limit = now + (int64_t)cfg.limit_s * 1000000;
+    while ((server = tcp_accept(b, listener)) < 0 && advance(NEVER) == 0)
+        ;
+    if (server >= 0)
+        b->closesocket(server);
+    a->closesocket(client);
+    settle();
+
+    return server >= 0;
+}
+
+// Connects to a port of B without a listener. With "data", it's sent in the SYN with TCP Fast
+// Open, which needs a cookie of B.
+static int refused_connect(const unsigned char *data, int len)
+{
+    node *a = &nodes[0];
+    const char *name = len > 0 ? "Fast Open" : "connect";
+    int ok           = 1;
+
+    int sock = open_socket(a, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        printf("refused: FAIL: can't open the socket\n");
+        return 0;
+    }
+
+    int64_t start = now;
+    if (len > 0)
+    {
+        struct sockaddr_in addr = make_addr(a, ADDR_B, PORT_CLOSED);
+        if (a->sendto(sock, data, len, MSG_FASTOPEN, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            && errno != EINPROGRESS)
+            ok = 0;
+    }
+    else
+    {
+        struct sockaddr_in addr = make_addr(a, ADDR_B, PORT_CLOSED);
+        if (a->connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+            ok = 0;
+    }
+    if (!ok)
+    {
+        printf("refused: FAIL: %s: can't start the connection (errno %d)\n", name, errno);
+        a->closesocket(sock);
+        return 0;
+    }
+
+    time_limit = now + (int64_t)cfg.limit_s * 1000000;
+    int r, error = 0;
+    while (error == 0)
+    {
+        char c;
+        r = a->recv(sock, &c, 1, 0);
+        if (r >= 0 || errno != EWOULDBLOCK)
+            error = r >= 0 ? -1 : errno;
+        else if (advance(NEVER) < 0)
+            break;
+    }
+
+    struct tcp_info info;
+    get_tcp_info(a, sock, &info);
+    printf("    %s: %u bytes in the SYN, ", name, info.tcpi_bytes_sent);
+    if (error == ECONNREFUSED)
+    {
+        printf("refused after %.1f ms\n", (now - start) / 1000.0);
+    }
+    else if (error == 0)
+    {
+        printf("\nrefused: FAIL: %s: still connecting after %.1f ms\n", name,
+               (now - start) / 1000.0);
+        ok = 0;
+    }
+    else
+    {
+        printf("\nrefused: FAIL: %s: recv() returned %d (errno %d)\n", name, r, error);
+        ok = 0;
+    }
+    // If nothing is lost, the SYN isn't sent again before the RST arrives. Otherwise A may not
+    // have the cookie, and SYNs sent again don't carry data.
+    if (ok && cfg.loss == 0 && now - start > 500000)
+    {
+        printf("refused: FAIL: %s: the SYN was sent again\n", name);
+        ok = 0;
+    }
+    if (cfg.loss == 0 && len > 0 && (int)info.tcpi_bytes_sent != len)
+    {
+        printf("refused: FAIL: the data wasn't sent in the SYN\n");
+        ok = 0;
+    }
+
+    a->closesocket(sock);
+    return ok;
+}
+
+static int test_refused(void)
+{
+    node *b = &nodes[1];
+    int ok = 1;
+
+    int listener = open_tfo_listener(PORT_TFO);
+    if (listener < 0 || !get_tfo_cookie(listener, PORT_TFO))
+    {
+        printf("refused: FAIL: can't get a Fast Open cookie\n");
+        return 0;
+    }
+    b->closesocket(listener);
+    settle();
+
+    unsigned char data[100];
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = pattern(i);
+
+    printf("refused: A connects to a port of B without a listener\n");
+    ok = refused_connect(NULL, 0) && ok;
+    ok = refused_connect(data, sizeof(data)) && ok;
+
+    settle();
+    print_heap();
+
+    return ok;
+}
+
+// Sends requests of A to B with a new connection for each one, which B closes after echoing the
+// request. Returns the number of requests answered, or -1 on failure.
+static int crr_run(int listener, int fastopen, int64_t *latency)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    const char *name = fastopen ? "Fast Open" : "connect";
+
+    unsigned char *request  = malloc(cfg.msg_size);
+    unsigned char *response = malloc(cfg.msg_size);
+    if (!request || !response)
+        abort();
+
+    // Data received by B that hasn't been echoed yet
+    unsigned char echo[4096];
+
+    struct sockaddr_in addr = make_addr(a, ADDR_B, PORT_CRR);
+    time_limit              = now + (int64_t)cfg.limit_s * 1000000;
+
+    int done = 0;
+    while (done < cfg.messages)
+    {
+        for (int i = 0; i < cfg.msg_size; i++)
+            request[i] = pattern(done * 7 + i);
+
+        int64_t req_time = now;
+        int req_sent = 0, resp_received = 0;
+        int echo_len = 0, echo_done = 0, echo_total = 0;
+
+        int client = open_socket(a, SOCK_STREAM, 0);
+        int server = -1;
+        if (client < 0)
+            break;
+        if (fastopen)
+        {
+            int r = a->sendto(client, request, cfg.msg_size, MSG_FASTOPEN,
+                              (struct sockaddr *)&addr, sizeof(addr));
+            if (r > 0)
+                req_sent = r;
+            else if (errno != EINPROGRESS)
+            {
+                a->closesocket(client);
+                break;
+            }
+        }
+        else if (a->connect(client, (struct sockaddr *)&addr, sizeof(addr)) < 0
+                 && errno != EINPROGRESS)
+        {
+            a->closesocket(client);
+            break;
+        }
+
+        while (resp_received < cfg.msg_size)
+        {
+            while (req_sent < cfg.msg_size)
+            {
+                int r = a->send(client, request + req_sent, cfg.msg_size - req_sent, 0);
+                if (r <= 0)
+                    break;
+                req_sent += r;
+            }
+
+            // A duplicated SYN with data that arrives after its connection has been closed opens
+            // a new one (RFC 7413 section 6.1), so B may have to answer stale requests first.
+            if (server < 0)
+                server = tcp_accept(b, listener);
+
+            while (server >= 0)
+            {
+                if (echo_done == echo_len)
+                {
+                    echo_len  = b->recv(server, echo, sizeof(echo), 0);
+                    echo_done = 0;
+                    if (echo_len == 0 || (echo_len < 0 && errno != EWOULDBLOCK))
+                    {
+                        // reset by A, the request was stale
+                        b->closesocket(server);
+                        server   = -1;
+                        echo_len = echo_total = 0;
+                        break;
+                    }
+                    if (echo_len < 0)
+                    {
+                        echo_len = 0;
+                        break;
+                    }
+                }
+
+                int r = b->send(server, echo + echo_done, echo_len - echo_done, 0);
+                if (r <= 0)
+                    break;
+                echo_done += r;
+                echo_total += r;
+                if (echo_total == cfg.msg_size)
+                {
+                    b->closesocket(server);
+                    server   = -1;
+                    echo_len = echo_done = echo_total = 0;
+                }
+            }
+
+            int error = 0;
+            for (;;)
+            {
+                int r = a->recv(client, response + resp_received, cfg.msg_size - resp_received,
+                                0);
+                if (r <= 0)
+                {
+                    if (r == 0 || errno != EWOULDBLOCK)
+                        error = r == 0 ? -1 : errno;
+                    break;
+                }
+                resp_received += r;
+            }
+
+            if (error != 0 && resp_received < cfg.msg_size)
+            {
+                printf("crr: FAIL: %s: request %d: connection closed (errno %d)\n", name, done,
+                       error);
+                break;
+            }
+            if (resp_received < cfg.msg_size && advance(NEVER) < 0)
+            {
+                printf("crr: FAIL: %s: timeout, %d of %d requests answered\n", name, done,
+                       cfg.messages);
+                break;
+            }
+        }
+
+        if (server >= 0)
+            b->closesocket(server);
+        a->closesocket(client);
+
+        if (resp_received < cfg.msg_size)
+        {
+            done = -1;
+            break;
+        }
+        if (memcmp(request, response, cfg.msg_size) != 0)
+        {
+            printf("crr: FAIL: %s: wrong response to request %d\n", name, done);
+            done = -1;
+            break;
+        }
+
+        latency[done++] = now - req_time;
+    }
+
+    if (done >= 0 && done < cfg.messages)
+    {
+        printf("crr: FAIL: %s: can't start connection %d (errno %d)\n", name, done, errno);
+        done = -1;
+    }
+
+    settle();
+    free(request);
+    free(response);
+    return done;
+}
+
+static int test_crr(void)
+{
+    node *b = &nodes[1];
+    int ok  = 1;
+
+    int listener = open_tfo_listener(PORT_CRR);
+    if (listener < 0)
+    {
+        printf("crr: FAIL: can't open the listener\n");
+        return 0;
+    }
+
+    int64_t *latency[2] = { NULL, NULL };
+    int64_t median[2] = { 0, 0 };
+    for (int fastopen = 0; fastopen < 2; fastopen++)
+    {
+        latency[fastopen] = calloc(cfg.messages, sizeof(int64_t));
+        if (!latency[fastopen])
+            abort();
+
+        if (fastopen && !get_tfo_cookie(listener, PORT_CRR))
+        {
+            printf("crr: FAIL: can't get a Fast Open cookie\n");
+            ok = 0;
+            break;
+        }
+
+        int64_t start = now;
+        int done      = crr_run(listener, fastopen, latency[fastopen]);
+        if (done < 0)
+        {
+            ok = 0;
+            break;
+        }
+
+        int64_t elapsed = now - start;
+        printf("crr: %s: %d requests of %d bytes in %.3f s, %.1f requests/s\n",
+               fastopen ? "Fast Open" : "connect", done, cfg.msg_size, elapsed / 1000000.0,
+               elapsed > 0 ? done * 1000000.0 / elapsed : 0.0);
+        print_latency("latency", latency[fastopen], done);
+        median[fastopen] = latency[fastopen][done / 2];
+    }
+
+    // Without Fast Open, the request waits for the SYN-ACK, so it should take a round trip more.
+    if (ok)
+    {
+        printf("    Fast Open saves %.1f ms per request (p50)\n", (median[0] - median[1]) / 1000.0);
+        if (cfg.loss == 0 && cfg.reorder == 0 && cfg.duplicate == 0 && cfg.jitter_ms == 0
+            && median[1] >= median[0])
+        {
+            printf("crr: FAIL: Fast Open doesn't make requests faster\n");
+            ok = 0;
+        }
+    }
+
+    b->closesocket(listener);
+    settle();
+    print_heap();
+
+    free(latency[0]);
+    free(latency[1]);
+    return ok;
+}
+
+// Sends datagrams of A to B at 60 Hz, like the state updates of a game, while A sends as much data
+// as it can to B over TCP if "tcp" is set. "rate" is the pacing rate of the TCP socket in bytes
+// per second, or 0. Returns the number of datagrams delivered, or -1 on failure.
+static int mixed_run(int tcp, unsigned int rate, int64_t *latency)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    int ok = 1;
+
+    int size = cfg.msg_size;
+    if (size < (int)sizeof(udp_header))
+        size = sizeof(udp_header);
+
+    int receiver = open_socket(b, SOCK_DGRAM, PORT_MIXED);
+    int sender   = open_socket(a, SOCK_DGRAM, 0);
+    int listener = -1, client = -1, server = -1;
+    if (tcp)
+    {
+        listener = open_socket(b, SOCK_STREAM, PORT_MIXED);
+        client   = tcp_connect(a, ADDR_B, PORT_MIXED);
+        if (client >= 0 && rate > 0)
+            a->setsockopt(client, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+    }
+    if (receiver < 0 || sender < 0 || (tcp && (listener < 0 || client < 0)))
+    {
+        printf("mixed: FAIL: can't open the sockets\n");
+        return -1;
+    }
+
+    unsigned char *seen   = calloc(cfg.messages, 1);
+    unsigned char *buffer = malloc(MAX_FRAME);
+    if (!seen || !buffer || size > MAX_FRAME)
+        abort();
+
+    struct sockaddr_in dest = make_addr(a, ADDR_B, PORT_MIXED);
+
+    int64_t start = now;
+    time_limit    = now + (int64_t)cfg.limit_s * 1000000;
+
+    int sent = 0, delivered = 0, blocked = 0;
+    int tcp_sent = 0, tcp_received = 0;
+    int64_t next_send = now;
+    int64_t end       = NEVER; // time to stop waiting for the last datagrams
+
+    while (ok && now < end)
+    {
+        if (sent < cfg.messages && now >= next_send)
+        {
+            udp_header header = { sent, 0, now };
+            memcpy(buffer, &header, sizeof(header));
+            for (int i = sizeof(header); i < size; i++)
+                buffer[i] = pattern(sent * 7 + i);
+
+            if (a->sendto(sender, buffer, size, 0, (struct sockaddr *)&dest, sizeof(dest)) == size)
+            {
+                sent++;
+                next_send = start + (int64_t)sent * 1000000 / 60;
+                if (sent == cfg.messages)
+                    end = now + cfg.rtt_ms * 1000 + cfg.jitter_ms * 1000 + 1000000;
+            }
+            else
+            {
+                // Try again in the next tick of the clock
+                blocked++;
+                next_send = now + 1000;
+            }
+        }
+
+        // The TCP sender always has data waiting while the datagrams are sent
+        while (tcp && sent < cfg.messages)
+        {
+            for (int i = 0; i < 1024; i++)
+                buffer[i] = pattern(tcp_sent + i);
+            int r = a->send(client, buffer, 1024, 0);
+            if (r <= 0)
+                break;
+            tcp_sent += r;
+        }
+        if (tcp && server < 0)
+            server = tcp_accept(b, listener);
+        while (server >= 0)
+        {
+            int r = b->recv(server, buffer, MAX_FRAME, 0);
+            if (r <= 0)
+                break;
+            for (int i = 0; i < r && ok; i++)
+            {
+                if (buffer[i] != pattern(tcp_received + i))
+                {
+                    printf("mixed: FAIL: wrong TCP data at offset %d\n", tcp_received + i);
+                    ok = 0;
+                }
+            }
+            tcp_received += r;
+        }
+
+        for (;;)
+        {
+            struct sockaddr_in from;
+            int from_len = sizeof(from);
+            int r = b->recvfrom(receiver, buffer, MAX_FRAME, 0, (struct sockaddr *)&from,
+                                &from_len);
+            if (r < 0)
+                break;
+
+            udp_header header;
+            memcpy(&header, buffer, sizeof(header));
+            if (r != size || header.seq >= (uint32_t)cfg.messages)
+            {
+                printf("mixed: FAIL: wrong datagram of %d bytes\n", r);
+                ok = 0;
+            }
+            else if (!seen[header.seq])
+            {
+                seen[header.seq]     = 1;
+                latency[delivered++] = now - header.time;
+            }
+        }
+
+        if (ok && advance(sent < cfg.messages ? next_send : end) < 0)
+        {
+            printf("mixed: FAIL: timeout, %d of %d datagrams sent\n", sent, cfg.messages);
+            ok = 0;
+        }
+    }
+
+    int64_t elapsed  = now - start;
+    const char *name = !tcp ? "UDP only" : rate ? "paced TCP" : "TCP";
+    printf("mixed: %s: %d of %d datagrams delivered", name, delivered, sent);
+    if (tcp && elapsed > 0)
+        printf(", TCP goodput %.1f kbit/s", tcp_received * 8000.0 / elapsed);
+    printf("\n");
+    if (blocked)
+        printf("    sendto() failed %d times\n", blocked);
+    print_latency("one-way latency", latency, delivered);
+
+    if (server >= 0)
+        b->closesocket(server);
+    if (tcp)
+    {
+        a->closesocket(client);
+        b->closesocket(listener);
+    }
+    a->closesocket(sender);
+    b->closesocket(receiver);
+    settle();
+
+    free(seen);
+    free(buffer);
+    return ok ? delivered : -1;
+}
+
+static int test_mixed(void)
+{
+    int ok = 1;
+
+    int64_t *latency = calloc(cfg.messages, sizeof(int64_t));
+    int64_t p90[3] = { 0, 0, 0 }, p99[3] = { 0, 0, 0 }, max[3] = { 0, 0, 0 };
+    if (!latency)
+        abort();
+
+    // Pacing to half the bandwidth of the link leaves room for the datagrams
+    unsigned int rate = cfg.bandwidth * 1000 / 8 / 2;
+    for (int run = 0; run < 3 && ok; run++)
+    {
+        int delivered = mixed_run(run > 0, run == 2 ? rate : 0, latency);
+        if (delivered < 0)
+        {
+            ok = 0;
+            break;
+        }
+        if (delivered > 0)
+        {
+            p90[run] = latency[delivered * 90 / 100];
+            p99[run] = latency[delivered * 99 / 100];
+            max[run] = latency[delivered - 1];
+        }
+        if (cfg.loss == 0 && delivered < cfg.messages)
+        {
+            printf("mixed: FAIL: datagrams lost on a link that doesn't lose them\n");
+            ok = 0;
+        }
+    }
+    if (ok)
+    {
+        printf("    TCP adds %.1f ms to the p90 latency and %.1f ms to the p99 latency, "
+               "%.1f ms and %.1f ms with pacing\n",
+               (p90[1] - p90[0]) / 1000.0, (p99[1] - p99[0]) / 1000.0,
+               (p90[2] - p90[0]) / 1000.0, (p99[2] - p99[0]) / 1000.0);
+    }
+
+    // The TCP sender only has one segment in flight, so a datagram never waits for more than one
+    // full segment (1474 bytes with headers) that is being sent. Pacing can make that less
+    // likely, but not shorter.
+    int64_t segment_us = 1474LL * 8000 / cfg.bandwidth;
+    if (ok && cfg.jitter_ms == 0 && cfg.loss == 0 && cfg.reorder == 0 && cfg.duplicate == 0)
+    {
+        for (int run = 1; run < 3; run++)
+        {
+            if (max[run] > p99[0] + segment_us + 1000)
+            {
+                printf("mixed: FAIL: datagrams waited %.1f ms, more than one TCP segment\n",
+                       (max[run] - p99[0]) / 1000.0);
+                ok = 0;
+            }
+        }
+    }
+    print_heap();
+
+    free(latency);
+    return ok;
+}
+
+#define RXMEM_IDLE 4
+
+static int get_rcvbuf(node *n, int sock)
+{
+    int size = 0, len = sizeof(size);
+    n->getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, &len);
+    return size;
+}
+
+static int test_rxmem(void)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    int ok = 1;
+
+    int client[RXMEM_IDLE + 1], server[RXMEM_IDLE + 1];
+    int opened = 0;
+
+    // Connections of the previous tests may still be in TIME_WAIT, they don't count
+    int used, peak, used_before;
+    b->sgIP_Sim_GetHeapUsage(&used_before, &peak);
+
+    // Every connection needs about 17 KB of heap in each node, and the listener as much
+    int num_idle = cfg.heap_size / (24 * 1024) - 1;
+    if (num_idle < 1)
+        num_idle = 1;
+    if (num_idle > RXMEM_IDLE || cfg.heap_size <= 0)
+        num_idle = RXMEM_IDLE;
+
+    int listener = open_socket(b, SOCK_STREAM, PORT_RXMEM);
+    if (listener < 0)
+    {
+        printf("rxmem: FAIL: can't open the sockets\n");
+        return 0;
+    }
+
+    // Control connections that send a few bytes and then stay idle
+    for (; opened < num_idle; opened++)
+    {
+        client[opened] = tcp_pair(listener, PORT_RXMEM, &server[opened]);
+        if (client[opened] < 0)
+            break;
+        int sent = 0, received = 0;
+        send_pattern(a, client[opened], &sent, 100);
+        run_for(200000);
+        recv_pattern("rxmem", b, server[opened], &received);
+    }
+    if (opened < num_idle)
+    {
+        printf("rxmem: FAIL: can't open the idle connections\n");
+        ok = 0;
+    }
+
+    int initial = opened > 0 ? get_rcvbuf(b, server[0]) : 0;
+
+    // Longer than SGIP_TCP_RECEIVEIDLEMS, so their buffers must shrink
+    run_for(15000000);
+    int idle = 0;
+    for (int i = 0; i < opened; i++)
+    {
+        int size = get_rcvbuf(b, server[i]);
+        if (size > idle)
+            idle = size;
+    }
+    if (ok && idle >= initial)
+    {
+        printf("rxmem: FAIL: idle receive buffers of %d bytes, %d at the start\n", idle, initial);
+        ok = 0;
+    }
+
+    int sent = 0, received = 0, largest = 0;
+    int64_t start = now;
+    if (ok)
+    {
+        client[opened] = tcp_pair(listener, PORT_RXMEM, &server[opened]);
+        if (client[opened] < 0)
+        {
+            printf("rxmem: FAIL: can't open the bulk connection\n");
+            ok = 0;
+        }
+        else
+        {
+            opened++;
+        }
+    }
+
+    time_limit = now + (int64_t)cfg.limit_s * 1000000;
+    while (ok && received < cfg.bulk_bytes)
+    {
+        send_pattern(a, client[opened - 1], &sent, cfg.bulk_bytes);
+        ok = recv_pattern("rxmem", b, server[opened - 1], &received);
+
+        int size = get_rcvbuf(b, server[opened - 1]);
+        if (size > largest)
+            largest = size;
+
+        if (ok && received < cfg.bulk_bytes && advance(NEVER) < 0)
+        {
+            printf("rxmem: FAIL: timeout, %d of %d bytes received\n", received, cfg.bulk_bytes);
+            ok = 0;
+        }
+    }
+
+    b->sgIP_Sim_GetHeapUsage(&used, &peak);
+    peak -= used_before;
+    if (ok)
+    {
+        int64_t elapsed = now - start;
+        printf("rxmem: %d bytes in %.3f s next to %d idle connection(s), goodput %.1f kbit/s\n",
+               received, elapsed / 1000000.0, num_idle, received * 8000.0 / elapsed);
+        printf("    B: receive buffers of %d bytes at the start, %d when idle, up to %d bytes for "
+               "the bulk data\n",
+               initial, idle, largest);
+    }
+
+    // Grown buffers must leave room in the heap for everything else, like frames in flight and new
+    // sockets: an eighth of it, 16 KB of the default heap, or ten frames of full size.
+    if (ok && cfg.heap_size > 0 && peak > cfg.heap_size - cfg.heap_size / 8)
+    {
+        printf("rxmem: FAIL: the connections of B use up to %d bytes of the heap of %d\n", peak,
+               cfg.heap_size);
+        ok = 0;
+    }
+
+    for (int i = 0; i < opened; i++)
+    {
+        a->closesocket(client[i]);
+        b->closesocket(server[i]);
+    }
+    b->closesocket(listener);
+    settle();
+    print_heap();
+
+    return ok;
+}
+
+// Time given to the connections that are still closing before the heap is measured. It's longer
+// than SGIP_TCP_ORPHANTIMEOUTMS.
+#define CHURN_DRAIN 70000000
+
+// Opens and closes cfg.cycles connections one after the other. Returns 0 on failure.
+static int churn_run(int listener, int abortive)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    const char *name = abortive ? "SO_LINGER 0" : "graceful";
+
+    int64_t start = now;
+
+    // Closed connections stay in TIME_WAIT for a while, but their number is limited. Once the
+    // limit has been reached, the heap in use must stop growing. It's measured once the last
+    // connections have been closed or reset as orphans, so they don't count.
+    int used_early[2] = { 0, 0 };
+
+    int done = 0;
+    for (; done < cfg.cycles; done++)
+    {
+        // Each connection gets a minute, retransmissions included
+        time_limit = now + 60000000;
+
+        int client = tcp_connect(a, ADDR_B, PORT_CHURN);
+        if (client < 0)
+        {
+            printf("churn: FAIL: %s: can't open connection %d (errno %d)\n", name, done, errno);
+            break;
+        }
+
+        int server;
+        while ((server = tcp_accept(b, listener)) < 0 && advance(NEVER) == 0)
+            ;
+        if (server < 0)
+        {
+            printf("churn: FAIL: %s: timeout, connection %d not accepted\n", name, done);
+            a->closesocket(client);
+            break;
+        }
+
+        if (abortive)
+        {
+            struct linger l = { 1, 0 };
+            a->setsockopt(client, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+        }
+        a->closesocket(client);
+
+        // B waits for the FIN or the RST of A. A RST isn't retransmitted, so if it's lost B only
+        // finds out when it sends something and A answers with another RST.
+        char c = 0;
+        int r;
+        int64_t probe = now + 1000000;
+        while ((r = b->recv(server, &c, 1, 0)) < 0 && errno == EWOULDBLOCK)
+        {
+            if (abortive && now >= probe)
+            {
+                b->send(server, &c, 1, 0);
+                probe = NEVER;
+            }
+            if (advance(abortive ? probe : NEVER) < 0)
+                break;
+        }
+        int error = r < 0 ? errno : 0;
+        b->closesocket(server);
+        if (error == EWOULDBLOCK)
+        {
+            printf("churn: FAIL: %s: timeout, connection %d not closed\n", name, done);
+            break;
+        }
+        if (r != 0 && !(abortive && error == ECONNRESET))
+        {
+            printf("churn: FAIL: %s: connection %d: recv() returned %d (errno %d)\n", name, done,
+                   r, error);
+            break;
+        }
+
+        if (done == cfg.cycles / 10)
+        {
+            int peak;
+            int64_t pause = now;
+            run_for(CHURN_DRAIN);
+            start += now - pause;
+            for (int i = 0; i < 2; i++)
+                nodes[i].sgIP_Sim_GetHeapUsage(&used_early[i], &peak);
+        }
+    }
+
+    int64_t elapsed = now - start;
+    int ok          = done == cfg.cycles;
+    if (ok)
+    {
+        printf("churn: %s: %d connections in %.3f s, %.1f per second\n", name, done,
+               elapsed / 1000000.0, done * 1000000.0 / elapsed);
+    }
+
+    run_for(CHURN_DRAIN);
+    for (int i = 0; i < 2 && ok; i++)
+    {
+        int used, peak;
+        nodes[i].sgIP_Sim_GetHeapUsage(&used, &peak);
+        if (used > used_early[i] + 4096)
+        {
+            printf("churn: FAIL: %s: heap in use by %s grew from %d to %d bytes\n", name,
+                   nodes[i].name, used_early[i], used);
+            ok = 0;
+        }
+    }
+
+    print_heap();
+    return ok;
+}
+
+static int test_churn(void)
+{
+    node *b = &nodes[1];
+
+    int listener = open_socket(b, SOCK_STREAM, PORT_CHURN);
+    if (listener < 0)
+    {
+        printf("churn: FAIL: can't open the sockets\n");
+        return 0;
+    }
+
+    int ok = churn_run(listener, 0);
+    ok     = churn_run(listener, 1) && ok;
+
+    b->closesocket(listener);
+    settle();
+    return ok;
+}
+
+// The flood sends datagrams that fit in one memblock for FLOOD_US, at half the bandwidth of the
+// link, so the link itself doesn't drop the other traffic. The other traffic is a request to B
+// every FLOOD_REQUEST_US and updates at 60 Hz to another socket.
+#define FLOOD_SIZE       1000
+#define FLOOD_US         10000000
+#define FLOOD_REQUEST_US 100000
+
+// A floods a UDP socket of B that is never read. Returns 0 on failure.
+static int flood_run(int listener, int drop_oldest)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    const char *name = drop_oldest ? "SO_RCVDROPOLDEST" : "tail drop";
+    int ok = 1;
+
+    int size = cfg.msg_size;
+    if (size < (int)sizeof(udp_header))
+        size = sizeof(udp_header);
+
+    b->sgIP_Sim_ResetHeapPeak();
+
+    int server   = -1;
+    int client   = tcp_pair(listener, PORT_FLOOD, &server);
+    int flooded  = open_socket(b, SOCK_DGRAM, PORT_FLOOD);
+    int receiver = open_socket(b, SOCK_DGRAM, PORT_FLOOD + 1);
+    int sender   = open_socket(a, SOCK_DGRAM, 0);
+    if (client < 0 || flooded < 0 || receiver < 0 || sender < 0)
+    {
+        printf("flood: FAIL: %s: can't open the sockets\n", name);
+        return 0;
+    }
+    if (drop_oldest)
+    {
+        int on = 1;
+        b->setsockopt(flooded, SOL_SOCKET, SO_RCVDROPOLDEST, &on, sizeof(on));
+    }
+
+    int requests = FLOOD_US / FLOOD_REQUEST_US;
+    int updates  = FLOOD_US * 60LL / 1000000;
+
+    int64_t *latency      = calloc(requests, sizeof(int64_t));
+    int64_t *req_time     = calloc(requests, sizeof(int64_t));
+    unsigned char *seen   = calloc(updates, 1);
+    unsigned char *buffer = malloc(MAX_FRAME);
+    if (!latency || !req_time || !seen || !buffer || size > MAX_FRAME)
+        abort();
+
+    struct sockaddr_in flood_dest  = make_addr(a, ADDR_B, PORT_FLOOD);
+    struct sockaddr_in update_dest = make_addr(a, ADDR_B, PORT_FLOOD + 1);
+
+    // Time needed to send a datagram of the flood with its headers, doubled
+    int64_t flood_interval = (int64_t)(FLOOD_SIZE + 42) * 8 * 1000 * 2 / cfg.bandwidth;
+
+    int64_t start = now;
+    int64_t end   = now + FLOOD_US;
+    time_limit    = now + (int64_t)cfg.limit_s * 1000000;
+
+    int flood_sent = 0, sent = 0, delivered = 0;
+    int req_sent = 0, tcp_sent = 0, tcp_received = 0, answered = 0;
+
+    // Data received by B that hasn't been echoed yet
+    unsigned char echo[4096];
+    int echo_len = 0, echo_done = 0;
+    int64_t next_flood = now, next_update = now, next_request = now;
+
+    while (ok && (now < end || answered < requests))
+    {
+        if (now < end && now >= next_flood)
+        {
+            udp_header header = { flood_sent, 0, now };
+            memcpy(buffer, &header, sizeof(header));
+            memset(buffer + sizeof(header), 0x5A, FLOOD_SIZE - sizeof(header));
+            if (a->sendto(sender, buffer, FLOOD_SIZE, 0, (struct sockaddr *)&flood_dest,
+                          sizeof(flood_dest))
+                == FLOOD_SIZE)
+                flood_sent++;
+            next_flood += flood_interval;
+        }
+
+        if (sent < updates && now >= next_update)
+        {
+            udp_header header = { sent, 0, now };
+            memcpy(buffer, &header, sizeof(header));
+            for (int i = sizeof(header); i < size; i++)
+                buffer[i] = pattern(sent * 7 + i);
+            if (a->sendto(sender, buffer, size, 0, (struct sockaddr *)&update_dest,
+                          sizeof(update_dest))
+                == size)
+                sent++;
+            next_update = start + (int64_t)(sent + 1) * 1000000 / 60;
+        }
+
+        if (req_sent < requests && now >= next_request)
+        {
+            req_time[req_sent++] = now;
+            next_request += FLOOD_REQUEST_US;
+        }
+        send_pattern(a, client, &tcp_sent, req_sent * size);
+
+        // B echoes the requests
+        for (;;)
+        {
+            if (echo_done == echo_len)
+            {
+                echo_len  = b->recv(server, echo, sizeof(echo), 0);
+                echo_done = 0;
+                if (echo_len <= 0)
+                {
+                    echo_len = 0;
+                    break;
+                }
+            }
+            int r = b->send(server, echo + echo_done, echo_len - echo_done, 0);
+            if (r <= 0)
+                break;
+            echo_done += r;
+        }
+        if (!recv_pattern("flood", a, client, &tcp_received))
+            ok = 0;
+        while (answered < requests && tcp_received >= (answered + 1) * size)
+        {
+            latency[answered] = now - req_time[answered];
+            answered++;
+        }
+
+        for (;;)
+        {
+            struct sockaddr_in from;
+            int from_len = sizeof(from);
+            int r = b->recvfrom(receiver, buffer, MAX_FRAME, 0, (struct sockaddr *)&from,
+                                &from_len);
+            if (r < 0)
+                break;
+
+            udp_header header;
+            memcpy(&header, buffer, sizeof(header));
+            if (r != size || header.seq >= (uint32_t)updates)
+            {
+                printf("flood: FAIL: %s: wrong datagram of %d bytes\n", name, r);
+                ok = 0;
+            }
+            else if (!seen[header.seq])
+            {
+                seen[header.seq] = 1;
+                delivered++;
+            }
+        }
+
+        int64_t wakeup = NEVER;
+        if (now < end)
+            wakeup = next_flood < next_update ? next_flood : next_update;
+        if (ok && advance(wakeup) < 0)
+        {
+            printf("flood: FAIL: %s: timeout, %d of %d requests answered\n", name, answered,
+                   requests);
+            ok = 0;
+        }
+    }
+
+    // The datagrams of the flood that are still queued
+    int queued = 0, newest = -1;
+    for (;;)
+    {
+        struct sockaddr_in from;
+        int from_len = sizeof(from);
+        int r = b->recvfrom(flooded, buffer, MAX_FRAME, 0, (struct sockaddr *)&from, &from_len);
+        if (r < 0)
+            break;
+        udp_header header;
+        memcpy(&header, buffer, sizeof(header));
+        if ((int)header.seq > newest)
+            newest = header.seq;
+        queued++;
+    }
+
+    int drops = 0, len = sizeof(drops);
+    b->getsockopt(flooded, SOL_SOCKET, SO_RCVDROPS, &drops, &len);
+    int rcvbuf = get_rcvbuf(b, flooded);
+    int used, peak;
+    b->sgIP_Sim_GetHeapUsage(&used, &peak);
+
+    if (ok)
+    {
+        printf("flood: %s: %d datagrams of %d bytes sent, %d dropped by B, %d queued\n", name,
+               flood_sent, FLOOD_SIZE, drops, queued);
+        printf("    %d of %d updates delivered, %d requests answered\n", delivered, sent, answered);
+        print_latency("request latency", latency, answered);
+    }
+
+    // The queue keeps the oldest datagrams, or the newest ones with SO_RCVDROPOLDEST
+    if (ok && (drops == 0 || queued * FLOOD_SIZE > rcvbuf))
+    {
+        printf("flood: FAIL: %s: %d datagrams queued with SO_RCVBUF %d bytes\n", name, queued,
+               rcvbuf);
+        ok = 0;
+    }
+    if (ok && (newest >= flood_sent / 2) != drop_oldest)
+    {
+        printf("flood: FAIL: %s: datagram %d of %d is still queued\n", name, newest, flood_sent);
+        ok = 0;
+    }
+    if (ok && cfg.loss == 0 && delivered < sent)
+    {
+        printf("flood: FAIL: %s: updates lost on a link without losses\n", name);
+        ok = 0;
+    }
+    if (ok && cfg.heap_size > 0 && peak > cfg.heap_size - cfg.heap_size / 8)
+    {
+        printf("flood: FAIL: %s: B uses up to %d bytes of the heap of %d\n", name, peak,
+               cfg.heap_size);
+        ok = 0;
+    }
+
+    a->closesocket(client);
+    b->closesocket(server);
+    a->closesocket(sender);
+    b->closesocket(receiver);
+    b->closesocket(flooded);
+    settle();
+    print_heap();
+
+    free(latency);
+    free(req_time);
+    free(seen);
+    free(buffer);
+    return ok;
+}
+
+static int test_flood(void)
+{
+    node *b = &nodes[1];
+
+    int listener = open_socket(b, SOCK_STREAM, PORT_FLOOD);
+    if (listener < 0)
+    {
+        printf("flood: FAIL: can't open the sockets\n");
+        return 0;
+    }
+
+    int ok = flood_run(listener, 0);
+    ok     = flood_run(listener, 1) && ok;
+
+    b->closesocket(listener);
+    settle();
+    return ok;
+}
+
+#define IGMP_GROUP "239.1.2.3"
+
+static int igmp_membership(node *n, int sock, int option)
+{
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = n->inet_addr(IGMP_GROUP);
+    mreq.imr_interface.s_addr = INADDR_ANY;
+    return n->setsockopt(sock, IPPROTO_IP, option, &mreq, sizeof(mreq));
+}
+
+static void querier_reset(void)
+{
+    querier.reports       = 0;
+    querier.leaves        = 0;
+    querier.last_reporter = NULL;
+}
+
+static int test_igmp(void)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    int ok = 1;
+
+    // Reports and datagrams that are lost aren't sent again right away, so some checks need a
+    // link without losses.
+    int lossless = cfg.loss == 0;
+
+    int sock_a = open_socket(a, SOCK_DGRAM, PORT_IGMP);
+    int sock_b = open_socket(b, SOCK_DGRAM, PORT_IGMP);
+    if (sock_a < 0 || sock_b < 0)
+    {
+        printf("igmp: FAIL: can't open the sockets\n");
+        return 0;
+    }
+
+    querier.group = a->inet_addr(IGMP_GROUP);
+    querier_reset();
+    time_limit = NEVER;
+
+    // A joins the group before it has an address, like a game that looks for others while DHCP
+    // hasn't finished. The report can only be sent when the address arrives.
+    a->sgIP_Sim_SetIP(0, 0, 1);
+    if (igmp_membership(a, sock_a, IP_ADD_MEMBERSHIP) < 0)
+    {
+        printf("igmp: FAIL: can't join the group\n");
+        ok = 0;
+    }
+    run_for(1000000);
+    if (ok && querier.reports != 0)
+    {
+        printf("igmp: FAIL: report sent without an address\n");
+        ok = 0;
+    }
+
+    int64_t configured = now;
+    a->sgIP_Sim_SetIP(a->inet_addr(ADDR_A), 0, 1);
+    run_for(1000000);
+    if (ok)
+    {
+        if (querier.reports == 0)
+        {
+            if (lossless)
+            {
+                printf("igmp: FAIL: group not reported when the address arrived\n");
+                ok = 0;
+            }
+        }
+        else
+        {
+            printf("igmp: A reported the group %.1f ms after getting its address\n",
+                   (querier.first_report - configured) / 1000.0);
+        }
+    }
+
+    // B joins too. Both answer a general query after a random delay, and the one that answers
+    // later sees the report of the other one and doesn't send its own.
+    igmp_membership(b, sock_b, IP_ADD_MEMBERSHIP);
+    run_for(11000000); // the repeated reports sent when joining
+    querier_reset();
+    int64_t query = now;
+    querier_send(0, 10000);
+    run_for(11000000);
+    if (ok)
+    {
+        if (querier.reports == 0)
+        {
+            if (lossless)
+            {
+                printf("igmp: FAIL: general query not answered\n");
+                ok = 0;
+            }
+        }
+        else
+        {
+            printf("igmp: general query answered with %u report(s), the first one after %.1f ms\n",
+                   querier.reports, (querier.first_report - query) / 1000.0);
+        }
+    }
+
+    // Datagrams sent to the group reach the members
+    struct sockaddr_in group = make_addr(a, IGMP_GROUP, PORT_IGMP);
+    unsigned char buffer[64];
+    int delivered = 0;
+    for (int i = 0; i < 3 && !delivered; i++)
+    {
+        a->sendto(sock_a, "lobby", 5, 0, (struct sockaddr *)&group, sizeof(group));
+        run_for(100000);
+        while (b->recv(sock_b, buffer, sizeof(buffer), 0) == 5)
+            delivered = 1;
+    }
+    if (ok && !delivered)
+    {
+        printf("igmp: FAIL: datagram sent to the group not received\n");
+        ok = 0;
+    }
+
+    // When B leaves, the router asks if there are other members, and A must answer in time
+    igmp_membership(b, sock_b, IP_DROP_MEMBERSHIP);
+    run_for(100000);
+    querier_reset();
+    query = now;
+    querier_send(querier.group, 1000);
+    run_for(1500000);
+    if (ok)
+    {
+        if (querier.reports == 0 || querier.last_reporter != a)
+        {
+            if (lossless)
+            {
+                printf("igmp: FAIL: query about the group not answered by A\n");
+                ok = 0;
+            }
+        }
+        else
+        {
+            printf("igmp: query about the group answered by A after %.1f ms\n",
+                   (querier.first_report - query) / 1000.0);
+        }
+    }
+
+    // A sent the last report, so it has to tell the router when it leaves
+    querier_reset();
+    igmp_membership(a, sock_a, IP_DROP_MEMBERSHIP);
+    run_for(100000);
+    if (ok && lossless && querier.leaves == 0)
+    {
+        printf("igmp: FAIL: no leave message from the last member\n");
+        ok = 0;
+    }
+
+    querier.group = 0;
+    a->closesocket(sock_a);
+    b->closesocket(sock_b);
+    settle();
+    print_heap();
+    return ok;
+}
+
+#define FRAG_SIZE 4000 // data of the datagrams, sent in 3 fragments
+#define FRAG_MTU  1500
+
+// Fragments are sent to B from the harness, as if A had sent them. They skip the link so that
+// losses don't change what each case checks.
+static unsigned short frag_id = 0x4000;
+
+// Builds a UDP datagram from A to B with "size" bytes of data. Returns its length.
+static int frag_datagram(unsigned char *dgram, int size, unsigned int seed)
+{
+    node *b = &nodes[1];
+    int len = 8 + size;
+
+    put16(dgram, PORT_FRAG);
+    put16(dgram + 2, PORT_FRAG);
+    put16(dgram + 4, len);
+    put16(dgram + 6, 0);
+    for (int i = 0; i < size; i++)
+        dgram[8 + i] = pattern(seed + i);
+
+    // Pseudo-header (RFC 768)
+    unsigned char *sum = malloc(12 + len);
+    if (!sum)
+        abort();
+    unsigned long src = b->inet_addr(ADDR_A), dest = b->inet_addr(ADDR_B);
+    memcpy(sum, &src, 4);
+    memcpy(sum + 4, &dest, 4);
+    sum[8] = 0;
+    sum[9] = 17;
+    put16(sum + 10, len);
+    memcpy(sum + 12, dgram, len);
+    unsigned short checksum = ip_checksum(sum, 12 + len);
+    put16(dgram + 6, checksum ? checksum : 0xFFFF);
+    free(sum);
+
+    return len;
+}
+
+// Sends "len" bytes of the datagram from "offset" as a fragment, in the order of the calls.
+static void frag_send(const unsigned char *dgram, int offset, int len, int more)
+{
+    static const unsigned char hwaddr_a[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    static const unsigned char hwaddr_b[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+    node *b = &nodes[1];
+
+    unsigned char frame[14 + 20 + FRAG_MTU];
+    memcpy(frame, hwaddr_b, 6);
+    memcpy(frame + 6, hwaddr_a, 6);
+    put16(frame + 12, 0x0800);
+
+    unsigned char *ip = frame + 14;
+    unsigned long src = b->inet_addr(ADDR_A), dest = b->inet_addr(ADDR_B);
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    put16(ip + 2, 20 + len);
+    put16(ip + 4, frag_id);
+    put16(ip + 6, (more ? 0x2000 : 0) | offset / 8);
+    ip[8] = 64;
+    ip[9] = 17; // UDP
+    memcpy(ip + 12, &src, 4);
+    memcpy(ip + 16, &dest, 4);
+    put16(ip + 10, ip_checksum(ip, 20));
+    memcpy(ip + 20, dgram + offset, len);
+
+    event_push(now + cfg.rtt_ms * 500, b, frame, 14 + 20 + len);
+}
+
+// Sends fragment "index" of a datagram of "len" bytes, split at the usual offsets of the MTU.
+static void frag_send_index(const unsigned char *dgram, int len, int index)
+{
+    int per_frag = (FRAG_MTU - 20) & ~7;
+    int offset   = index * per_frag;
+    int size     = len - offset < per_frag ? len - offset : per_frag;
+    frag_send(dgram, offset, size, offset + size < len);
+}
+
+// Returns the number of datagrams received by B, and checks them against the one given.
+static int frag_received(int sock, const unsigned char *dgram, int len, int *wrong)
+{
+    node *b = &nodes[1];
+    unsigned char buffer[FRAG_SIZE + 8];
+    int count = 0, r;
+
+    while ((r = b->recv(sock, buffer, sizeof(buffer), 0)) >= 0)
+    {
+        if (r != len - 8 || memcmp(buffer, dgram + 8, len - 8) != 0)
+            (*wrong)++;
+        count++;
+    }
+    return count;
+}
+
+static int frag_check(const char *name, int sock, const unsigned char *dgram, int len,
+                      int expected)
+{
+    int wrong = 0;
+    run_for(100000);
+    int count = frag_received(sock, dgram, len, &wrong);
+    frag_id++;
+
+    printf("fragments: %s: %d datagram(s) received\n", name, count);
+    if (count != expected || wrong)
+    {
+        printf("fragments: FAIL: %s: %d datagram(s) expected%s\n", name, expected,
+               wrong ? ", wrong data" : "");
+        return 0;
+    }
+    return 1;
+}
+
+static int test_fragments(void)
+{
+    node *b = &nodes[1];
+    int ok = 1;
+
+    int sock = open_socket(b, SOCK_DGRAM, PORT_FRAG);
+    if (sock < 0)
+    {
+        printf("fragments: FAIL: can't open socket\n");
+        return 0;
+    }
+    time_limit = NEVER;
+
+    unsigned char dgram[8 + FRAG_SIZE];
+    int len = frag_datagram(dgram, FRAG_SIZE, frag_id);
+
+    frag_send_index(dgram, len, 0);
+    frag_send_index(dgram, len, 1);
+    frag_send_index(dgram, len, 2);
+    ok &= frag_check("in order", sock, dgram, len, 1);
+
+    frag_send_index(dgram, len, 2);
+    frag_send_index(dgram, len, 0);
+    frag_send_index(dgram, len, 1);
+    ok &= frag_check("reordered", sock, dgram, len, 1);
+
+    static const int duplicated[] = { 0, 1, 0, 2, 1, 2 };
+    for (int i = 0; i < 6; i++)
+        frag_send_index(dgram, len, duplicated[i]);
+    ok &= frag_check("duplicated", sock, dgram, len, 1);
+
+    // The whole datagram is dropped, even if the missing parts arrive later (RFC 5722)
+    frag_send_index(dgram, len, 0);
+    frag_send(dgram, 1000, 1480, 1);
+    frag_send_index(dgram, len, 1);
+    frag_send_index(dgram, len, 2);
+    ok &= frag_check("overlapping", sock, dgram, len, 0);
+
+    // Fragments of other datagrams that never complete them, and a datagram sent in 16 tiny
+    // fragments. Every fragment is charged as a whole memblock, so the oldest incomplete datagrams
+    // must be released to make room, and completing them later isn't possible.
+    int used_before, peak;
+    b->sgIP_Sim_GetHeapUsage(&used_before, &peak);
+
+    unsigned char tiny[8 + 120];
+    int tiny_len            = frag_datagram(tiny, 120, frag_id);
+    unsigned short first_id = frag_id;
+    for (int d = 0; d < 3; d++, frag_id++)
+    {
+        for (int i = 0; i < 15; i++)
+            frag_send(tiny, i * 8, 8, 1);
+    }
+    for (int i = 0; i < 16; i++)
+        frag_send(tiny, i * 8, 8, i < 15);
+    ok &= frag_check("tiny fragments", sock, tiny, tiny_len, 1);
+
+    frag_id = first_id;
+    frag_send(tiny, 15 * 8, 8, 0);
+    ok &= frag_check("tiny fragments released", sock, tiny, tiny_len, 0);
+
+    // Reassembly still works, and everything is released when the rest time out
+    frag_id = first_id + 4;
+    len     = frag_datagram(dgram, FRAG_SIZE, frag_id);
+    frag_send_index(dgram, len, 1);
+    frag_send_index(dgram, len, 2);
+    frag_send_index(dgram, len, 0);
+    ok &= frag_check("after tiny fragments", sock, dgram, len, 1);
+
+    run_for(16000000); // SGIP_IP_REASM_TIMEOUTMS
+    int used_after;
+    b->sgIP_Sim_GetHeapUsage(&used_after, &peak);
+    if (used_after > used_before)
+    {
+        printf("fragments: FAIL: %d bytes still in use after the fragments timed out\n",
+               used_after - used_before);
+        ok = 0;
+    }
+
+    b->closesocket(sock);
+    settle();
+    print_heap();
+    return ok;
+}
+
+// Packets sent by sgIP are never larger than SGIP_MTU_OVERRIDE, so fragments carry 1440 bytes. The
+// biggest datagram fits in SGIP_IP_REASM_MAXFRAGS of them.
+#define FRAGSEND_MTU   1460
+#define FRAGSEND_MAX   (16 * 1440 - 8)
+#define FRAGSEND_TRIES 5
+
+static int test_fragsend(void)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    int ok = 1;
+
+    int sock_a = open_socket(a, SOCK_DGRAM, PORT_FRAG);
+    int sock_b = open_socket(b, SOCK_DGRAM, PORT_FRAG);
+    if (sock_a < 0 || sock_b < 0)
+    {
+        printf("fragsend: FAIL: can't open the sockets\n");
+        return 0;
+    }
+
+    // The fragments of a datagram are sent in a burst, so the queue of the link must fit the
+    // biggest one.
+    int queue_bytes = cfg.queue_bytes;
+    if (cfg.queue_bytes < 2 * (8 + FRAGSEND_MAX))
+        cfg.queue_bytes = 2 * (8 + FRAGSEND_MAX);
+    time_limit = NEVER;
+
+    static const int fixed[] = { 1, 1432, 1433, 1440, 2872, 2873, 4000, 8192, FRAGSEND_MAX };
+    const int num_fixed      = sizeof(fixed) / sizeof(fixed[0]);
+    const int num_sizes      = num_fixed + 10;
+
+    unsigned char *dgram  = malloc(8 + FRAGSEND_MAX);
+    unsigned char *buffer = malloc(FRAGSEND_MAX + 1);
+    if (!dgram || !buffer)
+        abort();
+
+    struct sockaddr_in dest = make_addr(a, ADDR_B, PORT_FRAG);
+    int delivered = 0, attempts = 0;
+
+    reference.active   = 1;
+    reference.mtu      = FRAGSEND_MTU;
+    reference.complete = 0;
+    reference.errors   = 0;
+    for (int s = 0; s < num_sizes && ok; s++)
+    {
+        // Sizes around the fragment boundaries, and random ones
+        int size = s < num_fixed ? fixed[s] : 1 + random_next() % FRAGSEND_MAX;
+        int len  = frag_datagram(dgram, size, s * 1000);
+
+        int received = 0;
+        for (int i = 0; i < FRAGSEND_TRIES && !received; i++)
+        {
+            reference_reset(dgram, len);
+            attempts++;
+            if (a->sendto(sock_a, dgram + 8, size, 0, (struct sockaddr *)&dest, sizeof(dest))
+                != size)
+            {
+                printf("fragsend: FAIL: can't send a datagram of %d bytes\n", size);
+                ok = 0;
+                break;
+            }
+            run_for((int64_t)len * 8000 / cfg.bandwidth + cfg.rtt_ms * 1000
+                    + cfg.jitter_ms * 1000 + 100000);
+
+            unsigned int fragments = (len + 1439) / 1440;
+            if (reference.errors == 0
+                && (reference.received != len || reference.fragments != fragments))
+            {
+                printf("fragsend: FAIL: %d bytes sent in %u fragments, expected %u\n", size,
+                       reference.fragments, fragments);
+                ok = 0;
+            }
+
+            int r;
+            while ((r = b->recv(sock_b, buffer, FRAGSEND_MAX + 1, 0)) >= 0)
+            {
+                if (r != size || memcmp(buffer, dgram + 8, size) != 0)
+                {
+                    printf("fragsend: FAIL: B received a wrong datagram of %d bytes\n", r);
+                    ok = 0;
+                }
+                received = 1;
+            }
+        }
+
+        if (received)
+            delivered++;
+        else if (cfg.loss == 0 && ok)
+        {
+            printf("fragsend: FAIL: datagram of %d bytes not received\n", size);
+            ok = 0;
+        }
+    }
+    reference.active = 0;
+    cfg.queue_bytes  = queue_bytes;
+
+    printf("fragsend: %d of %d datagrams received by B after %d attempts, %u checked against the "
+           "reference\n",
+           delivered, num_sizes, attempts, reference.complete);
+    if (reference.errors)
+        ok = 0;
+
+    free(dgram);
+    free(buffer);
+    a->closesocket(sock_a);
+    b->closesocket(sock_b);
+    settle();
+    print_heap();
+    return ok;
+}
+
+#define ARP_QUEUED 16 // SGIP_ARP_MAXQUEUED
+#define ARP_WAIT   12000000 // SGIP_ARP_MAXRETRIES requests
+
+// A forgets the address of B, like after joining a network, and sends a burst of datagrams to it
+// right away. They wait in the queue of the ARP entry until B answers.
+static int test_arpburst(void)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    int ok = 1;
+
+    // Losses, reordering and duplicates of the link change what B receives
+    int exact = cfg.loss == 0 && cfg.reorder == 0 && cfg.duplicate == 0;
+
+    int sock_a = open_socket(a, SOCK_DGRAM, PORT_ARP);
+    int sock_b = open_socket(b, SOCK_DGRAM, PORT_ARP);
+    if (sock_a < 0 || sock_b < 0)
+    {
+        printf("arpburst: FAIL: can't open the sockets\n");
+        return 0;
+    }
+
+    // Every datagram of the burst is charged as a whole memblock in the queue of B's socket
+    int rcvbuf = 2 * ARP_QUEUED * 1600; // SGIP_MEMBLOCK_DATASIZE
+    b->setsockopt(sock_b, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    // The burst must fit in the queue of the link
+    int queue_bytes = cfg.queue_bytes;
+    if (cfg.queue_bytes < 2 * (8 + FRAGSEND_MAX))
+        cfg.queue_bytes = 2 * (8 + FRAGSEND_MAX);
+    time_limit = NEVER;
+
+    unsigned char *dgram  = malloc(8 + FRAGSEND_MAX);
+    unsigned char *buffer = malloc(FRAGSEND_MAX + 1);
+    if (!dgram || !buffer)
+        abort();
+    struct sockaddr_in dest = make_addr(a, ADDR_B, PORT_ARP);
+
+    // A datagram with as many fragments as the queue fits
+    a->sgIP_Sim_SetIP(a->inet_addr(ADDR_A), 0, 1);
+    frag_datagram(dgram, FRAGSEND_MAX, 0);
+    int64_t start = now;
+    a->sendto(sock_a, dgram + 8, FRAGSEND_MAX, 0, (struct sockaddr *)&dest, sizeof(dest));
+
+    int r = -1;
+    while (now - start < ARP_WAIT && r < 0)
+    {
+        run_for(100000);
+        r = b->recv(sock_b, buffer, FRAGSEND_MAX + 1, 0);
+    }
+    if (r >= 0)
+    {
+        printf("arpburst: datagram in %d fragments received after %.1f ms\n", ARP_QUEUED,
+               (now - start) / 1000.0);
+        if (r != FRAGSEND_MAX || memcmp(buffer, dgram + 8, FRAGSEND_MAX) != 0)
+        {
+            printf("arpburst: FAIL: wrong datagram of %d bytes\n", r);
+            ok = 0;
+        }
+    }
+    else if (cfg.loss == 0)
+    {
+        printf("arpburst: FAIL: datagram in %d fragments not received\n", ARP_QUEUED);
+        ok = 0;
+    }
+    while (b->recv(sock_b, buffer, FRAGSEND_MAX + 1, 0) >= 0) // duplicates
+        ;
+
+    // More datagrams than the queue fits. The oldest ones are dropped, and the rest are sent in
+    // order once B answers.
+    const int burst = ARP_QUEUED + 4;
+    a->sgIP_Sim_SetIP(a->inet_addr(ADDR_A), 0, 1);
+    for (int i = 0; i < burst; i++)
+    {
+        unsigned char seq = i;
+        a->sendto(sock_a, &seq, 1, 0, (struct sockaddr *)&dest, sizeof(dest));
+    }
+    run_for(ARP_WAIT);
+
+    int count = 0, expected = burst - ARP_QUEUED, in_order = 1;
+    while (b->recv(sock_b, buffer, FRAGSEND_MAX + 1, 0) == 1)
+    {
+        if (buffer[0] < burst - ARP_QUEUED)
+        {
+            printf("arpburst: FAIL: datagram %d wasn't dropped from the full queue\n", buffer[0]);
+            ok = 0;
+        }
+        if (buffer[0] != expected)
+            in_order = 0;
+        expected = buffer[0] + 1;
+        count++;
+    }
+    printf("arpburst: %d of %d datagrams sent in a burst received, the queue fits %d\n", count,
+           burst, ARP_QUEUED);
+    if (exact && (count != ARP_QUEUED || !in_order))
+    {
+        printf("arpburst: FAIL: the last %d datagrams weren't received in order\n", ARP_QUEUED);
+        ok = 0;
+    }
+
+    cfg.queue_bytes = queue_bytes;
+    free(dgram);
+    free(buffer);
+    a->closesocket(sock_a);
+    b->closesocket(sock_b);
+    settle();
+    print_heap();
+    return ok;
+}
+
+#define LINKUP_RUNS     20
+#define LINKUP_APP_US   100000 // time the application takes to connect once the link is up
+#define LINKUP_GREETING 64     // sent right away, without waiting for SGIP_TCP_TRANSMIT_DELAY
+
+// The link of A comes up with B as its gateway, and the application connects to B a bit later, like
+// a game that connects to a server on the router. Returns the time from the call to connect() to
+// the first byte sent by B, or -1 if it didn't arrive.
+static int64_t linkup_run(int listener, int announce)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+
+    a->sgIP_Sim_SetIP(a->inet_addr(ADDR_A), a->inet_addr(ADDR_B), announce);
+    run_for(LINKUP_APP_US);
+
+    int64_t start = now;
+    time_limit    = now + (int64_t)cfg.limit_s * 1000000;
+
+    int client   = tcp_connect(a, ADDR_B, PORT_LINKUP);
+    int server   = -1;
+    int64_t ttfb = -1;
+    while (client >= 0)
+    {
+        // B greets every connection, like many servers do
+        unsigned char greeting[LINKUP_GREETING];
+        if (server < 0 && (server = tcp_accept(b, listener)) >= 0)
+        {
+            memset(greeting, '+', sizeof(greeting));
+            b->send(server, greeting, sizeof(greeting), 0);
+        }
+
+        if (a->recv(client, greeting, sizeof(greeting), 0) > 0)
+        {
+            ttfb = now - start;
+            break;
+        }
+        if (advance(NEVER) < 0)
+            break;
+    }
+
+    if (server >= 0)
+        b->closesocket(server);
+    if (client >= 0)
+        a->closesocket(client);
+    settle();
+    return ttfb;
+}
+
+static int test_linkup(void)
+{
+    node *a = &nodes[0], *b = &nodes[1];
+    int ok = 1;
+
+    int listener = open_socket(b, SOCK_STREAM, PORT_LINKUP);
+    if (listener < 0)
+    {
+        printf("linkup: FAIL: can't open the listener\n");
+        return 0;
+    }
+
+    // Runs with and without the announcement alternate, so both see the same conditions
+    int64_t ttfb[2][LINKUP_RUNS];
+    for (int i = 0; i < LINKUP_RUNS && ok; i++)
+    {
+        for (int announce = 0; announce < 2; announce++)
+        {
+            ttfb[announce][i] = linkup_run(listener, announce);
+            if (ttfb[announce][i] < 0)
+            {
+                printf("linkup: FAIL: no data from B after link up %d %s the announcement\n", i,
+                       announce ? "with" : "without");
+                ok = 0;
+                break;
+            }
+        }
+    }
+
+    a->sgIP_Sim_SetIP(a->inet_addr(ADDR_A), 0, 1);
+    b->closesocket(listener);
+    settle();
+
+    if (!ok)
+        return 0;
+
+    printf("linkup: time to first byte of a connection to the gateway %d ms after link up\n",
+           LINKUP_APP_US / 1000);
+    print_latency("without sgIP_ARP_Announce()", ttfb[0], LINKUP_RUNS);
+    print_latency("with sgIP_ARP_Announce()", ttfb[1], LINKUP_RUNS);
+
+    // Resolving the gateway when the link comes up saves the ARP round trip of the first packet
+    if (cfg.loss == 0)
+    {
+        int64_t sum[2] = { 0, 0 };
+        for (int i = 0; i < LINKUP_RUNS; i++)
+        {
+            sum[0] += ttfb[0][i];
+            sum[1] += ttfb[1][i];
+        }
+        if (sum[1] >= sum[0])
+        {
+            printf("linkup: FAIL: the announcement doesn't reduce the time to first byte\n");
+            ok = 0;
+        }
+    }
+
+    print_heap();
+    return ok;
+}
+
+// Main
+// ----
+
+static const struct
+{
+    const char *name;
+    int (*run)(void);
+} tests[] = {
+    { "bulk", test_bulk },
+    { "rr", test_rr },
+    { "udp", test_udp },
+    { "vanish", test_vanish },
+    { "slowread", test_slowread },
+    { "winupdate", test_winupdate },
+    { "pmtu", test_pmtu },
+    { "refused", test_refused },
+    { "crr", test_crr },
+    { "mixed", test_mixed },
+    { "rxmem", test_rxmem },
+    { "churn", test_churn },
+    { "flood", test_flood },
+    { "igmp", test_igmp },
+    { "fragments", test_fragments },
+    { "fragsend", test_fragsend },
+    { "arpburst", test_arpburst },
+    { "linkup", test_linkup },
+};
+
+#define NUM_TESTS (int)(sizeof(tests) / sizeof(tests[0]))
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options] [benchmark|all]\n"
+           "\n"
+           "Link:\n"
+           "  -b kbit/s   Bandwidth (%d)\n"
+           "  -r ms       Round-trip time (%d)\n"
+           "  -j ms       Max. jitter of each frame (%d)\n"
+           "  -l %%        Frames lost (%.1f)\n"
+           "  -o %%        Frames reordered (%.1f)\n"
+           "  -d %%        Frames duplicated (%.1f)\n"
+           "  -q bytes    Transmit queue of each direction (%d)\n"
+           "  -s seed     Seed of the random numbers (%llu)\n"
+           "\n"
+           "Nodes:\n"
+           "  -T ms       Period of sgIP_Timer() (%d)\n"
+           "  -H bytes    Heap of each node (%d)\n"
+           "\n"
+           "Benchmarks:\n"
+           "  -n bytes    Data sent by bulk (%d)\n"
+           "  -m count    Requests of rr and datagrams of udp (%d)\n"
+           "  -c count    Connections opened and closed by churn (%d)\n"
+           "  -S bytes    Size of the requests and datagrams (%d)\n"
+           "  -i ms       Time between datagrams of udp (%d)\n"
+           "  -L s        Max. duration of each benchmark in virtual time (%d)\n"
+           "\n"
+           "Benchmarks:",
+           name, cfg.bandwidth, cfg.rtt_ms, cfg.jitter_ms, cfg.loss, cfg.reorder, cfg.duplicate,
+           cfg.queue_bytes, cfg.seed, cfg.timer_ms, cfg.heap_size, cfg.bulk_bytes, cfg.messages,
+           cfg.cycles, cfg.msg_size, cfg.interval_ms, cfg.limit_s);
+    for (int i = 0; i < NUM_TESTS; i++)
+        printf(" %s", tests[i].name);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "b:r:j:l:o:d:q:s:T:H:n:m:c:S:i:L:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                cfg.bandwidth = atoi(optarg);
+                break;
+            case 'r':
+                cfg.rtt_ms = atoi(optarg);
+                break;
+            case 'j':
+                cfg.jitter_ms = atoi(optarg);
+                break;
+            case 'l':
+                cfg.loss = atof(optarg);
+                break;
+            case 'o':
+                cfg.reorder = atof(optarg);
+                break;
+            case 'd':
+                cfg.duplicate = atof(optarg);
+                break;
+            case 'q':
+                cfg.queue_bytes = atoi(optarg);
+                break;
+            case 's':
+                cfg.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'T':
+                cfg.timer_ms = atoi(optarg);
+                break;
+            case 'H':
+                cfg.heap_size = atoi(optarg);
+                break;
+            case 'n':
+                cfg.bulk_bytes = atoi(optarg);
+                break;
+            case 'm':
+                cfg.messages = atoi(optarg);
+                break;
+            case 'c':
+                cfg.cycles = atoi(optarg);
+                break;
+            case 'S':
+                cfg.msg_size = atoi(optarg);
+                break;
+            case 'i':
+                cfg.interval_ms = atoi(optarg);
+                break;
+            case 'L':
+                cfg.limit_s = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    const char *test = optind < argc ? argv[optind] : "all";
+    int all          = strcmp(test, "all") == 0;
+    int found        = all;
+    for (int i = 0; i < NUM_TESTS; i++)
+        found |= strcmp(test, tests[i].name) == 0;
+    if (!found)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (cfg.bandwidth <= 0 || cfg.timer_ms <= 0 || cfg.rtt_ms < 0 || cfg.jitter_ms < 0
+        || cfg.messages <= 0 || cfg.cycles <= 0 || cfg.msg_size <= 0 || cfg.msg_size > MAX_FRAME
+        || cfg.interval_ms < 0)
+    {
+        fprintf(stderr, "Invalid options\n");
+        return 1;
+    }
+
+    random_state = cfg.seed ? cfg.seed : 1;
+    next_timer   = cfg.timer_ms * 1000;
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (load_node(&nodes[i], i) < 0)
+            return 1;
+        nodes[i].peer = &nodes[i ^ 1];
+    }
+
+    static const unsigned char hwaddr[2][6] = {
+        { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 },
+        { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 },
+    };
+    const char *ipaddr[2] = { ADDR_A, ADDR_B };
+    for (int i = 0; i < 2; i++)
+    {
+        node *n = &nodes[i];
+        n->sgIP_Sim_Init(hwaddr[i], n->inet_addr(ipaddr[i]), n->inet_addr(ADDR_MASK),
+                         cfg.heap_size, link_transmit, n);
+    }
+
+    printf("link: %d kbit/s, rtt %d ms, jitter %d ms, loss %.1f%%, reorder %.1f%%, "
+           "duplicate %.1f%%, queue %d bytes, seed %llu\n",
+           cfg.bandwidth, cfg.rtt_ms, cfg.jitter_ms, cfg.loss, cfg.reorder, cfg.duplicate,
+           cfg.queue_bytes, cfg.seed);
+
+    int failed = 0;
+    for (int i = 0; i < NUM_TESTS; i++)
+    {
+        if (all || strcmp(test, tests[i].name) == 0)
+            failed += !tests[i].run();
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        link_stats *s = &nodes[i].stats;
+        printf("frames %s->%s: %u sent, %u queue drops, %u lost, %u reordered, %u duplicated\n",
+               nodes[i].name, nodes[i].peer->name, s->frames, s->queue_drops, s->lost,
+               s->reordered, s->duplicated);
+    }
+
+    return failed;
+}
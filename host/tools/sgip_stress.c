@@ -0,0 +1,562 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - Host build of sgIP
+
+// Stress test of the locking of sgIP. The stack has two interfaces connected by a packet pipe, so
+// all the traffic goes through the whole stack twice, and many threads use the socket API at the
+// same time:
+//
+// - TCP: Every connection has a thread that sends a pattern and another thread that receives the
+//   echo and checks it, using the same socket at the same time. The server side echoes the data.
+// - UDP: Several threads send datagrams to one socket, which is read by several threads that
+//   check them. Datagrams may be dropped, but they can't be corrupted.
+// - Close: Sockets are closed while other threads are blocked in accept(), recv(), recvfrom() and
+//   send() on them. The blocked calls must return an error instead of using the freed records.
+//
+// It's meant to be built with ThreadSanitizer and the multithreaded model:
+//
+//     make -C host clean
+//     make -C host SANITIZE=thread THREADING=multithreaded
+//     ./host/build/sgip_stress
+//
+// It returns 0 if all tests pass.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "arm9/sgIP/sgIP.h"
+#include "sgIP_Host.h"
+
+#define ADDR_CLIENT "10.0.0.1"
+#define ADDR_SERVER "10.0.0.2"
+#define ADDR_MASK   "255.255.255.0"
+
+#define PORT_ECHO  7
+#define PORT_UDP   4000
+#define PORT_CLOSE 5000
+
+#define UDP_SENDERS   4
+#define UDP_RECEIVERS 3
+#define UDP_MAXLEN    512
+
+static int num_connections = 4;
+static int stream_bytes    = 1024 * 1024;
+static int udp_datagrams   = 1000;
+static int close_rounds    = 50;
+
+static int failures;
+
+#define FAIL(...)                                                                                  \
+    do                                                                                             \
+    {                                                                                              \
+        fprintf(stderr, "FAIL: " __VA_ARGS__);                                                     \
+        fputc('\n', stderr);                                                                       \
+        __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);                                        \
+    } while (0)
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+static struct sockaddr_in make_addr(const char *ip, int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = ip ? inet_addr(ip) : INADDR_ANY;
+    return addr;
+}
+
+static int open_listener(int port)
+{
+    struct sockaddr_in addr = make_addr(ADDR_SERVER, port);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 8) < 0)
+    {
+        closesocket(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int open_client(int port)
+{
+    struct sockaddr_in addr = make_addr(ADDR_SERVER, port);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        closesocket(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int accept_one(int listener)
+{
+    struct sockaddr_in addr;
+    int addrlen = sizeof(addr);
+    return accept(listener, (struct sockaddr *)&addr, &addrlen);
+}
+
+static unsigned char pattern(int offset)
+{
+    return offset % 251;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// TCP streams
+
+static void *echo_thread(void *arg)
+{
+    int sock = (int)(intptr_t)arg;
+    char buffer[4096];
+
+    for (;;)
+    {
+        int len = recv(sock, buffer, sizeof(buffer), 0);
+        if (len <= 0)
+            break;
+
+        for (int done = 0; done < len;)
+        {
+            int sent = send(sock, buffer + done, len - done, 0);
+            if (sent <= 0)
+                goto end;
+            done += sent;
+        }
+    }
+
+end:
+    closesocket(sock);
+    return NULL;
+}
+
+static void *stream_send_thread(void *arg)
+{
+    int sock = (int)(intptr_t)arg;
+    unsigned char buffer[3000];
+
+    for (int offset = 0; offset < stream_bytes;)
+    {
+        // Use different sizes, so that segments and sends don't line up.
+        int len = 1 + (offset / 7) % sizeof(buffer);
+        if (len > stream_bytes - offset)
+            len = stream_bytes - offset;
+        for (int i = 0; i < len; i++)
+            buffer[i] = pattern(offset + i);
+
+        int sent = send(sock, buffer, len, 0);
+        if (sent <= 0)
+        {
+            FAIL("TCP send() returned %d (errno %d)", sent, errno);
+            break;
+        }
+        offset += sent;
+    }
+
+    return NULL;
+}
+
+static void *stream_recv_thread(void *arg)
+{
+    int sock = (int)(intptr_t)arg;
+    unsigned char buffer[2000];
+
+    for (int offset = 0; offset < stream_bytes;)
+    {
+        int len = recv(sock, buffer, sizeof(buffer), 0);
+        if (len <= 0)
+        {
+            FAIL("TCP recv() returned %d (errno %d) after %d bytes", len, errno, offset);
+            break;
+        }
+        for (int i = 0; i < len; i++)
+        {
+            if (buffer[i] != pattern(offset + i))
+            {
+                FAIL("TCP stream corrupted at offset %d", offset + i);
+                return NULL;
+            }
+        }
+        offset += len;
+    }
+
+    return NULL;
+}
+
+static void test_tcp(void)
+{
+    int listener = open_listener(PORT_ECHO);
+    if (listener < 0)
+    {
+        FAIL("Can't open TCP listener");
+        return;
+    }
+
+    int clients[num_connections];
+    pthread_t threads[num_connections][3];
+
+    for (int i = 0; i < num_connections; i++)
+    {
+        clients[i] = open_client(PORT_ECHO);
+        int server = accept_one(listener);
+        if (clients[i] < 0 || server < 0)
+        {
+            FAIL("Can't open TCP connection %d", i);
+            return;
+        }
+
+        pthread_create(&threads[i][0], NULL, echo_thread, (void *)(intptr_t)server);
+        pthread_create(&threads[i][1], NULL, stream_send_thread, (void *)(intptr_t)clients[i]);
+        pthread_create(&threads[i][2], NULL, stream_recv_thread, (void *)(intptr_t)clients[i]);
+    }
+
+    for (int i = 0; i < num_connections; i++)
+    {
+        pthread_join(threads[i][1], NULL);
+        pthread_join(threads[i][2], NULL);
+        closesocket(clients[i]);
+        pthread_join(threads[i][0], NULL);
+    }
+
+    closesocket(listener);
+
+    printf("TCP: %d connections, %d bytes echoed by each one\n", num_connections, stream_bytes);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// UDP
+
+static int udp_server;
+static int udp_received;
+
+// Datagrams start with the ID of the sender and a sequence number, which determine the length and
+// the contents of the rest of the datagram.
+#define UDP_HEADER 3
+
+static int udp_length(int id, int seq)
+{
+    return UDP_HEADER + (seq * 37 + id * 11) % (UDP_MAXLEN - UDP_HEADER);
+}
+
+static void *udp_send_thread(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        FAIL("Can't open UDP socket");
+        return NULL;
+    }
+
+    struct sockaddr_in addr = make_addr(ADDR_SERVER, PORT_UDP);
+    unsigned char buffer[UDP_MAXLEN];
+
+    for (int seq = 0; seq < udp_datagrams; seq++)
+    {
+        int len   = udp_length(id, seq);
+        buffer[0] = id;
+        buffer[1] = seq & 0xFF;
+        buffer[2] = seq >> 8;
+        for (int i = UDP_HEADER; i < len; i++)
+            buffer[i] = pattern(id + seq + i);
+
+        if (sendto(sock, buffer, len, 0, (struct sockaddr *)&addr, sizeof(addr)) != len)
+            FAIL("UDP sendto() failed (errno %d)", errno);
+
+        // Give the receivers a chance to keep up, so that most datagrams arrive.
+        if ((seq % 16) == 15)
+            sleep_ms(1);
+    }
+
+    closesocket(sock);
+    return NULL;
+}
+
+static void *udp_recv_thread(void *arg)
+{
+    (void)arg;
+
+    unsigned char buffer[UDP_MAXLEN + 16];
+
+    for (;;)
+    {
+        struct sockaddr_in from;
+        int fromlen = sizeof(from);
+        int len     = recvfrom(udp_server, buffer, sizeof(buffer), 0, (struct sockaddr *)&from,
+                               &fromlen);
+        if (len < 0)
+            break; // The socket has been closed
+
+        int id  = buffer[0];
+        int seq = buffer[1] | (buffer[2] << 8);
+        if (len < UDP_HEADER || id >= UDP_SENDERS || len != udp_length(id, seq))
+        {
+            FAIL("UDP datagram with wrong length %d", len);
+            continue;
+        }
+        for (int i = UDP_HEADER; i < len; i++)
+        {
+            if (buffer[i] != pattern(id + seq + i))
+            {
+                FAIL("UDP datagram corrupted");
+                break;
+            }
+        }
+
+        __atomic_fetch_add(&udp_received, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static void test_udp(void)
+{
+    struct sockaddr_in addr = make_addr(ADDR_SERVER, PORT_UDP);
+
+    udp_server = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp_server < 0 || bind(udp_server, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        FAIL("Can't open UDP server socket");
+        return;
+    }
+
+    pthread_t receivers[UDP_RECEIVERS], senders[UDP_SENDERS];
+
+    for (int i = 0; i < UDP_RECEIVERS; i++)
+        pthread_create(&receivers[i], NULL, udp_recv_thread, NULL);
+    for (int i = 0; i < UDP_SENDERS; i++)
+        pthread_create(&senders[i], NULL, udp_send_thread, (void *)(intptr_t)i);
+
+    for (int i = 0; i < UDP_SENDERS; i++)
+        pthread_join(senders[i], NULL);
+
+    // Let the receivers read what is still queued, then close the socket to make them return.
+    sleep_ms(200);
+    closesocket(udp_server);
+
+    for (int i = 0; i < UDP_RECEIVERS; i++)
+        pthread_join(receivers[i], NULL);
+
+    int sent     = UDP_SENDERS * udp_datagrams;
+    int received = __atomic_load_n(&udp_received, __ATOMIC_RELAXED);
+    if (received == 0)
+        FAIL("No UDP datagrams received");
+
+    printf("UDP: %d datagrams sent, %d received\n", sent, received);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Closing sockets that are in use
+
+typedef struct
+{
+    int sock;
+    int result;
+    int error;
+} blocked_call;
+
+static void *blocked_accept_thread(void *arg)
+{
+    blocked_call *call = arg;
+    call->result       = accept_one(call->sock);
+    call->error        = errno;
+    return NULL;
+}
+
+static void *blocked_recv_thread(void *arg)
+{
+    blocked_call *call = arg;
+    char buffer[256];
+    call->result = recv(call->sock, buffer, sizeof(buffer), 0);
+    call->error  = errno;
+    return NULL;
+}
+
+static void *blocked_recvfrom_thread(void *arg)
+{
+    blocked_call *call = arg;
+    char buffer[256];
+    struct sockaddr_in from;
+    int fromlen  = sizeof(from);
+    call->result = recvfrom(call->sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&from,
+                            &fromlen);
+    call->error  = errno;
+    return NULL;
+}
+
+static void *blocked_send_thread(void *arg)
+{
+    blocked_call *call = arg;
+    static char buffer[4096];
+
+    // The peer never reads, so this blocks when the buffers are full.
+    do
+        call->result = send(call->sock, buffer, sizeof(buffer), 0);
+    while (call->result > 0);
+    call->error = errno;
+    return NULL;
+}
+
+static void test_close(void)
+{
+    struct sockaddr_in udp_addr = make_addr(ADDR_SERVER, PORT_CLOSE);
+
+    for (int round = 0; round < close_rounds; round++)
+    {
+        int port = PORT_CLOSE + 1 + (round % 100);
+
+        int listener = open_listener(port);
+        int client   = open_client(port);
+        int server   = accept_one(listener);
+        int sender   = open_client(port);
+        int sink     = accept_one(listener);
+        int udp      = socket(AF_INET, SOCK_DGRAM, 0);
+        if (listener < 0 || client < 0 || server < 0 || sender < 0 || sink < 0 || udp < 0
+            || bind(udp, (struct sockaddr *)&udp_addr, sizeof(udp_addr)) < 0)
+        {
+            FAIL("Can't open sockets for round %d", round);
+            return;
+        }
+
+        blocked_call calls[4] = {
+            { listener, 0, 0 },
+            { client, 0, 0 },
+            { udp, 0, 0 },
+            { sender, 0, 0 },
+        };
+        void *(*functions[4])(void *) = {
+            blocked_accept_thread,
+            blocked_recv_thread,
+            blocked_recvfrom_thread,
+            blocked_send_thread,
+        };
+        static const char *names[4] = { "accept", "recv", "recvfrom", "send" };
+
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++)
+            pthread_create(&threads[i], NULL, functions[i], &calls[i]);
+
+        // Close them at different moments: before, while and after the calls start waiting.
+        sleep_ms(round % 5);
+
+        closesocket(listener);
+        closesocket(client);
+        closesocket(udp);
+        closesocket(sender);
+
+        for (int i = 0; i < 4; i++)
+        {
+            pthread_join(threads[i], NULL);
+            if (calls[i].result >= 0)
+            {
+                FAIL("%s() returned %d after closing its socket", names[i], calls[i].result);
+                if (i == 0)
+                    closesocket(calls[i].result);
+            }
+        }
+
+        closesocket(server);
+        closesocket(sink);
+    }
+
+    printf("Close: %d rounds\n", close_rounds);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-c connections] [-b bytes] [-u datagrams] [-r rounds]\n"
+           "\n"
+           "Defaults: -c 4 -b 1048576 -u 1000 -r 50\n",
+           name);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "c:b:u:r:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                num_connections = atoi(optarg);
+                break;
+            case 'b':
+                stream_bytes = atoi(optarg);
+                break;
+            case 'u':
+                udp_datagrams = atoi(optarg);
+                break;
+            case 'r':
+                close_rounds = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (num_connections < 1 || num_connections > 8)
+    {
+        fprintf(stderr, "The number of connections must be between 1 and 8\n");
+        return 1;
+    }
+
+    int fds[2];
+    if (sgIP_Host_OpenPipe(fds) < 0)
+    {
+        perror("Can't open packet pipe");
+        return 1;
+    }
+
+    sgIP_Host_Init(10);
+
+    static const unsigned char hwaddr_client[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    static const unsigned char hwaddr_server[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+
+    sgIP_Hub_HWInterface *hw_client = sgIP_Host_AddInterface(fds[0], hwaddr_client, 1500);
+    sgIP_Hub_HWInterface *hw_server = sgIP_Host_AddInterface(fds[1], hwaddr_server, 1500);
+    if (!hw_client || !hw_server)
+    {
+        fprintf(stderr, "Can't add interfaces\n");
+        return 1;
+    }
+    sgIP_Host_SetIP(hw_client, inet_addr(ADDR_CLIENT), 0, inet_addr(ADDR_MASK), 0);
+    sgIP_Host_SetIP(hw_server, inet_addr(ADDR_SERVER), 0, inet_addr(ADDR_MASK), 0);
+
+    test_tcp();
+    test_udp();
+    test_close();
+
+    if (failures)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+
+    printf("All tests passed\n");
+    return 0;
+}
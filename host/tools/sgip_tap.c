@@ -0,0 +1,219 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - Host build of sgIP
+
+// Runs sgIP on a TAP device with a few standard services, so that the stack can be tested and
+// benchmarked with the usual tools of the host (ping, nc, iperf-like clients...):
+//
+// - TCP and UDP echo (port 7)
+// - TCP discard (port 9), to measure upload throughput
+// - TCP chargen (port 19), to measure download throughput
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "arm9/sgIP/sgIP.h"
+#include "sgIP_Host.h"
+
+#define SERVICE_ECHO    7
+#define SERVICE_DISCARD 9
+#define SERVICE_CHARGEN 19
+
+typedef struct
+{
+    int port;
+    int sock;
+} service;
+
+static void *connection_thread(void *arg)
+{
+    intptr_t value = (intptr_t)arg;
+    int port       = value >> 16;
+    int sock       = value & 0xFFFF;
+
+    char buffer[8192];
+
+    if (port == SERVICE_CHARGEN)
+    {
+        for (size_t i = 0; i < sizeof(buffer); i++)
+            buffer[i] = ' ' + (i % 95);
+
+        while (send(sock, buffer, sizeof(buffer), 0) > 0)
+            ;
+    }
+    else
+    {
+        for (;;)
+        {
+            int len = recv(sock, buffer, sizeof(buffer), 0);
+            if (len <= 0)
+                break;
+
+            if (port == SERVICE_ECHO)
+            {
+                for (int done = 0; done < len;)
+                {
+                    int sent = send(sock, buffer + done, len - done, 0);
+                    if (sent <= 0)
+                        break;
+                    done += sent;
+                }
+            }
+        }
+    }
+
+    shutdown(sock, SHUT_RDWR);
+    closesocket(sock);
+    return NULL;
+}
+
+static void *listen_thread(void *arg)
+{
+    service *s = arg;
+
+    for (;;)
+    {
+        struct sockaddr_in addr;
+        int addrlen = sizeof(addr);
+        int sock    = accept(s->sock, (struct sockaddr *)&addr, &addrlen);
+        if (sock < 0)
+            continue;
+
+        pthread_t thread;
+        intptr_t value = ((intptr_t)s->port << 16) | sock;
+        if (pthread_create(&thread, NULL, connection_thread, (void *)value) == 0)
+            pthread_detach(thread);
+        else
+            closesocket(sock);
+    }
+
+    return NULL;
+}
+
+static void *udp_echo_thread(void *arg)
+{
+    service *s = arg;
+    char buffer[2048];
+
+    for (;;)
+    {
+        struct sockaddr_in from;
+        int fromlen = sizeof(from);
+        int len = recvfrom(s->sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &fromlen);
+        if (len >= 0)
+            sendto(s->sock, buffer, len, 0, (struct sockaddr *)&from, fromlen);
+    }
+
+    return NULL;
+}
+
+static int start_service(service *s, int type, int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    s->port = port;
+    s->sock = socket(AF_INET, type, 0);
+    if (s->sock < 0 || bind(s->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        return -1;
+    if (type == SOCK_STREAM && listen(s->sock, 4) < 0)
+        return -1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, type == SOCK_STREAM ? listen_thread : udp_echo_thread, s)
+        != 0)
+        return -1;
+    pthread_detach(thread);
+
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-i tap] [-a address] [-n netmask] [-g gateway] [-t timer_ms]\n"
+           "\n"
+           "Defaults: -i sgip0 -a 10.0.0.2 -n 255.255.255.0 -g 10.0.0.1 -t 10\n",
+           name);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *tap     = "sgip0";
+    const char *ipaddr  = "10.0.0.2";
+    const char *snmask  = "255.255.255.0";
+    const char *gateway = "10.0.0.1";
+    int timer_ms        = 10;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:a:n:g:t:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i':
+                tap = optarg;
+                break;
+            case 'a':
+                ipaddr = optarg;
+                break;
+            case 'n':
+                snmask = optarg;
+                break;
+            case 'g':
+                gateway = optarg;
+                break;
+            case 't':
+                timer_ms = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    int fd = sgIP_Host_OpenTap(tap);
+    if (fd < 0)
+    {
+        perror("Can't open TAP device");
+        return 1;
+    }
+
+    sgIP_Host_Init(timer_ms);
+
+    sgIP_Hub_HWInterface *hw = sgIP_Host_AddInterface(fd, NULL, 1500);
+    if (!hw)
+    {
+        fprintf(stderr, "Can't add interface\n");
+        return 1;
+    }
+    sgIP_Host_SetIP(hw, inet_addr(ipaddr), inet_addr(gateway), inet_addr(snmask),
+                    inet_addr(gateway));
+
+    static service services[4];
+    if (start_service(&services[0], SOCK_STREAM, SERVICE_ECHO) < 0
+        || start_service(&services[1], SOCK_STREAM, SERVICE_DISCARD) < 0
+        || start_service(&services[2], SOCK_STREAM, SERVICE_CHARGEN) < 0
+        || start_service(&services[3], SOCK_DGRAM, SERVICE_ECHO) < 0)
+    {
+        fprintf(stderr, "Can't start services\n");
+        return 1;
+    }
+
+    printf("sgIP running on %s: %s/%s, gateway %s\n", tap, ipaddr, snmask, gateway);
+
+    for (;;)
+        pause();
+
+    return 0;
+}
@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - Host build of sgIP
+
+// CPU time used by threads blocked in socket calls. Several threads wait in recvfrom() on their own
+// UDP socket while nothing arrives, first with the notifications of the stack, and then spinning
+// between checks like the DS does when the application hasn't set any wait handler. At the end of
+// each run every socket gets a datagram, which must wake up its thread.
+//
+// It returns 0 if all the threads received their datagram.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "arm9/sgIP/sgIP.h"
+#include "sgIP_Host.h"
+
+#define ADDR_CLIENT "10.0.0.1"
+#define ADDR_SERVER "10.0.0.2"
+#define ADDR_MASK   "255.255.255.0"
+
+#define PORT_BASE 6000
+
+#define MAX_THREADS 16
+
+static int num_threads = 8;
+static int seconds     = 2;
+
+typedef struct
+{
+    int sock;
+    int received;
+} waiter;
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+static double cpu_time_ms(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0
+           + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+static struct sockaddr_in make_addr(const char *ip, int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = ip ? inet_addr(ip) : INADDR_ANY;
+    return addr;
+}
+
+static void *waiter_thread(void *arg)
+{
+    waiter *w = arg;
+    char buffer[64];
+    struct sockaddr_in from;
+    int from_len = sizeof(from);
+
+    // Blocks until the datagram arrives, and then until the socket is closed.
+    while (recvfrom(w->sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &from_len) > 0)
+        __atomic_fetch_add(&w->received, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+// Returns the CPU time used per second of wall time while the threads were blocked, or -1 on error.
+static double run(int busy, int *woken)
+{
+    waiter waiters[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+
+    sgIP_Host_SetBusyWait(busy);
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        struct sockaddr_in addr = make_addr(ADDR_SERVER, PORT_BASE + i);
+
+        waiters[i].sock     = socket(AF_INET, SOCK_DGRAM, 0);
+        waiters[i].received = 0;
+        if (waiters[i].sock < 0
+            || bind(waiters[i].sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            fprintf(stderr, "Can't open socket %d\n", i);
+            return -1;
+        }
+        pthread_create(&threads[i], NULL, waiter_thread, &waiters[i]);
+    }
+
+    // Let them start waiting
+    sleep_ms(100);
+
+    double start = cpu_time_ms();
+    sleep_ms(seconds * 1000);
+    double used = cpu_time_ms() - start;
+
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    for (int i = 0; i < num_threads; i++)
+    {
+        struct sockaddr_in addr = make_addr(ADDR_SERVER, PORT_BASE + i);
+        sendto(sender, "wake up", 7, 0, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    closesocket(sender);
+
+    // Give them time to wake up
+    sleep_ms(200);
+
+    *woken = 0;
+    for (int i = 0; i < num_threads; i++)
+    {
+        if (__atomic_load_n(&waiters[i].received, __ATOMIC_RELAXED) > 0)
+            (*woken)++;
+        closesocket(waiters[i].sock);
+    }
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    return used / seconds;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-t threads] [-s seconds]\n"
+           "\n"
+           "  -t threads  Threads blocked in recvfrom() (%d, max. %d)\n"
+           "  -s seconds  Time they are blocked in each run (%d)\n",
+           name, num_threads, MAX_THREADS, seconds);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                num_threads = atoi(optarg);
+                break;
+            case 's':
+                seconds = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (num_threads < 1 || num_threads > MAX_THREADS || seconds < 1)
+    {
+        fprintf(stderr, "Invalid options\n");
+        return 1;
+    }
+
+    int fds[2];
+    if (sgIP_Host_OpenPipe(fds) < 0)
+    {
+        perror("Can't open packet pipe");
+        return 1;
+    }
+
+    // Same timer period as the DS
+    sgIP_Host_Init(50);
+
+    static const unsigned char hwaddr_client[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    static const unsigned char hwaddr_server[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+
+    sgIP_Hub_HWInterface *hw_client = sgIP_Host_AddInterface(fds[0], hwaddr_client, 1500);
+    sgIP_Hub_HWInterface *hw_server = sgIP_Host_AddInterface(fds[1], hwaddr_server, 1500);
+    if (!hw_client || !hw_server)
+    {
+        fprintf(stderr, "Can't add interfaces\n");
+        return 1;
+    }
+    sgIP_Host_SetIP(hw_client, inet_addr(ADDR_CLIENT), 0, inet_addr(ADDR_MASK), 0);
+    sgIP_Host_SetIP(hw_server, inet_addr(ADDR_SERVER), 0, inet_addr(ADDR_MASK), 0);
+
+    printf("%d threads blocked in recvfrom() for %d s\n", num_threads, seconds);
+
+    int woken_notify, woken_busy;
+    double notify = run(0, &woken_notify);
+    double busy   = run(1, &woken_busy);
+    if (notify < 0 || busy < 0)
+        return 1;
+
+    printf("    notifications: %.1f ms of CPU time per second, %d of %d threads woken up\n",
+           notify, woken_notify, num_threads);
+    printf("    busy-wait:     %.1f ms of CPU time per second, %d of %d threads woken up\n", busy,
+           woken_busy, num_threads);
+    if (busy > 0)
+        printf("    CPU time saved by the notifications: %.1f%%\n", (busy - notify) * 100.0 / busy);
+
+    return woken_notify == num_threads && woken_busy == num_threads ? 0 : 1;
+}
@@ -648,6 +648,157 @@ struct in_addr Wifi_GetIPInfo(struct in_addr *pGateway, struct in_addr *pSnmask,
 ///     The new secondary dns server
 void Wifi_SetIP(u32 IPaddr, u32 gateway, u32 subnetmask, u32 dns1, u32 dns2);
 
+/// Adds an entry to the ARP cache of the IP stack.
+///
+/// The IP stack has to find out the MAC address of a host in the local network
+/// before sending anything to it, which delays the first packet. If the MAC
+/// address is known in advance (for example, it was saved in a previous
+/// session), this function lets the IP stack skip that step. Packets that are
+/// waiting for the address are sent right away.
+///
+/// The entry ages like any other entry: after a few minutes it's removed if
+/// nothing has been sent to the host, or it's confirmed with a normal ARP
+/// request if something has. It's also removed when Wifi_SetIP() is called.
+///
+/// @param IPaddr
+///     IP address of the host, in the same format as in Wifi_SetIP().
+/// @param mac
+///     MAC address of the host (6 bytes).
+///
+/// @return
+///     0 on success, -1 on error (the IP stack isn't ready, or the address is
+///     a broadcast, multicast or own address).
+int Wifi_AddARPEntry(u32 IPaddr, const u8 *mac);
+
+/// Handler called by blocking socket functions while they wait for progress.
+///
+/// @param event
+///     Opaque pointer that identifies what the caller is waiting for. It is
+///     NULL when the caller is waiting for a timeout (like in select()).
+typedef void (*WifiWaitHandler)(const void *event);
+
+/// Handler called by the IP stack when there may be progress on an event.
+///
+/// It is usually called from an interrupt handler. It is called with NULL
+/// every time the timer of the IP stack runs.
+///
+/// @param event
+///     Opaque pointer that identifies the event (the same values that are
+///     passed to the WifiWaitHandler).
+typedef void (*WifiNotifyHandler)(const void *event);
+
+/// Sets the functions used by blocking sockets to wait for progress.
+///
+/// By default, blocking calls (connect(), send(), recv(), accept(), select(),
+/// gethostbyname()...) busy-wait with short delays until they can continue.
+/// This lets multithreaded applications yield to other threads instead, and
+/// wake them up when the IP stack has work for them.
+///
+/// The wait handler may return before the event is notified, it will just be
+/// called again. However, it must return eventually even if no notification
+/// arrives, because timeouts are checked by the caller. Waiting for the next
+/// timer interrupt satisfies both requirements. For example, with cothreads:
+///
+/// ```c
+/// static void wait_handler(const void *event)
+/// {
+///     (void)event;
+///     cothread_yield_irq(IRQ_TIMER3);
+/// }
+///
+/// Wifi_SetWaitHandlers(wait_handler, NULL);
+/// ```
+///
+/// @param wait
+///     Function called by blocking calls on every retry. NULL restores the
+///     default busy-wait.
+/// @param notify
+///     Function called by the IP stack when an event happens. It can be NULL.
+void Wifi_SetWaitHandlers(WifiWaitHandler wait, WifiNotifyHandler notify);
+
+/// Returns information about the memory usage of the heap of the IP stack.
+///
+/// The sizes include the bookkeeping information of each allocation. They are
+/// 0 if the heap was set up with WIFIINIT_OPTION_USECUSTOMALLOC.
+///
+/// @param total
+///     Pointer to receive the size of the heap in bytes. It can be NULL.
+/// @param used
+///     Pointer to receive the number of bytes currently in use. It can be NULL.
+/// @param peak
+///     Pointer to receive the highest number of bytes that have been in use at
+///     the same time since the library was initialized, or since the last call
+///     to Wifi_ResetHeapPeak(). It can be NULL.
+void Wifi_GetHeapUsage(u32 *total, u32 *used, u32 *peak);
+
+/// Resets the peak heap usage value returned by Wifi_GetHeapUsage().
+///
+/// After calling this function, the peak value will be the current usage.
+void Wifi_ResetHeapPeak(void);
+
+/// Size of the header that has to be written at the start of a pcap file.
+#define WIFI_CAPTURE_FILE_HEADER_SIZE 24
+
+/// Starts capturing all Ethernet frames sent and received by the IP stack.
+///
+/// Frames are stored in the provided buffer, which is used as a ring buffer of
+/// records in pcap format. When it is full, new frames are dropped until the
+/// application reads the old ones with Wifi_CaptureRead(). Each record uses
+/// 16 bytes plus "snaplen" bytes (rounded up to a multiple of 4) of the buffer.
+///
+/// Timestamps have a resolution of milliseconds, and they count from the
+/// moment the library was initialized.
+///
+/// @param buffer
+///     Buffer to store the captured frames. It must remain valid until
+///     Wifi_CaptureStop() is called.
+/// @param size
+///     Size of the buffer in bytes.
+/// @param snaplen
+///     Maximum number of bytes to store of each frame. Longer frames are
+///     truncated.
+///
+/// @return
+///     0 on success, -1 on error (the buffer is too small for one frame).
+int Wifi_CaptureStart(void *buffer, int size, int snaplen);
+
+/// Stops capturing frames.
+///
+/// Frames that haven't been read yet are discarded.
+void Wifi_CaptureStop(void);
+
+/// Reads captured frames.
+///
+/// This function can be called while the IP stack is running, from one thread
+/// at a time. It copies as many whole records as fit in the destination
+/// buffer. Each record starts with a 16-byte pcap record header, so the data
+/// can be appended to a file that starts with the header generated by
+/// Wifi_CaptureFileHeader().
+///
+/// @param dest
+///     Destination buffer.
+/// @param size
+///     Size of the destination buffer in bytes.
+///
+/// @return
+///     Number of bytes copied to the buffer.
+int Wifi_CaptureRead(void *dest, int size);
+
+/// Returns the number of frames dropped because the capture buffer was full.
+///
+/// @return
+///     Number of dropped frames since the capture was started.
+u32 Wifi_CaptureDropped(void);
+
+/// Generates the header of a pcap file for the frames of Wifi_CaptureRead().
+///
+/// @param dest
+///     Destination buffer. It must be at least WIFI_CAPTURE_FILE_HEADER_SIZE
+///     bytes in size and 32-bit aligned.
+/// @param snaplen
+///     The same value that was passed to Wifi_CaptureStart().
+void Wifi_CaptureFileHeader(void *dest, int snaplen);
+
 /// @}
 /// @defgroup dswifi9_raw_tx_rx Raw transfer/reception of packets.
 /// @{
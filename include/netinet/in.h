@@ -13,10 +13,18 @@ extern "C" {
 
 #include <sys/socket.h>
 
+#define IPPROTO_IP  0
+#define IPPROTO_TCP 6
+#define IPPROTO_UDP 17
+
 #define INADDR_ANY       0x00000000
 #define INADDR_BROADCAST 0xFFFFFFFF
 #define INADDR_NONE      0xFFFFFFFF
 
+// IPPROTO_IP level socket options (UDP sockets only)
+#define IP_ADD_MEMBERSHIP  12 // join a multicast group (struct ip_mreq)
+#define IP_DROP_MEMBERSHIP 13 // leave a multicast group (struct ip_mreq)
+
 struct in_addr
 {
     unsigned long s_addr;
@@ -30,6 +38,12 @@ struct sockaddr_in
     unsigned char sin_zero[8];
 };
 
+struct ip_mreq
+{
+    struct in_addr imr_multiaddr; // multicast group
+    struct in_addr imr_interface; // local address of the interface (ignored)
+};
+
 // actually from arpa/inet.h - but is included through netinet/in.h
 unsigned long inet_addr(const char *cp);
 int inet_aton(const char *cp, struct in_addr *inp);
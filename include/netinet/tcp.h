@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2005-2006 Stephen Stair - sgstair@akkit.org - http://www.akkit.org
+
+// DSWifi Project - socket emulation layer defines/prototypes (netinet/tcp.h)
+
+#ifndef NETINET_TCP_H
+#define NETINET_TCP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Options for (get/set)sockopt() at level SOL_TCP (IPPROTO_TCP). All of them take an int, except
+// TCP_INFO.
+#define TCP_KEEPIDLE  4 // seconds without activity before sending keepalive probes
+#define TCP_KEEPINTVL 5 // seconds between keepalive probes
+#define TCP_KEEPCNT   6 // unanswered probes before the connection is dropped
+#define TCP_INFO      11 // get only: statistics of the connection (struct tcp_info)
+#define TCP_FASTOPEN  23 // accept TCP Fast Open connections, value is the max. pending ones
+
+// Version of struct tcp_info. Fields are only ever added at the end of the struct, and the version
+// is increased when that happens. getsockopt(TCP_INFO) fills as much of the struct as fits in the
+// buffer it is given, and tcpi_version tells the caller which fields are valid.
+#define TCP_INFO_VERSION 1
+
+// All times are in milliseconds. All counters start at zero when the socket is created.
+struct tcp_info
+{
+    unsigned char tcpi_version;     // TCP_INFO_VERSION of the stack that filled the struct
+    unsigned char tcpi_state;       // internal state of the connection
+    unsigned char tcpi_retransmits; // retransmissions of the current segment without an ACK
+    unsigned char tcpi_probes;      // unanswered keepalive probes
+
+    unsigned int tcpi_rto;         // current retransmission timeout
+    unsigned int tcpi_rtt;         // smoothed round-trip time, 0 if it hasn't been measured yet
+    unsigned int tcpi_rttvar;      // mean deviation of the round-trip time
+    unsigned int tcpi_min_rtt;     // smallest round-trip time seen
+    unsigned int tcpi_snd_mss;     // max. size of the data of a segment to the peer
+    unsigned int tcpi_snd_wnd;     // window currently offered by the peer
+    unsigned int tcpi_max_snd_wnd; // largest window offered by the peer
+    unsigned int tcpi_rcv_wnd;     // window currently offered to the peer
+    unsigned int tcpi_unacked;     // bytes sent but not acknowledged yet
+    unsigned int tcpi_notsent;     // bytes queued that haven't been sent yet
+    unsigned int tcpi_last_recv;   // time since the last segment was received
+
+    unsigned int tcpi_segs_out;       // segments sent, including retransmissions
+    unsigned int tcpi_segs_in;        // segments received
+    unsigned int tcpi_bytes_sent;     // data bytes sent, including retransmissions
+    unsigned int tcpi_bytes_acked;    // data bytes acknowledged by the peer
+    unsigned int tcpi_bytes_received; // data bytes received in order
+    unsigned int tcpi_total_retrans;  // segments that resent data
+    unsigned int tcpi_dup_acks;       // duplicate ACKs received
+    unsigned int tcpi_dup_segs;       // segments received with data that we already had
+    unsigned int tcpi_ooo_drops;      // segments dropped because they were out of order
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,6 +11,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <sys/time.h>
 
 // Level number for (get/set)sockopt() to apply to socket itself.
@@ -35,7 +36,7 @@ extern "C" {
 #define SOCKET_ERROR -1
 
 // send()/recv()/etc flags
-// at present, only MSG_PEEK is implemented though.
+// at present, only MSG_PEEK and MSG_FASTOPEN are implemented though.
 #define MSG_WAITALL   0x40000000
 #define MSG_TRUNC     0x20000000
 #define MSG_PEEK      0x10000000
@@ -43,6 +44,7 @@ extern "C" {
 #define MSG_EOR       0x04000000
 #define MSG_DONTROUTE 0x02000000
 #define MSG_CTRUNC    0x01000000
+#define MSG_FASTOPEN  0x00800000 // sendto() on TCP: connect and send the data in the SYN
 
 // shutdown() flags:
 #define SHUT_RD   1
@@ -73,12 +75,51 @@ extern "C" {
 #define SO_ERROR    0x1007 // get error status and clear
 #define SO_TYPE     0x1008 // get socket type
 
+#define SO_MAX_PACING_RATE 0x1009 // max. bytes sent per second (unsigned int), 0 = no limit
+#define SO_RCVDROPS        0x100A // UDP: datagrams dropped because SO_RCVBUF was full (get only)
+#define SO_RCVDROPOLDEST   0x100B // UDP: if SO_RCVBUF is full, drop old datagrams, not new ones
+#define SO_RCVNOCHECK      0x100C // UDP: don't verify checksums of received datagrams
+
+// Argument of SO_LINGER
+struct linger
+{
+    int l_onoff;  // 0 to close connections in the background (default)
+    int l_linger; // seconds that closesocket() waits, 0 resets the connection right away
+};
+
 struct sockaddr
 {
     unsigned short sa_family;
     char sa_data[14];
 };
 
+#if __has_include(<sys/uio.h>)
+#    include <sys/uio.h>
+#else
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
+struct msghdr
+{
+    void *msg_name;        // address of the peer (struct sockaddr_in), or NULL
+    int msg_namelen;       // size of msg_name
+    struct iovec *msg_iov; // buffers of the data
+    int msg_iovlen;        // number of buffers in msg_iov
+    void *msg_control;     // ancillary data, not supported
+    int msg_controllen;    // size of msg_control, set to 0 when receiving
+    int msg_flags;         // MSG_TRUNC is set if a received datagram didn't fit in msg_iov
+};
+
+struct mmsghdr
+{
+    struct msghdr msg_hdr;
+    unsigned int msg_len; // number of bytes sent or received
+};
+
 #ifndef ntohs
 #    define ntohs(num) htons(num)
 #    define ntohl(num) htonl(num)
@@ -93,6 +134,13 @@ int sendto(int socket, const void *data, int sendlength, int flags, const struct
            int addr_len);
 int recvfrom(int socket, void *data, int recvlength, int flags, struct sockaddr *addr,
              int *addr_len);
+// Send and receive several datagrams in one call (UDP sockets only). They return the number of
+// messages sent or received. recvmmsg() only waits for the first datagram of blocking sockets, and
+// returns as many others as are already queued. timeout isn't supported and must be NULL. All the
+// datagrams sent by sendmmsg() are handed to the wifi hardware together.
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timeval *timeout);
 int listen(int socket, int max_connections);
 int accept(int socket, struct sockaddr *addr, int *addr_len);
 int shutdown(int socket, int shutdown_type);
@@ -307,7 +307,7 @@ int Wifi_AssocStatus(void)
                                         return ASSOCSTATUS_ACQUIRINGDHCP;
                                     }
                                 }
-                                sgIP_ARP_SendGratARP(wifi_hw);
+                                sgIP_ARP_Announce(wifi_hw);
                             }
 #endif
                             wifi_connect_state = WIFI_CONNECT_DONE;
@@ -330,7 +330,7 @@ int Wifi_AssocStatus(void)
                                 return ASSOCSTATUS_ACQUIRINGDHCP;
                             }
                         }
-                        sgIP_ARP_SendGratARP(wifi_hw);
+                        sgIP_ARP_Announce(wifi_hw);
                     }
 #endif
                     wifi_connect_state = WIFI_CONNECT_DONE;
@@ -356,7 +356,7 @@ int Wifi_AssocStatus(void)
                     case SGIP_DHCP_STATUS_SUCCESS:
                         wifi_connect_state = WIFI_CONNECT_DONE;
                         WifiData->flags9 |= WFLAG_ARM9_NETREADY;
-                        sgIP_ARP_SendGratARP(wifi_hw);
+                        sgIP_ARP_Announce(wifi_hw);
                         sgIP_DNS_Record_Localhost();
                         return ASSOCSTATUS_ASSOCIATED;
                     default:
@@ -4,6 +4,9 @@
 
 #include <stdlib.h>
 
+#include <nds.h>
+#include <dswifi9.h>
+
 #include "arm9/wifi_arm9.h"
 
 #ifdef WIFI_USE_TCP_SGIP
@@ -46,12 +49,19 @@ int wHeapsize;
 wHeapRecord *wHeapStart; // start of heap
 wHeapRecord *wHeapFirst; // first free block
 
+int wHeapUsed;    // bytes currently allocated, including the record headers of the allocations
+int wHeapMaxUsed; // highest value of wHeapUsed since the last reset
+
 void wHeapAllocInit(int size)
 {
     wHeapStart = (wHeapRecord *)malloc(size);
     if (!wHeapStart)
         return;
 
+    wHeapsize    = size;
+    wHeapUsed    = 0;
+    wHeapMaxUsed = wHeapUsed;
+
     wHeapFirst        = wHeapStart;
     wHeapStart->flags = WHEAP_RECORD_FLAG_UNUSED;
     wHeapStart->next  = 0;
@@ -126,6 +136,9 @@ void *wHeapAlloc(int size)
         rec->next   = rec2;
         rec->unused = 0;
     }
+    wHeapUsed += WHEAP_RECORD_SIZE + rec->size;
+    if (wHeapUsed > wHeapMaxUsed)
+        wHeapMaxUsed = wHeapUsed;
     if (rec == wHeapFirst)
     {
         while (wHeapFirst->next && wHeapFirst->flags == WHEAP_RECORD_FLAG_INUSE)
@@ -184,6 +197,10 @@ void wHeapFree(void *data)
         // note heap error
         SGIP_DEBUG_MESSAGE(("wHeapFree: Data already freed! 0x%X", data));
     }
+    else
+    {
+        wHeapUsed -= WHEAP_RECORD_SIZE + rec->size;
+    }
     rec->flags = WHEAP_RECORD_FLAG_FREED;
     if (rec < wHeapFirst || !wHeapFirst)
         wHeapFirst = rec; // reposition the "starting" pointer.
@@ -201,4 +218,27 @@ void sgIP_free(void *ptr)
     wHeapFree(ptr);
 }
 
+void Wifi_GetHeapUsage(u32 *total, u32 *used, u32 *peak)
+{
+    int oldIME = enterCriticalSection();
+
+    if (total)
+        *total = wHeapsize;
+    if (used)
+        *used = wHeapUsed;
+    if (peak)
+        *peak = wHeapMaxUsed;
+
+    leaveCriticalSection(oldIME);
+}
+
+void Wifi_ResetHeapPeak(void)
+{
+    int oldIME = enterCriticalSection();
+
+    wHeapMaxUsed = wHeapUsed;
+
+    leaveCriticalSection(oldIME);
+}
+
 #endif
@@ -92,24 +92,30 @@ u32 Wifi_Init(int initflags)
     WifiData = (Wifi_MainStruct *)memUncached(Wifi_Data_Struct);
 
 #ifdef WIFI_USE_TCP_SGIP
+    int heap_size = 0;
     switch (initflags & WIFIINIT_OPTION_HEAPMASK)
     {
         case WIFIINIT_OPTION_USEHEAP_128:
-            wHeapAllocInit(128 * 1024);
+            heap_size = 128 * 1024;
             break;
         case WIFIINIT_OPTION_USEHEAP_64:
-            wHeapAllocInit(64 * 1024);
+            heap_size = 64 * 1024;
             break;
         case WIFIINIT_OPTION_USEHEAP_256:
-            wHeapAllocInit(256 * 1024);
+            heap_size = 256 * 1024;
             break;
         case WIFIINIT_OPTION_USEHEAP_512:
-            wHeapAllocInit(512 * 1024);
+            heap_size = 512 * 1024;
             break;
         case WIFIINIT_OPTION_USECUSTOMALLOC:
             break;
     }
+    if (heap_size > 0)
+        wHeapAllocInit(heap_size);
     sgIP_Init();
+    // The size of a custom allocator isn't known, so the default budget is used with it.
+    if (heap_size > 0)
+        sgIP_TCP_SetHeapSize(heap_size);
 
 #endif
     // Start in Internet mode by default for compatibility with old code.
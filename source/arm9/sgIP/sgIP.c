@@ -7,16 +7,24 @@
 #include "arm9/sgIP/sgIP.h"
 
 volatile unsigned long sgIP_timems;
+
+#ifdef SGIP_MULTITHREADED_THREADING_MODEL
+void *sgIP_stack_mutex;
+#endif
 int sgIP_errno;
 
 // sgIP_Init(): Initializes sgIP hub and sets up a default surrounding interface (ARP and IP)
 void sgIP_Init(void)
 {
+#ifdef SGIP_MULTITHREADED_THREADING_MODEL
+    sgIP_stack_mutex = sgIP_MutexCreate();
+#endif
     sgIP_timems = 0;
     sgIP_memblock_Init();
     sgIP_Hub_Init();
     sgIP_sockets_Init();
     sgIP_ARP_Init();
+    sgIP_IGMP_Init();
     sgIP_TCP_Init();
     sgIP_UDP_Init();
     sgIP_DNS_Init();
@@ -29,6 +37,8 @@ unsigned long count_1000ms;
 
 void sgIP_Timer(int num_ms)
 {
+    SGIP_THREAD_PROTECT();
+
     sgIP_timems += num_ms;
     count_100ms += num_ms;
     if (count_100ms >= 100)
@@ -37,6 +47,7 @@ void sgIP_Timer(int num_ms)
         if (count_100ms >= 100)
             count_100ms = 0;
         sgIP_ARP_Timer100ms();
+        sgIP_IGMP_Timer100ms();
     }
     count_1000ms += num_ms;
     if (count_1000ms >= 1000)
@@ -45,7 +56,12 @@ void sgIP_Timer(int num_ms)
         if (count_1000ms >= 1000)
             count_1000ms = 0;
         sgIP_DNS_Timer1000ms();
-        sgIP_sockets_Timer1000ms();
+        sgIP_IP_Timer1000ms();
     }
     sgIP_TCP_Timer();
+
+    SGIP_THREAD_UNPROTECT();
+
+    // Let blocking calls with timeouts check the time again.
+    SGIP_NOTIFYEVENT(SGIP_EVENT_ANY);
 }
@@ -17,10 +17,13 @@ extern "C" {
 #include "arm9/sgIP/sgIP_DNS.h"
 #include "arm9/sgIP/sgIP_Hub.h"
 #include "arm9/sgIP/sgIP_ICMP.h"
+#include "arm9/sgIP/sgIP_IGMP.h"
 #include "arm9/sgIP/sgIP_IP.h"
 #include "arm9/sgIP/sgIP_TCP.h"
 #include "arm9/sgIP/sgIP_UDP.h"
 #include "arm9/sgIP/sgIP_memblock.h"
+#include "arm9/sgIP/sgIP_ports.h"
+#include "arm9/sgIP/sgIP_random.h"
 #include "arm9/sgIP/sgIP_sockets.h"
 
 extern volatile unsigned long sgIP_timems;
@@ -5,34 +5,117 @@
 // DSWifi Project - sgIP Internet Protocol Stack Implementation
 
 #include "arm9/sgIP/sgIP_ARP.h"
+#include "arm9/sgIP/sgIP_IGMP.h"
+#include "arm9/sgIP/sgIP_IP.h"
+
+extern volatile unsigned long sgIP_timems;
 
 sgIP_ARP_Record ArpRecords[SGIP_ARP_MAXENTRIES];
 
-int sgIP_FindArpSlot(sgIP_Hub_HWInterface *hw, unsigned long destip)
+// First entry of each hash bucket, or -1. Entries are only linked while they are active.
+static short arp_buckets[SGIP_ARP_HASHSIZE];
+
+// Earliest deadline of all entries. The timer doesn't look at the table until then.
+static unsigned long arp_next_deadline;
+
+static unsigned int sgIP_ARP_Hash(unsigned long ipaddr)
 {
-    for (int i = 0; i < SGIP_ARP_MAXENTRIES; i++)
+    ipaddr ^= ipaddr >> 16;
+    ipaddr ^= ipaddr >> 8;
+    return ipaddr & (SGIP_ARP_HASHSIZE - 1);
+}
+
+static void sgIP_ARP_Link(int slot)
+{
+    short *bucket = &arp_buckets[sgIP_ARP_Hash(ArpRecords[slot].protocol_address)];
+
+    ArpRecords[slot].hash_next = *bucket;
+    *bucket                    = slot;
+}
+
+static void sgIP_ARP_Unlink(int slot)
+{
+    short *link = &arp_buckets[sgIP_ARP_Hash(ArpRecords[slot].protocol_address)];
+
+    while (*link != -1)
     {
-        if (ArpRecords[i].flags & SGIP_ARP_FLAG_ACTIVE)
+        if (*link == slot)
         {
-            if (ArpRecords[i].linked_interface == hw && ArpRecords[i].protocol_address == destip)
-                return i;
+            *link = ArpRecords[slot].hash_next;
+            return;
         }
+        link = &ArpRecords[*link].hash_next;
+    }
+}
+
+static void sgIP_ARP_SetDeadline(int slot, unsigned long ms)
+{
+    unsigned long deadline = sgIP_timems + ms;
+
+    ArpRecords[slot].deadline = deadline;
+    if ((long)(deadline - arp_next_deadline) < 0)
+        arp_next_deadline = deadline;
+}
+
+static void sgIP_ARP_FreeSlot(int slot)
+{
+    sgIP_ARP_Record *rec = &ArpRecords[slot];
+
+    if (!(rec->flags & SGIP_ARP_FLAG_ACTIVE))
+        return;
+
+    while (rec->queue_count)
+    {
+        sgIP_memblock_free(rec->queued_packets[rec->queue_first]);
+        rec->queue_first = (rec->queue_first + 1) % SGIP_ARP_MAXQUEUED;
+        rec->queue_count--;
+    }
+    sgIP_ARP_Unlink(slot);
+    rec->flags = 0;
+}
+
+// Queues a frame until the address of the entry is known. The ethernet header must be exposed.
+static void sgIP_ARP_Enqueue(int slot, sgIP_memblock *mb)
+{
+    sgIP_ARP_Record *rec = &ArpRecords[slot];
+
+    sgIP_memblock_exposeheader(mb, -14); // re-hide ethernet header.
+
+    if (rec->queue_count == SGIP_ARP_MAXQUEUED)
+    {
+        // Drop the oldest frame to make room for the new one
+        sgIP_memblock_free(rec->queued_packets[rec->queue_first]);
+        rec->queue_first = (rec->queue_first + 1) % SGIP_ARP_MAXQUEUED;
+        rec->queue_count--;
+    }
+    rec->queued_packets[(rec->queue_first + rec->queue_count) % SGIP_ARP_MAXQUEUED] = mb;
+    rec->queue_count++;
+}
+
+int sgIP_FindArpSlot(sgIP_Hub_HWInterface *hw, unsigned long destip)
+{
+    for (int i = arp_buckets[sgIP_ARP_Hash(destip)]; i != -1; i = ArpRecords[i].hash_next)
+    {
+        if (ArpRecords[i].linked_interface == hw && ArpRecords[i].protocol_address == destip)
+            return i;
     }
     return -1;
 }
 
+// Returns a free slot. If all of them are used, the least recently used entry is dropped.
 int sgIP_GetArpSlot(void)
 {
-    int m     = 0;
-    int midle = 0;
+    int m               = 0;
+    unsigned long midle = 0;
 
     for (int i = 0; i < SGIP_ARP_MAXENTRIES; i++)
     {
         if (ArpRecords[i].flags & SGIP_ARP_FLAG_ACTIVE)
         {
-            if (ArpRecords[i].idletime >= midle)
+            unsigned long idle = sgIP_timems - ArpRecords[i].lastused;
+            if (idle >= midle)
             {
-                midle = ArpRecords[i].idletime;
+                midle = idle;
                 m     = i;
             }
         }
@@ -43,13 +126,7 @@ int sgIP_GetArpSlot(void)
     }
 
     // this slot *was* in use, so let's fix that situation.
-    if (ArpRecords[m].queued_packet)
-        sgIP_memblock_free(ArpRecords[m].queued_packet);
-
-    ArpRecords[m].flags         = 0;
-    ArpRecords[m].retrycount    = 0;
-    ArpRecords[m].idletime      = 0;
-    ArpRecords[m].queued_packet = 0;
+    sgIP_ARP_FreeSlot(m);
     return m;
 }
 
@@ -72,44 +149,65 @@ int sgIP_ARP_Check_isok(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb, sgIP_Header
 
 void sgIP_ARP_Init(void)
 {
+    for (int i = 0; i < SGIP_ARP_HASHSIZE; i++)
+        arp_buckets[i] = -1;
+
     for (int i = 0; i < SGIP_ARP_MAXENTRIES; i++)
     {
-        ArpRecords[i].flags         = 0;
-        ArpRecords[i].idletime      = 0;
-        ArpRecords[i].queued_packet = 0;
+        ArpRecords[i].flags       = 0;
+        ArpRecords[i].queue_first = 0;
+        ArpRecords[i].queue_count = 0;
     }
+
+    arp_next_deadline = sgIP_timems + SGIP_ARP_REACHABLEMS;
 }
 
 void sgIP_ARP_Timer100ms(void)
 {
+    // Nothing to do until the earliest deadline
+    if ((long)(sgIP_timems - arp_next_deadline) < 0)
+        return;
+
+    arp_next_deadline = sgIP_timems + SGIP_ARP_REACHABLEMS;
+
     for (int i = 0; i < SGIP_ARP_MAXENTRIES; i++)
     {
-        if (ArpRecords[i].flags & SGIP_ARP_FLAG_ACTIVE)
+        sgIP_ARP_Record *rec = &ArpRecords[i];
+
+        if (!(rec->flags & SGIP_ARP_FLAG_ACTIVE))
+            continue;
+
+        if ((long)(sgIP_timems - rec->deadline) < 0)
+        {
+            if ((long)(rec->deadline - arp_next_deadline) < 0)
+                arp_next_deadline = rec->deadline;
+            continue;
+        }
+
+        if ((rec->flags & (SGIP_ARP_FLAG_HAVEHWADDR | SGIP_ARP_FLAG_REFRESH))
+            == SGIP_ARP_FLAG_HAVEHWADDR)
         {
-            ArpRecords[i].idletime++;
-            if (!(ArpRecords[i].flags & SGIP_ARP_FLAG_HAVEHWADDR))
+            // The address has to be confirmed. Keep using it while we ask again, but forget it if
+            // nothing has been sent to it for a while.
+            if (!(rec->flags & SGIP_ARP_FLAG_USED))
             {
-                ArpRecords[i].retrycount++;
-                if (ArpRecords[i].retrycount > 125)
-                {
-                    // it's a lost cause.
-                    if (ArpRecords[i].queued_packet)
-                    {
-                        // if there is already a queued packet, kill it.
-                        sgIP_memblock_free(ArpRecords[i].queued_packet);
-                    }
-                    ArpRecords[i].flags = 0;
-                    continue;
-                }
-                if ((ArpRecords[i].retrycount & 7) == 7)
-                {
-                    // attempt retransmit of ARP frame.
-                    sgIP_ARP_SendARPRequest(ArpRecords[i].linked_interface,
-                                            ArpRecords[i].linked_protocol,
-                                            ArpRecords[i].protocol_address);
-                }
+                sgIP_ARP_FreeSlot(i);
+                continue;
             }
+            rec->flags |= SGIP_ARP_FLAG_REFRESH;
+            rec->retrycount = 0;
         }
+        else if (++rec->retrycount >= SGIP_ARP_MAXRETRIES)
+        {
+            // it's a lost cause.
+            sgIP_ARP_FreeSlot(i);
+            continue;
+        }
+
+        // attempt retransmit of ARP frame.
+        sgIP_ARP_SendARPRequest(rec->linked_interface, rec->linked_protocol,
+                                rec->protocol_address);
+        sgIP_ARP_SetDeadline(i, SGIP_ARP_RETRYMS);
     }
 }
 
@@ -117,10 +215,8 @@ void sgIP_ARP_FlushInterface(sgIP_Hub_HWInterface *hw)
 {
     for (int i = 0; i < SGIP_ARP_MAXENTRIES; i++)
     {
-        if (ArpRecords[i].linked_interface == hw)
-            ArpRecords[i].flags = 0;
-        if (hw == 0)
-            ArpRecords[i].flags = 0; // flush all interfaces
+        if (ArpRecords[i].linked_interface == hw || hw == 0) // hw == 0 flushes all interfaces
+            sgIP_ARP_FreeSlot(i);
     }
 }
 
@@ -133,9 +229,68 @@ int sgIP_ARP_ProcessIPFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
     return 0;
 }
 
+// Sends a frame to the hardware address of an ARP entry. The ethernet header must be exposed.
+static int sgIP_ARP_SendToSlot(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb, unsigned short protocol,
+                               int slot)
+{
+    ArpRecords[slot].lastused = sgIP_timems;
+    ArpRecords[slot].flags |= SGIP_ARP_FLAG_USED;
+    // construct ethernet header
+    sgIP_Header_Ethernet *ether = (sgIP_Header_Ethernet *)mb->datastart;
+    for (int j = 0; j < 6; j++)
+    {
+        ether->src_mac[j]  = hw->hwaddr[j];
+        ether->dest_mac[j] = ArpRecords[slot].hw_address[j];
+    }
+    ether->protocol = protocol;
+    // this function will free the memory block when it's done.
+    return sgIP_Hub_SendRawPacket(hw, mb);
+}
+
+// Saves the hardware address of an entry and sends the frames that were waiting for it.
+static void sgIP_ARP_Resolved(sgIP_Hub_HWInterface *hw, int slot, const unsigned char *hwaddr)
+{
+    sgIP_ARP_Record *rec = &ArpRecords[slot];
+
+    for (int j = 0; j < hw->hwaddrlen; j++)
+        rec->hw_address[j] = hwaddr[j];
+    rec->flags      = (rec->flags | SGIP_ARP_FLAG_HAVEHWADDR)
+                      & ~(SGIP_ARP_FLAG_USED | SGIP_ARP_FLAG_REFRESH);
+    rec->retrycount = 0;
+    sgIP_ARP_SetDeadline(slot, SGIP_ARP_REACHABLEMS);
+
+    while (rec->queue_count)
+    {
+        sgIP_memblock *mb = rec->queued_packets[rec->queue_first];
+        rec->queue_first  = (rec->queue_first + 1) % SGIP_ARP_MAXQUEUED;
+        rec->queue_count--;
+
+        sgIP_memblock_exposeheader(mb, 14); // add 14 bytes at the start for the header
+        sgIP_ARP_SendToSlot(hw, mb, rec->linked_protocol, slot);
+    }
+}
+
+// Creates the entry of an address that isn't in the table. The caller sends the first request.
+static int sgIP_ARP_NewEntry(sgIP_Hub_HWInterface *hw, unsigned short protocol,
+                             unsigned long destaddr)
+{
+    int m = sgIP_GetArpSlot(); // gets and cleans out an arp slot for us
+
+    // build new record
+    ArpRecords[m].flags            = SGIP_ARP_FLAG_ACTIVE;
+    ArpRecords[m].retrycount       = 0;
+    ArpRecords[m].lastused         = sgIP_timems;
+    ArpRecords[m].linked_interface = hw;
+    ArpRecords[m].linked_protocol  = protocol;
+    ArpRecords[m].protocol_address = destaddr;
+    sgIP_ARP_Link(m);
+    sgIP_ARP_SetDeadline(m, SGIP_ARP_RETRYMS);
+    return m;
+}
+
 int sgIP_ARP_ProcessARPFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
 {
-    int i, j, ip;
+    int i, ip;
 
     if (!hw || !mb)
         return 0;
@@ -151,6 +306,22 @@ int sgIP_ARP_ProcessARPFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
     }
     sgIP_memblock_exposeheader(mb, 14); // re-expose 14 bytes at the start...
 
+    if (arp->hw_addr_len != hw->hwaddrlen || arp->protocol_addr_len != 4)
+    {
+        sgIP_memblock_free(mb);
+        return 0;
+    }
+
+    // sender IP
+    ip = arp->addresses[arp->hw_addr_len + 0] + (arp->addresses[arp->hw_addr_len + 1] << 8)
+         + (arp->addresses[arp->hw_addr_len + 2] << 16)
+         + (arp->addresses[arp->hw_addr_len + 3] << 24);
+
+    // Requests and replies both update the entry of the sender if we have one (RFC 826).
+    i = sgIP_FindArpSlot(hw, ip);
+    if (i != -1) // we've been waiting for you...
+        sgIP_ARP_Resolved(hw, i, arp->addresses);
+
     if (htons(arp->opcode) == 1) // request
     {
         // requested IP
@@ -165,25 +336,6 @@ int sgIP_ARP_ProcessARPFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
             return 0;
         }
     }
-    if (htons(arp->opcode) == 2) // response
-    {
-        // sender IP
-        ip = arp->addresses[arp->hw_addr_len + 0] + (arp->addresses[arp->hw_addr_len + 1] << 8)
-             + (arp->addresses[arp->hw_addr_len + 2] << 16)
-             + (arp->addresses[arp->hw_addr_len + 3] << 24);
-        i = sgIP_FindArpSlot(hw, ip);
-        if (i != -1) // we've been waiting for you...
-        {
-            for (j = 0; j < arp->hw_addr_len; j++)
-                ArpRecords[i].hw_address[j] = arp->addresses[j];
-            ArpRecords[i].flags |= SGIP_ARP_FLAG_HAVEHWADDR;
-            sgIP_memblock *mb2;
-            mb2                         = ArpRecords[i].queued_packet;
-            ArpRecords[i].queued_packet = 0;
-            if (mb2)
-                sgIP_ARP_SendProtocolFrame(hw, mb2, ArpRecords[i].linked_protocol, ip);
-        }
-    }
 
     sgIP_memblock_free(mb);
     return 0;
@@ -216,56 +368,112 @@ int sgIP_ARP_SendProtocolFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb, unsi
         return sgIP_Hub_SendRawPacket(hw, mb);
     }
 
+    if (SGIP_IP_IS_MULTICAST(destaddr))
+    {
+        // Multicast addresses map to 01:00:5E plus the low 23 bits of the group (RFC 1112)
+        unsigned long group = htonl(destaddr);
+        ether               = (sgIP_Header_Ethernet *)mb->datastart;
+        for (j = 0; j < 6; j++)
+            ether->src_mac[j] = hw->hwaddr[j];
+        ether->dest_mac[0] = 0x01;
+        ether->dest_mac[1] = 0x00;
+        ether->dest_mac[2] = 0x5E;
+        ether->dest_mac[3] = (group >> 16) & 0x7F;
+        ether->dest_mac[4] = (group >> 8) & 0xFF;
+        ether->dest_mac[5] = group & 0xFF;
+        ether->protocol    = protocol;
+
+        return sgIP_Hub_SendRawPacket(hw, mb);
+    }
+
     i = sgIP_FindArpSlot(hw, destaddr);
     if (i != -1)
     {
         if (ArpRecords[i].flags & SGIP_ARP_FLAG_HAVEHWADDR) // we have the adddress
-        {
-            ArpRecords[i].idletime = 0;
-            // construct ethernet header
-            ether = (sgIP_Header_Ethernet *)mb->datastart;
-            for (j = 0; j < 6; j++)
-            {
-                ether->src_mac[j]  = hw->hwaddr[j];
-                ether->dest_mac[j] = ArpRecords[i].hw_address[j];
-            }
-            ether->protocol = protocol;
-            // this function will free the memory block when it's done.
-            return sgIP_Hub_SendRawPacket(hw, mb);
-        }
-        else
-        {
-            // we don't have the address, but are looking for it.
+            return sgIP_ARP_SendToSlot(hw, mb, protocol, i);
 
-            if (ArpRecords[i].queued_packet)
-            {
-                // if there is already a queued packet, reject the new one.
-                sgIP_memblock_free(mb);
-                return 0; // couldn't send.
-            }
-            else
-            {
-                sgIP_memblock_exposeheader(mb, -14);      // re-hide ethernet header.
-                ArpRecords[i].queued_packet   = mb;       // queue packet.
-                ArpRecords[i].linked_protocol = protocol; // queue packet.
-                return 0;
-            }
-        }
+        // we don't have the address, but are looking for it.
+        ArpRecords[i].linked_protocol = protocol;
+        sgIP_ARP_Enqueue(i, mb);
+        return 0;
     }
-    m = sgIP_GetArpSlot(); // gets and cleans out an arp slot for us
-                           // build new record
-    ArpRecords[m].flags            = SGIP_ARP_FLAG_ACTIVE;
-    ArpRecords[m].idletime         = 0;
-    ArpRecords[m].retrycount       = 0;
-    ArpRecords[m].linked_interface = hw;
-    ArpRecords[m].protocol_address = destaddr;
-    sgIP_memblock_exposeheader(mb, -14); // re-hide ethernet header.
-    ArpRecords[m].queued_packet   = mb;
-    ArpRecords[m].linked_protocol = protocol;
+    m = sgIP_ARP_NewEntry(hw, protocol, destaddr);
+    sgIP_ARP_Enqueue(m, mb);
     sgIP_ARP_SendARPRequest(hw, protocol, destaddr);
     return 0; // queued, but not sent yet.
 }
 
+int sgIP_ARP_SendProtocolFrameCached(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb,
+                                     unsigned short protocol, unsigned long destaddr, int *slot)
+{
+    if (!hw || !mb)
+        return 0;
+
+    int i = *slot;
+    if (i >= 0 && i < SGIP_ARP_MAXENTRIES && (ArpRecords[i].flags & SGIP_ARP_FLAG_HAVEHWADDR)
+        && ArpRecords[i].linked_interface == hw && ArpRecords[i].protocol_address == destaddr)
+    {
+        sgIP_memblock_exposeheader(mb, 14); // add 14 bytes at the start for the header
+        return sgIP_ARP_SendToSlot(hw, mb, protocol, i);
+    }
+
+    int ret = sgIP_ARP_SendProtocolFrame(hw, mb, protocol, destaddr);
+    *slot   = sgIP_FindArpSlot(hw, destaddr);
+    return ret;
+}
+
+// Addresses that never get an ARP entry of their own
+static int sgIP_ARP_IsNeighbor(sgIP_Hub_HWInterface *hw, unsigned long ipaddr)
+{
+    return ipaddr != 0 && ipaddr != hw->ipaddr && !sgIP_is_broadcast_address(hw, ipaddr)
+           && !SGIP_IP_IS_MULTICAST(ipaddr);
+}
+
+void sgIP_ARP_Resolve(sgIP_Hub_HWInterface *hw, unsigned long ipaddr)
+{
+    if (!hw || !sgIP_ARP_IsNeighbor(hw, ipaddr))
+        return;
+
+    SGIP_INTR_PROTECT();
+    if (sgIP_FindArpSlot(hw, ipaddr) == -1)
+    {
+        sgIP_ARP_NewEntry(hw, htons(0x0800), ipaddr);
+        sgIP_ARP_SendARPRequest(hw, htons(0x0800), ipaddr);
+    }
+    SGIP_INTR_UNPROTECT();
+}
+
+void sgIP_ARP_Announce(sgIP_Hub_HWInterface *hw)
+{
+    if (!hw || !hw->ipaddr)
+        return;
+
+    sgIP_ARP_SendGratARP(hw);
+    sgIP_IGMP_ReportAll();
+
+    // The gateway and the DNS servers are the first hosts contacted by almost every application
+    sgIP_ARP_Resolve(hw, hw->gateway);
+    for (int i = 0; i < 3; i++)
+    {
+        if (hw->dns[i])
+            sgIP_ARP_Resolve(hw, sgIP_Hub_NextHop(hw, hw->dns[i]));
+    }
+}
+
+int sgIP_ARP_AddEntry(sgIP_Hub_HWInterface *hw, unsigned long ipaddr, const unsigned char *hwaddr)
+{
+    if (!hw || !hwaddr || !sgIP_ARP_IsNeighbor(hw, ipaddr))
+        return 0;
+
+    SGIP_INTR_PROTECT();
+    int i = sgIP_FindArpSlot(hw, ipaddr);
+    if (i == -1)
+        i = sgIP_ARP_NewEntry(hw, htons(0x0800), ipaddr);
+    sgIP_ARP_Resolved(hw, i, hwaddr);
+    SGIP_INTR_UNPROTECT();
+    return 1;
+}
+
 int sgIP_ARP_SendARPResponse(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
 {
     int i;
@@ -17,16 +17,21 @@ extern "C" {
 
 #define SGIP_ARP_FLAG_ACTIVE     0x0001
 #define SGIP_ARP_FLAG_HAVEHWADDR 0x0002
+#define SGIP_ARP_FLAG_USED       0x0004 // A frame has been sent since the address was confirmed
+#define SGIP_ARP_FLAG_REFRESH    0x0008 // The address is being confirmed again
 
 typedef struct SGIP_ARP_RECORD
 {
     unsigned short flags, retrycount;
-    unsigned long idletime;
+    unsigned long deadline; // sgIP_timems of the next retry, or of the next confirmation
+    unsigned long lastused; // sgIP_timems of the last frame sent to this address
     sgIP_Hub_HWInterface *linked_interface;
-    sgIP_memblock *queued_packet;
     int linked_protocol;
     unsigned long protocol_address;
     char hw_address[SGIP_MAXHWADDRLEN];
+    short hash_next; // Next entry of the same hash bucket, or -1
+    unsigned char queue_first, queue_count;
+    sgIP_memblock *queued_packets[SGIP_ARP_MAXQUEUED]; // Circular queue, without ethernet header
 } sgIP_ARP_Record;
 
 typedef struct SGIP_HEADER_ARP
@@ -49,6 +54,20 @@ int sgIP_ARP_ProcessIPFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb);
 int sgIP_ARP_ProcessARPFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb);
 int sgIP_ARP_SendProtocolFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb, unsigned short protocol,
                                unsigned long destaddr);
+// Like sgIP_ARP_SendProtocolFrame(), but it tries the ARP entry *slot first. If it isn't the entry
+// of destaddr, the frame is sent normally and *slot is updated (-1 if there is no entry yet).
+int sgIP_ARP_SendProtocolFrameCached(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb,
+                                     unsigned short protocol, unsigned long destaddr, int *slot);
+
+// Starts resolving a neighbor address if it isn't in the table, without waiting for a frame to it.
+void sgIP_ARP_Resolve(sgIP_Hub_HWInterface *hw, unsigned long ipaddr);
+// Announces the address of the interface with a gratuitous ARP and IGMP reports of the joined
+// multicast groups, and starts resolving the gateway and the DNS servers. Call it when the
+// interface gets its IP configuration.
+void sgIP_ARP_Announce(sgIP_Hub_HWInterface *hw);
+// Adds or replaces the hardware address of a neighbor. Frames waiting for it are sent. The entry
+// ages like any other one. Returns 0 if the address can't have an entry.
+int sgIP_ARP_AddEntry(sgIP_Hub_HWInterface *hw, unsigned long ipaddr, const unsigned char *hwaddr);
 
 int sgIP_ARP_SendARPResponse(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb);
 int sgIP_ARP_SendGratARP(sgIP_Hub_HWInterface *hw);
@@ -12,6 +12,7 @@ extern "C" {
 #endif
 
 #include <errno.h>
+#include <stdint.h>
 
 //////////////////////////////////////////////////////////////////////////
 // General options - these control the core functionality of the stack.
@@ -32,13 +33,26 @@ extern "C" {
 //  "void sgIP_RestoreInterrupts(int)" that takes as a parameter the value returned by
 //  sgIP_DisableInterrupts().  Interrupts are disabled upon beginning work with sensitive
 //  memory areas or allocation/deallocation of memory, and are restored afterwards.
-#define SGIP_INTERRUPT_THREADING_MODEL
+//  Blocking socket calls wait for progress with "void sgIP_IntrWaitEvent(const void *)", and
+//  the stack reports progress with "void sgIP_IntrNotifyEvent(const void *)" (see
+//  SGIP_WAITEVENT() below).  It's used unless the build system defines
+//  SGIP_MULTITHREADED_THREADING_MODEL.
+#ifndef SGIP_MULTITHREADED_THREADING_MODEL
+#    define SGIP_INTERRUPT_THREADING_MODEL
+#endif
 
 // SGIP_MULTITHREADED_THREADING_MODEL: Standard memory protection for large multithreaded
 //  systems, such as operating systems and the like.  This kind of memory protection is
 //  useful for true multithreaded systems but useless in a single-threaded system and
-//  harmful in an interrupt-based multiprocess system.
-// #define SGIP_MULTITHREADED_THREADING_MODEL
+//  harmful in an interrupt-based multiprocess system.  This option requires the system to
+//  implement "void *sgIP_MutexCreate(void)", which returns a new recursive mutex, and
+//  "void sgIP_MutexLock(void *)" and "void sgIP_MutexUnlock(void *)".  One mutex protects the
+//  stack tables (records, ARP, memblocks), and every socket has a mutex for receiving and
+//  another one for sending, so that blocking calls in different threads don't interleave their
+//  data.  Socket mutexes must always be taken before the stack mutex.  Packet reception
+//  (sgIP_Hub_ReceiveHardwarePacket()) and sgIP_Timer() may be called from any thread.  The
+//  wait/notify functions of the interrupt model are required as well.  Define it in the build
+//  system (-DSGIP_MULTITHREADED_THREADING_MODEL) to use it, like the host build does.
 
 #define SGIP_LITTLEENDIAN
 
@@ -96,8 +110,21 @@ extern "C" {
 //  manually override this value.
 #define SGIP_IP_TTL 128
 
-// SGIP_TCPRECEIVEBUFFERLENGTH: The size (in bytes) of the receive FIFO in a TCP connection
+// SGIP_TCPRECEIVEBUFFERLENGTH: The initial size (in bytes) of the receive FIFO in a TCP
+//  connection. Unless the size is set with SO_RCVBUF, it grows up to SGIP_TCP_RECEIVEBUFFERMAX
+//  when the round-trip time and the rate of the incoming data require it, and it shrinks to
+//  SGIP_TCP_RECEIVEBUFFERMIN when the connection is idle for SGIP_TCP_RECEIVEIDLEMS.
 #define SGIP_TCP_RECEIVEBUFFERLENGTH 8192
+#define SGIP_TCP_RECEIVEBUFFERMIN    2048
+#define SGIP_TCP_RECEIVEBUFFERMAX    65536
+#define SGIP_TCP_RECEIVEIDLEMS       10000
+
+// SGIP_TCP_RECEIVEMEMORYPERCENT: The share of the heap (in percent) that the receive FIFOs of all
+//  TCP connections can use together. Buffers don't grow past this limit, new connections get the
+//  minimum size when it has been reached, and a single buffer can't grow past half of it. The size
+//  of the heap is given with sgIP_TCP_SetHeapSize(), and it is SGIP_TCP_HEAPSIZE until then.
+#define SGIP_TCP_RECEIVEMEMORYPERCENT 25
+#define SGIP_TCP_HEAPSIZE             (128 * 1024)
 
 // SGIP_TCPTRANSMITBUFFERLENGTH: The size (in bytes) of the transmit FIFO in a TCP connection
 #define SGIP_TCP_TRANSMITBUFFERLENGTH 8192
@@ -105,38 +132,122 @@ extern "C" {
 // SGIP_TCPOOBBUFFERLENGTH: The size (in bytes) of the receive OOB data FIFO in a TCP connection
 #define SGIP_TCP_OOBBUFFERLENGTH 256
 
+// SGIP_IGMP_MAXGROUPS: The maximum number of multicast groups joined at the same time by all
+//  sockets.
+// SGIP_UDP_MAXGROUPS: The maximum number of multicast groups joined by one UDP socket.
+#define SGIP_IGMP_MAXGROUPS 8
+#define SGIP_UDP_MAXGROUPS  4
+
 // SGIP_ARP_MAXENTRIES: The maximum number of cached ARP entries - this is defined staticly
 //  because it's somewhat impractical to dynamicly allocate memory for such a small structure
 //  (at least on most smaller systems)
 #define SGIP_ARP_MAXENTRIES 32
 
+// SGIP_ARP_HASHSIZE: Number of buckets of the hash table used to find ARP entries. It must be a
+//  power of two.
+// SGIP_ARP_MAXQUEUED: Max. number of frames that can wait for an address to be resolved. The
+//  oldest ones are dropped when more frames are sent to the same address. It fits all the
+//  fragments of the largest datagram that sgIP can reassemble (SGIP_IP_REASM_MAXFRAGS). A larger
+//  datagram sent to an address that isn't resolved yet loses its first fragments, so it's lost.
+#define SGIP_ARP_HASHSIZE  16
+#define SGIP_ARP_MAXQUEUED 16
+
+// SGIP_ARP_RETRYMS: Time between ARP requests of an address that hasn't been resolved. The
+//  entry is dropped after SGIP_ARP_MAXRETRIES requests without a reply.
+// SGIP_ARP_REACHABLEMS: Time after which a resolved address is confirmed with a new request if
+//  it's being used, or forgotten if it isn't.
+#define SGIP_ARP_RETRYMS     800
+#define SGIP_ARP_MAXRETRIES  15
+#define SGIP_ARP_REACHABLEMS (5 * 60 * 1000)
+
 // SGIP_HUB_MAXHWINTERFACES: The maximum number of hardware interfaces the sgIP hub will
 //  connect to. A hardware interface being some port (ethernet, wifi, etc) that will relay
-//  packets to the outside world.
-#define SGIP_HUB_MAXHWINTERFACES 1
+//  packets to the outside world.  The host build uses two of them to connect the stack to itself.
+#ifndef SGIP_HUB_MAXHWINTERFACES
+#    define SGIP_HUB_MAXHWINTERFACES 1
+#endif
 
 // SGIP_HUB_MAXPROTOCOLINTERFACES: The maximum number of protocol interfaces the sgIP hub will
 //  connect to. A protocol interface being a software handler for a certain protocol type
 //  (such as IP)
 #define SGIP_HUB_MAXPROTOCOLINTERFACES 1
 
+// SGIP_IP_PMTU_MAXENTRIES: The number of destinations for which a path MTU smaller than the MTU
+//  of the interface is remembered (RFC 1191 path MTU discovery). Entries are forgotten after
+//  SGIP_IP_PMTU_AGEMS so that larger packets are tried again in case the path has changed. The
+//  path MTU is never reduced below SGIP_IP_PMTU_MIN, whatever ICMP messages say.
+#define SGIP_IP_PMTU_MAXENTRIES 8
+#define SGIP_IP_PMTU_AGEMS      (10 * 60 * 1000)
+#define SGIP_IP_PMTU_MIN        576
+
+// SGIP_IP_REASM_MAXENTRIES: The number of fragmented datagrams that can be reassembled at the same
+//  time. Each one can have up to SGIP_IP_REASM_MAXFRAGS fragments, and the fragments of all of
+//  them can take up to SGIP_IP_REASM_MAXBYTES bytes. Every fragment counts as at least
+//  SGIP_MEMBLOCK_DATASIZE bytes, however small it is, so the limit fits one datagram with the max.
+//  number of fragments and part of another one. Datagrams that haven't been completed after
+//  SGIP_IP_REASM_TIMEOUTMS are dropped.
+#define SGIP_IP_REASM_MAXENTRIES 4
+#define SGIP_IP_REASM_MAXFRAGS   16
+#define SGIP_IP_REASM_MAXBYTES   (32 * 1024)
+#define SGIP_IP_REASM_TIMEOUTMS  15000
+
+// SGIP_PACING_BURSTMS: Sockets with a SO_MAX_PACING_RATE can send this many milliseconds worth of
+//  data in one go. It should match the period of sgIP_Timer(), which sends the paced data.
+#define SGIP_PACING_BURSTMS 50
+
 #define SGIP_TCP_FIRSTOUTGOINGPORT 40000
 #define SGIP_TCP_LASTOUTGOINGPORT  65000
 #define SGIP_UDP_FIRSTOUTGOINGPORT 40000
 #define SGIP_UDP_LASTOUTGOINGPORT  65000
 
+// SGIP_UDP_RECEIVEBUFFERLENGTH: Default SO_RCVBUF of UDP sockets. Queued datagrams are charged the
+//  size of the memblocks that hold them, so it also limits the number of queued datagrams.
+// SGIP_UDP_RECEIVEBUFFERMAX: Largest SO_RCVBUF allowed for UDP sockets.
+#define SGIP_UDP_RECEIVEBUFFERLENGTH (8 * SGIP_MEMBLOCK_DATASIZE)
+#define SGIP_UDP_RECEIVEBUFFERMAX    (64 * SGIP_MEMBLOCK_DATASIZE)
+
+// SGIP_UDP_HASHSIZE: Number of buckets of the tables used to find the socket of a received UDP
+//  datagram. It must be a power of two.
+#define SGIP_UDP_HASHSIZE 16
+
 #define SGIP_TCP_GENTIMEOUTMS       6000
 #define SGIP_TCP_TRANSMIT_DELAY     25
 #define SGIP_TCP_TRANSMIT_IMMTHRESH 40
 #define SGIP_TCP_TIMEMS_2MSL        1000 * 60 * 2
 #define SGIP_TCP_MAXRETRY           7
 #define SGIP_TCP_MAXSYNS            64
-#define SGIP_TCP_REACK_THRESH       1000
+#define SGIP_TCP_SWS_OVERRIDEMS     200
+#define SGIP_TCP_MAXWINDOW          65535 // there is no window scaling (RFC 7323)
+
+// SGIP_TCP_BLACKHOLE_RETRIES: Number of times a full sized segment is resent without getting an
+//  ACK before assuming that the "fragmentation needed" ICMP messages are being filtered, and
+//  reducing the path MTU anyway (RFC 4821, section 3).
+#define SGIP_TCP_BLACKHOLE_RETRIES 3
 
 #define SGIP_TCP_SYNRETRYMS 250
 #define SGIP_TCP_GENRETRYMS 500
 #define SGIP_TCP_BACKOFFMAX 6000
 
+#define SGIP_TCP_PERSISTMAXMS 60000
+
+// SGIP_TCP_ORPHANTIMEOUTMS: Connections closed by the application are reset if the other end stays
+//  silent for this long (for example, if it never sends its FIN).
+// SGIP_TCP_MAXTIMEWAIT: Max. number of closed connections kept in TIME_WAIT. The oldest ones are
+//  dropped early when there are more.
+#define SGIP_TCP_ORPHANTIMEOUTMS 60000
+#define SGIP_TCP_MAXTIMEWAIT     32
+
+// Default keepalive settings of sockets with SO_KEEPALIVE enabled (RFC 1122 section 4.2.3.6).
+#define SGIP_TCP_KEEPIDLEMS  (2 * 60 * 60 * 1000)
+#define SGIP_TCP_KEEPINTVLMS (75 * 1000)
+#define SGIP_TCP_KEEPCNT     9
+
+// SGIP_TCP_FASTOPEN_MAXCOOKIES: Number of servers whose TCP Fast Open cookie is remembered.
+#define SGIP_TCP_FASTOPEN_MAXCOOKIES 8
+// SGIP_TCP_FASTOPEN_KEYMS: Time after which the key of the cookies that we give to clients is
+// replaced. Cookies made with the previous key are accepted for the same time.
+#define SGIP_TCP_FASTOPEN_KEYMS (30 * 60 * 1000)
+
 #define SGIP_SOCKET_MAXSOCKETS 32
 
 // #define SGIP_SOCKET_DEFAULT_NONBLOCK			1
@@ -195,20 +306,79 @@ extern int sgIP_errno;
 
 //////////////////////////////////////////////////////////////////////////
 // External option-based dependencies
-#include <nds/interrupts.h>
 
+// Blocking calls wait on an event, which is the address of the record (TCP or UDP) that has to
+// make progress for the call to complete. SGIP_NOTIFYEVENT() is used whenever a record receives
+// data or changes state. Calls that wait on several records or that have a timeout wait on
+// SGIP_EVENT_ANY, which is notified on every timer tick. An implementation of the wait function
+// is allowed to return before the event is notified (the caller checks its condition again), and
+// it must return eventually even if no notification arrives, as the notification may happen right
+// before the caller starts waiting.
+#define SGIP_EVENT_ANY ((const void *)0)
+
+#if defined(SGIP_INTERRUPT_THREADING_MODEL) || defined(SGIP_MULTITHREADED_THREADING_MODEL)
+void sgIP_IntrWaitEvent(const void *event);
+void sgIP_IntrNotifyEvent(const void *event);
+#    define SGIP_WAITEVENT(event)   sgIP_IntrWaitEvent(event)
+#    define SGIP_NOTIFYEVENT(event) sgIP_IntrNotifyEvent(event)
+#else
+#    define SGIP_WAITEVENT(event) ;
+#    define SGIP_NOTIFYEVENT(event)
+#endif
+
+// SGIP_THREAD_PROTECT() is used at the entry points that are called from interrupt handlers in
+// the interrupt model (packet reception and the timer). They don't need any protection in that
+// model, but they can be called from any thread in the multithreaded model.
+//
+// SGIP_ATOMIC_INC() increments counters that are used without holding the stack lock.
+// SGIP_ATOMIC_LOAD() and SGIP_ATOMIC_STORE() read and write the indices of lock-free rings, and
+// they order the accesses to the ring contents with respect to them (acquire/release).
+//
+// SGIP_INTR_STATE is the state saved by SGIP_INTR_PROTECT() in the current function. Helpers that
+// release the lock while they wait take it as an "int tIME" argument, so that they can use
+// SGIP_INTR_UNPROTECT() and SGIP_INTR_REPROTECT() on the lock of their caller.
 #ifdef SGIP_INTERRUPT_THREADING_MODEL
-void sgIP_IntrWaitEvent(void);
+#    include <nds/interrupts.h>
 #    define SGIP_INTR_PROTECT()   int tIME = enterCriticalSection()
 #    define SGIP_INTR_REPROTECT() tIME = enterCriticalSection()
 #    define SGIP_INTR_UNPROTECT() leaveCriticalSection(tIME)
-#    define SGIP_WAITEVENT()      sgIP_IntrWaitEvent()
-#else // !SGIP_INTERRUPT_THREADING_MODEL
+#    define SGIP_INTR_STATE       tIME
+#    define SGIP_THREAD_PROTECT()
+#    define SGIP_THREAD_UNPROTECT()
+#    define SGIP_LOCK(mutex)
+#    define SGIP_UNLOCK(mutex)
+#    define SGIP_ATOMIC_INC(var)        ((var)++)
+#    define SGIP_ATOMIC_LOAD(var)       (var)
+#    define SGIP_ATOMIC_STORE(var, val) ((var) = (val))
+#elif defined(SGIP_MULTITHREADED_THREADING_MODEL)
+void *sgIP_MutexCreate(void);
+void sgIP_MutexLock(void *mutex);
+void sgIP_MutexUnlock(void *mutex);
+extern void *sgIP_stack_mutex;
+#    define SGIP_INTR_PROTECT()         sgIP_MutexLock(sgIP_stack_mutex)
+#    define SGIP_INTR_REPROTECT()       sgIP_MutexLock(sgIP_stack_mutex)
+#    define SGIP_INTR_UNPROTECT()       sgIP_MutexUnlock(sgIP_stack_mutex)
+#    define SGIP_INTR_STATE             0
+#    define SGIP_THREAD_PROTECT()       sgIP_MutexLock(sgIP_stack_mutex)
+#    define SGIP_THREAD_UNPROTECT()     sgIP_MutexUnlock(sgIP_stack_mutex)
+#    define SGIP_LOCK(mutex)            sgIP_MutexLock(mutex)
+#    define SGIP_UNLOCK(mutex)          sgIP_MutexUnlock(mutex)
+#    define SGIP_ATOMIC_INC(var)        __atomic_fetch_add(&(var), 1, __ATOMIC_RELAXED)
+#    define SGIP_ATOMIC_LOAD(var)       __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#    define SGIP_ATOMIC_STORE(var, val) __atomic_store_n(&(var), (val), __ATOMIC_RELEASE)
+#else // Single-threaded
 #    define SGIP_INTR_PROTECT()
 #    define SGIP_INTR_REPROTECT()
 #    define SGIP_INTR_UNPROTECT()
-#    define SGIP_WAITEVENT() ;
-#endif // SGIP_INTERRUPT_THREADING_MODEL
+#    define SGIP_INTR_STATE         0
+#    define SGIP_THREAD_PROTECT()
+#    define SGIP_THREAD_UNPROTECT()
+#    define SGIP_LOCK(mutex)
+#    define SGIP_UNLOCK(mutex)
+#    define SGIP_ATOMIC_INC(var)        ((var)++)
+#    define SGIP_ATOMIC_LOAD(var)       (var)
+#    define SGIP_ATOMIC_STORE(var, val) ((var) = (val))
+#endif
 
 #ifdef SGIP_DEBUG
 void sgIP_dbgprint(char *, ...);
@@ -24,13 +24,13 @@ typedef struct SGIP_DHCP_PACKET // yes, freaking big endian prevails here too.
     unsigned char htype;      // hardware address type
     unsigned char hlen;       // Hardware address length (should be 6, for ethernet/wifi)
     unsigned char hops;       // set to 0
-    unsigned long xid;        // 4-byte client specified transaction ID
+    uint32_t xid;             // 4-byte client specified transaction ID
     unsigned short secs;      // seconds elapsed since client started trying to boot
     unsigned short flags;     // flags
-    unsigned long ciaddr;     // client IP address, filled in by client if verifying previous params
-    unsigned long yiaddr;     // "your" (client) IP address
-    unsigned long siaddr;     // IP addr of next server to use in bootstrap.
-    unsigned long giaddr;     // Relay agent IP address
+    uint32_t ciaddr;          // client IP address, filled in by client if verifying previous params
+    uint32_t yiaddr;          // "your" (client) IP address
+    uint32_t siaddr;          // IP addr of next server to use in bootstrap.
+    uint32_t giaddr;          // Relay agent IP address
     unsigned char chaddr[16]; // client hardware address
     char sname[64];           // optional server hostname (null terminated string)
     char file[128];           // boot file name, null terminated string
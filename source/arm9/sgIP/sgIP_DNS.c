@@ -459,7 +459,7 @@ dns_listenonly:
                 if (dtime > SGIP_DNS_TIMEOUTMS)
                     break;
                 SGIP_INTR_UNPROTECT();
-                SGIP_WAITEVENT();
+                SGIP_WAITEVENT(SGIP_EVENT_ANY);
                 SGIP_INTR_REPROTECT();
             } while (1);
 
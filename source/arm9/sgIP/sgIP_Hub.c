@@ -5,9 +5,11 @@
 // DSWifi Project - sgIP Internet Protocol Stack Implementation
 
 #include <stddef.h>
+#include <string.h>
 
 #include "arm9/sgIP/sgIP_ARP.h"
 #include "arm9/sgIP/sgIP_Hub.h"
+#include "arm9/sgIP/sgIP_IP.h"
 
 //////////////////////////////////////////////////////////////////////////
 // Global vars
@@ -17,9 +19,70 @@ int NumProtocolInterfaces;
 sgIP_Hub_Protocol ProtocolInterfaces[SGIP_HUB_MAXPROTOCOLINTERFACES];
 sgIP_Hub_HWInterface HWInterfaces[SGIP_HUB_MAXHWINTERFACES];
 
+extern volatile unsigned long sgIP_timems;
+
+static int batch_depth; // number of nested calls to sgIP_Hub_BatchBegin()
+
+// Packet capture ring. It is split in fixed-size slots, each one holding a pcap record header
+// followed by up to "snaplen" bytes of the frame. Slots are written by the stack (the only
+// producer, as all callers hold the stack lock or run in interrupt context) and read by the
+// application without any lock: "head" is only modified by the producer and "tail" only by the
+// consumer. Both are free-running counters.
+typedef struct SGIP_HUB_CAPTURE
+{
+    unsigned char *buffer; // NULL if capture is disabled
+    int slotsize;
+    int numslots;
+    int snaplen;
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    volatile unsigned int dropped;
+} sgIP_Hub_Capture;
+
+static sgIP_Hub_Capture capture;
+
+// Makes sure that the compiler doesn't reorder the accesses to the ring contents and the ring
+// indices. The DS only has one CPU core that can access the ring, so this is enough. In the
+// multithreaded model the producer and the consumer may run in different cores, and the atomic
+// accesses to the indices order the accesses to the slots.
+#define CAPTURE_BARRIER() __asm__ volatile("" ::: "memory")
+
 //////////////////////////////////////////////////////////////////////////
 // Private functions
 
+static sgIP_Hub_CaptureRecord *sgIP_Hub_CaptureSlot(unsigned int index)
+{
+    return (sgIP_Hub_CaptureRecord *)(capture.buffer
+                                      + (index % capture.numslots) * capture.slotsize);
+}
+
+static void sgIP_Hub_CapturePacket(sgIP_memblock *packet)
+{
+    unsigned int head = capture.head;
+
+    if (head - SGIP_ATOMIC_LOAD(capture.tail) >= (unsigned int)capture.numslots)
+    {
+        SGIP_ATOMIC_INC(capture.dropped);
+        return;
+    }
+
+    sgIP_Hub_CaptureRecord *rec = sgIP_Hub_CaptureSlot(head);
+
+    int len = packet->totallength;
+    if (len > capture.snaplen)
+        len = capture.snaplen;
+
+    unsigned long time = sgIP_timems;
+
+    rec->ts_sec   = time / 1000;
+    rec->ts_usec  = (time % 1000) * 1000;
+    rec->incl_len = sgIP_memblock_CopyToLinear(packet, rec + 1, 0, len);
+    rec->orig_len = packet->totallength;
+
+    CAPTURE_BARRIER();
+    SGIP_ATOMIC_STORE(capture.head, head + 1);
+}
+
 //////////////////////////////////////////////////////////////////////////
 // Public functions
 
@@ -27,6 +90,7 @@ void sgIP_Hub_Init(void)
 {
     NumHWInterfaces       = 0;
     NumProtocolInterfaces = 0;
+    batch_depth           = 0;
 }
 
 sgIP_Hub_Protocol *sgIP_Hub_AddProtocolInterface(int protocolID,
@@ -72,6 +136,7 @@ sgIP_Hub_HWInterface *sgIP_Hub_AddHardwareInterface(int (*TransmitFunction)(sgIP
 
     HWInterfaces[n].flags            = SGIP_FLAG_HWINTERFACE_IN_USE | SGIP_FLAG_HWINTERFACE_ENABLED;
     HWInterfaces[n].TransmitFunction = TransmitFunction;
+    HWInterfaces[n].FlushFunction    = NULL;
 
     if (InterfaceInit)
         InterfaceInit(HWInterfaces + n);
@@ -115,6 +180,11 @@ int sgIP_Hub_ReceiveHardwarePacket(sgIP_Hub_HWInterface *hw, sgIP_memblock *pack
     if (!hw || !packet)
         return 0;
 
+    SGIP_THREAD_PROTECT();
+
+    if (capture.buffer)
+        sgIP_Hub_CapturePacket(packet);
+
     if (hw->flags & SGIP_FLAG_HWINTERFACE_ENABLED)
     {
         int n;
@@ -126,6 +196,7 @@ int sgIP_Hub_ReceiveHardwarePacket(sgIP_Hub_HWInterface *hw, sgIP_memblock *pack
         {
             // arp
             sgIP_ARP_ProcessARPFrame(hw, packet);
+            SGIP_THREAD_UNPROTECT();
             return 0;
         }
         if (protocol == PROTOCOL_ETHER_IP)
@@ -141,12 +212,15 @@ int sgIP_Hub_ReceiveHardwarePacket(sgIP_Hub_HWInterface *hw, sgIP_memblock *pack
                 && ProtocolInterfaces[n].protocol == protocol)
             {
                 // this protocol handler
-                return ProtocolInterfaces[n].ReceivePacket(packet);
+                int retval = ProtocolInterfaces[n].ReceivePacket(packet);
+                SGIP_THREAD_UNPROTECT();
+                return retval;
             }
         }
     }
     // hrmm, packet is unhandled. Ignore it for now.
     sgIP_memblock_free(packet);
+    SGIP_THREAD_UNPROTECT();
     return 0;
 }
 
@@ -158,33 +232,64 @@ int sgIP_Hub_SendProtocolPacket(int protocol, sgIP_memblock *packet, unsigned lo
     if (!packet)
         return 0;
 
-    sgIP_Hub_HWInterface *hw = NULL;
-
     // figure out what hardware interface is in use.
-    for (int i = 0; i < SGIP_HUB_MAXHWINTERFACES; i++)
-    {
-        if (HWInterfaces[i].ipaddr == src_address)
-        {
-            hw = HWInterfaces + i;
-            break;
-        }
-    }
-
+    sgIP_Hub_HWInterface *hw = sgIP_Hub_FindInterface(src_address);
     if (!hw)
     {
         sgIP_memblock_free(packet);
         return 0;
     }
+
     // resolve protocol address to hardware address & send packet
-    if ((src_address & hw->snmask) == (dest_address & hw->snmask) // on same network
-        || dest_address == 0xFFFFFFFF) // or broadcast address, send directly.
+    return sgIP_ARP_SendProtocolFrame(hw, packet, protocol, sgIP_Hub_NextHop(hw, dest_address));
+}
+
+void sgIP_Hub_BatchBegin(void)
+{
+    SGIP_INTR_PROTECT();
+    batch_depth++;
+    SGIP_INTR_UNPROTECT();
+}
+
+void sgIP_Hub_BatchEnd(void)
+{
+    SGIP_INTR_PROTECT();
+    if (batch_depth > 0 && --batch_depth == 0)
     {
-        return sgIP_ARP_SendProtocolFrame(hw, packet, protocol, dest_address);
+        for (int n = 0; n < SGIP_HUB_MAXHWINTERFACES; n++)
+        {
+            if ((HWInterfaces[n].flags & SGIP_FLAG_HWINTERFACE_IN_USE)
+                && HWInterfaces[n].FlushFunction)
+                HWInterfaces[n].FlushFunction(HWInterfaces + n);
+        }
     }
-    else
-    { // eek, on different network. Send to gateway
-        return sgIP_ARP_SendProtocolFrame(hw, packet, protocol, hw->gateway);
+    SGIP_INTR_UNPROTECT();
+}
+
+int sgIP_Hub_InBatch(void)
+{
+    return batch_depth > 0;
+}
+
+sgIP_Hub_HWInterface *sgIP_Hub_FindInterface(unsigned long ipaddr)
+{
+    for (int i = 0; i < SGIP_HUB_MAXHWINTERFACES; i++)
+    {
+        if (HWInterfaces[i].ipaddr == ipaddr)
+            return HWInterfaces + i;
     }
+    return NULL;
+}
+
+unsigned long sgIP_Hub_NextHop(sgIP_Hub_HWInterface *hw, unsigned long dest_address)
+{
+    // on same network, or broadcast or multicast address: send directly.
+    if ((hw->ipaddr & hw->snmask) == (dest_address & hw->snmask) || dest_address == 0xFFFFFFFF
+        || SGIP_IP_IS_MULTICAST(dest_address))
+        return dest_address;
+
+    // eek, on different network. Send to gateway
+    return hw->gateway;
 }
 
 // send packet on a hardware interface.
@@ -194,7 +299,12 @@ int sgIP_Hub_SendRawPacket(sgIP_Hub_HWInterface *hw, sgIP_memblock *packet)
         return 0;
 
     if (hw->flags & SGIP_FLAG_HWINTERFACE_ENABLED)
+    {
+        if (capture.buffer)
+            sgIP_Hub_CapturePacket(packet);
+
         return hw->TransmitFunction(hw, packet);
+    }
 
     sgIP_memblock_free(packet);
     return 0;
@@ -202,9 +312,22 @@ int sgIP_Hub_SendRawPacket(sgIP_Hub_HWInterface *hw, sgIP_memblock *packet)
 
 int sgIP_Hub_IPMaxMessageSize(unsigned long ipaddr)
 {
-    (void)ipaddr;
+    int mtu = SGIP_MTU_OVERRIDE;
+
+    // Use the MTU of the interface that packets to this address are sent from.
+    unsigned long srcip = sgIP_Hub_GetCompatibleIP(ipaddr);
+    for (int n = 0; n < SGIP_HUB_MAXHWINTERFACES; n++)
+    {
+        if ((HWInterfaces[n].flags & SGIP_FLAG_HWINTERFACE_IN_USE)
+            && HWInterfaces[n].ipaddr == srcip)
+        {
+            if (HWInterfaces[n].MTU > 0 && HWInterfaces[n].MTU < mtu)
+                mtu = HWInterfaces[n].MTU;
+            break;
+        }
+    }
 
-    return SGIP_MTU_OVERRIDE; // hack - make this more accurate soon!
+    return mtu;
 }
 
 unsigned long sgIP_Hub_GetCompatibleIP(unsigned long destIP)
@@ -240,6 +363,72 @@ sgIP_Hub_HWInterface *sgIP_Hub_GetDefaultInterface(void)
     return 0;
 }
 
+int sgIP_Hub_CaptureStart(void *buffer, int size, int snaplen)
+{
+    if (!buffer || snaplen <= 0)
+        return SGIP_ERROR(EINVAL);
+
+    int slotsize = (sizeof(sgIP_Hub_CaptureRecord) + snaplen + 3) & ~3;
+    if (size < slotsize)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+
+    capture.slotsize = slotsize;
+    capture.numslots = size / slotsize;
+    capture.snaplen  = snaplen;
+    capture.head     = 0;
+    capture.tail     = 0;
+    capture.dropped  = 0;
+    capture.buffer   = buffer;
+
+    SGIP_INTR_UNPROTECT();
+    return 0;
+}
+
+void sgIP_Hub_CaptureStop(void)
+{
+    SGIP_INTR_PROTECT();
+    capture.buffer = NULL;
+    SGIP_INTR_UNPROTECT();
+}
+
+int sgIP_Hub_CaptureRead(void *dest, int size)
+{
+    unsigned char *out = dest;
+    int copied         = 0;
+
+    if (!capture.buffer || !dest)
+        return 0;
+
+    unsigned int tail = capture.tail;
+
+    while (tail != SGIP_ATOMIC_LOAD(capture.head))
+    {
+        CAPTURE_BARRIER();
+
+        sgIP_Hub_CaptureRecord *rec = sgIP_Hub_CaptureSlot(tail);
+
+        int len = sizeof(sgIP_Hub_CaptureRecord) + rec->incl_len;
+        if (copied + len > size)
+            break;
+
+        memcpy(out + copied, rec, len);
+        copied += len;
+
+        tail++;
+        CAPTURE_BARRIER();
+        SGIP_ATOMIC_STORE(capture.tail, tail);
+    }
+
+    return copied;
+}
+
+unsigned int sgIP_Hub_CaptureDropped(void)
+{
+    return SGIP_ATOMIC_LOAD(capture.dropped);
+}
+
 #ifdef SGIP_LITTLEENDIAN
 unsigned short htons(unsigned short num)
 {
@@ -247,7 +436,9 @@ unsigned short htons(unsigned short num)
 }
 unsigned long htonl(unsigned long num)
 {
-    return (num << 24) | ((num & 0xFF00) << 8) | ((num & 0xFF0000) >> 8) | (num >> 24);
+    // Only the low 32 bits are swapped, in case unsigned long is bigger than that.
+    return ((num & 0xFF) << 24) | ((num & 0xFF00) << 8) | ((num & 0xFF0000) >> 8)
+           | ((num >> 24) & 0xFF);
 }
 #else
 unsigned short htons(unsigned short num)
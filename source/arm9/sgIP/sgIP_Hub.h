@@ -47,11 +47,22 @@ typedef struct SGIP_HUB_HWINTERFACE
     unsigned short hwaddrlen;
     int MTU;
     int (*TransmitFunction)(struct SGIP_HUB_HWINTERFACE *, sgIP_memblock *);
+    void (*FlushFunction)(struct SGIP_HUB_HWINTERFACE *); // optional, see sgIP_Hub_BatchEnd()
     void *userdata;
     unsigned long ipaddr, gateway, snmask, dns[3];
     unsigned char hwaddr[SGIP_MAXHWADDRLEN];
 } sgIP_Hub_HWInterface;
 
+// Header of each captured frame, in the format used by pcap files. It is followed by incl_len
+// bytes of the frame.
+typedef struct SGIP_HUB_CAPTURERECORD
+{
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len; // bytes of the frame stored in the capture
+    uint32_t orig_len; // real length of the frame
+} sgIP_Hub_CaptureRecord;
+
 typedef struct SGIP_HEADER_ETHERNET
 {
     unsigned char dest_mac[6];
@@ -67,6 +78,11 @@ void sgIP_Hub_Init(void);
 sgIP_Hub_Protocol *sgIP_Hub_AddProtocolInterface(int protocolID,
                                                  int (*ReceivePacket)(sgIP_memblock *),
                                                  int (*InterfaceInit)(sgIP_Hub_Protocol *));
+// Hardware interfaces exchange Ethernet frames with the stack. TransmitFunction() takes ownership
+// of the memblock chain it receives and must free it with sgIP_memblock_free(). Received frames
+// are passed to sgIP_Hub_ReceiveHardwarePacket() in a memblock that the stack will free. The
+// InterfaceInit() callback is expected to set the hardware address, its length and the MTU. The
+// owner of the interface must also call sgIP_Timer() periodically.
 sgIP_Hub_HWInterface *sgIP_Hub_AddHardwareInterface(int (*TransmitFunction)(sgIP_Hub_HWInterface *,
                                                                             sgIP_memblock *),
                                                     int (*InterfaceInit)(sgIP_Hub_HWInterface *));
@@ -78,11 +94,33 @@ int sgIP_Hub_SendProtocolPacket(int protocol, sgIP_memblock *packet, unsigned lo
                                 unsigned long src_address);
 int sgIP_Hub_SendRawPacket(sgIP_Hub_HWInterface *hw, sgIP_memblock *packet);
 
+// Frames sent between sgIP_Hub_BatchBegin() and sgIP_Hub_BatchEnd() are part of a batch. Hardware
+// interfaces may delay the work that they do for every frame (like notifying the hardware) while
+// sgIP_Hub_InBatch() returns 1, and do it once for the whole batch in FlushFunction(), which is
+// called by sgIP_Hub_BatchEnd(). Batches can be nested.
+void sgIP_Hub_BatchBegin(void);
+void sgIP_Hub_BatchEnd(void);
+int sgIP_Hub_InBatch(void);
+
+// Returns the hardware interface with the given address, or NULL.
+sgIP_Hub_HWInterface *sgIP_Hub_FindInterface(unsigned long ipaddr);
+// Returns the address that packets to dest_address are sent to from hw: the destination itself if
+// it's in the same network or a broadcast or multicast address, or the gateway otherwise.
+unsigned long sgIP_Hub_NextHop(sgIP_Hub_HWInterface *hw, unsigned long dest_address);
+
 int sgIP_Hub_IPMaxMessageSize(unsigned long ipaddr);
 unsigned long sgIP_Hub_GetCompatibleIP(unsigned long destIP);
 
 sgIP_Hub_HWInterface *sgIP_Hub_GetDefaultInterface(void);
 
+// Capture of all frames received and sent by hardware interfaces. The buffer is provided by the
+// caller and it must remain valid until capture is stopped. sgIP_Hub_CaptureRead() copies as many
+// whole records as fit in the destination buffer and returns the number of bytes copied.
+int sgIP_Hub_CaptureStart(void *buffer, int size, int snaplen);
+void sgIP_Hub_CaptureStop(void);
+int sgIP_Hub_CaptureRead(void *dest, int size);
+unsigned int sgIP_Hub_CaptureDropped(void);
+
 unsigned short htons(unsigned short num);
 unsigned long htonl(unsigned long num);
 
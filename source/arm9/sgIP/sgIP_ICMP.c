@@ -7,11 +7,61 @@
 #include "arm9/sgIP/sgIP_Hub.h"
 #include "arm9/sgIP/sgIP_ICMP.h"
 #include "arm9/sgIP/sgIP_IP.h"
+#include "arm9/sgIP/sgIP_TCP.h"
+#include "arm9/sgIP/sgIP_UDP.h"
 
 void sgIP_ICMP_Init(void)
 {
 }
 
+// Destination unreachable (RFC 792). The message carries the IP header and the first 8 bytes of
+// the packet that couldn't be delivered, which identify the connection that sent it.
+static void sgIP_ICMP_DestinationUnreachable(sgIP_memblock *mb)
+{
+    sgIP_Header_ICMP *icmp = (sgIP_Header_ICMP *)mb->datastart;
+    if (mb->thislength < 8 + 20 + 8)
+        return;
+
+    sgIP_Header_IP *iphdr = (sgIP_Header_IP *)(mb->datastart + 8);
+    int hdrlen            = (iphdr->version_ihl & 15) * 4;
+    if ((iphdr->version_ihl >> 4) != 4 || hdrlen < 20 || mb->thislength < 8 + hdrlen + 8)
+        return;
+
+    char *payload = mb->datastart + 8 + hdrlen;
+
+    if (icmp->code == 4)
+    {
+        // Fragmentation needed and DF set (RFC 1191 section 4). The next hop MTU is in the low 16
+        // bits of the rest of the ICMP header. It's 0 if the router predates RFC 1191.
+        int mtu = htons(((unsigned short *)&icmp->xtra)[1]);
+
+        if (iphdr->protocol == PROTOCOL_IP_TCP)
+        {
+            sgIP_Header_TCP *tcp = (sgIP_Header_TCP *)payload;
+            sgIP_TCP_FragmentationNeeded(iphdr->src_address, iphdr->dest_address, tcp->srcport,
+                                         tcp->destport, htonl(tcp->seqnum), mtu);
+        }
+        return;
+    }
+
+    // Protocol or port unreachable come from the destination itself: nobody is listening there.
+    // Anything else means that the destination couldn't be reached.
+    int error = (icmp->code == 2 || icmp->code == 3) ? ECONNREFUSED : EHOSTUNREACH;
+
+    if (iphdr->protocol == PROTOCOL_IP_TCP)
+    {
+        sgIP_Header_TCP *tcp = (sgIP_Header_TCP *)payload;
+        sgIP_TCP_Unreachable(iphdr->src_address, iphdr->dest_address, tcp->srcport,
+                             tcp->destport, htonl(tcp->seqnum), error);
+    }
+    else if (iphdr->protocol == PROTOCOL_IP_UDP)
+    {
+        sgIP_Header_UDP *udp = (sgIP_Header_UDP *)payload;
+        sgIP_UDP_Unreachable(iphdr->src_address, iphdr->dest_address, udp->srcport,
+                             udp->destport, error);
+    }
+}
+
 int sgIP_ICMP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long destip)
 {
     if (!mb)
@@ -28,6 +78,9 @@ int sgIP_ICMP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned lon
     switch (icmp->type)
     {
         case 8: // echo request
+            // Replies to a multicast request would all arrive at the same time. Ignore them.
+            if (SGIP_IP_IS_MULTICAST(destip))
+                break;
             // change to echo reply
             icmp->type = 0;
             // mod checksum
@@ -35,6 +88,10 @@ int sgIP_ICMP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned lon
             icmp->checksum = ~sgIP_memblock_IPChecksum(mb, 0, mb->totallength);
             return sgIP_IP_SendViaIP(mb, PROTOCOL_IP_ICMP, destip, srcip);
 
+        case 3: // destination unreachable
+            sgIP_ICMP_DestinationUnreachable(mb);
+            break;
+
         case 0:  // echo reply (ignore for now)
         default: // others (ignore for now)
             break;
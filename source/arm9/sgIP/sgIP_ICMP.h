@@ -18,7 +18,7 @@ typedef struct SGIP_HEADER_ICMP
 {
     unsigned char type, code;
     unsigned short checksum;
-    unsigned long xtra;
+    uint32_t xtra;
 } sgIP_Header_ICMP;
 
 void sgIP_ICMP_Init(void);
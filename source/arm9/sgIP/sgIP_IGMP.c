@@ -0,0 +1,290 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - sgIP Internet Protocol Stack Implementation
+
+// IGMPv2 host side (RFC 2236). It tells multicast routers which groups have members in this
+// network. Queries of IGMPv3 routers are answered with IGMPv2 reports, which they understand.
+
+#include <stddef.h>
+
+#include "arm9/sgIP/sgIP_Hub.h"
+#include "arm9/sgIP/sgIP_IGMP.h"
+#include "arm9/sgIP/sgIP_IP.h"
+
+#define IGMP_TYPE_QUERY     0x11
+#define IGMP_TYPE_V1_REPORT 0x12
+#define IGMP_TYPE_V2_REPORT 0x16
+#define IGMP_TYPE_LEAVE     0x17
+
+// Groups in host byte order
+#define IGMP_ALL_HOSTS   0xE0000001 // 224.0.0.1
+#define IGMP_ALL_ROUTERS 0xE0000002 // 224.0.0.2
+
+#define IGMP_UNSOLICITED_REPORT_MS 10000  // delay of the repeated report sent when joining
+#define IGMP_V1_QUERY_RESPONSE_MS  10000  // IGMPv1 queries don't have a maximum response time
+#define IGMP_V1_ROUTER_PRESENT_MS  400000 // time that we behave as IGMPv1 hosts after a v1 query
+
+// users == 0 marks free entries
+typedef struct SGIP_IGMP_GROUP
+{
+    unsigned long group;
+    int users;         // sockets that have joined the group
+    int timer;         // milliseconds left to send a report, or 0 if none is pending
+    int last_reporter; // we sent the last report, so we have to send a leave message
+} sgIP_IGMP_Group;
+
+static sgIP_IGMP_Group igmp_groups[SGIP_IGMP_MAXGROUPS];
+static int igmp_v1_router;                // an IGMPv1 router has been seen
+static unsigned long igmp_v1_router_time; // time of the last IGMPv1 query
+static unsigned long igmp_random;
+
+extern volatile unsigned long sgIP_timems;
+
+void sgIP_IGMP_Init(void)
+{
+    for (int i = 0; i < SGIP_IGMP_MAXGROUPS; i++)
+    {
+        igmp_groups[i].users = 0;
+        igmp_groups[i].timer = 0;
+    }
+    igmp_v1_router = 0;
+    igmp_random    = sgIP_timems;
+}
+
+// Reports are delayed by a random time so that the members of a group don't answer a query at the
+// same time. Only the first one is sent, the others are suppressed when they see it.
+static int sgIP_IGMP_RandomDelay(int max_ms)
+{
+    igmp_random = igmp_random * 1103515245 + 12345 + sgIP_timems;
+    return 1 + (igmp_random >> 8) % max_ms;
+}
+
+static int sgIP_IGMP_V1Router(void)
+{
+    return igmp_v1_router && sgIP_timems - igmp_v1_router_time < IGMP_V1_ROUTER_PRESENT_MS;
+}
+
+// Returns 0 if the message can't be sent, like when the interface doesn't have an address yet.
+static int sgIP_IGMP_Send(int type, unsigned long group, unsigned long destip)
+{
+    // Router Alert option (RFC 2113), so that routers look at messages that aren't sent to them.
+    static const unsigned char router_alert[4] = { 0x94, 0x04, 0x00, 0x00 };
+
+    sgIP_Hub_HWInterface *hw = sgIP_Hub_GetDefaultInterface();
+    if (!hw || hw->ipaddr == 0)
+        return 0;
+
+    int hdrlen        = sgIP_IP_RequiredHeaderSize() + sizeof(router_alert);
+    sgIP_memblock *mb = sgIP_memblock_alloc(hdrlen + sizeof(sgIP_Header_IGMP));
+    if (!mb)
+        return 0;
+    sgIP_memblock_exposeheader(mb, -hdrlen);
+
+    sgIP_Header_IGMP *igmp = (sgIP_Header_IGMP *)mb->datastart;
+    igmp->type             = type;
+    igmp->max_resp_time    = 0;
+    igmp->checksum         = 0;
+    igmp->group            = group;
+    igmp->checksum         = ~sgIP_memblock_IPChecksum(mb, 0, mb->totallength);
+
+    sgIP_IP_SendViaIPOptions(mb, PROTOCOL_IP_IGMP, hw->ipaddr, destip, 1, router_alert,
+                             sizeof(router_alert));
+    return 1;
+}
+
+static void sgIP_IGMP_Report(sgIP_IGMP_Group *g)
+{
+    int type = sgIP_IGMP_V1Router() ? IGMP_TYPE_V1_REPORT : IGMP_TYPE_V2_REPORT;
+    if (sgIP_IGMP_Send(type, g->group, g->group))
+        g->last_reporter = 1;
+}
+
+void sgIP_IGMP_Timer100ms(void)
+{
+    for (int i = 0; i < SGIP_IGMP_MAXGROUPS; i++)
+    {
+        sgIP_IGMP_Group *g = &igmp_groups[i];
+        if (g->users == 0 || g->timer == 0)
+            continue;
+
+        g->timer -= 100;
+        if (g->timer <= 0)
+        {
+            g->timer = 0;
+            sgIP_IGMP_Report(g);
+        }
+    }
+}
+
+int sgIP_IGMP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long destip)
+{
+    (void)srcip;
+    (void)destip;
+
+    if (!mb)
+        return 0;
+
+    sgIP_Header_IGMP *igmp = (sgIP_Header_IGMP *)mb->datastart;
+    if (mb->totallength < (int)sizeof(sgIP_Header_IGMP)
+        || sgIP_memblock_IPChecksum(mb, 0, mb->totallength) != 0xFFFF)
+    {
+        SGIP_DEBUG_MESSAGE(("IGMP receive checksum incorrect"));
+        sgIP_memblock_free(mb);
+        return 0;
+    }
+
+    switch (igmp->type)
+    {
+        case IGMP_TYPE_QUERY:
+        {
+            int max_ms = igmp->max_resp_time * 100;
+            if (max_ms == 0)
+            {
+                max_ms              = IGMP_V1_QUERY_RESPONSE_MS;
+                igmp_v1_router      = 1;
+                igmp_v1_router_time = sgIP_timems;
+            }
+
+            // General queries (group 0) ask about all groups
+            for (int i = 0; i < SGIP_IGMP_MAXGROUPS; i++)
+            {
+                sgIP_IGMP_Group *g = &igmp_groups[i];
+                if (g->users == 0 || (igmp->group != 0 && igmp->group != g->group))
+                    continue;
+                if (g->timer == 0 || g->timer > max_ms)
+                    g->timer = sgIP_IGMP_RandomDelay(max_ms);
+            }
+            break;
+        }
+        case IGMP_TYPE_V1_REPORT:
+        case IGMP_TYPE_V2_REPORT:
+            // Another member has reported the group, so we don't need to
+            for (int i = 0; i < SGIP_IGMP_MAXGROUPS; i++)
+            {
+                sgIP_IGMP_Group *g = &igmp_groups[i];
+                if (g->users != 0 && g->group == igmp->group)
+                {
+                    g->timer         = 0;
+                    g->last_reporter = 0;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+    sgIP_memblock_free(mb);
+    return 0;
+}
+
+int sgIP_IGMP_Join(unsigned long group)
+{
+    if (!SGIP_IP_IS_MULTICAST(group))
+        return SGIP_ERROR(EINVAL);
+    if (htonl(group) == IGMP_ALL_HOSTS)
+        return 0;
+
+    SGIP_INTR_PROTECT();
+
+    sgIP_IGMP_Group *free_entry = NULL;
+    for (int i = 0; i < SGIP_IGMP_MAXGROUPS; i++)
+    {
+        sgIP_IGMP_Group *g = &igmp_groups[i];
+        if (g->users != 0 && g->group == group)
+        {
+            g->users++;
+            SGIP_INTR_UNPROTECT();
+            return 0;
+        }
+        if (g->users == 0 && !free_entry)
+            free_entry = g;
+    }
+
+    if (!free_entry)
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(ENOBUFS);
+    }
+
+    // Report the new membership right away, and repeat it in case the first report is lost
+    free_entry->group = group;
+    free_entry->users = 1;
+    sgIP_IGMP_Report(free_entry);
+    free_entry->timer = sgIP_IGMP_RandomDelay(IGMP_UNSOLICITED_REPORT_MS);
+
+    SGIP_INTR_UNPROTECT();
+    return 0;
+}
+
+void sgIP_IGMP_ReportAll(void)
+{
+    SGIP_INTR_PROTECT();
+
+    // Like when joining: report right away, and repeat it in case the first report is lost
+    for (int i = 0; i < SGIP_IGMP_MAXGROUPS; i++)
+    {
+        sgIP_IGMP_Group *g = &igmp_groups[i];
+        if (g->users == 0)
+            continue;
+        sgIP_IGMP_Report(g);
+        g->timer = sgIP_IGMP_RandomDelay(IGMP_UNSOLICITED_REPORT_MS);
+    }
+
+    SGIP_INTR_UNPROTECT();
+}
+
+void sgIP_IGMP_Leave(unsigned long group)
+{
+    SGIP_INTR_PROTECT();
+
+    for (int i = 0; i < SGIP_IGMP_MAXGROUPS; i++)
+    {
+        sgIP_IGMP_Group *g = &igmp_groups[i];
+        if (g->users == 0 || g->group != group)
+            continue;
+
+        if (--g->users == 0)
+        {
+            // IGMPv1 routers don't understand leave messages, they wait until nobody reports it.
+            if (g->last_reporter && !sgIP_IGMP_V1Router())
+                sgIP_IGMP_Send(IGMP_TYPE_LEAVE, group, htonl(IGMP_ALL_ROUTERS));
+            g->timer = 0;
+        }
+        break;
+    }
+
+    SGIP_INTR_UNPROTECT();
+}
+
+int sgIP_IGMP_IsMember(unsigned long group)
+{
+    if (htonl(group) == IGMP_ALL_HOSTS)
+        return 1;
+
+    for (int i = 0; i < SGIP_IGMP_MAXGROUPS; i++)
+    {
+        if (igmp_groups[i].users != 0 && igmp_groups[i].group == group)
+            return 1;
+    }
+    return 0;
+}
+
+int sgIP_IGMP_IsMemberMAC(const unsigned char *mac)
+{
+    if (mac[0] != 0x01 || mac[1] != 0x00 || mac[2] != 0x5E || (mac[3] & 0x80))
+        return 0;
+
+    // Only the low 23 bits of the group are part of the MAC address, so several groups share it.
+    unsigned long low_bits = (mac[3] << 16) | (mac[4] << 8) | mac[5];
+    if (low_bits == (IGMP_ALL_HOSTS & 0x7FFFFF))
+        return 1;
+
+    for (int i = 0; i < SGIP_IGMP_MAXGROUPS; i++)
+    {
+        if (igmp_groups[i].users != 0 && (htonl(igmp_groups[i].group) & 0x7FFFFF) == low_bits)
+            return 1;
+    }
+    return 0;
+}
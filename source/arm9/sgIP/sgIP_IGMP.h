@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - sgIP Internet Protocol Stack Implementation
+
+#ifndef SGIP_IGMP_H
+#define SGIP_IGMP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "arm9/sgIP/sgIP_Config.h"
+#include "arm9/sgIP/sgIP_memblock.h"
+
+typedef struct SGIP_HEADER_IGMP
+{
+    unsigned char type;
+    unsigned char max_resp_time; // in tenths of a second
+    unsigned short checksum;
+    uint32_t group;
+} sgIP_Header_IGMP;
+
+void sgIP_IGMP_Init(void);
+void sgIP_IGMP_Timer100ms(void);
+
+int sgIP_IGMP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long destip);
+
+// Memberships are counted, so a group is only left when every user has left it. Join returns 0 on
+// success, or -1 if too many groups have been joined. Groups are in network byte order.
+int sgIP_IGMP_Join(unsigned long group);
+void sgIP_IGMP_Leave(unsigned long group);
+
+// Reports all the joined groups again. Groups joined before the interface had an address haven't
+// been reported, and switches and access points that snoop IGMP only forward the groups that have
+// been reported in their network. It's called when the address of the interface is announced.
+void sgIP_IGMP_ReportAll(void);
+
+// Returns 1 if datagrams sent to the multicast address or to the multicast MAC address have to be
+// received. The all-hosts group 224.0.0.1 is always joined.
+int sgIP_IGMP_IsMember(unsigned long group);
+int sgIP_IGMP_IsMemberMAC(const unsigned char *mac);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
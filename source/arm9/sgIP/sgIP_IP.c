@@ -4,13 +4,276 @@
 
 // DSWifi Project - sgIP Internet Protocol Stack Implementation
 
+#include <string.h>
+
+#include "arm9/sgIP/sgIP_ARP.h"
 #include "arm9/sgIP/sgIP_Hub.h"
 #include "arm9/sgIP/sgIP_ICMP.h"
+#include "arm9/sgIP/sgIP_IGMP.h"
 #include "arm9/sgIP/sgIP_IP.h"
 #include "arm9/sgIP/sgIP_TCP.h"
 #include "arm9/sgIP/sgIP_UDP.h"
 
 int idnum_count;
+extern volatile unsigned long sgIP_timems;
+
+// Destinations with a path MTU smaller than the MTU of the interface. mtu == 0 marks free entries.
+typedef struct SGIP_IP_PMTU_ENTRY
+{
+    unsigned long destip;
+    int mtu;
+    unsigned long time_set;
+} sgIP_IP_PMTUEntry;
+
+static sgIP_IP_PMTUEntry pmtu_cache[SGIP_IP_PMTU_MAXENTRIES];
+
+// Plateaus from RFC 1191 section 7, used when the next hop MTU isn't known.
+static const int pmtu_plateaus[] = { 1492, 1006, SGIP_IP_PMTU_MIN };
+
+// Datagram being reassembled. Its fragments are kept sorted by offset, and they never overlap, so
+// the datagram is complete when the length of all of them adds up to its total length.
+typedef struct SGIP_IP_REASM_ENTRY
+{
+    int used;
+    int failed; // fragments overlapped, so the rest of the datagram is ignored (RFC 5722)
+    unsigned long srcip, destip;
+    unsigned short id;
+    unsigned char protocol;
+    int total;    // length of the contents of the datagram, or -1 until the last fragment arrives
+    int received; // bytes received so far
+    int charged;  // memory of the fragments, counted against SGIP_IP_REASM_MAXBYTES
+    unsigned long time_started;
+
+    int numfrags;
+    sgIP_memblock *frags[SGIP_IP_REASM_MAXFRAGS]; // fragments without their IP header
+    unsigned short frag_offset[SGIP_IP_REASM_MAXFRAGS];
+    unsigned short frag_length[SGIP_IP_REASM_MAXFRAGS];
+} sgIP_IP_ReasmEntry;
+
+static sgIP_IP_ReasmEntry reasm_entries[SGIP_IP_REASM_MAXENTRIES];
+static int reasm_bytes; // memory charged to all entries
+
+static void sgIP_IP_ReasmFreeFrags(sgIP_IP_ReasmEntry *entry)
+{
+    for (int i = 0; i < entry->numfrags; i++)
+        sgIP_memblock_free(entry->frags[i]);
+    reasm_bytes -= entry->charged;
+    entry->numfrags = 0;
+    entry->received = 0;
+    entry->charged  = 0;
+}
+
+static void sgIP_IP_ReasmFree(sgIP_IP_ReasmEntry *entry)
+{
+    sgIP_IP_ReasmFreeFrags(entry);
+    entry->used = 0;
+}
+
+// Failed entries are kept until they time out so that the fragments that arrive later are dropped
+// as well. Their memory is released right away.
+static void sgIP_IP_ReasmFail(sgIP_IP_ReasmEntry *entry)
+{
+    SGIP_DEBUG_MESSAGE(("IP: bad fragments!"));
+    sgIP_IP_ReasmFreeFrags(entry);
+    entry->failed = 1;
+}
+
+// Releases the memory of the oldest entry other than the one given. Returns 0 if there isn't any.
+static int sgIP_IP_ReasmEvict(sgIP_IP_ReasmEntry *keep)
+{
+    sgIP_IP_ReasmEntry *oldest = NULL;
+    for (int i = 0; i < SGIP_IP_REASM_MAXENTRIES; i++)
+    {
+        sgIP_IP_ReasmEntry *entry = &reasm_entries[i];
+        if (!entry->used || entry == keep || entry->received == 0)
+            continue;
+        if (!oldest || sgIP_timems - entry->time_started > sgIP_timems - oldest->time_started)
+            oldest = entry;
+    }
+    if (!oldest)
+        return 0;
+
+    sgIP_IP_ReasmFree(oldest);
+    return 1;
+}
+
+static sgIP_IP_ReasmEntry *sgIP_IP_ReasmFind(sgIP_Header_IP *iphdr)
+{
+    sgIP_IP_ReasmEntry *free_entry = NULL;
+    sgIP_IP_ReasmEntry *oldest     = NULL;
+
+    for (int i = 0; i < SGIP_IP_REASM_MAXENTRIES; i++)
+    {
+        sgIP_IP_ReasmEntry *entry = &reasm_entries[i];
+        if (!entry->used)
+        {
+            if (!free_entry)
+                free_entry = entry;
+            continue;
+        }
+        if (entry->srcip == iphdr->src_address && entry->destip == iphdr->dest_address
+            && entry->id == iphdr->identification && entry->protocol == iphdr->protocol)
+            return entry;
+        if (!oldest || sgIP_timems - entry->time_started > sgIP_timems - oldest->time_started)
+            oldest = entry;
+    }
+
+    if (!free_entry)
+    {
+        sgIP_IP_ReasmFree(oldest);
+        free_entry = oldest;
+    }
+
+    free_entry->used         = 1;
+    free_entry->failed       = 0;
+    free_entry->srcip        = iphdr->src_address;
+    free_entry->destip       = iphdr->dest_address;
+    free_entry->id           = iphdr->identification;
+    free_entry->protocol     = iphdr->protocol;
+    free_entry->total        = -1;
+    free_entry->received     = 0;
+    free_entry->charged      = 0;
+    free_entry->time_started = sgIP_timems;
+    free_entry->numfrags     = 0;
+    return free_entry;
+}
+
+// Memory charged to a fragment. Like in the incoming queues of UDP sockets, every block counts as
+// at least a whole memblock, so that lots of tiny fragments can't pin more memory than the limit.
+static int sgIP_IP_ReasmCost(const sgIP_memblock *mb)
+{
+    int cost = 0;
+    for (; mb; mb = mb->next)
+        cost += mb->thislength > SGIP_MEMBLOCK_DATASIZE ? mb->thislength : SGIP_MEMBLOCK_DATASIZE;
+    return cost;
+}
+
+// Copies the fragments of a complete datagram to a new memblock, with space for headers in front
+// of it in case the datagram is used to send a reply.
+static sgIP_memblock *sgIP_IP_ReasmBuild(sgIP_IP_ReasmEntry *entry)
+{
+    int hdrlen        = sgIP_IP_RequiredHeaderSize();
+    sgIP_memblock *mb = sgIP_memblock_alloc(hdrlen + entry->total);
+    if (mb)
+    {
+        sgIP_memblock_exposeheader(mb, -hdrlen);
+        for (int i = 0; i < entry->numfrags; i++)
+        {
+            int pos = entry->frag_offset[i];
+            int end = pos + entry->frag_length[i];
+            for (sgIP_memblock *t = entry->frags[i]; t && pos < end; t = t->next)
+            {
+                int len = t->thislength;
+                if (len > end - pos)
+                    len = end - pos;
+                sgIP_memblock_CopyFromLinear(mb, t->datastart, pos, len);
+                pos += len;
+            }
+        }
+    }
+
+    sgIP_IP_ReasmFree(entry);
+    return mb;
+}
+
+// Takes a fragment with its IP header. Returns the contents of the datagram when the fragment
+// completes it, or NULL otherwise. Fragments that overlap cause the whole datagram to be dropped,
+// except for exact duplicates, which are ignored.
+static sgIP_memblock *sgIP_IP_Reassemble(sgIP_memblock *mb, int hdrlen)
+{
+    sgIP_Header_IP *iphdr = (sgIP_Header_IP *)mb->datastart;
+    int flags             = htons(iphdr->fragment_offset);
+    int offset            = (flags & SGIP_IP_OFFSET_MASK) * 8;
+    int length            = mb->totallength - hdrlen;
+    int more              = flags & SGIP_IP_FLAG_MF;
+
+    // All fragments but the last one must be a multiple of 8 bytes long, and datagrams can't be
+    // longer than 65535 bytes.
+    if (length <= 0 || (more && (length & 7)) || hdrlen + offset + length > 0xFFFF)
+    {
+        sgIP_memblock_free(mb);
+        return NULL;
+    }
+
+    sgIP_IP_ReasmEntry *entry = sgIP_IP_ReasmFind(iphdr);
+    if (entry->failed)
+    {
+        sgIP_memblock_free(mb);
+        return NULL;
+    }
+
+    int end = offset + length;
+    if (!more)
+    {
+        int last_end = entry->numfrags > 0 ? entry->frag_offset[entry->numfrags - 1]
+                                                 + entry->frag_length[entry->numfrags - 1]
+                                           : 0;
+        if ((entry->total != -1 && entry->total != end) || last_end > end)
+        {
+            sgIP_IP_ReasmFail(entry);
+            sgIP_memblock_free(mb);
+            return NULL;
+        }
+        entry->total = end;
+    }
+    else if (entry->total != -1 && end > entry->total)
+    {
+        sgIP_IP_ReasmFail(entry);
+        sgIP_memblock_free(mb);
+        return NULL;
+    }
+
+    int pos = 0;
+    while (pos < entry->numfrags && entry->frag_offset[pos] < offset)
+        pos++;
+
+    if (pos < entry->numfrags && entry->frag_offset[pos] == offset
+        && entry->frag_length[pos] == length)
+    {
+        // Retransmitted fragment
+        sgIP_memblock_free(mb);
+        return NULL;
+    }
+
+    if ((pos > 0 && entry->frag_offset[pos - 1] + entry->frag_length[pos - 1] > offset)
+        || (pos < entry->numfrags && end > entry->frag_offset[pos])
+        || entry->numfrags == SGIP_IP_REASM_MAXFRAGS)
+    {
+        sgIP_IP_ReasmFail(entry);
+        sgIP_memblock_free(mb);
+        return NULL;
+    }
+
+    int cost = sgIP_IP_ReasmCost(mb);
+    while (reasm_bytes + cost > SGIP_IP_REASM_MAXBYTES)
+    {
+        if (!sgIP_IP_ReasmEvict(entry))
+        {
+            sgIP_memblock_free(mb);
+            return NULL;
+        }
+    }
+
+    sgIP_memblock_exposeheader(mb, -hdrlen);
+    for (int i = entry->numfrags; i > pos; i--)
+    {
+        entry->frags[i]       = entry->frags[i - 1];
+        entry->frag_offset[i] = entry->frag_offset[i - 1];
+        entry->frag_length[i] = entry->frag_length[i - 1];
+    }
+    entry->frags[pos]       = mb;
+    entry->frag_offset[pos] = offset;
+    entry->frag_length[pos] = length;
+    entry->numfrags++;
+    entry->received += length;
+    entry->charged += cost;
+    reasm_bytes += cost;
+
+    if (entry->received != entry->total)
+        return NULL;
+
+    return sgIP_IP_ReasmBuild(entry);
+}
 
 int sgIP_IP_ReceivePacket(sgIP_memblock *mb)
 {
@@ -49,25 +312,45 @@ int sgIP_IP_ReceivePacket(sgIP_memblock *mb)
         sgIP_memblock_free(mb);
         return 0; // bad checksum.
     }
-    if (htons(iphdr->fragment_offset) & 0x3FFF)
+    // Multicast datagrams are only received for joined groups, and TCP can't use multicast.
+    if (SGIP_IP_IS_MULTICAST(iphdr->dest_address)
+        && (iphdr->protocol == PROTOCOL_IP_TCP || !sgIP_IGMP_IsMember(iphdr->dest_address)))
     {
-        // fragmented! oh noes! We can't deal with this!
-        SGIP_DEBUG_MESSAGE(("IP: fragmented!"));
         sgIP_memblock_free(mb);
-        return 0; // fragmented.
+        return 0;
+    }
+
+    // The header is gone after reassembly, so keep what's needed from it.
+    unsigned long srcip  = iphdr->src_address;
+    unsigned long destip = iphdr->dest_address;
+    int protocol         = iphdr->protocol;
+
+    if (htons(iphdr->fragment_offset) & (SGIP_IP_FLAG_MF | SGIP_IP_OFFSET_MASK))
+    {
+        SGIP_INTR_PROTECT();
+        mb = sgIP_IP_Reassemble(mb, hdrlen * 4);
+        SGIP_INTR_UNPROTECT();
+        if (!mb)
+            return 0; // incomplete or dropped.
+    }
+    else
+    {
+        sgIP_memblock_exposeheader(mb, -hdrlen * 4);
     }
 
-    sgIP_memblock_exposeheader(mb, -hdrlen * 4);
-    switch (iphdr->protocol)
+    switch (protocol)
     {
         case PROTOCOL_IP_ICMP: // ICMP
-            sgIP_ICMP_ReceivePacket(mb, iphdr->src_address, iphdr->dest_address);
+            sgIP_ICMP_ReceivePacket(mb, srcip, destip);
+            break;
+        case PROTOCOL_IP_IGMP: // IGMP
+            sgIP_IGMP_ReceivePacket(mb, srcip, destip);
             break;
         case PROTOCOL_IP_TCP: // TCP
-            sgIP_TCP_ReceivePacket(mb, iphdr->src_address, iphdr->dest_address);
+            sgIP_TCP_ReceivePacket(mb, srcip, destip);
             break;
         case PROTOCOL_IP_UDP: // UDP
-            sgIP_UDP_ReceivePacket(mb, iphdr->src_address, iphdr->dest_address);
+            sgIP_UDP_ReceivePacket(mb, srcip, destip);
             break;
         default:
             sgIP_memblock_free(mb);
@@ -78,7 +361,106 @@ int sgIP_IP_ReceivePacket(sgIP_memblock *mb)
 
 int sgIP_IP_MaxContentsSize(unsigned long destip)
 {
-    return sgIP_Hub_IPMaxMessageSize(destip) - sgIP_IP_RequiredHeaderSize();
+    return sgIP_IP_PathMTU(destip) - sgIP_IP_RequiredHeaderSize();
+}
+
+int sgIP_IP_PathMTU(unsigned long destip)
+{
+    int mtu = sgIP_Hub_IPMaxMessageSize(destip);
+
+    for (int i = 0; i < SGIP_IP_PMTU_MAXENTRIES; i++)
+    {
+        if (pmtu_cache[i].mtu != 0 && pmtu_cache[i].destip == destip)
+        {
+            if (pmtu_cache[i].mtu < mtu)
+                mtu = pmtu_cache[i].mtu;
+            break;
+        }
+    }
+
+    return mtu;
+}
+
+void sgIP_IP_ReducePathMTU(unsigned long destip, int mtu)
+{
+    SGIP_INTR_PROTECT();
+
+    int current = sgIP_IP_PathMTU(destip);
+    if (mtu == 0)
+    {
+        // Old routers don't report the MTU of the next hop, guess the next plateau down.
+        mtu = SGIP_IP_PMTU_MIN;
+        for (unsigned int i = 0; i < sizeof(pmtu_plateaus) / sizeof(pmtu_plateaus[0]); i++)
+        {
+            if (pmtu_plateaus[i] < current)
+            {
+                mtu = pmtu_plateaus[i];
+                break;
+            }
+        }
+    }
+    if (mtu < SGIP_IP_PMTU_MIN)
+        mtu = SGIP_IP_PMTU_MIN;
+    if (mtu >= current)
+    {
+        SGIP_INTR_UNPROTECT();
+        return;
+    }
+
+    // Reuse the entry of this destination, or a free one, or the oldest one.
+    int slot = -1;
+    for (int i = 0; i < SGIP_IP_PMTU_MAXENTRIES; i++)
+    {
+        if (pmtu_cache[i].mtu != 0 && pmtu_cache[i].destip == destip)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0)
+    {
+        slot = 0;
+        for (int i = 0; i < SGIP_IP_PMTU_MAXENTRIES; i++)
+        {
+            if (pmtu_cache[i].mtu == 0)
+            {
+                slot = i;
+                break;
+            }
+            if ((int)(pmtu_cache[i].time_set - pmtu_cache[slot].time_set) < 0)
+                slot = i;
+        }
+    }
+
+    SGIP_DEBUG_MESSAGE(("IP: path MTU %i", mtu));
+    pmtu_cache[slot].destip   = destip;
+    pmtu_cache[slot].mtu      = mtu;
+    pmtu_cache[slot].time_set = sgIP_timems;
+
+    SGIP_INTR_UNPROTECT();
+}
+
+void sgIP_IP_Timer1000ms(void)
+{
+    SGIP_INTR_PROTECT();
+
+    // Forget old reductions so that the full MTU is tried again (RFC 1191 section 6.3). If the path
+    // is still constricted, ICMP or the TCP blackhole detection will reduce it again.
+    for (int i = 0; i < SGIP_IP_PMTU_MAXENTRIES; i++)
+    {
+        if (pmtu_cache[i].mtu != 0 && sgIP_timems - pmtu_cache[i].time_set >= SGIP_IP_PMTU_AGEMS)
+            pmtu_cache[i].mtu = 0;
+    }
+
+    // Drop datagrams whose missing fragments haven't arrived in time (RFC 791).
+    for (int i = 0; i < SGIP_IP_REASM_MAXENTRIES; i++)
+    {
+        sgIP_IP_ReasmEntry *entry = &reasm_entries[i];
+        if (entry->used && sgIP_timems - entry->time_started >= SGIP_IP_REASM_TIMEOUTMS)
+            sgIP_IP_ReasmFree(entry);
+    }
+
+    SGIP_INTR_UNPROTECT();
 }
 
 int sgIP_IP_RequiredHeaderSize(void)
@@ -86,25 +468,18 @@ int sgIP_IP_RequiredHeaderSize(void)
     return 5 * 4; // we'll not include zeroed options.
 }
 
-int sgIP_IP_SendViaIP(sgIP_memblock *mb, int protocol, unsigned long srcip, unsigned long destip)
+// Multicast packets stay in the local network unless the application asks otherwise (RFC 1112)
+static int sgIP_IP_DefaultTTL(unsigned long destip)
 {
-    sgIP_memblock_exposeheader(mb, 20);
+    return SGIP_IP_IS_MULTICAST(destip) ? 1 : SGIP_IP_TTL;
+}
 
-    sgIP_Header_IP *iphdr       = (sgIP_Header_IP *)mb->datastart;
-    unsigned short *chksum_calc = (unsigned short *)mb->datastart;
-    iphdr->dest_address         = destip;
-    iphdr->fragment_offset      = 0;
-    iphdr->header_checksum      = 0;
-    iphdr->identification       = idnum_count++;
-    iphdr->protocol             = protocol;
-    iphdr->src_address          = srcip;
-    iphdr->tot_length           = htons(mb->totallength);
-    iphdr->TTL                  = SGIP_IP_TTL;
-    iphdr->type_of_service      = 0;
-    iphdr->version_ihl          = 0x45;
+static unsigned short sgIP_IP_HeaderChecksum(const void *header, int hdrlen)
+{
+    const unsigned short *chksum_calc = header;
 
     int chksum_temp = 0;
-    for (int i = 0; i < 10; i++)
+    for (int i = 0; i < hdrlen / 2; i++)
         chksum_temp += chksum_calc[i];
     chksum_temp = (chksum_temp & 0xFFFF) + (chksum_temp >> 16);
     chksum_temp = (chksum_temp & 0xFFFF) + (chksum_temp >> 16);
@@ -112,8 +487,160 @@ int sgIP_IP_SendViaIP(sgIP_memblock *mb, int protocol, unsigned long srcip, unsi
     chksum_temp &= 0xFFFF;
     if (chksum_temp == 0)
         chksum_temp = 0xFFFF;
+    return chksum_temp;
+}
 
-    iphdr->header_checksum = chksum_temp;
+// Payload bytes that fit in each fragment of a datagram. It must be a multiple of 8 bytes.
+static int sgIP_IP_FragmentSize(int mtu, int hdrlen)
+{
+    return (mtu - hdrlen) & ~7;
+}
+
+sgIP_memblock *sgIP_IP_AllocPacket(unsigned long destip, int size)
+{
+    int hdrlen = sgIP_IP_RequiredHeaderSize();
+    int mtu    = sgIP_IP_PathMTU(destip);
+
+    sgIP_memblock *mb;
+    if (hdrlen + size > mtu)
+    {
+        int fragsize = sgIP_IP_FragmentSize(mtu, hdrlen);
+        mb           = sgIP_memblock_allocSplit(hdrlen + size, hdrlen + fragsize, fragsize);
+    }
+    else
+    {
+        mb = sgIP_memblock_alloc(hdrlen + size);
+    }
+    if (mb)
+        sgIP_memblock_exposeheader(mb, -hdrlen); // hide IP header space for later
+    return mb;
+}
+
+// Sends a datagram with its IP header as several fragments that fit in the MTU. Options are copied
+// to all fragments, which is right for the only option that is sent (Router Alert). If the payload
+// memblocks are split at fragment boundaries, like the ones from sgIP_IP_AllocPacket(), they are
+// sent as they are after a new header. If not, the payload is copied to new memblocks.
+static int sgIP_IP_SendFragments(sgIP_memblock *mb, int hdrlen, int mtu)
+{
+    int fragsize = sgIP_IP_FragmentSize(mtu, hdrlen);
+    int datalen  = mb->totallength - hdrlen;
+    if (fragsize <= 0)
+    {
+        sgIP_memblock_free(mb);
+        return 0;
+    }
+
+    unsigned char header[60];
+    memcpy(header, mb->datastart, hdrlen);
+    sgIP_Header_IP *iphdr = (sgIP_Header_IP *)header;
+    unsigned long srcip   = iphdr->src_address;
+    unsigned long destip  = iphdr->dest_address;
+    int flags             = htons(iphdr->fragment_offset);
+
+    int aligned = mb->thislength == hdrlen + fragsize;
+    for (sgIP_memblock *t = mb->next; t && aligned; t = t->next)
+    {
+        if (t->thislength > fragsize || (t->next && t->thislength != fragsize))
+            aligned = 0;
+    }
+
+    sgIP_memblock *payload = NULL; // blocks that haven't been sent yet
+    if (aligned)
+    {
+        payload  = mb->next;
+        mb->next = NULL;
+    }
+
+    int retval = 0;
+    for (int offset = 0; offset < datalen; offset += fragsize)
+    {
+        int len = datalen - offset;
+        if (len > fragsize)
+            len = fragsize;
+
+        sgIP_memblock *frag;
+        if (aligned && offset == 0)
+        {
+            frag = mb;
+        }
+        else
+        {
+            frag = sgIP_memblock_alloc(aligned ? hdrlen : hdrlen + len);
+            if (!frag)
+                break;
+            memcpy(frag->datastart, header, hdrlen);
+            if (aligned)
+            {
+                frag->next       = payload;
+                payload          = payload->next;
+                frag->next->next = NULL;
+            }
+            else
+            {
+                sgIP_memblock_CopyToLinear(mb, frag->datastart + hdrlen, hdrlen + offset, len);
+            }
+        }
+        for (sgIP_memblock *t = frag; t; t = t->next)
+            t->totallength = hdrlen + len;
+
+        int more = offset + len < datalen ? SGIP_IP_FLAG_MF : 0;
+
+        sgIP_Header_IP *fraghdr  = (sgIP_Header_IP *)frag->datastart;
+        fraghdr->tot_length      = htons(hdrlen + len);
+        fraghdr->fragment_offset = htons(flags | more | (offset / 8));
+        fraghdr->header_checksum = 0;
+        fraghdr->header_checksum = sgIP_IP_HeaderChecksum(fraghdr, hdrlen);
+
+        retval = sgIP_Hub_SendProtocolPacket(htons(0x0800), frag, destip, srcip);
+    }
+
+    if (aligned)
+    {
+        if (payload)
+            sgIP_memblock_free(payload);
+    }
+    else
+    {
+        sgIP_memblock_free(mb);
+    }
+    return retval;
+}
+
+int sgIP_IP_SendViaIP(sgIP_memblock *mb, int protocol, unsigned long srcip, unsigned long destip)
+{
+    int ttl = sgIP_IP_DefaultTTL(destip);
+    return sgIP_IP_SendViaIPOptions(mb, protocol, srcip, destip, ttl, NULL, 0);
+}
+
+int sgIP_IP_SendViaIPOptions(sgIP_memblock *mb, int protocol, unsigned long srcip,
+                             unsigned long destip, int ttl, const void *options, int optionslen)
+{
+    int hdrlen = 20 + optionslen;
+    sgIP_memblock_exposeheader(mb, hdrlen);
+
+    sgIP_Header_IP *iphdr  = (sgIP_Header_IP *)mb->datastart;
+    iphdr->dest_address    = destip;
+    iphdr->fragment_offset = 0;
+    iphdr->header_checksum = 0;
+    iphdr->identification  = SGIP_ATOMIC_INC(idnum_count);
+    iphdr->protocol        = protocol;
+    iphdr->src_address     = srcip;
+    iphdr->tot_length      = htons(mb->totallength);
+    iphdr->TTL             = ttl;
+    iphdr->type_of_service = 0;
+    iphdr->version_ihl     = 0x40 | (hdrlen / 4);
+
+    if (optionslen > 0)
+        memcpy(mb->datastart + 20, options, optionslen);
+
+    // TCP adapts its segment size to the path MTU, so let routers report when it's too big. Other
+    // protocols can't do that, so their packets may be fragmented on the way.
+    if (protocol == PROTOCOL_IP_TCP)
+        iphdr->fragment_offset = htons(SGIP_IP_FLAG_DF);
+    else if (mb->totallength > sgIP_IP_PathMTU(destip))
+        return sgIP_IP_SendFragments(mb, hdrlen, sgIP_IP_PathMTU(destip));
+
+    iphdr->header_checksum = sgIP_IP_HeaderChecksum(iphdr, hdrlen);
     return sgIP_Hub_SendProtocolPacket(htons(0x0800), mb, destip, srcip);
 }
 
@@ -123,3 +650,133 @@ unsigned long sgIP_IP_GetLocalBindAddr(unsigned long srcip, unsigned long destip
         return srcip;
     return sgIP_Hub_GetCompatibleIP(destip);
 }
+
+void sgIP_IP_RouteInit(sgIP_IP_Route *route)
+{
+    route->hw       = NULL;
+    route->arp_slot = -1;
+}
+
+int sgIP_IP_RouteResolve(sgIP_IP_Route *route, int protocol, unsigned long srcip,
+                         unsigned long destip)
+{
+    sgIP_IP_RouteInit(route);
+
+    srcip                    = sgIP_IP_GetLocalBindAddr(srcip, destip);
+    sgIP_Hub_HWInterface *hw = sgIP_Hub_FindInterface(srcip);
+    if (!hw)
+        return 0;
+
+    route->hw       = hw;
+    route->srcip    = srcip;
+    route->destip   = destip;
+    route->nexthop  = sgIP_Hub_NextHop(hw, destip);
+    route->snmask   = hw->snmask;
+    route->gateway  = hw->gateway;
+    route->protocol = protocol;
+
+    // Everything but the length, the identification and the checksum itself
+    sgIP_Header_IP iphdr;
+    unsigned short *chksum_calc = (unsigned short *)&iphdr;
+    iphdr.dest_address          = destip;
+    iphdr.fragment_offset       = protocol == PROTOCOL_IP_TCP ? htons(SGIP_IP_FLAG_DF) : 0;
+    iphdr.header_checksum       = 0;
+    iphdr.identification        = 0;
+    iphdr.protocol              = protocol;
+    iphdr.src_address           = srcip;
+    iphdr.tot_length            = 0;
+    iphdr.TTL                   = sgIP_IP_DefaultTTL(destip);
+    iphdr.type_of_service       = 0;
+    iphdr.version_ihl           = 0x45;
+
+    route->header_sum = 0;
+    for (int i = 0; i < 10; i++)
+        route->header_sum += chksum_calc[i];
+
+    return 1;
+}
+
+int sgIP_IP_RouteValid(const sgIP_IP_Route *route)
+{
+    sgIP_Hub_HWInterface *hw = route->hw;
+    if (!hw)
+        return 0;
+
+    return (hw->flags & SGIP_FLAG_HWINTERFACE_IN_USE) && hw->ipaddr == route->srcip
+           && hw->snmask == route->snmask && hw->gateway == route->gateway;
+}
+
+int sgIP_IP_SendViaRoute(sgIP_memblock *mb, sgIP_IP_Route *route)
+{
+    // Most packets are small enough that the path MTU doesn't need to be checked.
+    int length = mb->totallength + 20;
+    if (route->protocol != PROTOCOL_IP_TCP && length > SGIP_IP_PMTU_MIN
+        && length > sgIP_IP_PathMTU(route->destip))
+        return sgIP_IP_SendViaIP(mb, route->protocol, route->srcip, route->destip);
+
+    sgIP_memblock_exposeheader(mb, 20);
+
+    sgIP_Header_IP *iphdr  = (sgIP_Header_IP *)mb->datastart;
+    iphdr->dest_address    = route->destip;
+    iphdr->fragment_offset = route->protocol == PROTOCOL_IP_TCP ? htons(SGIP_IP_FLAG_DF) : 0;
+    iphdr->identification  = SGIP_ATOMIC_INC(idnum_count);
+    iphdr->protocol        = route->protocol;
+    iphdr->src_address     = route->srcip;
+    iphdr->tot_length      = htons(mb->totallength);
+    iphdr->TTL             = sgIP_IP_DefaultTTL(route->destip);
+    iphdr->type_of_service = 0;
+    iphdr->version_ihl     = 0x45;
+
+    unsigned long chksum_temp = route->header_sum;
+    chksum_temp += iphdr->tot_length + iphdr->identification;
+    chksum_temp = (chksum_temp & 0xFFFF) + (chksum_temp >> 16);
+    chksum_temp = (chksum_temp & 0xFFFF) + (chksum_temp >> 16);
+    chksum_temp = ~chksum_temp & 0xFFFF;
+    if (chksum_temp == 0)
+        chksum_temp = 0xFFFF;
+
+    iphdr->header_checksum = chksum_temp;
+    return sgIP_ARP_SendProtocolFrameCached(route->hw, mb, htons(0x0800), route->nexthop,
+                                            &route->arp_slot);
+}
+
+// The bucket holds enough tokens for one timer period, so that paced sockets can reach their rate
+// when they are only serviced from sgIP_Timer(). It always fits one packet of the largest size.
+static int sgIP_IP_PacingBurst(sgIP_IP_Pacing *pacing)
+{
+    int burst = (unsigned long long)pacing->rate * SGIP_PACING_BURSTMS / 1000;
+    if (burst < SGIP_MTU_OVERRIDE)
+        burst = SGIP_MTU_OVERRIDE;
+    return burst;
+}
+
+void sgIP_IP_PacingInit(sgIP_IP_Pacing *pacing, unsigned long rate)
+{
+    pacing->rate      = rate;
+    pacing->time_last = sgIP_timems;
+    pacing->tokens    = sgIP_IP_PacingBurst(pacing);
+}
+
+int sgIP_IP_PacingAllows(sgIP_IP_Pacing *pacing, int length)
+{
+    if (pacing->rate == 0)
+        return 1;
+
+    unsigned long elapsed = sgIP_timems - pacing->time_last;
+    if (elapsed > 0)
+    {
+        int burst = sgIP_IP_PacingBurst(pacing);
+        unsigned long long tokens =
+            (unsigned long long)pacing->rate * elapsed / 1000 + pacing->tokens;
+        pacing->tokens    = tokens > (unsigned long long)burst ? burst : (int)tokens;
+        pacing->time_last = sgIP_timems;
+    }
+
+    return pacing->tokens >= length;
+}
+
+void sgIP_IP_PacingConsume(sgIP_IP_Pacing *pacing, int length)
+{
+    if (pacing->rate != 0)
+        pacing->tokens -= length;
+}
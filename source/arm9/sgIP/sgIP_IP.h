@@ -11,12 +11,21 @@
 extern "C" {
 #endif
 
+#include "arm9/sgIP/sgIP_Hub.h"
 #include "arm9/sgIP/sgIP_memblock.h"
 
 #define PROTOCOL_IP_ICMP 1
+#define PROTOCOL_IP_IGMP 2
 #define PROTOCOL_IP_TCP  6
 #define PROTOCOL_IP_UDP  17
 
+// Addresses in network byte order
+#define SGIP_IP_IS_MULTICAST(addr) ((htonl(addr) & 0xF0000000) == 0xE0000000) // 224.0.0.0/4
+
+#define SGIP_IP_FLAG_DF     0x4000 // Don't Fragment, in fragment_offset
+#define SGIP_IP_FLAG_MF     0x2000 // More Fragments, in fragment_offset
+#define SGIP_IP_OFFSET_MASK 0x1FFF // Fragment offset in units of 8 bytes, in fragment_offset
+
 typedef struct SGIP_HEADER_IP
 {
     // version = top 4 bits == 4, IHL = header length in 32bit increments = bottom 4 bits
@@ -36,17 +45,64 @@ typedef struct SGIP_HEADER_IP
     unsigned char TTL;              // time to live, measured in hops
     unsigned char protocol;         // protocols: ICMP=1, TCP=6, UDP=17
     unsigned short header_checksum; // checksum:
-    unsigned long src_address;      // src address is 32bit IP address
-    unsigned long dest_address;     // dest address is 32bit IP address
+    uint32_t src_address;           // src address is 32bit IP address
+    uint32_t dest_address;          // dest address is 32bit IP address
     unsigned char options[4];       // optional options come here.
 } sgIP_Header_IP;
 
+// Token bucket that limits the rate at which a socket sends data (SO_MAX_PACING_RATE).
+typedef struct SGIP_IP_PACING
+{
+    unsigned long rate;      // bytes per second, or 0 if unlimited
+    int tokens;              // bytes that can be sent right now
+    unsigned long time_last; // time when tokens was last refilled
+} sgIP_IP_Pacing;
+
+// Path to a destination cached by connected sockets, so that the interface, next hop and ARP entry
+// aren't looked up for every packet. It must be checked with sgIP_IP_RouteValid() before it's used,
+// because the configuration of the interface may change.
+typedef struct SGIP_IP_ROUTE
+{
+    sgIP_Hub_HWInterface *hw; // interface that owns srcip, or NULL if not resolved
+    unsigned long srcip, destip;
+    unsigned long nexthop;
+    unsigned long snmask, gateway; // configuration of hw when the route was resolved
+    int arp_slot;                  // ARP entry of nexthop, or -1
+    int protocol;
+    unsigned long header_sum; // checksum of the fields of the IP header that don't change
+} sgIP_IP_Route;
+
 int sgIP_IP_ReceivePacket(sgIP_memblock *mb);
 int sgIP_IP_MaxContentsSize(unsigned long destip);
+int sgIP_IP_PathMTU(unsigned long destip);
+// Lower the path MTU to destip, after an ICMP "fragmentation needed" message or when packets of the
+// current size seem to be lost. If mtu is 0 the next lower common MTU is used.
+void sgIP_IP_ReducePathMTU(unsigned long destip, int mtu);
+void sgIP_IP_Timer1000ms(void);
 int sgIP_IP_RequiredHeaderSize(void);
+// Allocates a memblock for size bytes of contents, with hidden space for the IP header. Datagrams
+// larger than the path MTU are split so that they can be fragmented without copying them.
+sgIP_memblock *sgIP_IP_AllocPacket(unsigned long destip, int size);
+// Datagrams larger than the path MTU are fragmented, except for TCP segments.
 int sgIP_IP_SendViaIP(sgIP_memblock *mb, int protocol, unsigned long srcip, unsigned long destip);
+// Like sgIP_IP_SendViaIP(), with a specific TTL and IP options. The length of the options must be a
+// multiple of 4, and the memblock needs space for them before the data.
+int sgIP_IP_SendViaIPOptions(sgIP_memblock *mb, int protocol, unsigned long srcip,
+                             unsigned long destip, int ttl, const void *options, int optionslen);
 unsigned long sgIP_IP_GetLocalBindAddr(unsigned long srcip, unsigned long destip);
 
+void sgIP_IP_RouteInit(sgIP_IP_Route *route);
+// Resolves the route from srcip (0 for any local address) to destip. Returns 1 on success.
+int sgIP_IP_RouteResolve(sgIP_IP_Route *route, int protocol, unsigned long srcip,
+                         unsigned long destip);
+int sgIP_IP_RouteValid(const sgIP_IP_Route *route);
+int sgIP_IP_SendViaRoute(sgIP_memblock *mb, sgIP_IP_Route *route);
+
+void sgIP_IP_PacingInit(sgIP_IP_Pacing *pacing, unsigned long rate);
+// Returns 1 if a packet of "length" bytes, IP header included, can be sent right now.
+int sgIP_IP_PacingAllows(sgIP_IP_Pacing *pacing, int length);
+void sgIP_IP_PacingConsume(sgIP_IP_Pacing *pacing, int length);
+
 #ifdef __cplusplus
 };
 #endif
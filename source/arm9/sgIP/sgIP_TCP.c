@@ -4,39 +4,133 @@
 
 // DSWifi Project - sgIP Internet Protocol Stack Implementation
 
+#include <netinet/tcp.h>
+#include <string.h>
 #include <sys/socket.h>
 
 #include "arm9/sgIP/sgIP_Hub.h"
 #include "arm9/sgIP/sgIP_IP.h"
 #include "arm9/sgIP/sgIP_TCP.h"
+#include "arm9/sgIP/sgIP_ports.h"
+#include "arm9/sgIP/sgIP_random.h"
 
 sgIP_Record_TCP *tcprecords;
-int port_counter;
 unsigned long lasttime;
 extern volatile unsigned long sgIP_timems;
 sgIP_TCP_SYNCookie synlist[SGIP_TCP_MAXSYNS];
 
 int numsynlist; // number of active entries in synlist (earliest first)
 
+// TCP Fast Open cookies given to us by servers. len == 0 marks free entries.
+static struct
+{
+    unsigned long ip;
+    int len;
+    unsigned char cookie[SGIP_TCP_FASTOPEN_MAXCOOKIELEN];
+} tfo_cookies[SGIP_TCP_FASTOPEN_MAXCOOKIES];
+static int tfo_cookies_next;        // entry to replace when the cache is full
+// Keys of the cookies that we give to clients: the current one and the previous one.
+static uint32_t tfo_keys[2][4];
+static int tfo_num_keys;           // keys that are valid
+static unsigned long tfo_key_time; // when the current key was made
+
+static int tcp_rx_memory; // total size of the receive buffers of all connections
+static int tcp_rx_budget = SGIP_TCP_HEAPSIZE * SGIP_TCP_RECEIVEMEMORYPERCENT / 100;
+
+static uint32_t tcp_port_bits[SGIP_PORTS_WORDS(SGIP_TCP_FIRSTOUTGOINGPORT,
+                                               SGIP_TCP_LASTOUTGOINGPORT)];
+static sgIP_PortSet tcp_ports;
+
+static int sgIP_TCP_ResizeRxBuffer(sgIP_Record_TCP *rec, int size);
+static void sgIP_TCP_SendKeepalive(sgIP_Record_TCP *rec);
+static int sgIP_TCP_SendLength(sgIP_Record_TCP *rec, int force);
+static void sgIP_TCP_SendSyn(sgIP_Record_TCP *rec);
+static int sgIP_TCP_SendSynReplyOptions(int flags, unsigned long seq, unsigned long ack,
+                                        unsigned long srcip, unsigned long destip, int srcport,
+                                        int destport, int windowlen, const unsigned char *options,
+                                        int optionslen);
+
 void sgIP_TCP_Init(void)
 {
-    tcprecords   = 0;
-    numsynlist   = 0;
-    port_counter = SGIP_TCP_FIRSTOUTGOINGPORT;
-    lasttime     = sgIP_timems;
+    tcprecords    = 0;
+    numsynlist    = 0;
+    lasttime      = sgIP_timems;
+    tcp_rx_memory = 0;
+
+    sgIP_Ports_Init(&tcp_ports, tcp_port_bits, SGIP_TCP_FIRSTOUTGOINGPORT,
+                    SGIP_TCP_LASTOUTGOINGPORT);
+
+    for (int i = 0; i < SGIP_TCP_FASTOPEN_MAXCOOKIES; i++)
+        tfo_cookies[i].len = 0;
+    tfo_cookies_next = 0;
+    tfo_num_keys     = 0;
+}
+
+void sgIP_TCP_SetHeapSize(int size)
+{
+    SGIP_INTR_PROTECT();
+    // the budget is kept across sgIP_TCP_Init(), which runs before the size is known
+    tcp_rx_budget = size * SGIP_TCP_RECEIVEMEMORYPERCENT / 100;
+    SGIP_INTR_UNPROTECT();
+}
+
+// Removes entry i of the list of connections that have got a SYN-ACK and haven't answered yet.
+static void sgIP_TCP_RemoveSyn(int i)
+{
+    numsynlist--;
+    for (; i < numsynlist; i++)
+        synlist[i] = synlist[i + 1]; // assume struct copy
+}
+
+// Takes care of a connection that the application has closed. The record is freed once the
+// connection is closed, or if the other end has been silent for too long. timewait counts the
+// connections in TIME_WAIT. The list of records starts with the newest one, so the ones past the
+// limit are the oldest ones.
+static void sgIP_TCP_OrphanTimer(sgIP_Record_TCP *rec, int *timewait)
+{
+    if (rec->tcpstate == SGIP_TCP_STATE_TIME_WAIT)
+    {
+        (*timewait)++;
+        if (*timewait > SGIP_TCP_MAXTIMEWAIT)
+            rec->tcpstate = SGIP_TCP_STATE_CLOSED;
+    }
+    else if (rec->tcpstate != SGIP_TCP_STATE_CLOSED
+             && sgIP_timems - rec->time_last_rx > SGIP_TCP_ORPHANTIMEOUTMS)
+    {
+        sgIP_TCP_Abort(rec);
+    }
+
+    if (rec->tcpstate == SGIP_TCP_STATE_CLOSED)
+    {
+        sgIP_TCP_FreeRecord(rec);
+        return;
+    }
+
+    // our FIN is only sent once all data has been acknowledged, and only the FIN is resent
+    if (rec->buf_tx && rec->want_shutdown == 2)
+    {
+        sgIP_free(rec->buf_tx);
+        rec->buf_tx = NULL;
+    }
 }
 
 // scan through tcp records and resend anything necessary
 void sgIP_TCP_Timer(void)
 {
-    int i, j;
+    int i, j, k;
 
     int time = sgIP_timems - lasttime;
     lasttime = sgIP_timems;
     for (i = 0; i < numsynlist; i++)
     {
-        if (synlist[i].timenext <= time)
+        if (synlist[i].timenext <= time && synlist[i].retrycount >= SGIP_TCP_MAXRETRY)
+        {
+            // the client has gone away
+            sgIP_TCP_RemoveSyn(i--);
+        }
+        else if (synlist[i].timenext <= time)
         {
+            synlist[i].retrycount++;
             j = time - synlist[i].timenext;
             synlist[i].timebackoff *= 2;
             if (synlist[i].timebackoff > SGIP_TCP_BACKOFFMAX)
@@ -56,9 +150,30 @@ void sgIP_TCP_Timer(void)
         }
     }
 
+    int timewait         = 0;
     sgIP_Record_TCP *rec = tcprecords;
     while (rec)
     {
+        int oldstate = rec->tcpstate;
+
+        // give the memory of the receive buffer back if the connection is idle
+        if (rec->buf_rx_size > SGIP_TCP_RECEIVEBUFFERMIN && !rec->rx_locked
+            && rec->buf_rx_in == rec->buf_rx_out
+            && sgIP_timems - rec->rx_time_data > SGIP_TCP_RECEIVEIDLEMS)
+        {
+            uint32_t rxwindow = rec->rxwindow;
+            if (sgIP_TCP_ResizeRxBuffer(rec, SGIP_TCP_RECEIVEBUFFERMIN))
+            {
+                rec->rx_measuring = 0; // measure again when data arrives
+                rec->rx_rtt       = 0;
+                if (rec->rxwindow != rxwindow
+                    && (rec->tcpstate == SGIP_TCP_STATE_ESTABLISHED
+                        || rec->tcpstate == SGIP_TCP_STATE_FIN_WAIT_1
+                        || rec->tcpstate == SGIP_TCP_STATE_FIN_WAIT_2))
+                    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0); // tell them about the window
+            }
+        }
+
         time = sgIP_timems - rec->time_last_action;
         switch (rec->tcpstate)
         {
@@ -84,7 +199,9 @@ void sgIP_TCP_Timer(void)
                     j *= 2;
                     if (j > SGIP_TCP_BACKOFFMAX)
                         j = SGIP_TCP_BACKOFFMAX;
-                    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_SYN, 0);
+                    // Resend the SYN without data, in case a middlebox drops SYNs with data.
+                    rec->tfo_connect = 0;
+                    sgIP_TCP_SendSyn(rec);
                     rec->time_backoff = j; // preserve backoff
                 }
                 break;
@@ -109,27 +226,55 @@ void sgIP_TCP_Timer(void)
                     rec->want_shutdown = 2;
                     break;
                 }
+                if (rec->buf_tx_out != rec->buf_tx_in && (int)(rec->txwindow - rec->sequence) <= 0)
+                {
+                    // The other end has closed its window. Probe it periodically in case the
+                    // window update that opens it again is lost.
+                    if (rec->persist_backoff == 0)
+                    {
+                        rec->persist_backoff = SGIP_TCP_GENRETRYMS;
+                        rec->retrycount      = 0;
+                    }
+                    if (time > rec->persist_backoff)
+                    {
+                        // Probes are sent for as long as the other end answers them (RFC 1122
+                        // section 4.2.2.17), but a peer that has vanished never does.
+                        if ((int)(rec->time_last_rx - rec->time_last_action) >= 0)
+                            rec->retrycount = 0;
+                        rec->retrycount++;
+                        if (rec->retrycount >= SGIP_TCP_MAXRETRY)
+                        {
+                            rec->errorcode = ETIMEDOUT;
+                            rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
+                            break;
+                        }
+                        j = rec->persist_backoff;
+                        j *= 2;
+                        if (j > SGIP_TCP_PERSISTMAXMS)
+                            j = SGIP_TCP_PERSISTMAXMS;
+                        sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 1); // window probe
+                        rec->persist_backoff = j;
+                    }
+                    break;
+                }
+                rec->persist_backoff = 0;
+
+                // Segments always start at the oldest unacknowledged byte, so new data waits until
+                // everything in flight has been acknowledged, or until it's resent below.
                 j = rec->buf_tx_out - rec->buf_tx_in;
                 if (j < 0)
                     j += SGIP_TCP_TRANSMITBUFFERLENGTH;
-                j += (int)(rec->sequence - rec->sequence_next);
-                if (j > 0)
+                if (j > 0 && rec->sequence_max == rec->sequence)
                 {
                     // never-sent bytes
                     if (time > SGIP_TCP_TRANSMIT_DELAY)
                     {
-                        // 1000 is an arbitrary constant.
-                        j = rec->buf_tx_out - rec->buf_tx_in;
-                        if (j < 0)
-                            j += SGIP_TCP_TRANSMITBUFFERLENGTH;
-                        i = (int)(rec->txwindow - rec->sequence);
-                        if (j > i)
-                            j = i;
-                        i = sgIP_IP_MaxContentsSize(rec->destip) - 20; // max tcp data size
-                        if (j > i)
-                            j = i;
-                        sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, j);
-                        break;
+                        j = sgIP_TCP_SendLength(rec, time > SGIP_TCP_SWS_OVERRIDEMS);
+                        if (j > 0)
+                        {
+                            sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, j);
+                            break;
+                        }
                     }
                 }
                 if (time > rec->time_backoff && rec->buf_tx_out != rec->buf_tx_in)
@@ -142,9 +287,30 @@ void sgIP_TCP_Timer(void)
                     if (j > i)
                         j = i;
                     i = sgIP_IP_MaxContentsSize(rec->destip) - 20; // max tcp data size
+                    rec->retrycount++;
+                    if (j >= i && rec->retrycount >= SGIP_TCP_BLACKHOLE_RETRIES)
+                    {
+                        // Full sized segments keep getting lost but no ICMP message has arrived,
+                        // maybe it's being filtered. Try smaller segments. The count only starts
+                        // again if the segments actually get smaller.
+                        sgIP_IP_ReducePathMTU(rec->destip, 0);
+                        k = sgIP_IP_MaxContentsSize(rec->destip) - 20;
+                        if (k < i)
+                            rec->retrycount = 0;
+                        i = k;
+                    }
+                    if (rec->retrycount >= SGIP_TCP_MAXRETRY)
+                    {
+                        // error
+                        rec->errorcode = ETIMEDOUT;
+                        rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
+                        break;
+                    }
                     if (j > i)
                         j = i;
                     i = j;
+                    if (!sgIP_IP_PacingAllows(&rec->pacing, i + 40))
+                        break; // try again when the socket is allowed to send
 
                     j = rec->time_backoff;
                     j *= 2;
@@ -154,6 +320,22 @@ void sgIP_TCP_Timer(void)
                     rec->time_backoff = j; // preserve backoff
                     break;
                 }
+                if (rec->keepalive && rec->buf_tx_out == rec->buf_tx_in)
+                {
+                    // idle connection, check that the other end is still there.
+                    j = sgIP_timems - rec->time_last_rx;
+                    if (j >= rec->keepidle + rec->keepalive_probes * rec->keepintvl)
+                    {
+                        if (rec->keepalive_probes >= rec->keepcnt)
+                        {
+                            rec->errorcode = ETIMEDOUT;
+                            rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
+                            break;
+                        }
+                        sgIP_TCP_SendKeepalive(rec);
+                        rec->keepalive_probes++;
+                    }
+                }
                 break;
 
             case SGIP_TCP_STATE_FIN_WAIT_1: // sent a FIN, haven't got FIN or ACK yet. [resend fin]
@@ -171,7 +353,7 @@ void sgIP_TCP_Timer(void)
                     j *= 2;
                     if (j > SGIP_TCP_BACKOFFMAX)
                         j = SGIP_TCP_BACKOFFMAX;
-                    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_FIN, 0);
+                    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_FIN | SGIP_TCP_FLAG_ACK, 0);
                     rec->time_backoff = j; // preserve backoff
                 }
                 break;
@@ -207,14 +389,21 @@ void sgIP_TCP_Timer(void)
                 break;
         }
 
-        rec = rec->next;
+        // Wake up anything blocked on a connection that has timed out
+        if (rec->tcpstate != oldstate)
+            SGIP_NOTIFYEVENT(rec);
+
+        sgIP_Record_TCP *next = rec->next;
+        if (rec->orphan)
+            sgIP_TCP_OrphanTimer(rec, &timewait);
+        rec = next;
     }
 }
 
-unsigned long sgIP_TCP_support_seqhash(unsigned long srcip, unsigned long destip,
-                                       unsigned short srcport, unsigned short destport)
+uint32_t sgIP_TCP_support_seqhash(unsigned long srcip, unsigned long destip,
+                                  unsigned short srcport, unsigned short destport)
 {
-    unsigned long hash;
+    uint32_t hash;
     hash = destip;
     hash ^= destport * (0x02041089 + sgIP_timems);
     hash ^= srcport * (0x080810422 + (sgIP_timems << 1));
@@ -223,35 +412,237 @@ unsigned long sgIP_TCP_support_seqhash(unsigned long srcip, unsigned long destip
     return hash;
 }
 
-int sgIP_TCP_GetUnusedOutgoingPort(void)
+// Sets the local port of a record that isn't connected yet. A port of 0 picks an unused ephemeral
+// port. Ephemeral ports stay in use until the record is freed, so connections in TIME_WAIT keep
+// them until they end. Must be called with interrupts protected.
+static int sgIP_TCP_SetLocalPort(sgIP_Record_TCP *rec, int srcport)
 {
-    int myport, clear;
-    sgIP_Record_TCP *rec;
-    port_counter += (sgIP_timems & 1023); // semi-random
+    int reserved = 1;
+
+    if (srcport == 0)
+    {
+        int port = sgIP_Ports_Alloc(&tcp_ports);
+        if (port == 0)
+            return SGIP_ERROR(EADDRNOTAVAIL);
+        srcport = htons(port);
+    }
+    else
+    {
+        reserved = sgIP_Ports_Reserve(&tcp_ports, ntohs(srcport));
+    }
+
+    if (rec->srcport_reserved)
+        sgIP_Ports_Release(&tcp_ports, ntohs(rec->srcport));
+    rec->srcport          = srcport;
+    rec->srcport_reserved = reserved;
+    return 0;
+}
 
-    if (port_counter > SGIP_TCP_LASTOUTGOINGPORT)
-        port_counter = SGIP_TCP_FIRSTOUTGOINGPORT;
+// Returns the length of the data of the TCP option "kind" and a pointer to it, or -1 if the segment
+// doesn't have that option.
+static int sgIP_TCP_FindOption(sgIP_Header_TCP *tcp, int kind, unsigned char **data)
+{
+    unsigned char *opt = (unsigned char *)tcp + 20;
+    unsigned char *end = (unsigned char *)tcp + (tcp->dataofs_ >> 4) * 4;
 
-    while (1)
+    while (opt < end)
     {
-        rec    = tcprecords;
-        myport = port_counter++;
-        if (port_counter > SGIP_TCP_LASTOUTGOINGPORT)
-            port_counter = SGIP_TCP_FIRSTOUTGOINGPORT;
-        clear = 1;
-        while (rec)
+        if (opt[0] == SGIP_TCP_OPTION_END)
+            break;
+        if (opt[0] == SGIP_TCP_OPTION_NOP)
         {
-            if (rec->srcport == myport && rec->tcpstate != SGIP_TCP_STATE_CLOSED
-                && rec->tcpstate != SGIP_TCP_STATE_NODATA)
-            {
-                clear = 0;
-                break;
-            }
-            rec = rec->next;
+            opt++;
+            continue;
+        }
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+            break; // malformed
+        if (opt[0] == kind)
+        {
+            *data = opt + 2;
+            return opt[1] - 2;
+        }
+        opt += opt[1];
+    }
+
+    return -1;
+}
+
+// The key is made when the first cookie is needed, so that the platform has had time to seed the
+// random numbers, and it's replaced every SGIP_TCP_FASTOPEN_KEYMS. Cookies made with the previous
+// key are still accepted, so clients don't lose theirs right after a change (RFC 7413 section
+// 4.1.2).
+static void sgIP_TCP_FastOpenUpdateKeys(void)
+{
+    int age = (int)(sgIP_timems - tfo_key_time);
+    if (tfo_num_keys > 0 && age < SGIP_TCP_FASTOPEN_KEYMS)
+        return;
+
+    // The previous key is forgotten too if it's older than that.
+    memcpy(tfo_keys[1], tfo_keys[0], sizeof(tfo_keys[0]));
+    tfo_num_keys = (tfo_num_keys > 0 && age < 2 * SGIP_TCP_FASTOPEN_KEYMS) ? 2 : 1;
+
+    for (int i = 0; i < 4; i++)
+        tfo_keys[0][i] = sgIP_Random_Get();
+    tfo_key_time = sgIP_timems;
+}
+
+// Cookie that a client at "ip" has to present to open a connection with TCP Fast Open. It's a
+// SipHash of the address of the client.
+static void sgIP_TCP_FastOpenCookie(unsigned long ip, const uint32_t *key, unsigned char *cookie)
+{
+    uint32_t addr = ip;
+    uint64_t hash = sgIP_SipHash(key, &addr, sizeof(addr));
+    for (int i = 0; i < SGIP_TCP_FASTOPEN_COOKIELEN; i++)
+        cookie[i] = hash >> (8 * i);
+}
+
+static int sgIP_TCP_FastOpenCheckCookie(unsigned long ip, const unsigned char *cookie)
+{
+    unsigned char valid[SGIP_TCP_FASTOPEN_COOKIELEN];
+    for (int i = 0; i < tfo_num_keys; i++)
+    {
+        sgIP_TCP_FastOpenCookie(ip, tfo_keys[i], valid);
+        if (memcmp(cookie, valid, SGIP_TCP_FASTOPEN_COOKIELEN) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+// Returns the length of the cookie stored for the server at "ip", or 0 if there isn't any.
+static int sgIP_TCP_FastOpenFindCookie(unsigned long ip, unsigned char **cookie)
+{
+    for (int i = 0; i < SGIP_TCP_FASTOPEN_MAXCOOKIES; i++)
+    {
+        if (tfo_cookies[i].len != 0 && tfo_cookies[i].ip == ip)
+        {
+            *cookie = tfo_cookies[i].cookie;
+            return tfo_cookies[i].len;
+        }
+    }
+
+    return 0;
+}
+
+static void sgIP_TCP_FastOpenStoreCookie(unsigned long ip, const unsigned char *cookie, int len)
+{
+    // RFC 7413 section 4.1.1: cookies are between 4 and 16 bytes long, and of even length.
+    if (len < 4 || len > SGIP_TCP_FASTOPEN_MAXCOOKIELEN || (len & 1))
+        return;
+
+    int slot = -1;
+    for (int i = 0; i < SGIP_TCP_FASTOPEN_MAXCOOKIES; i++)
+    {
+        if (tfo_cookies[i].len != 0 && tfo_cookies[i].ip == ip)
+        {
+            slot = i;
+            break;
         }
-        if (clear)
-            return myport;
     }
+    if (slot < 0)
+    {
+        slot             = tfo_cookies_next;
+        tfo_cookies_next = (tfo_cookies_next + 1) % SGIP_TCP_FASTOPEN_MAXCOOKIES;
+    }
+
+    tfo_cookies[slot].ip  = ip;
+    tfo_cookies[slot].len = len;
+    for (int i = 0; i < len; i++)
+        tfo_cookies[slot].cookie[i] = cookie[i];
+}
+
+// Number of connections opened with TCP Fast Open that are waiting to be accepted and haven't
+// completed the handshake (RFC 7413 section 5.1).
+static int sgIP_TCP_FastOpenPending(sgIP_Record_TCP *listener)
+{
+    int count = 0;
+    for (int i = 0; i < listener->maxlisten && listener->listendata[i]; i++)
+    {
+        if (listener->listendata[i]->tfo_child)
+            count++;
+    }
+    return count;
+}
+
+// Adds a new record to the listen queue of a listening record. Returns NULL if the queue is full.
+static sgIP_Record_TCP *sgIP_TCP_AllocListenRecord(sgIP_Record_TCP *listener)
+{
+    int j;
+    for (j = 0; j < listener->maxlisten; j++)
+        if (!listener->listendata[j])
+            break; // find last entry in listen queue
+    if (j == listener->maxlisten)
+        return NULL;
+
+    sgIP_Record_TCP *rec = sgIP_TCP_AllocRecord();
+    if (!rec)
+        return NULL;
+
+    listener->listendata[j] = rec;
+    j++;
+    if (j != listener->maxlisten)
+        listener->listendata[j] = 0;
+
+    // connections inherit the keepalive settings of the listening socket
+    rec->keepalive = listener->keepalive;
+    rec->keepidle  = listener->keepidle;
+    rec->keepintvl = listener->keepintvl;
+    rec->keepcnt   = listener->keepcnt;
+
+    sgIP_IP_PacingInit(&rec->pacing, listener->pacing.rate);
+    rec->linger = listener->linger;
+
+    return rec;
+}
+
+// Handles a SYN that carries a valid Fast Open cookie: the connection is created right away and the
+// data in the SYN is handed to the application. Returns 0 if it has to fall back to the regular
+// three-way handshake.
+static int sgIP_TCP_FastOpenAccept(sgIP_Record_TCP *listener, sgIP_memblock *mb,
+                                   unsigned long srcip, unsigned long destip)
+{
+    sgIP_Header_TCP *tcp = (sgIP_Header_TCP *)mb->datastart;
+    int datastart        = (tcp->dataofs_ >> 4) * 4;
+    int datalen          = mb->totallength - datastart;
+    if (datalen <= 0 || datalen >= SGIP_TCP_RECEIVEBUFFERMIN)
+        return 0;
+    if (sgIP_TCP_FastOpenPending(listener) >= listener->tfo_qlen)
+        return 0;
+
+    sgIP_Record_TCP *rec = sgIP_TCP_AllocListenRecord(listener);
+    if (!rec)
+        return 0;
+
+    uint32_t iss = sgIP_TCP_support_seqhash(srcip, destip, tcp->srcport, tcp->destport);
+
+    // fill in data about the connection. Our SYN is counted as acknowledged already, so that the
+    // application can start replying before the handshake completes.
+    rec->tcpstate         = SGIP_TCP_STATE_ESTABLISHED;
+    rec->time_last_action = sgIP_timems;
+    rec->time_backoff     = SGIP_TCP_GENRETRYMS; // backoff timer
+    rec->srcip            = destip;
+    rec->destip           = srcip;
+    rec->srcport          = tcp->destport;
+    rec->destport         = tcp->srcport;
+    rec->sequence         = iss + 1;
+    rec->sequence_next    = rec->sequence;
+    rec->sequence_max     = rec->sequence;
+    rec->ack              = htonl(tcp->seqnum) + 1 + datalen;
+    rec->rxwindow         = rec->ack + rec->buf_rx_size - 1 - datalen; // last byte in window
+    rec->txwindow         = rec->sequence + htons(tcp->window);
+    rec->max_txwindow     = htons(tcp->window);
+    rec->tfo_child        = 1;
+    rec->tfo_iss          = iss;
+
+    sgIP_memblock_CopyToLinear(mb, rec->buf_rx, datastart, datalen);
+    rec->buf_rx_out = datalen;
+
+    sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK, iss, rec->ack, destip, srcip,
+                          rec->srcport, rec->destport, (int)(rec->rxwindow - rec->ack));
+
+    // the listening socket has a connection ready to be accepted
+    SGIP_NOTIFYEVENT(listener);
+    return 1;
 }
 
 int sgIP_TCP_CalcChecksum(sgIP_memblock *mb, unsigned long srcip, unsigned long destip,
@@ -260,9 +651,6 @@ int sgIP_TCP_CalcChecksum(sgIP_memblock *mb, unsigned long srcip, unsigned long
     if (!mb)
         return 0;
 
-    if (mb->totallength & 1)
-        mb->datastart[mb->totallength] = 0;
-
     int checksum = sgIP_memblock_IPChecksum(mb, 0, mb->totallength);
     // add in checksum of "faux header"
     checksum += (destip & 0xFFFF);
@@ -277,6 +665,143 @@ int sgIP_TCP_CalcChecksum(sgIP_memblock *mb, unsigned long srcip, unsigned long
     return checksum;
 }
 
+// Adds a round-trip time measurement to the estimate (RFC 6298 section 2).
+static void sgIP_TCP_UpdateRTT(sgIP_Record_TCP *rec, int rtt)
+{
+    if (rtt < 1)
+        rtt = 1; // below the resolution of the timer, and 0 means "not measured"
+    if (rec->min_rtt == 0 || rtt < rec->min_rtt)
+        rec->min_rtt = rtt;
+
+    if (rec->srtt == 0)
+    {
+        rec->srtt   = rtt << 3;
+        rec->rttvar = rtt << 1;
+        return;
+    }
+
+    int delta = rtt - (rec->srtt >> 3);
+    rec->srtt += delta; // srtt = 7/8 srtt + 1/8 rtt
+    if (delta < 0)
+        delta = -delta;
+    rec->rttvar += delta - (rec->rttvar >> 2); // rttvar = 3/4 rttvar + 1/4 |delta|
+}
+
+// Largest receive buffer of a single connection, so that one bulk transfer leaves room in the
+// budget for the other connections.
+static int sgIP_TCP_RxBufferMax(void)
+{
+    int size = tcp_rx_budget / 2;
+    if (size > SGIP_TCP_RECEIVEBUFFERMAX)
+        size = SGIP_TCP_RECEIVEBUFFERMAX;
+    if (size < SGIP_TCP_RECEIVEBUFFERMIN)
+        size = SGIP_TCP_RECEIVEBUFFERMIN;
+    return size;
+}
+
+// Changes the size of the receive buffer, keeping the data in it. If the new buffer has less free
+// space than the window that we have advertised, the right edge of the window moves to the left.
+// That is allowed but discouraged (RFC 9293 section 3.8.6), so it is only done to idle
+// connections, or when the application asks for it. Returns 0 on failure.
+static int sgIP_TCP_ResizeRxBuffer(sgIP_Record_TCP *rec, int size)
+{
+    int len = rec->buf_rx_out - rec->buf_rx_in;
+    if (len < 0)
+        len += rec->buf_rx_size;
+    if (len >= size)
+        return 0;
+
+    unsigned char *buf = sgIP_malloc(size);
+    if (!buf)
+        return 0;
+
+    if (rec->buf_rx_out < rec->buf_rx_in)
+    {
+        // the data wraps around the end of the old buffer
+        int first = rec->buf_rx_size - rec->buf_rx_in;
+        memcpy(buf, rec->buf_rx + rec->buf_rx_in, first);
+        memcpy(buf + first, rec->buf_rx, rec->buf_rx_out);
+    }
+    else
+    {
+        memcpy(buf, rec->buf_rx + rec->buf_rx_in, len);
+    }
+    sgIP_free(rec->buf_rx);
+
+    tcp_rx_memory += size - rec->buf_rx_size;
+    rec->buf_rx      = buf;
+    rec->buf_rx_size = size;
+    rec->buf_rx_in   = 0;
+    rec->buf_rx_out  = len;
+
+    if ((int)(rec->rxwindow - rec->ack) > size - 1 - len)
+        rec->rxwindow = rec->ack + size - 1 - len;
+    return 1;
+}
+
+// Receive buffer autotuning ("dynamic right-sizing"), called when data is received. Once per
+// round trip, the buffer is grown to hold twice the data received during the last round trip:
+// one window of data in flight, and one more that the application hasn't read yet.
+static void sgIP_TCP_RxAutotune(sgIP_Record_TCP *rec)
+{
+    unsigned long now = sgIP_timems;
+    rec->rx_time_data = now;
+
+    if (!rec->rx_measuring && rec->rx_rtt == 0)
+    {
+        // first data of the connection, or the first data after being idle
+        rec->rx_measuring  = 1;
+        rec->rx_rtt_seq    = rec->rxwindow;
+        rec->rx_rtt_time   = now;
+        rec->rx_space_seq  = rec->ack;
+        rec->rx_space_time = now;
+        return;
+    }
+
+    // Without timestamps, the receiver can only measure the time that it takes for the sender to
+    // fill the window that we have advertised. That's an upper bound of the round-trip time, and
+    // it's exact when the sender is limited by our window, which is when it matters.
+    if (rec->rx_measuring && (int)(rec->ack - rec->rx_rtt_seq) >= 0)
+    {
+        int rtt = now - rec->rx_rtt_time;
+        if (rtt < 1)
+            rtt = 1;
+        if (rec->rx_rtt == 0 || rtt < rec->rx_rtt)
+            rec->rx_rtt = rtt;
+        else
+            rec->rx_rtt += (rtt - rec->rx_rtt) >> 3;
+        rec->rx_measuring = 0;
+    }
+    if (!rec->rx_measuring)
+    {
+        rec->rx_measuring = 1;
+        rec->rx_rtt_seq   = rec->rxwindow;
+        rec->rx_rtt_time  = now;
+    }
+
+    // the estimate of the sender side is better, if we have sent any data
+    int rtt = rec->rx_rtt;
+    if (rec->srtt && (rtt == 0 || (rec->srtt >> 3) < rtt))
+        rtt = rec->srtt >> 3;
+    if (rtt == 0 || (int)(now - rec->rx_space_time) < rtt)
+        return;
+
+    int received       = (int)(rec->ack - rec->rx_space_seq);
+    rec->rx_space_seq  = rec->ack;
+    rec->rx_space_time = now;
+    if (rec->rx_locked)
+        return;
+
+    int size = 2 * (received + sgIP_IP_MaxContentsSize(rec->destip) - 20);
+    size     = (size + 1023) & ~1023;
+    if (size > sgIP_TCP_RxBufferMax())
+        size = sgIP_TCP_RxBufferMax();
+    if (size > tcp_rx_budget - tcp_rx_memory + rec->buf_rx_size)
+        size = tcp_rx_budget - tcp_rx_memory + rec->buf_rx_size;
+    if (size > rec->buf_rx_size)
+        sgIP_TCP_ResizeRxBuffer(rec, size);
+}
+
 int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long destip)
 {
     if (!mb)
@@ -284,7 +809,7 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
 
     sgIP_Header_TCP *tcp;
     int delta1, delta2, delta3, datalen, shouldReply;
-    unsigned long tcpack, tcpseq;
+    uint32_t tcpack, tcpseq, finseq;
     tcp = (sgIP_Header_TCP *)mb->datastart;
 
     //                      01234567890123456789012345678901
@@ -320,35 +845,20 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
     {
         // could be completion of an incoming connection?
         tcpack = htonl(tcp->acknum);
-        if (tcp->tcpflags & SGIP_TCP_FLAG_ACK)
+        if ((tcp->tcpflags & (SGIP_TCP_FLAG_ACK | SGIP_TCP_FLAG_RST)) == SGIP_TCP_FLAG_ACK)
         {
-            int i, j;
+            int i;
             for (i = 0; i < numsynlist; i++)
             {
                 if (synlist[i].localseq + 1 == tcpack) // oki! this is probably legit ;)
                 {
-                    rec = synlist[i].linked; // we have the data we need.
-                    // remove entry from synlist
-                    numsynlist--;
-                    for (; i < numsynlist; i++)
-                    {
-                        synlist[i] = synlist[i + 1]; // assume struct copy
-                    }
-                    for (j = 0; j < rec->maxlisten; j++)
-                        if (!rec->listendata[j])
-                            break; // find last entry in listen queue
-                    if (j == rec->maxlisten)
-                    {
-                        rec = 0;
-                        break;
-                    } // discard this connection! we have no space in the listen queue.
+                    sgIP_Record_TCP *synlist_linked = synlist[i].linked;
 
-                    rec->listendata[j] = sgIP_TCP_AllocRecord();
-                    j++;
-                    if (j != rec->maxlisten)
-                        rec->listendata[j] = 0;
-
-                    rec = rec->listendata[j - 1];
+                    rec = synlist_linked; // we have the data we need.
+                    sgIP_TCP_RemoveSyn(i);
+                    rec = sgIP_TCP_AllocListenRecord(synlist_linked);
+                    if (!rec)
+                        break; // discard this connection! we have no space in the listen queue.
 
                     // fill in data about the connection.
                     rec->tcpstate         = SGIP_TCP_STATE_ESTABLISHED;
@@ -361,33 +871,91 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
                     rec->sequence         = htonl(tcp->acknum);
                     rec->ack              = htonl(tcp->seqnum);
                     rec->sequence_next    = rec->sequence;
-                    rec->rxwindow         = rec->ack + 1400; // last byte in receive window
+                    rec->sequence_max     = rec->sequence;
+                    rec->rxwindow         = rec->ack + SGIP_TCP_RECEIVEBUFFERMIN - 1; // last byte
                     rec->txwindow         = rec->sequence + htons(tcp->window);
+                    rec->max_txwindow     = htons(tcp->window);
 
-                    sgIP_memblock_free(mb);
-                    return 0;
+                    // the listening socket has a connection ready to be accepted
+                    SGIP_NOTIFYEVENT(synlist_linked);
+
+                    // The ACK may carry data already. Handle it like any other segment of the
+                    // connection.
+                    break;
                 }
             }
         }
     }
+    if (!rec && (tcp->tcpflags & SGIP_TCP_FLAG_RST))
+    {
+        // The client of a connection that hasn't answered our SYN-ACK yet has given up, or it
+        // doesn't know about that connection. Stop sending the SYN-ACK.
+        for (int i = 0; i < numsynlist; i++)
+        {
+            if (synlist[i].remoteip == srcip && synlist[i].remoteport == tcp->srcport
+                && synlist[i].localport == tcp->destport
+                && synlist[i].remoteseq == ntohl(tcp->seqnum))
+            {
+                sgIP_TCP_RemoveSyn(i);
+                break;
+            }
+        }
+    }
     if (!rec)
     {
         // we don't have a clue what this one is.
 #ifndef SGIP_TCP_STEALTH
-        // send a RST
-        sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_RST, ntohl(tcp->acknum), 0, destip, srcip,
-                              tcp->destport, tcp->srcport, 0);
+        // send a RST, unless it's a RST itself: two hosts that have both forgotten a connection
+        // would answer each other forever (RFC 793, section 3.4). A segment without ACK, like a
+        // SYN to a closed port, gets a RST that acknowledges it, or it wouldn't be accepted.
+        if (!(tcp->tcpflags & SGIP_TCP_FLAG_RST))
+        {
+            if (tcp->tcpflags & SGIP_TCP_FLAG_ACK)
+            {
+                sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_RST, ntohl(tcp->acknum), 0, destip, srcip,
+                                      tcp->destport, tcp->srcport, 0);
+            }
+            else
+            {
+                tcpseq = ntohl(tcp->seqnum) + mb->totallength - (tcp->dataofs_ >> 4) * 4;
+                if (tcp->tcpflags & SGIP_TCP_FLAG_SYN)
+                    tcpseq++;
+                if (tcp->tcpflags & SGIP_TCP_FLAG_FIN)
+                    tcpseq++;
+                sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_RST | SGIP_TCP_FLAG_ACK, 0, tcpseq, destip,
+                                      srcip, tcp->destport, tcp->srcport, 0);
+            }
+        }
 #endif
         sgIP_memblock_free(mb);
         return 0;
     }
+    SGIP_TCP_COUNT(rec, segs_in, 1);
+
     // check sequence and ACK numbers, to ensure they're in range.
     tcpack      = htonl(tcp->acknum);
     tcpseq      = htonl(tcp->seqnum);
     datalen     = mb->totallength - (tcp->dataofs_ >> 4) * 4;
+    finseq      = tcpseq + datalen; // sequence number of a FIN, after the data
     shouldReply = 0;
     if (tcp->tcpflags & SGIP_TCP_FLAG_RST) // verify if rst is legit, and act on it.
     {
+        if (rec->tcpstate == SGIP_TCP_STATE_SYN_SENT)
+        {
+            // There is no receive window yet. The RST is legit if it acknowledges our SYN, which
+            // means that nobody is listening on that port. With Fast Open it may acknowledge the
+            // data of the SYN too (RFC 793, page 66: SND.UNA < SEG.ACK =< SND.NXT).
+            if ((tcp->tcpflags & SGIP_TCP_FLAG_ACK) && (int)(tcpack - rec->sequence) > 0
+                && (int)(tcpack - rec->sequence_max) <= 0)
+            {
+                rec->errorcode = ECONNREFUSED;
+                rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
+                SGIP_NOTIFYEVENT(rec);
+            }
+            sgIP_memblock_free(mb);
+            return 0;
+        }
+
         // check seq against receive window
         delta1 = (int)(tcpseq - rec->ack);
         delta2 = (int)(rec->rxwindow - tcpseq);
@@ -400,17 +968,37 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
             // in range! reset connection.
             rec->errorcode = ECONNRESET;
             rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
+            SGIP_NOTIFYEVENT(rec);
         }
         sgIP_memblock_free(mb);
         return 0;
     }
 
+    if (rec->tfo_child
+        && (tcp->tcpflags & (SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK)) == SGIP_TCP_FLAG_SYN)
+    {
+        // The client didn't get our SYN-ACK and sent its SYN again.
+        sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK, rec->tfo_iss, rec->ack, destip,
+                              srcip, rec->srcport, rec->destport, (int)(rec->rxwindow - rec->ack));
+        sgIP_memblock_free(mb);
+        return 0;
+    }
+
+    if (rec->tcpstate == SGIP_TCP_STATE_SYN_SENT && !(tcp->tcpflags & SGIP_TCP_FLAG_SYN))
+    {
+        // Nothing but the SYN of the other end is valid yet (RFC 793, page 68). A Fast Open server
+        // may send data before its SYN-ACK arrives, and its ACK would move our sequence number.
+        sgIP_memblock_free(mb);
+        return 0;
+    }
+
     // doesn't work very well with SYN.
     if ((tcp->tcpflags & SGIP_TCP_FLAG_ACK) && !(tcp->tcpflags & SGIP_TCP_FLAG_SYN))
     {
-        // verify ack value (checking ack sequence vs transmit window)
+        // verify ack value: it can't acknowledge anything that we haven't sent. Window probes
+        // send data past the window, so the window can't be used as the limit.
         delta1 = (int)(tcpack - rec->sequence);
-        delta2 = (int)(rec->txwindow - tcpack);
+        delta2 = (int)(rec->sequence_max - tcpack);
         if (delta1 < 0 || delta2 < 0)
         {
             // invalid ack range, discard packet
@@ -419,14 +1007,43 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
         }
         delta2        = tcpack - rec->sequence;
         rec->sequence = tcpack;
+        // the ACK of our FIN acknowledges one more byte than the data in the buffer
+        delta3 = rec->buf_tx_out - rec->buf_tx_in;
+        if (delta3 < 0)
+            delta3 += SGIP_TCP_TRANSMITBUFFERLENGTH;
+        if (delta2 > delta3)
+            delta2 = delta3;
         delta2 += rec->buf_tx_in;
         if (delta2 >= SGIP_TCP_TRANSMITBUFFERLENGTH)
             delta2 -= SGIP_TCP_TRANSMITBUFFERLENGTH;
         rec->buf_tx_in = delta2;
         if (delta1 > 0)
-            shouldReply = 1;
+        {
+            shouldReply     = 1;
+            rec->retrycount = 0;
+            SGIP_TCP_COUNT(rec, bytes_acked, delta1);
+            if (rec->rtt_timing && (int)(tcpack - rec->rtt_seq) >= 0)
+            {
+                sgIP_TCP_UpdateRTT(rec, sgIP_timems - rec->rtt_time);
+                rec->rtt_timing = 0;
+            }
+        }
+        else if (datalen == 0 && rec->sequence != rec->sequence_max
+                 && !(tcp->tcpflags & SGIP_TCP_FLAG_FIN)
+                 && rec->txwindow == rec->sequence + htons(tcp->window))
+        {
+            // nothing new, while we have data in flight (RFC 5681 section 2)
+            SGIP_TCP_COUNT(rec, dup_acks, 1);
+        }
+        rec->tfo_child = 0; // the handshake of TFO connections is complete
     }
     rec->txwindow = rec->sequence + htons(tcp->window);
+    if (htons(tcp->window) > rec->max_txwindow)
+        rec->max_txwindow = htons(tcp->window);
+
+    // the other end is alive, restart the keepalive timer.
+    rec->time_last_rx     = sgIP_timems;
+    rec->keepalive_probes = 0;
 
     // now, decide what to do with our nice new shiny memblock...
 
@@ -447,6 +1064,12 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
         case SGIP_TCP_STATE_ESTABLISHED:  // syns have been exchanged
         case SGIP_TCP_STATE_FIN_WAIT_1:   // sent a FIN, haven't got FIN or ACK yet.
         case SGIP_TCP_STATE_FIN_WAIT_2:   // got ACK for our FIN, haven't got FIN yet.
+            if (rec->orphan && datalen > 0 && (int)(tcpseq + datalen - rec->ack) > 0)
+            {
+                // new data, but the socket has been closed and nobody can read it
+                sgIP_TCP_Abort(rec);
+                break;
+            }
             if (tcp->tcpflags & SGIP_TCP_FLAG_ACK)
             {
                 // check end of incoming data against receive window
@@ -463,7 +1086,11 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
 
                 if (delta1 < 0 || delta2 < 0 || delta3 < 0)
                 {
-                    if (delta1 > -SGIP_TCP_RECEIVEBUFFERLENGTH)
+                    if (delta1 < 0)
+                        SGIP_TCP_COUNT(rec, dup_segs, 1);
+                    else if (delta3 < 0)
+                        SGIP_TCP_COUNT(rec, ooo_drops, 1); // there is a hole before it
+                    if (delta1 > -rec->buf_rx_size)
                     {
                         // ack it anyway, they got lost on the retard bus.
                         sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
@@ -478,15 +1105,17 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
                         // data is partly ack'd...just copy what we need.
                         datastart -= delta1;
                         datalen += delta1;
+                        SGIP_TCP_COUNT(rec, dup_segs, 1);
                     }
                     // copy data into the fifo
                     rec->ack += datalen;
+                    SGIP_TCP_COUNT(rec, bytes_received, datalen);
                     delta1 = datalen;
                     while (datalen > 0)
                     {
                         // don't actually need to check the rx buffer length, if the ack check
                         // approved it, it will be in range (not overflow) by default
-                        delta2 = SGIP_TCP_RECEIVEBUFFERLENGTH
+                        delta2 = rec->buf_rx_size
                                  - rec->buf_rx_out; // number of bytes til the end of the buffer
                         if (datalen < delta2)
                             delta2 = datalen;
@@ -495,15 +1124,21 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
                         datalen -= delta2;
                         datastart += delta2;
                         rec->buf_rx_out += delta2;
-                        if (rec->buf_rx_out >= SGIP_TCP_RECEIVEBUFFERLENGTH)
-                            rec->buf_rx_out -= SGIP_TCP_RECEIVEBUFFERLENGTH;
+                        if (rec->buf_rx_out >= rec->buf_rx_size)
+                            rec->buf_rx_out -= rec->buf_rx_size;
                     }
+                    if (delta1 > 0)
+                        sgIP_TCP_RxAutotune(rec);
                     if (rec->tcpstate == SGIP_TCP_STATE_FIN_WAIT_1
                         || rec->tcpstate == SGIP_TCP_STATE_FIN_WAIT_2)
                         break;
-                    if (shouldReply || delta1 >= 0)
+                    // Acknowledge the data, and send more of ours if the segment has acknowledged
+                    // some. Segments without data that acknowledge nothing new don't get a reply:
+                    // two stacks that answer them would send ACKs to each other forever, and
+                    // resending our data every time would duplicate it every round trip.
+                    delta3 = delta1; // data received
+                    if (shouldReply || delta3 > 0)
                     {
-                        // send a packet in reply, ha!
                         delta1 = rec->buf_tx_out - rec->buf_tx_in;
                         if (delta1 < 0)
                             delta1 += SGIP_TCP_TRANSMITBUFFERLENGTH;
@@ -513,7 +1148,11 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
                         delta2 = sgIP_IP_MaxContentsSize(rec->destip) - 20; // max tcp data size
                         if (delta1 > delta2)
                             delta1 = delta2;
-                        if (delta1 >= 0)
+                        // Our data would start at the first unacknowledged byte. Don't resend
+                        // what is still in flight just to acknowledge theirs.
+                        if (rec->sequence_max != rec->sequence)
+                            delta1 = 0;
+                        if (delta1 > 0 || (delta1 == 0 && delta3 > 0))
                         {
                             // could be less than 0, but very odd.
                             sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, delta1);
@@ -535,30 +1174,79 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
             if (tcp->tcpflags & SGIP_TCP_FLAG_SYN)
             {
                 // other end requesting a connection
-                if (numsynlist == SGIP_TCP_MAXSYNS)
+                unsigned char *cookie;
+                unsigned char mycookie[SGIP_TCP_FASTOPEN_COOKIELEN];
+                int cookielen = -1;
+                if (rec->tfo_qlen > 0)
                 {
-                    numsynlist--;
-                    for (delta1 = 0; delta1 < numsynlist; delta1++)
+                    cookielen = sgIP_TCP_FindOption(tcp, SGIP_TCP_OPTION_FASTOPEN, &cookie);
+                    if (cookielen >= 0)
                     {
-                        synlist[delta1] = synlist[delta1 + 1]; // assume struct copy
+                        sgIP_TCP_FastOpenUpdateKeys();
+                        sgIP_TCP_FastOpenCookie(srcip, tfo_keys[0], mycookie);
                     }
                 }
+                if (cookielen == SGIP_TCP_FASTOPEN_COOKIELEN
+                    && sgIP_TCP_FastOpenCheckCookie(srcip, cookie)
+                    && sgIP_TCP_FastOpenAccept(rec, mb, srcip, destip))
                 {
-                    unsigned long myseq, myport;
-                    myport = tcp->destport;
-                    myseq  = sgIP_TCP_support_seqhash(srcip, destip, tcp->srcport, myport);
-                    // send relevant synack
-                    sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK, myseq, tcpseq + 1,
-                                          destip, srcip, myport, tcp->srcport, -1);
-                    synlist[numsynlist].localseq    = myseq;
-                    synlist[numsynlist].timebackoff = SGIP_TCP_SYNRETRYMS;
-                    synlist[numsynlist].timenext    = SGIP_TCP_SYNRETRYMS;
-                    synlist[numsynlist].linked      = rec;
-                    synlist[numsynlist].remoteseq   = tcpseq + 1;
-                    synlist[numsynlist].remoteip    = srcip;
-                    synlist[numsynlist].localip     = destip;
-                    synlist[numsynlist].localport   = myport;
-                    synlist[numsynlist].remoteport  = tcp->srcport;
+                    sgIP_memblock_free(mb);
+                    return 0;
+                }
+
+                unsigned long myseq, myport;
+                myport = tcp->destport;
+                myseq  = sgIP_TCP_support_seqhash(srcip, destip, tcp->srcport, myport);
+
+                // A SYN sent again replaces the entry of the first one. If our SYN-ACK has been
+                // lost, the new one must have the same sequence number, the first one may arrive
+                // late.
+                for (delta1 = 0; delta1 < numsynlist; delta1++)
+                {
+                    if (synlist[delta1].remoteip == srcip
+                        && synlist[delta1].remoteport == tcp->srcport
+                        && synlist[delta1].localport == tcp->destport)
+                    {
+                        if (synlist[delta1].remoteseq == tcpseq + 1)
+                            myseq = synlist[delta1].localseq;
+                        sgIP_TCP_RemoveSyn(delta1);
+                        break;
+                    }
+                }
+                if (numsynlist == SGIP_TCP_MAXSYNS)
+                    sgIP_TCP_RemoveSyn(0);
+                {
+                    // send relevant synack. Any data in the SYN is ignored, the client will send it
+                    // again. If the client asked for a Fast Open cookie, or sent a bad one, give it
+                    // the right one.
+                    if (cookielen >= 0)
+                    {
+                        unsigned char options[4 + SGIP_TCP_FASTOPEN_COOKIELEN];
+                        options[0] = SGIP_TCP_OPTION_NOP;
+                        options[1] = SGIP_TCP_OPTION_NOP;
+                        options[2] = SGIP_TCP_OPTION_FASTOPEN;
+                        options[3] = 2 + SGIP_TCP_FASTOPEN_COOKIELEN;
+                        for (delta1 = 0; delta1 < SGIP_TCP_FASTOPEN_COOKIELEN; delta1++)
+                            options[4 + delta1] = mycookie[delta1];
+                        sgIP_TCP_SendSynReplyOptions(SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK, myseq,
+                                                     tcpseq + 1, destip, srcip, myport,
+                                                     tcp->srcport, -1, options, sizeof(options));
+                    }
+                    else
+                    {
+                        sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK, myseq,
+                                              tcpseq + 1, destip, srcip, myport, tcp->srcport, -1);
+                    }
+                    synlist[numsynlist].localseq    = myseq;
+                    synlist[numsynlist].timebackoff = SGIP_TCP_SYNRETRYMS;
+                    synlist[numsynlist].timenext    = SGIP_TCP_SYNRETRYMS;
+                    synlist[numsynlist].retrycount  = 0;
+                    synlist[numsynlist].linked      = rec;
+                    synlist[numsynlist].remoteseq   = tcpseq + 1;
+                    synlist[numsynlist].remoteip    = srcip;
+                    synlist[numsynlist].localip     = destip;
+                    synlist[numsynlist].localport   = myport;
+                    synlist[numsynlist].remoteport  = tcp->srcport;
                     numsynlist++;
                 }
             }
@@ -568,15 +1256,39 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
             switch (tcp->tcpflags & (SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK))
             {
                 case SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK: // both flags set
-                    // FIXME: shall check ack againts our seq instead.
-                    rec->ack      = tcpseq + 1;
-                    rec->sequence = tcpack;
-                    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
+                    // The server may acknowledge any part of the data sent with our SYN.
+                    delta1 = (int)(tcpack - (rec->sequence + 1));
+                    if (delta1 < 0 || delta1 > rec->tfo_syndata)
+                    {
+                        // not an answer to our SYN (RFC 793, page 66)
+                        sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_RST, tcpack, 0, destip, srcip,
+                                              tcp->destport, tcp->srcport, 0);
+                        break;
+                    }
+                    {
+                        // remember the Fast Open cookie if the server gave us one
+                        unsigned char *cookie;
+                        int cookielen = sgIP_TCP_FindOption(tcp, SGIP_TCP_OPTION_FASTOPEN, &cookie);
+                        if (cookielen > 0)
+                            sgIP_TCP_FastOpenStoreCookie(rec->destip, cookie, cookielen);
+                    }
+                    delta1 += rec->buf_tx_in;
+                    if (delta1 >= SGIP_TCP_TRANSMITBUFFERLENGTH)
+                        delta1 -= SGIP_TCP_TRANSMITBUFFERLENGTH;
+                    rec->buf_tx_in    = delta1;
+                    rec->ack          = tcpseq + 1;
+                    rec->rxwindow     = rec->ack;
+                    rec->sequence     = tcpack;
+                    rec->txwindow     = rec->sequence + htons(tcp->window);
+                    rec->max_txwindow = htons(tcp->window);
+                    // send whatever the server didn't take with the SYN along with the ACK
+                    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, sgIP_TCP_SendLength(rec, 1));
                     rec->tcpstate   = SGIP_TCP_STATE_ESTABLISHED;
                     rec->retrycount = 0;
                     break;
                 case SGIP_TCP_FLAG_SYN: // just got a syn...
                     rec->ack      = tcpseq + 1;
+                    rec->rxwindow = rec->ack;
                     rec->sequence = tcpack;
                     sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
                     rec->tcpstate   = SGIP_TCP_STATE_SYN_RECEIVED;
@@ -596,14 +1308,12 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
         case SGIP_TCP_STATE_ESTABLISHED: // syns have been exchanged
             if (tcp->tcpflags & SGIP_TCP_FLAG_FIN)
             {
-                // check sequence against next ack number
-                delta1 = (int)(tcpseq - rec->ack);
-                // delta2=(int)(rec->rxwindow-tcpseq);
-                if (delta1 < 0 || delta1 > 0)
+                // all the data before the FIN must have been received
+                if (finseq != rec->ack)
                     break; // out of range, they should know better.
                 // this is the end...
                 rec->tcpstate = SGIP_TCP_STATE_CLOSE_WAIT;
-                rec->ack      = tcpseq + datalen + 1;
+                rec->ack      = finseq + 1;
                 sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
             }
             break;
@@ -612,28 +1322,30 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
             switch (tcp->tcpflags & (SGIP_TCP_FLAG_FIN | SGIP_TCP_FLAG_ACK))
             {
                 case SGIP_TCP_FLAG_FIN:
-                    // check sequence against next ack number
-                    delta1 = (int)(tcpseq - rec->ack);
-                    // delta2=(int)(rec->rxwindow-tcpseq);
-                    if (delta1 < 0 || delta1 > 0)
+                    // all the data before the FIN must have been received
+                    if (finseq != rec->ack)
                         break; // out of range, they should know better.
 
                     rec->tcpstate = SGIP_TCP_STATE_CLOSING;
-                    rec->ack      = tcpseq + datalen + 1;
+                    rec->ack      = finseq + 1;
                     sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
                     break;
                 case SGIP_TCP_FLAG_ACK: // already checked ack against appropriate window
-                    rec->tcpstate = SGIP_TCP_STATE_FIN_WAIT_2;
+                    // it may only acknowledge the data sent before our FIN
+                    if (rec->sequence == rec->sequence_max)
+                        rec->tcpstate = SGIP_TCP_STATE_FIN_WAIT_2;
                     break;
                 case (SGIP_TCP_FLAG_FIN
                       | SGIP_TCP_FLAG_ACK): // already checked ack, check sequence though
-                    // check sequence against next ack number
-                    delta1 = (int)(tcpseq - rec->ack);
-                    // delta2=(int)(rec->rxwindow-tcpseq);
-                    if (delta1 < 0 || delta1 > 0)
+                    // all the data before the FIN must have been received
+                    if (finseq != rec->ack)
                         break; // out of range, they should know better.
-                    rec->tcpstate = SGIP_TCP_STATE_TIME_WAIT;
-                    rec->ack      = tcpseq + datalen + 1;
+                    // both ends are closing at the same time if our FIN hasn't been acknowledged
+                    if (rec->sequence == rec->sequence_max)
+                        rec->tcpstate = SGIP_TCP_STATE_TIME_WAIT;
+                    else
+                        rec->tcpstate = SGIP_TCP_STATE_CLOSING;
+                    rec->ack      = finseq + 1;
                     sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
                     break;
             }
@@ -642,14 +1354,12 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
         case SGIP_TCP_STATE_FIN_WAIT_2: // got ACK for our FIN, haven't got FIN yet.
             if (tcp->tcpflags & SGIP_TCP_FLAG_FIN)
             {
-                // check sequence against next ack number
-                delta1 = (int)(tcpseq - rec->ack);
-                // delta2=(int)(rec->rxwindow-tcpseq);
-                if (delta1 < 0 || delta1 > 0)
+                // all the data before the FIN must have been received
+                if (finseq != rec->ack)
                     break; // out of range, they should know better.
 
                 rec->tcpstate = SGIP_TCP_STATE_TIME_WAIT;
-                rec->ack      = tcpseq + datalen + 1;
+                rec->ack      = finseq + 1;
                 sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
             }
             break;
@@ -657,10 +1367,8 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
         case SGIP_TCP_STATE_CLOSE_WAIT: // got FIN, wait for user code to close socket & send FIN
             if (tcp->tcpflags & SGIP_TCP_FLAG_FIN)
             {
-                // check sequence against next ack number
-                delta1 = (int)(tcpseq - rec->ack);
-                // delta2=(int)(rec->rxwindow-tcpseq);
-                if (delta1 < 0 || delta1 > 0)
+                // the FIN that we have acknowledged already
+                if (finseq + 1 != rec->ack)
                     break; // out of range, they should know better.
 
                 sgIP_TCP_SendPacket(
@@ -669,79 +1377,99 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
             }
             break;
 
-        case SGIP_TCP_STATE_CLOSING: // got FIN, waiting for ACK of our FIN
-            switch (tcp->tcpflags & (SGIP_TCP_FLAG_FIN | SGIP_TCP_FLAG_ACK))
-            {
-                case SGIP_TCP_FLAG_FIN:
-                    // check sequence against receive window
-                    delta1 = (int)(tcpseq - rec->ack);
-                    delta2 = (int)(rec->rxwindow - tcpseq);
-                    if (delta1 < 1 || delta2 < 0)
-                        break; // out of range, they should know better.
-
-                    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0); // resend their ack.
-                    break;
-                case SGIP_TCP_FLAG_ACK: // already checked ack against appropriate window
-                    rec->tcpstate = SGIP_TCP_STATE_TIME_WAIT;
-                    break;
-                case (SGIP_TCP_FLAG_FIN
-                      | SGIP_TCP_FLAG_ACK): // already checked ack, check sequence though
-                    // check sequence against receive window
-                    delta1 = (int)(tcpseq - rec->ack);
-                    delta2 = (int)(rec->rxwindow - tcpseq);
-                    if (delta1 < 1 || delta2 < 0)
-                        break; // out of range, they should know better.
-                    rec->tcpstate = SGIP_TCP_STATE_TIME_WAIT;
-                    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
-                    break;
-            }
-            break;
-
+        case SGIP_TCP_STATE_CLOSING:  // got FIN, waiting for ACK of our FIN
         case SGIP_TCP_STATE_LAST_ACK: // wait for ACK of our last FIN
-            switch (tcp->tcpflags & (SGIP_TCP_FLAG_FIN | SGIP_TCP_FLAG_ACK))
+            // The FIN that we have acknowledged already. Our ACK was lost, send it again.
+            if ((tcp->tcpflags & SGIP_TCP_FLAG_FIN) && finseq + 1 == rec->ack)
+                sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
+            // The ACK may only acknowledge the data sent before our FIN
+            if ((tcp->tcpflags & SGIP_TCP_FLAG_ACK) && rec->sequence == rec->sequence_max)
             {
-                case SGIP_TCP_FLAG_FIN:
-                    // check sequence against receive window
-                    delta1 = (int)(tcpseq - rec->ack);
-                    delta2 = (int)(rec->rxwindow - tcpseq);
-                    if (delta1 < 1 || delta2 < 0)
-                        break; // out of range, they should know better.
-
-                    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0); // resend their ack.
-                    break;
-                case SGIP_TCP_FLAG_ACK: // already checked ack against appropriate window
-                    rec->tcpstate = SGIP_TCP_STATE_CLOSED;
-                    break;
-                case (SGIP_TCP_FLAG_FIN
-                      | SGIP_TCP_FLAG_ACK): // already checked ack, check sequence though
-                    // check sequence against receive window
-                    delta1 = (int)(tcpseq - rec->ack);
-                    delta2 = (int)(rec->rxwindow - tcpseq);
-                    if (delta1 < 1 || delta2 < 0)
-                        break; // out of range, they should know better.
+                if (rec->tcpstate == SGIP_TCP_STATE_CLOSING)
+                {
+                    rec->tcpstate         = SGIP_TCP_STATE_TIME_WAIT;
+                    rec->time_last_action = sgIP_timems;
+                }
+                else
+                {
                     rec->tcpstate = SGIP_TCP_STATE_CLOSED;
-                    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
-                    break;
+                }
             }
             break;
 
         case SGIP_TCP_STATE_TIME_WAIT: // wait to ensure remote tcp knows it's been terminated.
-            if (tcp->tcpflags & SGIP_TCP_FLAG_FIN)
-            {
-                // check sequence against receive window
-                delta1 = (int)(tcpseq - rec->ack);
-                delta2 = (int)(rec->rxwindow - tcpseq);
-                if (delta1 < 1 || delta2 < 0)
-                    break; // out of range, they should know better.
-
-                sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0); // send 'em a grat ACK
-            }
+            // The other end didn't get the ACK of its FIN and sent it again. Acknowledge it again
+            // and restart the 2MSL timer (RFC 9293 section 3.10.7.4).
+            if ((tcp->tcpflags & SGIP_TCP_FLAG_FIN) && finseq + 1 == rec->ack)
+                sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
             break;
     }
+    // new data, free space in the TX buffer, or a change of state.
+    SGIP_NOTIFYEVENT(rec);
+
     sgIP_memblock_free(mb);
     return 0;
 }
 
+// Returns the receive window to advertise. To avoid the silly window syndrome (RFC 1122
+// 4.2.3.3), the right edge of the window is only moved when it can move by a significant amount
+// (the MSS or half of the buffer), and it is never moved to the left.
+static int sgIP_TCP_ReceiveWindow(sgIP_Record_TCP *rec)
+{
+    int windowlen = rec->buf_rx_out - rec->buf_rx_in;
+    if (windowlen < 0)
+        windowlen += rec->buf_rx_size; // we now have the amount in the buffer
+    windowlen = rec->buf_rx_size - windowlen - 1;
+    if (windowlen < 0)
+        windowlen = 0;
+    if (windowlen > SGIP_TCP_MAXWINDOW)
+        windowlen = SGIP_TCP_MAXWINDOW;
+
+    int current = (int)(rec->rxwindow - rec->ack);
+    if (current < 0)
+        current = 0;
+
+    int threshold = sgIP_IP_MaxContentsSize(rec->destip) - 20; // max tcp data size
+    if (threshold > rec->buf_rx_size / 2)
+        threshold = rec->buf_rx_size / 2;
+
+    if (windowlen < current + threshold && windowlen < SGIP_TCP_MAXWINDOW
+        && windowlen < rec->buf_rx_size - 1)
+        return current;
+
+    return windowlen;
+}
+
+// Returns the number of bytes to send from the start of the unacknowledged data. To avoid the
+// silly window syndrome (RFC 1122 4.2.3.4), it returns 0 if only a small segment could be sent,
+// unless "force" is set.
+static int sgIP_TCP_SendLength(sgIP_Record_TCP *rec, int force)
+{
+    int queued = rec->buf_tx_out - rec->buf_tx_in;
+    if (queued < 0)
+        queued += SGIP_TCP_TRANSMITBUFFERLENGTH;
+
+    int mss = sgIP_IP_MaxContentsSize(rec->destip) - 20; // max tcp data size
+
+    int len = queued;
+    int i   = (int)(rec->txwindow - rec->sequence);
+    if (len > i)
+        len = i;
+    if (len > mss)
+        len = mss;
+    if (len <= 0)
+        return 0;
+
+    // paced sockets wait for the timer to send it later
+    if (!sgIP_IP_PacingAllows(&rec->pacing, len + 40))
+        return 0;
+
+    if (force || len == mss || len == queued || len >= rec->max_txwindow / 2)
+        return len;
+
+    return 0;
+}
+
 sgIP_memblock *sgIP_TCP_GenHeader(sgIP_Record_TCP *rec, int flags, int datalength)
 {
     sgIP_memblock *mb = sgIP_memblock_alloc(datalength + 20 + sgIP_IP_RequiredHeaderSize());
@@ -759,21 +1487,12 @@ sgIP_memblock *sgIP_TCP_GenHeader(sgIP_Record_TCP *rec, int flags, int datalengt
     tcp->checksum        = 0;
     tcp->dataofs_        = 5 << 4; // header length == 20 (5*32bit)
 
-    int windowlen = rec->buf_rx_out - rec->buf_rx_in;
-    if (windowlen < 0)
-        windowlen += SGIP_TCP_RECEIVEBUFFERLENGTH; // we now have the amount in the buffer
-    windowlen = SGIP_TCP_RECEIVEBUFFERLENGTH - windowlen - 1;
-    if (windowlen < 0)
-        windowlen = 0;
+    int windowlen = sgIP_TCP_ReceiveWindow(rec);
     if (flags & SGIP_TCP_FLAG_ACK)
     {
         // indicate an additional ack should be sent when we have more space in the buffer.
-        rec->want_reack = windowlen < SGIP_TCP_REACK_THRESH;
+        rec->want_reack = windowlen < SGIP_TCP_MAXWINDOW && windowlen < rec->buf_rx_size - 1;
     }
-    if (windowlen > 65535)
-        windowlen = 65535;
-    if (windowlen > 1400)
-        windowlen = 1400;                 // don't want to deal with IP fragmentation.
     rec->rxwindow = rec->ack + windowlen; // last byte in receive window
     tcp->window   = htons(windowlen);
     return mb;
@@ -805,10 +1524,29 @@ void sgIP_TCP_FixChecksum(unsigned long srcip, unsigned long destip, sgIP_memblo
     tcp->checksum = checksum;
 }
 
+// Copies "datalength" bytes from the start of the unacknowledged data to offset "j" of a segment.
+static void sgIP_TCP_CopyTxData(sgIP_Record_TCP *rec, sgIP_memblock *mb, int j, int datalength)
+{
+    int i, k;
+    k = rec->buf_tx_in;
+    while (datalength > 0)
+    {
+        i = SGIP_TCP_TRANSMITBUFFERLENGTH - k;
+        if (i > datalength)
+            i = datalength;
+        sgIP_memblock_CopyFromLinear(mb, rec->buf_tx + k, j, i);
+        k += i;
+        if (k >= SGIP_TCP_TRANSMITBUFFERLENGTH)
+            k -= SGIP_TCP_TRANSMITBUFFERLENGTH;
+        j += i;
+        datalength -= i;
+    }
+}
+
 int sgIP_TCP_SendPacket(sgIP_Record_TCP *rec, int flags, int datalength)
 {
     // data sent is taken directly from the TX fifo.
-    int i, j, k;
+    int j;
     if (!rec)
         return 0;
 
@@ -819,6 +1557,10 @@ int sgIP_TCP_SendPacket(sgIP_Record_TCP *rec, int flags, int datalength)
         j += SGIP_TCP_TRANSMITBUFFERLENGTH;
     if (datalength > j)
         datalength = j;
+    // Segments are paced by the callers, but acknowledgements must not wait. Drop the data if it
+    // would go over the rate limit.
+    if (datalength > 0 && !sgIP_IP_PacingAllows(&rec->pacing, datalength + 40))
+        datalength = 0;
     sgIP_memblock *mb = sgIP_TCP_GenHeader(rec, flags, datalength);
     if (!mb)
     {
@@ -826,22 +1568,36 @@ int sgIP_TCP_SendPacket(sgIP_Record_TCP *rec, int flags, int datalength)
         return 0;
     }
 
-    rec->sequence_next = rec->sequence + datalength;
-
-    j = 20; // destination offset in memblock for data
-    k = rec->buf_tx_in;
-    while (datalength > 0)
+    if (datalength > 0)
     {
-        i = SGIP_TCP_TRANSMITBUFFERLENGTH - k;
-        if (i > datalength)
-            i = datalength;
-        sgIP_memblock_CopyFromLinear(mb, rec->buf_tx + k, j, i);
-        k += i;
-        if (k >= SGIP_TCP_TRANSMITBUFFERLENGTH)
-            k -= SGIP_TCP_TRANSMITBUFFERLENGTH;
-        j += i;
-        datalength -= i;
+        SGIP_TCP_COUNT(rec, bytes_sent, datalength);
+        if ((int)(rec->sequence_max - rec->sequence) > 0)
+        {
+            // some of this data has been sent before. sequence_next can't be used, segments
+            // without data move it back to the first unacknowledged byte.
+            SGIP_TCP_COUNT(rec, total_retrans, 1);
+            rec->rtt_timing = 0;
+        }
+        else if (!rec->rtt_timing)
+        {
+            rec->rtt_timing = 1;
+            rec->rtt_seq    = rec->sequence + datalength;
+            rec->rtt_time   = sgIP_timems;
+        }
     }
+    SGIP_TCP_COUNT(rec, segs_out, 1);
+    rec->sequence_next = rec->sequence + datalength;
+
+    // a SYN or a FIN takes a sequence number too
+    uint32_t sent = rec->sequence_next;
+    if (flags & (SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_FIN))
+        sent++;
+    if ((int)(sent - rec->sequence_max) > 0)
+        rec->sequence_max = sent;
+
+    sgIP_TCP_CopyTxData(rec, mb, 20, datalength);
+    if (datalength > 0)
+        sgIP_IP_PacingConsume(&rec->pacing, datalength + 40);
 
     sgIP_TCP_FixChecksum(rec->srcip, rec->destip, mb);
     sgIP_IP_SendViaIP(mb, 6, rec->srcip, rec->destip);
@@ -852,12 +1608,185 @@ int sgIP_TCP_SendPacket(sgIP_Record_TCP *rec, int flags, int datalength)
     return 0;
 }
 
+// Keepalive probes are empty segments with the sequence number of the last byte that has already
+// been acknowledged, so that the other end replies with an ACK.
+static void sgIP_TCP_SendKeepalive(sgIP_Record_TCP *rec)
+{
+    SGIP_INTR_PROTECT();
+
+    sgIP_memblock *mb = sgIP_TCP_GenHeader(rec, SGIP_TCP_FLAG_ACK, 0);
+    if (mb)
+    {
+        sgIP_Header_TCP *tcp = (sgIP_Header_TCP *)mb->datastart;
+        tcp->seqnum          = htonl(rec->sequence - 1);
+        SGIP_TCP_COUNT(rec, segs_out, 1);
+
+        sgIP_TCP_FixChecksum(rec->srcip, rec->destip, mb);
+        sgIP_IP_SendViaIP(mb, 6, rec->srcip, rec->destip);
+    }
+
+    SGIP_INTR_UNPROTECT();
+}
+
+// Sends the SYN of a connection we're opening. With TCP Fast Open it carries the cookie of the
+// server and as much queued data as fits, or a request for a cookie if we don't have one yet.
+static void sgIP_TCP_SendSyn(sgIP_Record_TCP *rec)
+{
+    rec->sequence_max = rec->sequence;
+
+    if (!rec->tfo_connect)
+    {
+        sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_SYN, 0);
+        return;
+    }
+
+    SGIP_INTR_PROTECT();
+
+    unsigned char *cookie;
+    int cookielen  = sgIP_TCP_FastOpenFindCookie(rec->destip, &cookie);
+    int optionslen = (2 + cookielen + 3) & ~3;
+
+    int datalength = 0;
+    if (cookielen > 0)
+    {
+        datalength = rec->buf_tx_out - rec->buf_tx_in;
+        if (datalength < 0)
+            datalength += SGIP_TCP_TRANSMITBUFFERLENGTH;
+        int mss = sgIP_IP_MaxContentsSize(rec->destip) - 20 - optionslen;
+        if (datalength > mss)
+            datalength = mss;
+    }
+
+    sgIP_memblock *mb = sgIP_TCP_GenHeader(rec, SGIP_TCP_FLAG_SYN, optionslen + datalength);
+    if (mb)
+    {
+        sgIP_Header_TCP *tcp = (sgIP_Header_TCP *)mb->datastart;
+        unsigned char *opt   = (unsigned char *)mb->datastart + 20;
+        tcp->dataofs_        = ((20 + optionslen) / 4) << 4;
+
+        // pad with NOPs in front, so that the cookie ends at the end of the header
+        int i = 0;
+        while (i < optionslen - 2 - cookielen)
+            opt[i++] = SGIP_TCP_OPTION_NOP;
+        opt[i++] = SGIP_TCP_OPTION_FASTOPEN;
+        opt[i++] = 2 + cookielen;
+        for (int j = 0; j < cookielen; j++)
+            opt[i++] = cookie[j];
+
+        sgIP_TCP_CopyTxData(rec, mb, 20 + optionslen, datalength);
+        rec->tfo_syndata   = datalength;
+        rec->sequence_next = rec->sequence;
+        rec->sequence_max  = rec->sequence + 1 + datalength;
+        SGIP_TCP_COUNT(rec, segs_out, 1);
+        SGIP_TCP_COUNT(rec, bytes_sent, datalength);
+
+        sgIP_TCP_FixChecksum(rec->srcip, rec->destip, mb);
+        sgIP_IP_SendViaIP(mb, 6, rec->srcip, rec->destip);
+    }
+
+    rec->time_last_action = sgIP_timems;         // semi-generic timer.
+    rec->time_backoff     = SGIP_TCP_GENRETRYMS; // backoff timer
+    SGIP_INTR_UNPROTECT();
+}
+
+// Find the connection that sent the segment quoted in an ICMP message. Only messages about
+// segments that are still in flight are believed (RFC 5927 section 4.1), anybody could send an
+// ICMP message with made up contents.
+static sgIP_Record_TCP *sgIP_TCP_FindICMPRecord(unsigned long srcip, unsigned long destip,
+                                                unsigned short srcport, unsigned short destport,
+                                                unsigned long seq)
+{
+    sgIP_Record_TCP *rec = tcprecords;
+    while (rec)
+    {
+        if (rec->srcip == srcip && rec->destip == destip && rec->srcport == srcport
+            && rec->destport == destport)
+            break;
+        rec = rec->next;
+    }
+
+    if (!rec || rec->tcpstate == SGIP_TCP_STATE_LISTEN || (int)(seq - rec->sequence) < 0)
+        return NULL;
+    // The segment must be one we sent and that hasn't been acknowledged.
+    if ((int)(seq - rec->sequence_max) >= 0)
+        return NULL;
+
+    return rec;
+}
+
+void sgIP_TCP_FragmentationNeeded(unsigned long srcip, unsigned long destip, unsigned short srcport,
+                                  unsigned short destport, unsigned long seq, int mtu)
+{
+    SGIP_INTR_PROTECT();
+
+    sgIP_Record_TCP *rec = sgIP_TCP_FindICMPRecord(srcip, destip, srcport, destport, seq);
+    if (!rec)
+    {
+        SGIP_INTR_UNPROTECT();
+        return;
+    }
+
+    int mss = sgIP_IP_MaxContentsSize(destip) - 20;
+    sgIP_IP_ReducePathMTU(destip, mtu);
+
+    // The segment was dropped, resend it right away in smaller pieces.
+    int len = sgIP_IP_MaxContentsSize(destip) - 20;
+    if (len < mss && (rec->tcpstate == SGIP_TCP_STATE_ESTABLISHED
+                      || rec->tcpstate == SGIP_TCP_STATE_CLOSE_WAIT))
+    {
+        int j = rec->buf_tx_out - rec->buf_tx_in;
+        if (j < 0)
+            j += SGIP_TCP_TRANSMITBUFFERLENGTH;
+        if (len > j)
+            len = j;
+        j = (int)(rec->txwindow - rec->sequence);
+        if (len > j)
+            len = j;
+        if (len > 0)
+            sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, len);
+    }
+
+    SGIP_INTR_UNPROTECT();
+}
+
+void sgIP_TCP_Unreachable(unsigned long srcip, unsigned long destip, unsigned short srcport,
+                          unsigned short destport, unsigned long seq, int error)
+{
+    SGIP_INTR_PROTECT();
+
+    sgIP_Record_TCP *rec = sgIP_TCP_FindICMPRecord(srcip, destip, srcport, destport, seq);
+
+    // Give up on connections that are still being opened, instead of resending the SYN until it
+    // times out. Established connections ignore the message (RFC 1122 section 4.2.3.9), the route
+    // may be back before the retransmissions give up.
+    if (rec
+        && (rec->tcpstate == SGIP_TCP_STATE_SYN_SENT
+            || rec->tcpstate == SGIP_TCP_STATE_SYN_RECEIVED))
+    {
+        rec->errorcode = error;
+        rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
+        SGIP_NOTIFYEVENT(rec);
+    }
+
+    SGIP_INTR_UNPROTECT();
+}
+
 int sgIP_TCP_SendSynReply(int flags, unsigned long seq, unsigned long ack, unsigned long srcip,
                           unsigned long destip, int srcport, int destport, int windowlen)
+{
+    return sgIP_TCP_SendSynReplyOptions(flags, seq, ack, srcip, destip, srcport, destport,
+                                        windowlen, NULL, 0);
+}
+
+// optionslen has to be a multiple of 4.
+static int sgIP_TCP_SendSynReplyOptions(int flags, unsigned long seq, unsigned long ack,
+                                        unsigned long srcip, unsigned long destip, int srcport,
+                                        int destport, int windowlen, const unsigned char *options,
+                                        int optionslen)
 {
     SGIP_INTR_PROTECT();
 
-    sgIP_memblock *mb = sgIP_memblock_alloc(20 + sgIP_IP_RequiredHeaderSize());
+    sgIP_memblock *mb = sgIP_memblock_alloc(20 + optionslen + sgIP_IP_RequiredHeaderSize());
     if (!mb)
     {
         SGIP_INTR_UNPROTECT();
@@ -873,10 +1802,14 @@ int sgIP_TCP_SendSynReply(int flags, unsigned long seq, unsigned long ack, unsig
     tcp->tcpflags        = flags;
     tcp->urg_ptr         = 0; // no support for URG data atm.
     tcp->checksum        = 0;
-    tcp->dataofs_        = 5 << 4; // header length == 20 (5*32bit)
+    tcp->dataofs_        = ((20 + optionslen) / 4) << 4; // header length in 32bit words
+
+    if (optionslen > 0)
+        sgIP_memblock_CopyFromLinear(mb, (void *)options, 20, optionslen);
 
-    if (windowlen < 0 || windowlen > 1400)
-        windowlen = 1400; // don't want to deal with IP fragmentation.
+    // connections always get at least the minimum receive buffer
+    if (windowlen < 0 || windowlen > SGIP_TCP_RECEIVEBUFFERMIN - 1)
+        windowlen = SGIP_TCP_RECEIVEBUFFERMIN - 1;
     tcp->window = htons(windowlen);
 
     sgIP_TCP_FixChecksum(srcip, destip, mb);
@@ -891,8 +1824,33 @@ sgIP_Record_TCP *sgIP_TCP_AllocRecord(void)
     SGIP_INTR_PROTECT();
     sgIP_Record_TCP *rec;
     rec = sgIP_malloc(sizeof(sgIP_Record_TCP));
+
+    // new connections get the minimum receive buffer if the memory budget has been used up
+    int rxsize = SGIP_TCP_RECEIVEBUFFERLENGTH;
+    if (rxsize > sgIP_TCP_RxBufferMax())
+        rxsize = sgIP_TCP_RxBufferMax();
+    if (tcp_rx_memory + rxsize > tcp_rx_budget)
+        rxsize = SGIP_TCP_RECEIVEBUFFERMIN;
     if (rec)
     {
+        rec->buf_rx = sgIP_malloc(rxsize);
+        rec->buf_tx = sgIP_malloc(SGIP_TCP_TRANSMITBUFFERLENGTH);
+        if (!rec->buf_rx || !rec->buf_tx)
+        {
+            if (rec->buf_rx)
+                sgIP_free(rec->buf_rx);
+            if (rec->buf_tx)
+                sgIP_free(rec->buf_tx);
+            sgIP_free(rec);
+            rec = NULL;
+        }
+    }
+
+    if (rec)
+    {
+        rec->buf_rx_size = rxsize;
+        tcp_rx_memory += rxsize;
+
         rec->buf_oob_in    = 0;
         rec->buf_oob_out   = 0;
         rec->buf_rx_in     = 0;
@@ -904,11 +1862,46 @@ sgIP_Record_TCP *sgIP_TCP_AllocRecord(void)
         tcprecords         = rec;
         rec->maxlisten     = 0;
         rec->srcip         = 0;
+        rec->srcport       = 0;
         rec->retrycount    = 0;
         rec->errorcode     = 0;
         rec->listendata    = 0;
         rec->want_shutdown = 0;
         rec->want_reack    = 0;
+        rec->max_txwindow  = 0;
+        rec->ack           = 0;
+        rec->rxwindow      = 0;
+
+        rec->persist_backoff  = 0;
+        rec->linger           = -1;
+        rec->orphan           = 0;
+        rec->srcport_reserved = 0;
+
+        rec->tfo_qlen    = 0;
+        rec->tfo_connect = 0;
+        rec->tfo_syndata = 0;
+        rec->tfo_child   = 0;
+        rec->tfo_iss     = 0;
+
+        sgIP_IP_PacingInit(&rec->pacing, 0);
+
+        rec->rtt_timing = 0;
+        rec->srtt       = 0;
+        rec->rttvar     = 0;
+        rec->min_rtt    = 0;
+        memset(&rec->stats, 0, sizeof(rec->stats));
+
+        rec->rx_locked    = 0;
+        rec->rx_rtt       = 0;
+        rec->rx_measuring = 0;
+        rec->rx_time_data = sgIP_timems;
+
+        rec->keepalive        = 0;
+        rec->keepidle         = SGIP_TCP_KEEPIDLEMS;
+        rec->keepintvl        = SGIP_TCP_KEEPINTVLMS;
+        rec->keepcnt          = SGIP_TCP_KEEPCNT;
+        rec->keepalive_probes = 0;
+        rec->time_last_rx     = sgIP_timems;
     }
     SGIP_INTR_UNPROTECT();
     return rec;
@@ -962,6 +1955,13 @@ void sgIP_TCP_FreeRecord(sgIP_Record_TCP *rec)
         numsynlist = j;
         sgIP_free(rec->listendata);
     }
+    if (rec->srcport_reserved)
+        sgIP_Ports_Release(&tcp_ports, ntohs(rec->srcport));
+    tcp_rx_memory -= rec->buf_rx_size;
+    if (rec->buf_rx)
+        sgIP_free(rec->buf_rx);
+    if (rec->buf_tx)
+        sgIP_free(rec->buf_tx);
     sgIP_free(rec);
 
     SGIP_INTR_UNPROTECT();
@@ -975,8 +1975,12 @@ int sgIP_TCP_Bind(sgIP_Record_TCP *rec, int srcport, unsigned long srcip)
     SGIP_INTR_PROTECT();
     if (rec->tcpstate == SGIP_TCP_STATE_NODATA)
     {
+        if (sgIP_TCP_SetLocalPort(rec, srcport) < 0)
+        {
+            SGIP_INTR_UNPROTECT();
+            return -1;
+        }
         rec->srcip    = srcip;
-        rec->srcport  = srcport;
         rec->tcpstate = SGIP_TCP_STATE_UNUSED;
     }
     SGIP_INTR_UNPROTECT();
@@ -1003,7 +2007,7 @@ int sgIP_TCP_Listen(sgIP_Record_TCP *rec, int maxlisten)
             maxlisten = 1;
         rec->maxlisten  = maxlisten;
         rec->listendata = (sgIP_Record_TCP **)sgIP_malloc(
-            maxlisten * 4); // pointers to TCP records, 0-terminated list.
+            maxlisten * sizeof(sgIP_Record_TCP *)); // pointers to TCP records, 0-terminated list.
         if (!rec->listendata)
         {
             rec->maxlisten = 0;
@@ -1021,10 +2025,11 @@ int sgIP_TCP_Listen(sgIP_Record_TCP *rec, int maxlisten)
 
 sgIP_Record_TCP *sgIP_TCP_Accept(sgIP_Record_TCP *rec)
 {
-    if (!rec)
-        return (sgIP_Record_TCP *)SGIP_ERROR0(EINVAL);
-    if (rec->tcpstate != SGIP_TCP_STATE_LISTEN)
-        return (sgIP_Record_TCP *)SGIP_ERROR0(EINVAL);
+    if (!rec || rec->tcpstate != SGIP_TCP_STATE_LISTEN)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
 
     int err, i;
     sgIP_Record_TCP *t;
@@ -1067,6 +2072,74 @@ int sgIP_TCP_Close(sgIP_Record_TCP *rec)
     return 0;
 }
 
+void sgIP_TCP_Abort(sgIP_Record_TCP *rec)
+{
+    if (!rec)
+        return;
+    SGIP_INTR_PROTECT();
+    switch (rec->tcpstate)
+    {
+        case SGIP_TCP_STATE_SYN_RECEIVED:
+        case SGIP_TCP_STATE_ESTABLISHED:
+        case SGIP_TCP_STATE_FIN_WAIT_1:
+        case SGIP_TCP_STATE_FIN_WAIT_2:
+        case SGIP_TCP_STATE_CLOSE_WAIT:
+        {
+            // the other end thinks that the connection is open (RFC 9293 section 3.10.5)
+            uint32_t seq = rec->sequence;
+            if ((int)(rec->sequence_next - seq) > 0)
+                seq = rec->sequence_next;
+            sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_RST | SGIP_TCP_FLAG_ACK, seq, rec->ack, rec->srcip,
+                                  rec->destip, rec->srcport, rec->destport, 0);
+            break;
+        }
+        default:
+            break;
+    }
+    rec->errorcode = ECONNABORTED;
+    rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
+    SGIP_NOTIFYEVENT(rec);
+    SGIP_INTR_UNPROTECT();
+}
+
+void sgIP_TCP_Orphan(sgIP_Record_TCP *rec)
+{
+    if (!rec)
+        return;
+    SGIP_INTR_PROTECT();
+    if (rec->buf_rx_in != rec->buf_rx_out)
+    {
+        // The data that hasn't been read is lost, the other end has to know that the connection
+        // didn't end normally (RFC 2525 section 2.17).
+        sgIP_TCP_Abort(rec);
+    }
+    else if (rec->tcpstate == SGIP_TCP_STATE_SYN_SENT)
+    {
+        rec->tcpstate = SGIP_TCP_STATE_CLOSED; // nothing to tell the other end yet
+    }
+    else if (rec->want_shutdown == 0)
+    {
+        rec->want_shutdown = 1;
+    }
+
+    if (rec->tcpstate == SGIP_TCP_STATE_CLOSED)
+    {
+        sgIP_TCP_FreeRecord(rec);
+        SGIP_INTR_UNPROTECT();
+        return;
+    }
+
+    // nobody is going to read anything from now on
+    tcp_rx_memory -= rec->buf_rx_size;
+    sgIP_free(rec->buf_rx);
+    rec->buf_rx      = NULL;
+    rec->buf_rx_size = 0;
+    rec->buf_rx_in   = 0;
+    rec->buf_rx_out  = 0;
+    rec->orphan      = 1;
+    SGIP_INTR_UNPROTECT();
+}
+
 int sgIP_TCP_Connect(sgIP_Record_TCP *rec, unsigned long destip, int destport)
 {
     if (!rec)
@@ -1075,8 +2148,12 @@ int sgIP_TCP_Connect(sgIP_Record_TCP *rec, unsigned long destip, int destport)
     if (rec->tcpstate == SGIP_TCP_STATE_NODATA)
     {
         // need to bind a local address
+        if (sgIP_TCP_SetLocalPort(rec, 0) < 0)
+        {
+            SGIP_INTR_UNPROTECT();
+            return -1;
+        }
         rec->srcip    = sgIP_IP_GetLocalBindAddr(0, destip);
-        rec->srcport  = htons(sgIP_TCP_GetUnusedOutgoingPort());
         rec->destip   = destip;
         rec->destport = destport;
     }
@@ -1095,7 +2172,7 @@ int sgIP_TCP_Connect(sgIP_Record_TCP *rec, unsigned long destip, int destport)
 
     // send a SYN packet, and advance the state of the connection
     rec->sequence = sgIP_TCP_support_seqhash(rec->srcip, rec->destip, rec->srcport, rec->destport);
-    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_SYN, 0);
+    sgIP_TCP_SendSyn(rec);
     rec->retrycount = 0;
     rec->tcpstate   = SGIP_TCP_STATE_SYN_SENT;
 
@@ -1103,6 +2180,40 @@ int sgIP_TCP_Connect(sgIP_Record_TCP *rec, unsigned long destip, int destport)
     return 0;
 }
 
+int sgIP_TCP_FastOpen(sgIP_Record_TCP *rec, unsigned long destip, int destport,
+                      const char *datatosend, int datalength)
+{
+    if (!rec || !datatosend)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    if (rec->tcpstate != SGIP_TCP_STATE_NODATA && rec->tcpstate != SGIP_TCP_STATE_UNUSED)
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(EISCONN);
+    }
+
+    // Queue the data and let the SYN take it. If we don't have a cookie for this server yet, the
+    // SYN asks for one and the data is sent after the handshake.
+    int queued = sgIP_TCP_Send(rec, datatosend, datalength, 0);
+    if (queued < 0)
+    {
+        SGIP_INTR_UNPROTECT();
+        return queued;
+    }
+    rec->tfo_connect = 1;
+    if (sgIP_TCP_Connect(rec, destip, destport) < 0)
+    {
+        rec->buf_tx_out  = rec->buf_tx_in;
+        rec->tfo_connect = 0;
+        SGIP_INTR_UNPROTECT();
+        return -1;
+    }
+
+    SGIP_INTR_UNPROTECT();
+    return queued;
+}
+
 int sgIP_TCP_Send(sgIP_Record_TCP *rec, const char *datatosend, int datalength, int flags)
 {
     (void)flags;
@@ -1140,22 +2251,13 @@ int sgIP_TCP_Send(sgIP_Record_TCP *rec, const char *datatosend, int datalength,
     j = rec->buf_tx_out - rec->buf_tx_in;
     if (j < 0)
         j += SGIP_TCP_TRANSMITBUFFERLENGTH;
-    j += (int)(rec->sequence - rec->sequence_next);
-    if (j > SGIP_TCP_TRANSMIT_IMMTHRESH && rec->tcpstate == SGIP_TCP_STATE_ESTABLISHED)
+    // Data in flight would be sent again with the new data, wait for its ACK instead.
+    if (j > SGIP_TCP_TRANSMIT_IMMTHRESH && rec->tcpstate == SGIP_TCP_STATE_ESTABLISHED
+        && rec->sequence_max == rec->sequence)
     {
-        j = (int)(rec->sequence_next - rec->sequence);
-        if (j < 1000)
+        j = sgIP_TCP_SendLength(rec, 0);
+        if (j > 0)
         {
-            // arbitrary constant.
-            j = rec->buf_tx_out - rec->buf_tx_in;
-            if (j < 0)
-                j += SGIP_TCP_TRANSMITBUFFERLENGTH;
-            i = (int)(rec->txwindow - rec->sequence);
-            if (j > i)
-                j = i;
-            i = sgIP_IP_MaxContentsSize(rec->destip) - 20; // max tcp data size
-            if (j > i)
-                j = i;
             sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, j);
             rec->retrycount = 0;
         }
@@ -1186,7 +2288,7 @@ int sgIP_TCP_Recv(sgIP_Record_TCP *rec, char *databuf, int buflength, int flags)
     SGIP_INTR_PROTECT();
     int rxlen = rec->buf_rx_out - rec->buf_rx_in;
     if (rxlen < 0)
-        rxlen += SGIP_TCP_RECEIVEBUFFERLENGTH;
+        rxlen += rec->buf_rx_size;
     if (buflength > rxlen)
         buflength = rxlen;
     int i, j;
@@ -1194,7 +2296,7 @@ int sgIP_TCP_Recv(sgIP_Record_TCP *rec, char *databuf, int buflength, int flags)
     for (i = 0; i < buflength; i++)
     {
         databuf[i] = rec->buf_rx[j++];
-        if (j == SGIP_TCP_RECEIVEBUFFERLENGTH)
+        if (j == rec->buf_rx_size)
             j = 0;
     }
 
@@ -1202,21 +2304,213 @@ int sgIP_TCP_Recv(sgIP_Record_TCP *rec, char *databuf, int buflength, int flags)
     {
         rec->buf_rx_in = j;
 
-        if (rec->want_reack)
+        // send a window update if the window can be opened significantly
+        if (rec->want_reack && sgIP_TCP_ReceiveWindow(rec) > (int)(rec->rxwindow - rec->ack))
+        {
+            rec->want_reack = 0;
+            sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
+        }
+    }
+    SGIP_INTR_UNPROTECT();
+    return buflength;
+}
+
+int sgIP_TCP_SetOption(sgIP_Record_TCP *rec, int level, int option, const void *data,
+                       int data_len)
+{
+    if (!rec || !data || data_len < (int)sizeof(int))
+        return SGIP_ERROR(EINVAL);
+
+    int value = *(const int *)data;
+
+    // Options that aren't supported are ignored, as they have always been.
+    if (level == SOL_SOCKET)
+    {
+        switch (option)
         {
-            i = rec->buf_rx_out - rec->buf_rx_in;
-            if (i < 0)
-                i += SGIP_TCP_RECEIVEBUFFERLENGTH; // we now have the amount in the buffer
-            i = SGIP_TCP_RECEIVEBUFFERLENGTH - i - 1;
-            if (i < 0)
-                i = 0;
-            if (i > SGIP_TCP_REACK_THRESH)
+            case SO_KEEPALIVE:
+                rec->keepalive = value ? 1 : 0;
+                break;
+            case SO_MAX_PACING_RATE:
+                sgIP_IP_PacingInit(&rec->pacing, *(const unsigned int *)data);
+                break;
+            case SO_LINGER:
             {
-                rec->want_reack = 0;
-                sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
+                const struct linger *l = data;
+                if (data_len < (int)sizeof(struct linger))
+                    return SGIP_ERROR(EINVAL);
+                if (!l->l_onoff)
+                    rec->linger = -1;
+                else if (l->l_linger < 0 || l->l_linger > 0x7FFFFFFF / 1000)
+                    return SGIP_ERROR(EINVAL);
+                else
+                    rec->linger = l->l_linger * 1000;
+                break;
             }
+            case SO_RCVBUF:
+                // a size set by the application disables autotuning
+                if (value < SGIP_TCP_RECEIVEBUFFERMIN)
+                    value = SGIP_TCP_RECEIVEBUFFERMIN;
+                if (value > sgIP_TCP_RxBufferMax())
+                    value = sgIP_TCP_RxBufferMax();
+                if (value > rec->buf_rx_size
+                    && tcp_rx_memory + value - rec->buf_rx_size > tcp_rx_budget)
+                    return SGIP_ERROR(ENOBUFS);
+                if (value != rec->buf_rx_size && !sgIP_TCP_ResizeRxBuffer(rec, value))
+                    return SGIP_ERROR(ENOBUFS);
+                rec->rx_locked = 1;
+                break;
         }
+        return 0;
+    }
+
+    if (level != SOL_TCP)
+        return 0;
+
+    switch (option)
+    {
+        case TCP_KEEPIDLE:
+            if (value < 1 || value > 0x7FFFFFFF / 1000)
+                return SGIP_ERROR(EINVAL);
+            rec->keepidle = value * 1000;
+            break;
+        case TCP_KEEPINTVL:
+            if (value < 1 || value > 0x7FFFFFFF / 1000)
+                return SGIP_ERROR(EINVAL);
+            rec->keepintvl = value * 1000;
+            break;
+        case TCP_KEEPCNT:
+            if (value < 1 || value > 127)
+                return SGIP_ERROR(EINVAL);
+            rec->keepcnt = value;
+            break;
+        case TCP_FASTOPEN:
+            if (value < 0)
+                return SGIP_ERROR(EINVAL);
+            rec->tfo_qlen = value;
+            break;
     }
+
+    return 0;
+}
+
+// Fills as much of a struct tcp_info as fits in data_len bytes.
+static int sgIP_TCP_GetInfo(sgIP_Record_TCP *rec, void *data, int *data_len)
+{
+    struct tcp_info info;
+    int i;
+
+    SGIP_INTR_PROTECT();
+
+    info.tcpi_version     = TCP_INFO_VERSION;
+    info.tcpi_state       = rec->tcpstate;
+    info.tcpi_retransmits = rec->retrycount;
+    info.tcpi_probes      = rec->keepalive_probes;
+
+    info.tcpi_rto     = rec->time_backoff;
+    info.tcpi_rtt     = rec->srtt >> 3;
+    info.tcpi_rttvar  = rec->rttvar >> 2;
+    info.tcpi_min_rtt = rec->min_rtt;
+    info.tcpi_snd_mss = rec->destip ? sgIP_IP_MaxContentsSize(rec->destip) - 20 : 0;
+
+    i                     = (int)(rec->txwindow - rec->sequence);
+    info.tcpi_snd_wnd     = i > 0 ? i : 0;
+    info.tcpi_max_snd_wnd = rec->max_txwindow;
+    i                     = (int)(rec->rxwindow - rec->ack);
+    info.tcpi_rcv_wnd     = i > 0 ? i : 0;
+
+    // unsent bytes are the ones in the transmit buffer that aren't in flight
+    i                 = (int)(rec->sequence_max - rec->sequence);
+    info.tcpi_unacked = i > 0 ? i : 0;
+    i                 = rec->buf_tx_out - rec->buf_tx_in;
+    if (i < 0)
+        i += SGIP_TCP_TRANSMITBUFFERLENGTH;
+    i -= info.tcpi_unacked;
+    info.tcpi_notsent   = i > 0 ? i : 0;
+    info.tcpi_last_recv = sgIP_timems - rec->time_last_rx;
+
+    info.tcpi_segs_out       = rec->stats.segs_out;
+    info.tcpi_segs_in        = rec->stats.segs_in;
+    info.tcpi_bytes_sent     = rec->stats.bytes_sent;
+    info.tcpi_bytes_acked    = rec->stats.bytes_acked;
+    info.tcpi_bytes_received = rec->stats.bytes_received;
+    info.tcpi_total_retrans  = rec->stats.total_retrans;
+    info.tcpi_dup_acks       = rec->stats.dup_acks;
+    info.tcpi_dup_segs       = rec->stats.dup_segs;
+    info.tcpi_ooo_drops      = rec->stats.ooo_drops;
+
     SGIP_INTR_UNPROTECT();
-    return buflength;
+
+    if (*data_len > (int)sizeof(info))
+        *data_len = sizeof(info);
+    memcpy(data, &info, *data_len);
+    return 0;
+}
+
+int sgIP_TCP_GetOption(sgIP_Record_TCP *rec, int level, int option, void *data, int *data_len)
+{
+    if (!rec || !data || !data_len || *data_len < (int)sizeof(int))
+        return SGIP_ERROR(EINVAL);
+
+    if (level == SOL_TCP && option == TCP_INFO)
+        return sgIP_TCP_GetInfo(rec, data, data_len);
+
+    if (level == SOL_SOCKET && option == SO_LINGER)
+    {
+        struct linger *l = data;
+        if (*data_len < (int)sizeof(struct linger))
+            return SGIP_ERROR(EINVAL);
+        l->l_onoff  = rec->linger >= 0;
+        l->l_linger = rec->linger >= 0 ? rec->linger / 1000 : 0;
+        *data_len   = sizeof(struct linger);
+        return 0;
+    }
+
+    int value;
+
+    if (level == SOL_SOCKET && option == SO_KEEPALIVE)
+    {
+        value = rec->keepalive;
+    }
+    else if (level == SOL_SOCKET && option == SO_MAX_PACING_RATE)
+    {
+        value = rec->pacing.rate;
+    }
+    else if (level == SOL_SOCKET && option == SO_RCVBUF)
+    {
+        value = rec->buf_rx_size;
+    }
+    else if (level == SOL_SOCKET && option == SO_ERROR)
+    {
+        // lets non-blocking connect() calls check how the connection attempt went
+        value = rec->tcpstate == SGIP_TCP_STATE_CLOSED ? rec->errorcode : 0;
+    }
+    else if (level == SOL_TCP)
+    {
+        switch (option)
+        {
+            case TCP_KEEPIDLE:
+                value = rec->keepidle / 1000;
+                break;
+            case TCP_KEEPINTVL:
+                value = rec->keepintvl / 1000;
+                break;
+            case TCP_KEEPCNT:
+                value = rec->keepcnt;
+                break;
+            case TCP_FASTOPEN:
+                value = rec->tfo_qlen;
+                break;
+            default:
+                return SGIP_ERROR(ENOPROTOOPT);
+        }
+    }
+    else
+    {
+        return SGIP_ERROR(ENOPROTOOPT);
+    }
+
+    *(int *)data = value;
+    *data_len    = sizeof(int);
+    return 0;
 }
@@ -12,6 +12,7 @@ extern "C" {
 #endif
 
 #include "arm9/sgIP/sgIP_Config.h"
+#include "arm9/sgIP/sgIP_IP.h"
 #include "arm9/sgIP/sgIP_memblock.h"
 
 enum SGIP_TCP_STATE
@@ -38,11 +39,18 @@ enum SGIP_TCP_STATE
 #define SGIP_TCP_FLAG_ACK 16
 #define SGIP_TCP_FLAG_URG 32
 
+#define SGIP_TCP_OPTION_END      0
+#define SGIP_TCP_OPTION_NOP      1
+#define SGIP_TCP_OPTION_FASTOPEN 34 // RFC 7413
+
+#define SGIP_TCP_FASTOPEN_COOKIELEN    8  // length of the cookies given to clients
+#define SGIP_TCP_FASTOPEN_MAXCOOKIELEN 16 // max. length of the cookies given by servers
+
 typedef struct SGIP_HEADER_TCP
 {
     unsigned short srcport, destport;
-    unsigned long seqnum;
-    unsigned long acknum;
+    uint32_t seqnum;
+    uint32_t acknum;
     unsigned char dataofs_;
     unsigned char tcpflags;
     unsigned short window;
@@ -51,6 +59,28 @@ typedef struct SGIP_HEADER_TCP
     unsigned char options[4];
 } sgIP_Header_TCP;
 
+// sgIP_TCP_Stats - counters of a TCP connection. They are never reset, and wrap around.
+typedef struct SGIP_TCP_STATS
+{
+    unsigned long segs_out;       // segments sent, including retransmissions
+    unsigned long segs_in;        // segments received
+    unsigned long bytes_sent;     // data bytes sent, including retransmissions
+    unsigned long bytes_acked;    // data bytes acknowledged by the remote system
+    unsigned long bytes_received; // data bytes received in order
+    unsigned long total_retrans;  // segments that resent data
+    unsigned long dup_acks;       // duplicate ACKs received
+    unsigned long dup_segs;       // segments received with data that we already had
+    unsigned long ooo_drops;      // segments dropped because they were out of order
+} sgIP_TCP_Stats;
+
+// Adds to a counter of a connection. SGIP_TCP_NOSTATS leaves the counters out of the build, which
+// is only done to measure what they cost: getsockopt(TCP_INFO) returns them as 0.
+#ifdef SGIP_TCP_NOSTATS
+#    define SGIP_TCP_COUNT(rec, counter, n) ((void)0)
+#else
+#    define SGIP_TCP_COUNT(rec, counter, n) ((rec)->stats.counter += (n))
+#endif
+
 // sgIP_Record_TCP - a TCP record, to store data for an active TCP connection.
 typedef struct SGIP_RECORD_TCP
 {
@@ -58,45 +88,100 @@ typedef struct SGIP_RECORD_TCP
 
     // TCP state information
     int tcpstate;
-    unsigned long sequence;      // sequence number of first byte not acknowledged by remote system
-    unsigned long ack;           // external sequence number of next byte to receive
-    unsigned long sequence_next; // sequence number of first unsent byte
-    unsigned long rxwindow;      // sequence of last byte in receive window
-    unsigned long txwindow;      // sequence of last byte allowed to send
-    int time_last_action;        // used for retransmission and etc.
+    uint32_t sequence;      // sequence number of first byte not acknowledged by remote system
+    uint32_t ack;           // external sequence number of next byte to receive
+    uint32_t sequence_next; // sequence number of first unsent byte
+    uint32_t sequence_max;  // highest sequence number sent so far, FIN included
+    uint32_t rxwindow;      // sequence of last byte in receive window
+    uint32_t txwindow;      // sequence of last byte allowed to send
+    int time_last_action;   // used for retransmission and etc.
     int time_backoff;
     int retrycount;
     unsigned long srcip;
     unsigned long destip;
     unsigned short srcport, destport;
+    int srcport_reserved; // srcport is an ephemeral port that has to be released
     struct SGIP_RECORD_TCP **listendata;
     int maxlisten;
     int errorcode;
     int want_shutdown; // 0= don't want shutdown, 1= want shutdown, 2= being shutdown
     int want_reack;
+    int max_txwindow;    // largest window advertised by the remote system
+    int persist_backoff; // time between window probes, or 0 if the remote window is open
+    int linger;          // SO_LINGER timeout in ms, or -1 if it's disabled
+    int orphan;          // 1 if the socket has been closed, sgIP_TCP_Timer() frees the record
+
+    // keepalive information:
+    int keepalive;              // 1 if SO_KEEPALIVE is enabled
+    int keepidle, keepintvl;    // time before the first probe and between probes, in ms
+    int keepcnt;                // number of unanswered probes before dropping the connection
+    int keepalive_probes;       // number of probes sent since the last received segment
+    unsigned long time_last_rx; // time when the last valid segment was received
+
+    // TCP Fast Open (RFC 7413):
+    int tfo_qlen;     // max. TFO connections pending accept() on a listening socket, or 0
+    int tfo_connect;  // 1 to send the queued data in our SYN (sendto() with MSG_FASTOPEN)
+    int tfo_syndata;  // number of bytes sent in our SYN
+    int tfo_child;    // opened by a TFO SYN, the ACK of our SYN hasn't arrived yet
+    uint32_t tfo_iss; // sequence number of the SYN of a TFO child, to resend the SYN-ACK
+
+    sgIP_IP_Pacing pacing; // limits the rate of data segments (SO_MAX_PACING_RATE)
+
+    // round-trip time estimation (RFC 6298). Only one segment is timed at a time, and the sample
+    // is discarded if any data is retransmitted before it is acknowledged (Karn's algorithm).
+    int rtt_timing;         // 1 while the segment that ends at rtt_seq is being timed
+    uint32_t rtt_seq;       // sequence number after the end of the timed segment
+    unsigned long rtt_time; // time when the timed segment was sent
+    int srtt;               // smoothed round-trip time in ms, scaled by 8. 0 if not measured yet
+    int rttvar;             // mean deviation of the round-trip time in ms, scaled by 4
+    int min_rtt;            // smallest round-trip time seen in ms, or 0
+
+    sgIP_TCP_Stats stats; // counters returned by getsockopt(TCP_INFO)
+
+    // receive buffer autotuning:
+    int rx_locked;              // 1 if the size has been set with SO_RCVBUF
+    int rx_rtt;                 // round-trip time seen by the receiver in ms, or 0
+    int rx_measuring;           // 1 while the data up to rx_rtt_seq is being waited for
+    uint32_t rx_rtt_seq;        // right edge of the window when the measurement started
+    unsigned long rx_rtt_time;  // time when the measurement started
+    uint32_t rx_space_seq;      // value of ack at the start of the current round trip
+    unsigned long rx_space_time;
+    unsigned long rx_time_data; // time when data was last received
 
     // TCP buffer information:
     int buf_rx_in, buf_rx_out;
     int buf_tx_in, buf_tx_out;
     int buf_oob_in, buf_oob_out;
-    unsigned char buf_rx[SGIP_TCP_RECEIVEBUFFERLENGTH];
-    unsigned char buf_tx[SGIP_TCP_TRANSMITBUFFERLENGTH];
+    int buf_rx_size; // size of buf_rx, it changes with autotuning
+    unsigned char *buf_rx;
+    unsigned char *buf_tx; // SGIP_TCP_TRANSMITBUFFERLENGTH bytes
     unsigned char buf_oob[SGIP_TCP_OOBBUFFERLENGTH];
 } sgIP_Record_TCP;
 
 typedef struct SGIP_TCP_SYNCOOKIE
 {
-    unsigned long localseq, remoteseq;
+    uint32_t localseq, remoteseq;
     unsigned long localip, remoteip;
     unsigned short localport, remoteport;
     unsigned long timenext, timebackoff;
+    int retrycount;
     sgIP_Record_TCP *linked; // parent listening connection
 } sgIP_TCP_SYNCookie;
 
 void sgIP_TCP_Init(void);
 void sgIP_TCP_Timer(void);
+// Sets the size of the heap used by the stack, which limits the size of the receive buffers.
+void sgIP_TCP_SetHeapSize(int size);
 
 int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long destip);
+// Called when an ICMP "fragmentation needed" message quotes a segment with sequence number seq
+// sent from srcip:srcport to destip:destport (ports in network byte order).
+void sgIP_TCP_FragmentationNeeded(unsigned long srcip, unsigned long destip, unsigned short srcport,
+                                  unsigned short destport, unsigned long seq, int mtu);
+// Called when an ICMP "destination unreachable" message quotes a segment of a connection. error is
+// the errno value to report.
+void sgIP_TCP_Unreachable(unsigned long srcip, unsigned long destip, unsigned short srcport,
+                          unsigned short destport, unsigned long seq, int error);
 int sgIP_TCP_SendPacket(sgIP_Record_TCP *rec, int flags,
                         int datalength); // data sent is taken directly from the TX fifo.
 int sgIP_TCP_SendSynReply(int flags, unsigned long seq, unsigned long ack, unsigned long srcip,
@@ -108,9 +193,19 @@ int sgIP_TCP_Bind(sgIP_Record_TCP *rec, int srcport, unsigned long srcip);
 int sgIP_TCP_Listen(sgIP_Record_TCP *rec, int maxlisten);
 sgIP_Record_TCP *sgIP_TCP_Accept(sgIP_Record_TCP *rec);
 int sgIP_TCP_Close(sgIP_Record_TCP *rec);
+// Resets the connection and closes it right away.
+void sgIP_TCP_Abort(sgIP_Record_TCP *rec);
+// Called when the application closes the socket of a connection that hasn't been closed yet. The
+// connection is closed in the background, and the record is freed when it's done.
+void sgIP_TCP_Orphan(sgIP_Record_TCP *rec);
 int sgIP_TCP_Connect(sgIP_Record_TCP *rec, unsigned long destip, int destport);
+int sgIP_TCP_FastOpen(sgIP_Record_TCP *rec, unsigned long destip, int destport,
+                      const char *datatosend, int datalength);
 int sgIP_TCP_Send(sgIP_Record_TCP *rec, const char *datatosend, int datalength, int flags);
 int sgIP_TCP_Recv(sgIP_Record_TCP *rec, char *databuf, int buflength, int flags);
+int sgIP_TCP_SetOption(sgIP_Record_TCP *rec, int level, int option, const void *data,
+                       int data_len);
+int sgIP_TCP_GetOption(sgIP_Record_TCP *rec, int level, int option, void *data, int *data_len);
 
 #ifdef __cplusplus
 };
@@ -4,66 +4,315 @@
 
 // DSWifi Project - sgIP Internet Protocol Stack Implementation
 
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+
 #include "arm9/sgIP/sgIP_Hub.h"
+#include "arm9/sgIP/sgIP_IGMP.h"
 #include "arm9/sgIP/sgIP_IP.h"
 #include "arm9/sgIP/sgIP_UDP.h"
+#include "arm9/sgIP/sgIP_ports.h"
 
 sgIP_Record_UDP *udprecords;
-int udpport_counter;
 extern volatile unsigned long sgIP_timems;
 
+static uint32_t udp_port_bits[SGIP_PORTS_WORDS(SGIP_UDP_FIRSTOUTGOINGPORT,
+                                               SGIP_UDP_LASTOUTGOINGPORT)];
+static sgIP_PortSet udp_ports;
+
+// Bound records are kept in hash tables to find the destination of received datagrams quickly.
+// Connected records are hashed by local port and peer, the rest only by local port.
+static sgIP_Record_UDP *udp_connected[SGIP_UDP_HASHSIZE];
+static sgIP_Record_UDP *udp_bound[SGIP_UDP_HASHSIZE];
+
 void sgIP_UDP_Init(void)
 {
-    udprecords      = 0;
-    udpport_counter = SGIP_UDP_FIRSTOUTGOINGPORT;
+    udprecords = 0;
+    for (int i = 0; i < SGIP_UDP_HASHSIZE; i++)
+    {
+        udp_connected[i] = 0;
+        udp_bound[i]     = 0;
+    }
+    sgIP_Ports_Init(&udp_ports, udp_port_bits, SGIP_UDP_FIRSTOUTGOINGPORT,
+                    SGIP_UDP_LASTOUTGOINGPORT);
 }
 
-int sgIP_UDP_GetUnusedOutgoingPort(void)
+// Sets the local port of a record. A port of 0 picks an unused ephemeral port. The previous port
+// of the record is released. Must be called with interrupts protected.
+static int sgIP_UDP_SetLocalPort(sgIP_Record_UDP *rec, int srcport)
 {
-    int myport, clear;
-    sgIP_Record_UDP *rec;
-    udpport_counter += sgIP_timems & 1023; // semi-random
+    int reserved = 1;
+
+    if (srcport == 0)
+    {
+        int port = sgIP_Ports_Alloc(&udp_ports);
+        if (port == 0)
+            return SGIP_ERROR(EADDRNOTAVAIL);
+        srcport = htons(port);
+    }
+    else
+    {
+        reserved = sgIP_Ports_Reserve(&udp_ports, ntohs(srcport));
+    }
 
-    if (udpport_counter > SGIP_UDP_LASTOUTGOINGPORT)
-        udpport_counter = SGIP_UDP_FIRSTOUTGOINGPORT;
+    if (rec->srcport_reserved)
+        sgIP_Ports_Release(&udp_ports, ntohs(rec->srcport));
+    rec->srcport          = srcport;
+    rec->srcport_reserved = reserved;
+    return 0;
+}
 
-    while (1)
+static sgIP_Record_UDP **sgIP_UDP_BoundBucket(unsigned short srcport)
+{
+    return &udp_bound[(srcport ^ (srcport >> 8)) & (SGIP_UDP_HASHSIZE - 1)];
+}
+
+static sgIP_Record_UDP **sgIP_UDP_ConnectedBucket(unsigned short srcport, unsigned long destip,
+                                                  unsigned short destport)
+{
+    unsigned long hash = destip ^ ((unsigned long)srcport << 16) ^ destport;
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+    return &udp_connected[hash & (SGIP_UDP_HASHSIZE - 1)];
+}
+
+static void sgIP_UDP_Unhash(sgIP_Record_UDP *rec)
+{
+    if (!rec->hash_bucket)
+        return;
+
+    sgIP_Record_UDP **link = rec->hash_bucket;
+    while (*link)
     {
-        rec    = udprecords;
-        myport = udpport_counter++;
-        if (udpport_counter > SGIP_UDP_LASTOUTGOINGPORT)
-            udpport_counter = SGIP_UDP_FIRSTOUTGOINGPORT;
-        clear = 1;
-        while (rec)
+        if (*link == rec)
         {
-            if (rec->srcport == myport)
+            *link = rec->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    rec->hash_next   = 0;
+    rec->hash_bucket = 0;
+}
+
+// Moves a record to the hash bucket that matches its current addresses. It must be called every
+// time that the addresses or the state of a record change.
+static void sgIP_UDP_Rehash(sgIP_Record_UDP *rec)
+{
+    sgIP_UDP_Unhash(rec);
+    if (rec->state != SGIP_UDP_STATE_BOUND)
+        return;
+
+    if (rec->destip)
+        rec->hash_bucket = sgIP_UDP_ConnectedBucket(rec->srcport, rec->destip, rec->destport);
+    else
+        rec->hash_bucket = sgIP_UDP_BoundBucket(rec->srcport);
+    rec->hash_next    = *rec->hash_bucket;
+    *rec->hash_bucket = rec;
+}
+
+// Finds the record that receives a datagram sent from srcip:srcport to destip:destport. Connected
+// records take precedence. Records bound to destip take precedence over the ones bound to any
+// local address.
+static sgIP_Record_UDP *sgIP_UDP_FindRecord(unsigned long srcip, unsigned short srcport,
+                                            unsigned long destip, unsigned short destport)
+{
+    sgIP_Record_UDP *rec      = *sgIP_UDP_ConnectedBucket(destport, srcip, srcport);
+    sgIP_Record_UDP *wildcard = 0;
+
+    for (; rec; rec = rec->hash_next)
+    {
+        if (rec->srcport != destport || rec->destip != srcip || rec->destport != srcport)
+            continue;
+        if (rec->srcip == destip)
+            return rec;
+        if (rec->srcip == 0 && !wildcard)
+            wildcard = rec;
+    }
+    if (wildcard)
+        return wildcard;
+
+    for (rec = *sgIP_UDP_BoundBucket(destport); rec; rec = rec->hash_next)
+    {
+        if (rec->srcport != destport)
+            continue;
+        if (rec->srcip == destip)
+            return rec;
+        if (rec->srcip == 0 && !wildcard)
+            wildcard = rec;
+    }
+    return wildcard;
+}
+
+// Memory charged to a memblock in the incoming queue. Reassembled datagrams can be stored in
+// blocks larger than the usual size.
+static int sgIP_UDP_BlockCost(const sgIP_memblock *mb)
+{
+    return mb->thislength > SGIP_MEMBLOCK_DATASIZE ? mb->thislength : SGIP_MEMBLOCK_DATASIZE;
+}
+
+// Removes the first datagram of the incoming queue. Must be called with interrupts protected, and
+// the queue can't be empty.
+static void sgIP_UDP_DropFirst(sgIP_Record_UDP *rec)
+{
+    int totlen = rec->incoming_queue->totallength;
+
+    while (totlen > 0 && rec->incoming_queue)
+    {
+        sgIP_memblock *mb = rec->incoming_queue;
+        totlen -= mb->thislength;
+
+        rec->incoming_queue = mb->next;
+        rec->rx_queued -= sgIP_UDP_BlockCost(mb);
+        mb->next = 0;
+        sgIP_memblock_free(mb);
+    }
+    if (!rec->incoming_queue)
+        rec->incoming_queue_end = 0;
+}
+
+// Adds len bytes to a 16-bit one's complement sum and copies them to dst (if it isn't NULL) in the
+// same pass. odd is set if the data added so far has an odd length.
+static unsigned long sgIP_UDP_SumCopy(void *dst, const void *src, int len, unsigned long sum,
+                                      int *odd)
+{
+    const unsigned char *s = src;
+    unsigned char *d       = dst;
+
+    if (*odd && len > 0)
+    {
+        if (d)
+            *d++ = *s;
+        sum += *s++ << 8;
+        len--;
+        *odd = 0;
+    }
+    while (len > 1)
+    {
+        unsigned char b0 = s[0];
+        unsigned char b1 = s[1];
+        if (d)
+        {
+            d[0] = b0;
+            d[1] = b1;
+            d += 2;
+        }
+        sum += b0 | (b1 << 8);
+        s += 2;
+        len -= 2;
+    }
+    if (len > 0)
+    {
+        if (d)
+            *d = *s;
+        sum += *s;
+        *odd = 1;
+    }
+    return sum;
+}
+
+// Checksum of the addresses and protocol of the "faux header". The length is added separately.
+static unsigned long sgIP_UDP_PseudoHeaderSum(unsigned long srcip, unsigned long destip)
+{
+    unsigned long checksum = 0;
+    checksum += (destip & 0xFFFF);
+    checksum += (destip >> 16);
+    checksum += (srcip & 0xFFFF);
+    checksum += (srcip >> 16);
+    checksum += (17) << 8;
+    return checksum;
+}
+
+// Removes the first datagram of the incoming queue, and copies as much of it as fits in the buffers
+// of iov. The checksum is verified while the data is copied, so that it's only read once. Returns
+// the number of bytes copied, or -1 if the checksum is wrong. The sender can be NULL if it isn't
+// needed. Must be called with interrupts protected, and the queue can't be empty.
+static int sgIP_UDP_Dequeue(sgIP_Record_UDP *rec, const struct iovec *iov, int iovlen,
+                            unsigned long *sender_ip, unsigned short *sender_port)
+{
+    sgIP_memblock *mb    = rec->incoming_queue;
+    unsigned long srcip  = ((uint32_t *)mb->datastart)[0];
+    unsigned long destip = ((uint32_t *)mb->datastart)[1];
+    sgIP_Header_UDP *udp = (sgIP_Header_UDP *)(mb->datastart + 8);
+    int udplen           = mb->totallength - 8;
+    int verify           = udp->checksum != 0 && !rec->rx_nocheck;
+    if (sender_ip)
+        *sender_ip = srcip;
+    if (sender_port)
+        *sender_port = udp->srcport;
+
+    unsigned long sum = 0;
+    int odd           = 0;
+    if (verify)
+        sum = sgIP_UDP_SumCopy(NULL, udp, 8, sum, &odd);
+
+    int first   = SGIP_UDP_QUEUEHEADER;
+    int copied  = 0;
+    int iov_i   = 0;
+    int iov_pos = 0;
+
+    for (int totlen = mb->totallength; totlen > 0 && mb; mb = mb->next)
+    {
+        totlen -= mb->thislength;
+
+        const char *src = mb->datastart + first;
+        int avail       = mb->thislength - first;
+        while (avail > 0 && iov_i < iovlen)
+        {
+            char *dst = (char *)iov[iov_i].iov_base + iov_pos;
+            int len   = iov[iov_i].iov_len - iov_pos;
+            if (len > avail)
+                len = avail;
+            if (verify)
+                sum = sgIP_UDP_SumCopy(dst, src, len, sum, &odd);
+            else
+                memcpy(dst, src, len);
+            src += len;
+            avail -= len;
+            copied += len;
+            iov_pos += len;
+            if (iov_pos == (int)iov[iov_i].iov_len)
             {
-                clear = 0;
-                break;
+                iov_i++;
+                iov_pos = 0;
             }
-            rec = rec->next;
         }
-        if (clear)
-            return myport;
+        // The part that doesn't fit in the buffers (if any) still has to be checked
+        if (verify && avail > 0)
+            sum = sgIP_UDP_SumCopy(NULL, src, avail, sum, &odd);
+
+        first = 0;
+    }
+
+    sgIP_UDP_DropFirst(rec);
+
+    if (verify)
+    {
+        sum += sgIP_UDP_PseudoHeaderSum(srcip, destip);
+        sum += htons(udplen);
+        sum = (sum & 0xFFFF) + (sum >> 16);
+        sum = (sum & 0xFFFF) + (sum >> 16);
+        if (sum != 0xFFFF)
+        {
+            SGIP_DEBUG_MESSAGE(("UDP receive checksum incorrect"));
+            return -1;
+        }
     }
+
+    return copied;
 }
 
-int sgIP_UDP_CalcChecksum(sgIP_memblock *mb, unsigned long srcip, unsigned long destip,
-                          int totallength)
+static int sgIP_UDP_ChecksumWithHeader(sgIP_memblock *mb, unsigned long pseudo_sum,
+                                       int totallength)
 {
     if (!mb)
         return 0;
-    if (mb->totallength & 1)
-        mb->datastart[mb->totallength] = 0;
 
     int checksum = sgIP_memblock_IPChecksum(mb, 0, mb->totallength);
     // add in checksum of "faux header"
-    checksum += (destip & 0xFFFF);
-    checksum += (destip >> 16);
-    checksum += (srcip & 0xFFFF);
-    checksum += (srcip >> 16);
+    checksum += pseudo_sum;
     checksum += htons(totallength);
-    checksum += (17) << 8;
     checksum = (checksum & 0xFFFF) + (checksum >> 16);
     checksum = (checksum & 0xFFFF) + (checksum >> 16);
 
@@ -73,43 +322,66 @@ int sgIP_UDP_CalcChecksum(sgIP_memblock *mb, unsigned long srcip, unsigned long
     return checksum;
 }
 
+int sgIP_UDP_CalcChecksum(sgIP_memblock *mb, unsigned long srcip, unsigned long destip,
+                          int totallength)
+{
+    return sgIP_UDP_ChecksumWithHeader(mb, sgIP_UDP_PseudoHeaderSum(srcip, destip), totallength);
+}
+
 int sgIP_UDP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long destip)
 {
     if (!mb)
         return 0;
 
-    int chk = sgIP_UDP_CalcChecksum(mb, srcip, destip, mb->totallength);
+    // The checksum is verified when the datagram is read, so that datagrams that are dropped
+    // aren't checked, and the check can be done while the data is copied to the user buffer.
     sgIP_Header_UDP *udp;
     udp = (sgIP_Header_UDP *)mb->datastart;
-    if (chk != 0xFFFF && udp->checksum != 0)
+    if (mb->totallength < (int)sizeof(sgIP_Header_UDP))
     {
-        SGIP_DEBUG_MESSAGE(("UDP receive checksum incorrect"));
         sgIP_memblock_free(mb);
-        return 0; // checksum error
+        return 0;
     }
     sgIP_Record_UDP *rec;
     sgIP_memblock *tmb;
     SGIP_INTR_PROTECT();
-    rec = udprecords;
+    rec = sgIP_UDP_FindRecord(srcip, udp->srcport, destip, udp->destport);
+    if (!rec)
+    {
+        // no matching records
+        sgIP_memblock_free(mb);
+        SGIP_INTR_UNPROTECT();
+        return 0;
+    }
 
-    while (rec)
+    // add some data to the packet before it's stuffed into the record queue.
+    sgIP_memblock_exposeheader(mb, 8);
+    ((uint32_t *)mb->datastart)[0] = srcip; // keep the addresses around for the checksum
+    ((uint32_t *)mb->datastart)[1] = destip;
+
+    // Datagrams are charged the memory that they take from the heap, not their length, so that
+    // floods of small datagrams are limited as well.
+    int cost = 0;
+    for (tmb = mb; tmb; tmb = tmb->next)
+        cost += sgIP_UDP_BlockCost(tmb);
+    if (rec->rx_dropoldest)
     {
-        if ((rec->srcip == destip || rec->srcip == 0) && rec->srcport == udp->destport
-            && rec->state != SGIP_UDP_STATE_UNUSED)
-            break; // a match!
-        rec = rec->next;
+        while (rec->incoming_queue && rec->rx_queued + cost > rec->rx_limit)
+        {
+            sgIP_UDP_DropFirst(rec);
+            rec->rx_drops++;
+        }
     }
-    if (!rec)
+    else if (rec->incoming_queue && rec->rx_queued + cost > rec->rx_limit)
     {
-        // no matching records
+        rec->rx_drops++;
         sgIP_memblock_free(mb);
         SGIP_INTR_UNPROTECT();
         return 0;
     }
-    // we have a record and a packet for it; add some data to the record and stuff it into the
-    // record queue.
-    sgIP_memblock_exposeheader(mb, 4);
-    *((unsigned long *)mb->datastart) = srcip; // keep srcip around.
+    rec->rx_queued += cost;
+
+    // we have a record and a packet for it; stuff it into the record queue.
     if (rec->incoming_queue == 0)
     {
         rec->incoming_queue = mb;
@@ -125,47 +397,112 @@ int sgIP_UDP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
     rec->incoming_queue_end = tmb;
     // ok, data added to queue - yay!
     // that means... we're done.
+    SGIP_NOTIFYEVENT(rec);
 
     SGIP_INTR_UNPROTECT();
     return 0;
 }
 
-int sgIP_UDP_SendPacket(sgIP_Record_UDP *rec, const char *data, int datalen, unsigned long destip,
-                        int destport)
+// Sends one datagram with the contents of all the buffers of iov.
+static int sgIP_UDP_SendGather(sgIP_Record_UDP *rec, const struct iovec *iov, int iovlen,
+                               unsigned long destip, int destport)
 {
-    if (!rec || !data)
+    if (!rec || !iov || iovlen < 0)
         return SGIP_ERROR(EINVAL);
 
+    int datalen = 0;
+    for (int i = 0; i < iovlen; i++)
+    {
+        if (!iov[i].iov_base && iov[i].iov_len > 0)
+            return SGIP_ERROR(EINVAL);
+        datalen += iov[i].iov_len;
+    }
+    if (datalen > 0xFFFF - sgIP_IP_RequiredHeaderSize() - 8)
+        return SGIP_ERROR(EMSGSIZE);
+
+    if (rec->errorcode)
+    {
+        SGIP_INTR_PROTECT();
+        int error      = rec->errorcode;
+        rec->errorcode = 0;
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(error);
+    }
+
     if (rec->state != SGIP_UDP_STATE_BOUND)
     {
-        rec->srcip   = 0;
-        rec->srcport = sgIP_UDP_GetUnusedOutgoingPort();
-        rec->state   = SGIP_UDP_STATE_BOUND;
+        SGIP_INTR_PROTECT();
+        if (sgIP_UDP_SetLocalPort(rec, 0) < 0)
+        {
+            SGIP_INTR_UNPROTECT();
+            return -1;
+        }
+        rec->srcip = 0;
+        rec->state = SGIP_UDP_STATE_BOUND;
+        sgIP_UDP_Rehash(rec);
+        SGIP_INTR_UNPROTECT();
     }
 
-    sgIP_memblock *mb = sgIP_memblock_alloc(sgIP_IP_RequiredHeaderSize() + 8 + datalen);
+    if (!sgIP_IP_PacingAllows(&rec->pacing, sgIP_IP_RequiredHeaderSize() + 8 + datalen))
+        return SGIP_ERROR(EWOULDBLOCK);
+
+    // Datagrams larger than the MTU are split so that they can be fragmented without copying them
+    sgIP_memblock *mb = sgIP_IP_AllocPacket(destip, 8 + datalen);
     if (!mb)
         return SGIP_ERROR(ENOMEM);
-    sgIP_memblock_exposeheader(mb, -sgIP_IP_RequiredHeaderSize()); // hide IP header space for later
 
     SGIP_INTR_PROTECT();
-    unsigned long srcip  = sgIP_IP_GetLocalBindAddr(rec->srcip, destip);
     sgIP_Header_UDP *udp = (sgIP_Header_UDP *)mb->datastart;
     udp->srcport         = rec->srcport;
     udp->destport        = destport;
     udp->length          = htons(datalen + 8);
     udp->checksum        = 0;
 
-    for (int i = 0; i < datalen; i++)
-        mb->datastart[i + 8] = data[i];
+    int pos = 8;
+    for (int i = 0; i < iovlen; i++)
+    {
+        sgIP_memblock_CopyFromLinear(mb, iov[i].iov_base, pos, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+
+    sgIP_IP_PacingConsume(&rec->pacing, sgIP_IP_RequiredHeaderSize() + mb->totallength);
 
-    udp->checksum = sgIP_UDP_CalcChecksum(mb, srcip, destip, mb->totallength);
-    sgIP_IP_SendViaIP(mb, 17, srcip, destip);
+    // Connected sockets keep the route to their peer, so that it isn't looked up every time.
+    int connected = rec->destip != 0 && destip == rec->destip && destport == rec->destport;
+    if (connected && !sgIP_IP_RouteValid(&rec->route))
+    {
+        if (sgIP_IP_RouteResolve(&rec->route, PROTOCOL_IP_UDP, rec->srcip, destip))
+            rec->pseudo_sum = sgIP_UDP_PseudoHeaderSum(rec->route.srcip, destip);
+        else
+            connected = 0;
+    }
+
+    if (connected)
+    {
+        udp->checksum = sgIP_UDP_ChecksumWithHeader(mb, rec->pseudo_sum, mb->totallength);
+        sgIP_IP_SendViaRoute(mb, &rec->route);
+    }
+    else
+    {
+        unsigned long srcip = sgIP_IP_GetLocalBindAddr(rec->srcip, destip);
+        udp->checksum       = sgIP_UDP_CalcChecksum(mb, srcip, destip, mb->totallength);
+        sgIP_IP_SendViaIP(mb, PROTOCOL_IP_UDP, srcip, destip);
+    }
 
     SGIP_INTR_UNPROTECT();
     return datalen;
 }
 
+int sgIP_UDP_SendPacket(sgIP_Record_UDP *rec, const char *data, int datalen, unsigned long destip,
+                        int destport)
+{
+    if (!data)
+        return SGIP_ERROR(EINVAL);
+
+    struct iovec iov = { (void *)data, datalen };
+    return sgIP_UDP_SendGather(rec, &iov, 1, destip, destport);
+}
+
 sgIP_Record_UDP *sgIP_UDP_AllocRecord(void)
 {
     SGIP_INTR_PROTECT();
@@ -175,13 +512,26 @@ sgIP_Record_UDP *sgIP_UDP_AllocRecord(void)
     {
         rec->destip             = 0;
         rec->destport           = 0;
+        rec->errorcode          = 0;
+        rec->hash_next          = 0;
+        rec->hash_bucket        = 0;
         rec->incoming_queue     = 0;
         rec->incoming_queue_end = 0;
+        rec->rx_queued          = 0;
+        rec->rx_limit           = SGIP_UDP_RECEIVEBUFFERLENGTH;
+        rec->rx_dropoldest      = 0;
+        rec->rx_drops           = 0;
+        rec->rx_nocheck         = 0;
         rec->srcip              = 0;
         rec->srcport            = 0;
+        rec->srcport_reserved   = 0;
         rec->state              = 0;
         rec->next               = udprecords;
         udprecords              = rec;
+        for (int i = 0; i < SGIP_UDP_MAXGROUPS; i++)
+            rec->groups[i] = 0;
+        sgIP_IP_PacingInit(&rec->pacing, 0);
+        sgIP_IP_RouteInit(&rec->route);
     }
     SGIP_INTR_UNPROTECT();
     return rec;
@@ -199,6 +549,16 @@ void sgIP_UDP_FreeRecord(sgIP_Record_UDP *rec)
     if (rec->incoming_queue)
         sgIP_memblock_free(rec->incoming_queue); // woohoo!
 
+    if (rec->srcport_reserved)
+        sgIP_Ports_Release(&udp_ports, ntohs(rec->srcport));
+
+    for (int i = 0; i < SGIP_UDP_MAXGROUPS; i++)
+    {
+        if (rec->groups[i] != 0)
+            sgIP_IGMP_Leave(rec->groups[i]);
+    }
+
+    sgIP_UDP_Unhash(rec);
     rec->state = 0;
     if (udprecords == rec)
     {
@@ -230,15 +590,47 @@ int sgIP_UDP_Bind(sgIP_Record_UDP *rec, int srcport, unsigned long srcip)
     SGIP_INTR_PROTECT();
     if (rec->state != SGIP_UDP_STATE_UNUSED)
     {
-        rec->srcip   = srcip;
-        rec->srcport = srcport;
+        if (sgIP_UDP_SetLocalPort(rec, srcport) < 0)
+        {
+            SGIP_INTR_UNPROTECT();
+            return -1;
+        }
+        rec->srcip = srcip;
         if (rec->state == SGIP_UDP_STATE_UNBOUND)
             rec->state = SGIP_UDP_STATE_BOUND;
+        sgIP_UDP_Rehash(rec);
+        sgIP_IP_RouteInit(&rec->route);
     }
     SGIP_INTR_UNPROTECT();
     return 0;
 }
 
+int sgIP_UDP_Connect(sgIP_Record_UDP *rec, unsigned long destip, int destport)
+{
+    if (!rec)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    if (rec->state == SGIP_UDP_STATE_UNBOUND)
+    {
+        if (sgIP_UDP_SetLocalPort(rec, 0) < 0)
+        {
+            SGIP_INTR_UNPROTECT();
+            return -1;
+        }
+        rec->srcip = 0;
+        rec->state = SGIP_UDP_STATE_BOUND;
+    }
+    // a destination of 0 removes the peer
+    rec->destip    = destip;
+    rec->destport  = destip ? destport : 0;
+    rec->errorcode = 0;
+    sgIP_UDP_Rehash(rec);
+    sgIP_IP_RouteInit(&rec->route);
+    SGIP_INTR_UNPROTECT();
+    return 0;
+}
+
 int sgIP_UDP_RecvFrom(sgIP_Record_UDP *rec, char *destbuf, int buflength, int flags,
                       unsigned long *sender_ip, unsigned short *sender_port)
 {
@@ -248,44 +640,88 @@ int sgIP_UDP_RecvFrom(sgIP_Record_UDP *rec, char *destbuf, int buflength, int fl
         return SGIP_ERROR(EINVAL);
 
     SGIP_INTR_PROTECT();
-    if (rec->incoming_queue == 0)
+    if (rec->errorcode)
     {
+        int error      = rec->errorcode;
+        rec->errorcode = 0;
         SGIP_INTR_UNPROTECT();
-        return SGIP_ERROR(EWOULDBLOCK);
+        return SGIP_ERROR(error);
+    }
+
+    // Datagrams with a wrong checksum are dropped, and the next one is read instead.
+    struct iovec iov = { destbuf, buflength };
+    int retval       = -1;
+    while (retval < 0)
+    {
+        if (rec->incoming_queue == 0)
+        {
+            SGIP_INTR_UNPROTECT();
+            return SGIP_ERROR(EWOULDBLOCK);
+        }
+        int packetlen = rec->incoming_queue->totallength - SGIP_UDP_QUEUEHEADER;
+        if (packetlen > buflength)
+        {
+            SGIP_INTR_UNPROTECT();
+            return SGIP_ERROR(EMSGSIZE);
+        }
+        retval = sgIP_UDP_Dequeue(rec, &iov, 1, sender_ip, sender_port);
     }
-    int packetlen = rec->incoming_queue->totallength - 12;
-    if (packetlen > buflength)
+
+    SGIP_INTR_UNPROTECT();
+    return retval;
+}
+
+int sgIP_UDP_RecvMsg(sgIP_Record_UDP *rec, const struct iovec *iov, int iovlen, int *msg_flags,
+                     unsigned long *sender_ip, unsigned short *sender_port)
+{
+    if (!rec || (!iov && iovlen > 0) || iovlen < 0)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    if (rec->errorcode)
     {
+        int error      = rec->errorcode;
+        rec->errorcode = 0;
         SGIP_INTR_UNPROTECT();
-        return SGIP_ERROR(EMSGSIZE);
+        return SGIP_ERROR(error);
     }
-    sgIP_memblock *mb;
-    *sender_ip   = *((unsigned long *)rec->incoming_queue->datastart);
-    *sender_port = ((unsigned short *)rec->incoming_queue->datastart)[2];
-    int totlen, first, buf_start, i;
-    totlen    = rec->incoming_queue->totallength;
-    first     = 12;
-    buf_start = 0;
 
-    while (totlen > 0 && rec->incoming_queue)
+    int retval = -1;
+    while (retval < 0)
     {
-        totlen -= rec->incoming_queue->thislength;
-
-        for (i = first; i < rec->incoming_queue->thislength; i++)
-            destbuf[buf_start + i - first] = rec->incoming_queue->datastart[i];
+        if (rec->incoming_queue == 0)
+        {
+            SGIP_INTR_UNPROTECT();
+            return SGIP_ERROR(EWOULDBLOCK);
+        }
 
-        buf_start += rec->incoming_queue->thislength - first;
-        first               = 0;
-        mb                  = rec->incoming_queue;
-        rec->incoming_queue = rec->incoming_queue->next;
-        mb->next            = 0;
-        sgIP_memblock_free(mb);
+        // Unlike recvfrom(), datagrams that don't fit are truncated and flagged.
+        int packetlen = rec->incoming_queue->totallength - SGIP_UDP_QUEUEHEADER;
+        retval        = sgIP_UDP_Dequeue(rec, iov, iovlen, sender_ip, sender_port);
+        if (msg_flags)
+            *msg_flags = retval < packetlen ? MSG_TRUNC : 0;
     }
-    if (!(rec->incoming_queue))
-        rec->incoming_queue_end = 0;
 
     SGIP_INTR_UNPROTECT();
-    return buf_start;
+    return retval;
+}
+
+int sgIP_UDP_SendMsg(sgIP_Record_UDP *rec, const struct iovec *iov, int iovlen,
+                     unsigned long dest_ip, int dest_port)
+{
+    if (!rec)
+        return SGIP_ERROR(EINVAL);
+
+    // Without a destination, the datagram goes to the peer of the socket.
+    if (dest_ip == 0)
+    {
+        if (rec->destip == 0)
+            return SGIP_ERROR(EDESTADDRREQ);
+        dest_ip   = rec->destip;
+        dest_port = rec->destport;
+    }
+
+    return sgIP_UDP_SendGather(rec, iov, iovlen, dest_ip, dest_port);
 }
 
 int sgIP_UDP_SendTo(sgIP_Record_UDP *rec, const char *buf, int buflength, int flags,
@@ -295,3 +731,174 @@ int sgIP_UDP_SendTo(sgIP_Record_UDP *rec, const char *buf, int buflength, int fl
 
     return sgIP_UDP_SendPacket(rec, buf, buflength, dest_ip, dest_port);
 }
+
+int sgIP_UDP_Send(sgIP_Record_UDP *rec, const char *buf, int buflength, int flags)
+{
+    (void)flags;
+
+    if (!rec)
+        return SGIP_ERROR(EINVAL);
+    if (rec->destip == 0)
+        return SGIP_ERROR(EDESTADDRREQ);
+
+    return sgIP_UDP_SendPacket(rec, buf, buflength, rec->destip, rec->destport);
+}
+
+// Groups are tracked per socket so that they can be left when the socket is closed.
+static int sgIP_UDP_SetMembership(sgIP_Record_UDP *rec, int option, const struct ip_mreq *mreq)
+{
+    unsigned long group = mreq->imr_multiaddr.s_addr;
+    if (!SGIP_IP_IS_MULTICAST(group))
+        return SGIP_ERROR(EINVAL);
+
+    int slot = -1;
+    for (int i = 0; i < SGIP_UDP_MAXGROUPS; i++)
+    {
+        if (rec->groups[i] == group)
+        {
+            slot = i;
+            break;
+        }
+    }
+
+    if (option == IP_DROP_MEMBERSHIP)
+    {
+        if (slot == -1)
+            return SGIP_ERROR(EADDRNOTAVAIL);
+        rec->groups[slot] = 0;
+        sgIP_IGMP_Leave(group);
+        return 0;
+    }
+
+    if (slot != -1)
+        return SGIP_ERROR(EADDRINUSE);
+
+    for (int i = 0; i < SGIP_UDP_MAXGROUPS; i++)
+    {
+        if (rec->groups[i] == 0)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == -1)
+        return SGIP_ERROR(ENOBUFS);
+
+    if (sgIP_IGMP_Join(group) != 0)
+        return -1;
+    rec->groups[slot] = group;
+    return 0;
+}
+
+int sgIP_UDP_SetOption(sgIP_Record_UDP *rec, int level, int option, const void *data,
+                       int data_len)
+{
+    if (!rec || !data || data_len < (int)sizeof(int))
+        return SGIP_ERROR(EINVAL);
+
+    if (level == IPPROTO_IP && (option == IP_ADD_MEMBERSHIP || option == IP_DROP_MEMBERSHIP))
+    {
+        if (data_len < (int)sizeof(struct ip_mreq))
+            return SGIP_ERROR(EINVAL);
+
+        SGIP_INTR_PROTECT();
+        int retval = sgIP_UDP_SetMembership(rec, option, (const struct ip_mreq *)data);
+        SGIP_INTR_UNPROTECT();
+        return retval;
+    }
+
+    // Options that aren't supported are ignored, like for TCP sockets.
+    if (level != SOL_SOCKET)
+        return 0;
+
+    int value = *(const int *)data;
+
+    SGIP_INTR_PROTECT();
+    switch (option)
+    {
+        case SO_MAX_PACING_RATE:
+            sgIP_IP_PacingInit(&rec->pacing, *(const unsigned int *)data);
+            break;
+        case SO_RCVBUF:
+            // Datagrams that are already queued are kept even if they go over the new limit.
+            if (value < SGIP_MEMBLOCK_DATASIZE)
+                value = SGIP_MEMBLOCK_DATASIZE;
+            if (value > SGIP_UDP_RECEIVEBUFFERMAX)
+                value = SGIP_UDP_RECEIVEBUFFERMAX;
+            rec->rx_limit = value;
+            break;
+        case SO_RCVDROPOLDEST:
+            rec->rx_dropoldest = value ? 1 : 0;
+            break;
+        case SO_RCVNOCHECK:
+            // Only for links that protect frames in other ways, like the FCS of 802.11 frames.
+            rec->rx_nocheck = value ? 1 : 0;
+            break;
+    }
+    SGIP_INTR_UNPROTECT();
+
+    return 0;
+}
+
+int sgIP_UDP_GetOption(sgIP_Record_UDP *rec, int level, int option, void *data, int *data_len)
+{
+    if (!rec || !data || !data_len || *data_len < (int)sizeof(int))
+        return SGIP_ERROR(EINVAL);
+
+    if (level != SOL_SOCKET)
+        return SGIP_ERROR(ENOPROTOOPT);
+
+    SGIP_INTR_PROTECT();
+    switch (option)
+    {
+        case SO_ERROR:
+            *(int *)data   = rec->errorcode;
+            rec->errorcode = 0;
+            break;
+        case SO_MAX_PACING_RATE:
+            *(int *)data = rec->pacing.rate;
+            break;
+        case SO_RCVBUF:
+            *(int *)data = rec->rx_limit;
+            break;
+        case SO_RCVDROPS:
+            *(int *)data = rec->rx_drops;
+            break;
+        case SO_RCVDROPOLDEST:
+            *(int *)data = rec->rx_dropoldest;
+            break;
+        case SO_RCVNOCHECK:
+            *(int *)data = rec->rx_nocheck;
+            break;
+        default:
+            SGIP_INTR_UNPROTECT();
+            return SGIP_ERROR(ENOPROTOOPT);
+    }
+    SGIP_INTR_UNPROTECT();
+
+    *data_len = sizeof(int);
+    return 0;
+}
+
+void sgIP_UDP_Unreachable(unsigned long srcip, unsigned long destip, unsigned short srcport,
+                          unsigned short destport, int error)
+{
+    SGIP_INTR_PROTECT();
+
+    // Like other stacks, only connected sockets get the error. Unconnected sockets can send to
+    // many destinations and can't tell which one the error is about.
+    sgIP_Record_UDP *rec = *sgIP_UDP_ConnectedBucket(srcport, destip, destport);
+    while (rec)
+    {
+        if (rec->srcport == srcport && (rec->srcip == srcip || rec->srcip == 0)
+            && rec->destip == destip && rec->destport == destport && destip != 0)
+        {
+            rec->errorcode = error;
+            SGIP_NOTIFYEVENT(rec);
+            break;
+        }
+        rec = rec->hash_next;
+    }
+
+    SGIP_INTR_UNPROTECT();
+}
@@ -12,8 +12,15 @@ extern "C" {
 #endif
 
 #include "arm9/sgIP/sgIP_Config.h"
+#include "arm9/sgIP/sgIP_IP.h"
 #include "arm9/sgIP/sgIP_memblock.h"
 
+struct iovec;
+
+// Datagrams in the incoming queue start with their source and destination addresses, followed
+// by the UDP header. The checksum is verified when they are read.
+#define SGIP_UDP_QUEUEHEADER 16
+
 enum SGIP_UDP_STATE
 {
     SGIP_UDP_STATE_UNBOUND, // newly allocated
@@ -30,14 +37,28 @@ typedef struct SGIP_HEADER_UDP
 typedef struct SGIP_RECORD_UDP
 {
     struct SGIP_RECORD_UDP *next;
+    struct SGIP_RECORD_UDP *hash_next;    // next record in the same hash bucket
+    struct SGIP_RECORD_UDP **hash_bucket; // hash bucket of the record, or NULL
 
     int state;
     unsigned long srcip;
-    unsigned long destip;
+    unsigned long destip; // peer set by connect(), or 0
     unsigned short srcport, destport;
+    int srcport_reserved;     // srcport is an ephemeral port that has to be released
+    int errorcode;            // error reported by ICMP to a connected socket, returned once
+    sgIP_IP_Pacing pacing;    // limits the rate of sent datagrams (SO_MAX_PACING_RATE)
+    sgIP_IP_Route route;      // cached route to the peer of a connected socket
+    unsigned long pseudo_sum; // checksum of the pseudo-header of datagrams sent through route
 
     sgIP_memblock *incoming_queue;
     sgIP_memblock *incoming_queue_end;
+    int rx_queued;         // memory used by the incoming queue
+    int rx_limit;          // maximum value of rx_queued (SO_RCVBUF)
+    int rx_dropoldest;     // make room for new datagrams by dropping old ones (SO_RCVDROPOLDEST)
+    unsigned int rx_drops; // datagrams dropped because the queue was full (SO_RCVDROPS)
+    int rx_nocheck;        // don't verify checksums (SO_RCVNOCHECK)
+
+    unsigned long groups[SGIP_UDP_MAXGROUPS]; // multicast groups joined by the socket, or 0
 
 } sgIP_Record_UDP;
 
@@ -53,10 +74,27 @@ sgIP_Record_UDP *sgIP_UDP_AllocRecord(void);
 void sgIP_UDP_FreeRecord(sgIP_Record_UDP *rec);
 
 int sgIP_UDP_Bind(sgIP_Record_UDP *rec, int srcport, unsigned long srcip);
+int sgIP_UDP_Connect(sgIP_Record_UDP *rec, unsigned long destip, int destport);
 int sgIP_UDP_RecvFrom(sgIP_Record_UDP *rec, char *destbuf, int buflength, int flags,
                       unsigned long *sender_ip, unsigned short *sender_port);
 int sgIP_UDP_SendTo(sgIP_Record_UDP *rec, const char *buf, int buflength, int flags,
                     unsigned long dest_ip, int dest_port);
+int sgIP_UDP_Send(sgIP_Record_UDP *rec, const char *buf, int buflength, int flags);
+// Scatter/gather versions of the functions above, used by recvmmsg() and sendmmsg(). RecvMsg()
+// truncates datagrams that don't fit and sets MSG_TRUNC in *msg_flags. SendMsg() sends to the peer
+// of the socket if dest_ip is 0.
+int sgIP_UDP_RecvMsg(sgIP_Record_UDP *rec, const struct iovec *iov, int iovlen, int *msg_flags,
+                     unsigned long *sender_ip, unsigned short *sender_port);
+int sgIP_UDP_SendMsg(sgIP_Record_UDP *rec, const struct iovec *iov, int iovlen,
+                     unsigned long dest_ip, int dest_port);
+int sgIP_UDP_SetOption(sgIP_Record_UDP *rec, int level, int option, const void *data,
+                       int data_len);
+int sgIP_UDP_GetOption(sgIP_Record_UDP *rec, int level, int option, void *data, int *data_len);
+
+// Called when an ICMP "destination unreachable" message quotes a datagram sent from srcip:srcport
+// to destip:destport (ports in network byte order). error is the errno value to report.
+void sgIP_UDP_Unreachable(unsigned long srcip, unsigned long destip, unsigned short srcport,
+                          unsigned short destport, int error);
 
 #ifdef __cplusplus
 };
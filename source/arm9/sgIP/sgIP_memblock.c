@@ -145,6 +145,43 @@ sgIP_memblock *sgIP_memblock_alloc(int packetsize)
     return sgIP_memblock_allocHW(0, packetsize);
 }
 
+sgIP_memblock *sgIP_memblock_allocSplit(int packetsize, int firstsize, int blocksize)
+{
+#ifndef SGIP_MEMBLOCK_DYNAMIC_MALLOC_ALL
+    // Blocks from the pool can't hold more than this, so they can't be split as requested.
+    if (firstsize > SGIP_MEMBLOCK_FIRSTINTERNALSIZE || blocksize > SGIP_MEMBLOCK_FIRSTINTERNALSIZE)
+        return sgIP_memblock_alloc(packetsize);
+#endif
+    if (firstsize <= 0 || blocksize <= 0 || packetsize <= firstsize)
+        return sgIP_memblock_alloc(packetsize);
+
+    sgIP_memblock *mb = sgIP_memblock_allocHW(0, firstsize);
+    if (!mb)
+        return 0;
+    mb->totallength = packetsize;
+
+    sgIP_memblock *tmb = mb;
+    int totlen         = firstsize;
+    while (totlen < packetsize)
+    {
+        int len = packetsize - totlen;
+        if (len > blocksize)
+            len = blocksize;
+
+        sgIP_memblock *t = sgIP_memblock_allocHW(0, len);
+        if (!t)
+        {
+            sgIP_memblock_free(mb);
+            return 0;
+        }
+        t->totallength = packetsize;
+        tmb->next      = t;
+        tmb            = t;
+        totlen += len;
+    }
+    return mb;
+}
+
 #ifdef SGIP_MEMBLOCK_DYNAMIC_MALLOC_ALL
 
 void sgIP_memblock_free(sgIP_memblock *mb)
@@ -13,6 +13,9 @@ extern "C" {
 
 #include "arm9/sgIP/sgIP_Config.h"
 
+// Size of the fields that go before the data of a memblock (16 bytes with 32-bit pointers).
+#define SGIP_MEMBLOCK_HEADERSIZE (2 * sizeof(int) + 2 * sizeof(void *))
+
 typedef struct SGIP_MEMBLOCK
 {
     int totallength;
@@ -20,17 +23,18 @@ typedef struct SGIP_MEMBLOCK
     struct SGIP_MEMBLOCK *next;
     char *datastart;
 
-    // assume the other 4 values are 16 bytes total in length.
-    char reserved[SGIP_MEMBLOCK_DATASIZE - 16];
+    char reserved[SGIP_MEMBLOCK_DATASIZE - SGIP_MEMBLOCK_HEADERSIZE];
 } sgIP_memblock;
 
-#define SGIP_MEMBLOCK_HEADERSIZE        16
-#define SGIP_MEMBLOCK_INTERNALSIZE      (SGIP_MEMBLOCK_DATASIZE - 16)
-#define SGIP_MEMBLOCK_FIRSTINTERNALSIZE (SGIP_MEMBLOCK_DATASIZE - 16 - SGIP_MAXHWHEADER)
+#define SGIP_MEMBLOCK_INTERNALSIZE      (int)(SGIP_MEMBLOCK_DATASIZE - SGIP_MEMBLOCK_HEADERSIZE)
+#define SGIP_MEMBLOCK_FIRSTINTERNALSIZE (SGIP_MEMBLOCK_INTERNALSIZE - SGIP_MAXHWHEADER)
 
 void sgIP_memblock_Init(void);
 sgIP_memblock *sgIP_memblock_alloc(int packetsize);
 sgIP_memblock *sgIP_memblock_allocHW(int headersize, int packetsize);
+// Allocates a chain where the first block holds firstsize bytes and the others hold blocksize bytes
+// (except for the last one), so that it can be split into packets without copying the data.
+sgIP_memblock *sgIP_memblock_allocSplit(int packetsize, int firstsize, int blocksize);
 void sgIP_memblock_free(sgIP_memblock *mb);
 void sgIP_memblock_exposeheader(sgIP_memblock *mb, int change);
 void sgIP_memblock_trimsize(sgIP_memblock *mb, int newsize);
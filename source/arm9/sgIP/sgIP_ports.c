@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - sgIP Internet Protocol Stack Implementation
+
+#include "arm9/sgIP/sgIP_ports.h"
+#include "arm9/sgIP/sgIP_random.h"
+
+void sgIP_Ports_Init(sgIP_PortSet *set, uint32_t *bits, int first, int last)
+{
+    int words = SGIP_PORTS_WORDS(first, last);
+
+    set->first = first;
+    set->count = last - first + 1;
+    set->used  = 0;
+    set->bits  = bits;
+
+    for (int i = 0; i < words; i++)
+        bits[i] = 0;
+    // the bits past the end of the range are never free
+    for (int i = set->count; i < words * 32; i++)
+        bits[i / 32] |= 1u << (i & 31);
+}
+
+int sgIP_Ports_Alloc(sgIP_PortSet *set)
+{
+    if (set->used >= set->count)
+        return 0;
+
+    // RFC 6056 section 3.3.1: start at a random port and take the next one that is free. Ports of
+    // connections in TIME_WAIT are still in use, so they aren't reused until it ends. The start
+    // comes from the same pool as the keys of the Fast Open cookies, so it can't be predicted from
+    // the ports of earlier connections.
+    int words = (set->count + 31) / 32;
+    int i     = sgIP_Random_Get() % set->count;
+    int word  = i / 32;
+    uint32_t w = set->bits[word] | ((1u << (i & 31)) - 1); // skip the ports before the start
+
+    while (w == 0xFFFFFFFF)
+    {
+        word++;
+        if (word == words)
+            word = 0;
+        w = set->bits[word];
+    }
+
+    int bit = __builtin_ctz(~w);
+    set->bits[word] |= 1u << bit;
+    set->used++;
+    return set->first + word * 32 + bit;
+}
+
+int sgIP_Ports_Reserve(sgIP_PortSet *set, int port)
+{
+    int i = port - set->first;
+    if (i < 0 || i >= set->count)
+        return 0;
+    if (set->bits[i / 32] & (1u << (i & 31)))
+        return 0;
+
+    set->bits[i / 32] |= 1u << (i & 31);
+    set->used++;
+    return 1;
+}
+
+void sgIP_Ports_Release(sgIP_PortSet *set, int port)
+{
+    int i = port - set->first;
+    if (i < 0 || i >= set->count)
+        return;
+    if (!(set->bits[i / 32] & (1u << (i & 31))))
+        return;
+
+    set->bits[i / 32] &= ~(1u << (i & 31));
+    set->used--;
+}
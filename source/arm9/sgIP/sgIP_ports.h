@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - sgIP Internet Protocol Stack Implementation
+
+#ifndef SGIP_PORTS_H
+#define SGIP_PORTS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "arm9/sgIP/sgIP_Config.h"
+
+// Number of words of the bitmap of an ephemeral port range.
+#define SGIP_PORTS_WORDS(first, last) (((last) - (first) + 1 + 31) / 32)
+
+// sgIP_PortSet - the ephemeral ports of a protocol, with one bit per port that is set while the
+// port is in use. Ports are in host byte order.
+typedef struct SGIP_PORTSET
+{
+    int first, count; // range of ephemeral ports
+    int used;         // number of ports in use
+    uint32_t *bits;   // SGIP_PORTS_WORDS(first, last) words
+} sgIP_PortSet;
+
+void sgIP_Ports_Init(sgIP_PortSet *set, uint32_t *bits, int first, int last);
+
+// Returns a random unused port, and marks it as used. Returns 0 if all ports are in use. It must be
+// called with the stack locked.
+int sgIP_Ports_Alloc(sgIP_PortSet *set);
+// Marks a port chosen by the application as used. Returns 1 if it was in the range of ephemeral
+// ports and unused, which means that it has to be released later.
+int sgIP_Ports_Reserve(sgIP_PortSet *set, int port);
+void sgIP_Ports_Release(sgIP_PortSet *set, int port);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - sgIP Internet Protocol Stack Implementation
+
+#include "arm9/sgIP/sgIP_random.h"
+
+extern volatile unsigned long sgIP_timems;
+
+static uint32_t random_pool[4]; // also the key of the numbers that are returned
+static uint32_t random_counter;
+
+#define SIPHASH_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPHASH_ROUND()                \
+    do                                 \
+    {                                  \
+        v0 += v1;                      \
+        v1 = SIPHASH_ROTL(v1, 13);     \
+        v1 ^= v0;                      \
+        v0 = SIPHASH_ROTL(v0, 32);     \
+        v2 += v3;                      \
+        v3 = SIPHASH_ROTL(v3, 16);     \
+        v3 ^= v2;                      \
+        v0 += v3;                      \
+        v3 = SIPHASH_ROTL(v3, 21);     \
+        v3 ^= v0;                      \
+        v2 += v1;                      \
+        v1 = SIPHASH_ROTL(v1, 17);     \
+        v1 ^= v2;                      \
+        v2 = SIPHASH_ROTL(v2, 32);     \
+    } while (0)
+
+uint64_t sgIP_SipHash(const uint32_t *key, const void *data, int len)
+{
+    const unsigned char *in = data;
+
+    uint64_t k0 = key[0] | ((uint64_t)key[1] << 32);
+    uint64_t k1 = key[2] | ((uint64_t)key[3] << 32);
+    uint64_t v0 = k0 ^ 0x736F6D6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646F72616E646F6DULL;
+    uint64_t v2 = k0 ^ 0x6C7967656E657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+    // the last word holds the bytes that are left and the length
+    uint64_t m;
+    int i = 0;
+    for (;;)
+    {
+        m = 0;
+        int n = len - i < 8 ? len - i : 8;
+        for (int j = 0; j < n; j++)
+            m |= (uint64_t)in[i + j] << (8 * j);
+        if (n < 8)
+        {
+            m |= (uint64_t)len << 56;
+            break;
+        }
+        i += 8;
+
+        v3 ^= m;
+        SIPHASH_ROUND();
+        SIPHASH_ROUND();
+        v0 ^= m;
+    }
+
+    v3 ^= m;
+    SIPHASH_ROUND();
+    SIPHASH_ROUND();
+    v0 ^= m;
+
+    v2 ^= 0xFF;
+    SIPHASH_ROUND();
+    SIPHASH_ROUND();
+    SIPHASH_ROUND();
+    SIPHASH_ROUND();
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+void sgIP_Random_AddEntropy(uint32_t value)
+{
+    SGIP_INTR_PROTECT();
+
+    // Every word of the pool depends on the new value and on the whole previous pool.
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        uint32_t data[3] = { value, sgIP_timems, i };
+        uint64_t hash    = sgIP_SipHash(random_pool, data, sizeof(data));
+        random_pool[i * 2] ^= (uint32_t)hash;
+        random_pool[i * 2 + 1] ^= (uint32_t)(hash >> 32);
+    }
+
+    SGIP_INTR_UNPROTECT();
+}
+
+uint32_t sgIP_Random_Get(void)
+{
+    uint32_t data[2] = { random_counter++, sgIP_timems };
+    return (uint32_t)sgIP_SipHash(random_pool, data, sizeof(data));
+}
@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2026 Antonio Niño Díaz
+
+// DSWifi Project - sgIP Internet Protocol Stack Implementation
+
+#ifndef SGIP_RANDOM_H
+#define SGIP_RANDOM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "arm9/sgIP/sgIP_Config.h"
+
+// Random numbers for the values that other hosts must not be able to guess, like the keys of the
+// TCP Fast Open cookies. They come from a pool of 128 bits that the platform seeds with
+// sgIP_Random_AddEntropy() after sgIP_Init(), and again from time to time. sgIP_Init() doesn't
+// clear the pool. Without any seed, the numbers only depend on the time of the calls, which is
+// easy to guess.
+
+// Mixes a value from a source of entropy of the platform, like a hardware random number
+// generator, into the pool.
+void sgIP_Random_AddEntropy(uint32_t value);
+
+// Returns a random number. It must be called with the stack locked.
+uint32_t sgIP_Random_Get(void);
+
+// SipHash-2-4 of "data" with a 128-bit key, a keyed hash that can't be reversed or predicted
+// without the key (Aumasson and Bernstein, 2012). The key is read as 16 bytes in little endian
+// order, like the reference implementation.
+uint64_t sgIP_SipHash(const uint32_t *key, const void *data, int len);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
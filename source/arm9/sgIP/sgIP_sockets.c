@@ -19,42 +19,14 @@ void sgIP_sockets_Init(void)
     {
         socketlist[i].conn_ptr = 0;
         socketlist[i].flags    = 0;
+        socketlist[i].waiters  = 0;
+#ifdef SGIP_MULTITHREADED_THREADING_MODEL
+        socketlist[i].rx_mutex = sgIP_MutexCreate();
+        socketlist[i].tx_mutex = sgIP_MutexCreate();
+#endif
     }
 }
 
-// Additional timer routine that cleans up after half-closed sockets.
-void sgIP_sockets_Timer1000ms(void)
-{
-    SGIP_INTR_PROTECT();
-    for (int i = 0; i < SGIP_SOCKET_MAXSOCKETS; i++)
-    {
-        if ((socketlist[i].flags & SGIP_SOCKET_FLAG_CLOSING) == SGIP_SOCKET_FLAG_CLOSING)
-        {
-            if (((sgIP_Record_TCP *)socketlist[i].conn_ptr)->tcpstate == SGIP_TCP_STATE_CLOSED)
-            {
-                // Socket is finally closed. Clean up this record.
-                forceclosesocket(i + 1);
-                continue;
-            }
-            if ((socketlist[i].flags & SGIP_SOCKET_MASK_CLOSE_COUNT) == 0)
-            {
-                // Timed out while waiting
-                forceclosesocket(i + 1);
-                continue;
-            }
-
-            // Decrement counter for future reference.
-            unsigned long counter = (socketlist[i].flags & SGIP_SOCKET_MASK_CLOSE_COUNT)
-                                    >> SGIP_SOCKET_SHIFT_CLOSE_COUNT;
-            counter--;
-            counter = counter << SGIP_SOCKET_SHIFT_CLOSE_COUNT;
-
-            socketlist[i].flags = (socketlist[i].flags & ~SGIP_SOCKET_MASK_CLOSE_COUNT) | counter;
-        }
-    }
-    SGIP_INTR_UNPROTECT();
-}
-
 // spawn/kill socket for internal use ONLY.
 int spawn_socket(int flags)
 {
@@ -87,6 +59,29 @@ int kill_socket(int s)
     return 0;
 }
 
+// Releases the stack lock while it waits for progress in the record of a socket. The caller must
+// hold the lock, and pass SGIP_INTR_STATE. The socket may be closed by another thread while the
+// lock is released. In that case this returns -1 with EBADF, and the caller must return without
+// using the record again. closesocket() doesn't free the record until all waiting calls have
+// seen that the socket isn't valid.
+static int wait_socket(int socket, void *conn, int tIME)
+{
+    (void)tIME;
+
+    socketlist[socket].waiters++;
+    SGIP_INTR_UNPROTECT();
+    SGIP_WAITEVENT(conn);
+    SGIP_INTR_REPROTECT();
+    socketlist[socket].waiters--;
+
+    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
+    {
+        SGIP_NOTIFYEVENT(conn); // wake up close_begin()
+        return SGIP_ERROR(EBADF);
+    }
+    return 0;
+}
+
 int socket(int domain, int type, int protocol)
 {
     int s;
@@ -139,6 +134,46 @@ int socket(int domain, int type, int protocol)
     return s + 1;
 }
 
+// Makes a socket invalid so that no new call can use it, and wakes up the calls that are waiting
+// on it, which return with EBADF. Then it waits until they have seen it, and until the calls that
+// hold the socket mutexes have returned. The caller must hold the stack lock, and pass
+// SGIP_INTR_STATE. When this returns, the caller holds the socket mutexes as well as the stack
+// lock, and it's the only user of the record of the socket.
+static void close_begin(int socket, int tIME)
+{
+    (void)tIME;
+
+    void *conn = socketlist[socket].conn_ptr;
+
+    socketlist[socket].flags &= ~SGIP_SOCKET_FLAG_VALID;
+    SGIP_NOTIFYEVENT(conn);
+
+    // The socket mutexes don't exist in the interrupt model, so this is the only thing that keeps
+    // the record alive until the waiting calls are done with it.
+    while (socketlist[socket].waiters > 0)
+    {
+        SGIP_INTR_UNPROTECT();
+        SGIP_WAITEVENT(conn);
+        SGIP_INTR_REPROTECT();
+    }
+
+    // Socket mutexes must be taken before the stack lock.
+    SGIP_INTR_UNPROTECT();
+    SGIP_LOCK(socketlist[socket].rx_mutex);
+    SGIP_LOCK(socketlist[socket].tx_mutex);
+    SGIP_INTR_REPROTECT();
+}
+
+// Frees the socket. The caller must have called close_begin(), and it must still hold the stack
+// lock.
+static void close_end(int socket)
+{
+    socketlist[socket].conn_ptr = 0;
+    socketlist[socket].flags    = 0;
+    SGIP_UNLOCK(socketlist[socket].tx_mutex);
+    SGIP_UNLOCK(socketlist[socket].rx_mutex);
+}
+
 int forceclosesocket(int socket)
 {
     if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
@@ -146,11 +181,13 @@ int forceclosesocket(int socket)
 
     SGIP_INTR_PROTECT();
     socket--;
-    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_ALLOCATED))
+    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
     {
+        // Not open, or another thread is closing it already.
         SGIP_INTR_UNPROTECT();
         return 0;
     }
+    close_begin(socket, SGIP_INTR_STATE);
     if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
     {
         sgIP_TCP_FreeRecord((sgIP_Record_TCP *)socketlist[socket].conn_ptr);
@@ -159,8 +196,7 @@ int forceclosesocket(int socket)
     {
         sgIP_UDP_FreeRecord((sgIP_Record_UDP *)socketlist[socket].conn_ptr);
     }
-    socketlist[socket].conn_ptr = 0;
-    socketlist[socket].flags    = 0;
+    close_end(socket);
     SGIP_INTR_UNPROTECT();
     return 0;
 }
@@ -177,33 +213,61 @@ int closesocket(int socket)
         SGIP_INTR_UNPROTECT();
         return 0;
     }
+    close_begin(socket, SGIP_INTR_STATE);
+    int retval = 0;
     if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
     {
         // TCP is special.
-        int tcpstate = ((sgIP_Record_TCP *)socketlist[socket].conn_ptr)->tcpstate;
+        sgIP_Record_TCP *rec = (sgIP_Record_TCP *)socketlist[socket].conn_ptr;
+        int tcpstate         = rec->tcpstate;
         if (tcpstate == SGIP_TCP_STATE_CLOSED || tcpstate == SGIP_TCP_STATE_UNUSED
             || tcpstate == SGIP_TCP_STATE_NODATA || tcpstate == SGIP_TCP_STATE_LISTEN)
         {
             // Connection already closed / unused. No need to mess around.
-            sgIP_TCP_FreeRecord((sgIP_Record_TCP *)socketlist[socket].conn_ptr);
+            sgIP_TCP_FreeRecord(rec);
+        }
+        else if (rec->linger == 0)
+        {
+            // SO_LINGER with a timeout of 0: reset the connection and free everything right away
+            sgIP_TCP_Abort(rec);
+            sgIP_TCP_FreeRecord(rec);
         }
         else
         {
-            shutdown(socket + 1, 0);
-            socketlist[socket].flags &= ~(SGIP_SOCKET_FLAG_VALID | SGIP_SOCKET_MASK_CLOSE_COUNT);
-            socketlist[socket].flags |= SGIP_SOCKET_FLAG_CLOSING | SGIP_SOCKET_VALUE_CLOSE_COUNT;
-            SGIP_INTR_UNPROTECT();
-            return 0;
+            if (rec->linger > 0)
+            {
+                // SO_LINGER: wait until all data has been sent and acknowledged
+                unsigned long start = sgIP_timems;
+                sgIP_TCP_Close(rec);
+                while (rec->tcpstate != SGIP_TCP_STATE_FIN_WAIT_2
+                       && rec->tcpstate != SGIP_TCP_STATE_TIME_WAIT
+                       && rec->tcpstate != SGIP_TCP_STATE_CLOSED)
+                {
+                    if ((int)(sgIP_timems - start) >= rec->linger)
+                    {
+                        // give up, the data that hasn't been sent is lost
+                        sgIP_TCP_Abort(rec);
+                        retval = SGIP_ERROR(EWOULDBLOCK);
+                        break;
+                    }
+                    SGIP_INTR_UNPROTECT();
+                    SGIP_WAITEVENT(rec);
+                    SGIP_INTR_REPROTECT();
+                }
+            }
+
+            // The stack closes the connection in the background and frees the record when it's
+            // done. The socket can be reused right away.
+            sgIP_TCP_Orphan(rec);
         }
     }
     else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
     {
         sgIP_UDP_FreeRecord((sgIP_Record_UDP *)socketlist[socket].conn_ptr);
     }
-    socketlist[socket].conn_ptr = 0;
-    socketlist[socket].flags    = 0;
+    close_end(socket);
     SGIP_INTR_UNPROTECT();
-    return 0;
+    return retval;
 }
 
 int bind(int socket, const struct sockaddr *addr, int addr_len)
@@ -237,6 +301,43 @@ int bind(int socket, const struct sockaddr *addr, int addr_len)
     return retval;
 }
 
+// Waits until the TCP connection of a socket is established or fails. Non-blocking sockets return
+// EINPROGRESS instead of waiting. The caller must hold the stack lock, and pass SGIP_INTR_STATE so
+// that the lock can be released while waiting.
+static int wait_connected(int socket, int tIME)
+{
+    (void)tIME;
+
+    int i, retval;
+    do
+    {
+        i = ((sgIP_Record_TCP *)socketlist[socket].conn_ptr)->tcpstate;
+        if (i == SGIP_TCP_STATE_ESTABLISHED || i == SGIP_TCP_STATE_CLOSE_WAIT)
+        {
+            retval = 0;
+            break;
+        }
+        if (i == SGIP_TCP_STATE_CLOSED || i == SGIP_TCP_STATE_UNUSED || i == SGIP_TCP_STATE_LISTEN
+            || i == SGIP_TCP_STATE_NODATA)
+        {
+            retval = SGIP_ERROR(((sgIP_Record_TCP *)socketlist[socket].conn_ptr)->errorcode);
+            break;
+        }
+        if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
+        {
+            retval = -1;
+            (void)SGIP_ERROR(EINPROGRESS);
+            break;
+        }
+        if (wait_socket(socket, socketlist[socket].conn_ptr, SGIP_INTR_STATE) < 0)
+        {
+            retval = -1;
+            break;
+        }
+    } while (1);
+    return retval;
+}
+
 int connect(int socket, const struct sockaddr *addr, int addr_len)
 {
     if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
@@ -244,13 +345,15 @@ int connect(int socket, const struct sockaddr *addr, int addr_len)
     if (addr_len != sizeof(struct sockaddr_in))
         return SGIP_ERROR(EINVAL);
 
+    socket--;
+    SGIP_LOCK(socketlist[socket].tx_mutex);
+
     SGIP_INTR_PROTECT();
-    int i;
     int retval = SGIP_ERROR(EINVAL);
-    socket--;
     if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
     {
         SGIP_INTR_UNPROTECT();
+        SGIP_UNLOCK(socketlist[socket].tx_mutex);
         return SGIP_ERROR(EINVAL);
     }
     if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
@@ -259,35 +362,20 @@ int connect(int socket, const struct sockaddr *addr, int addr_len)
                                   ((struct sockaddr_in *)addr)->sin_addr.s_addr,
                                   ((struct sockaddr_in *)addr)->sin_port);
         if (retval == 0)
-        {
-            do
-            {
-                i = ((sgIP_Record_TCP *)socketlist[socket].conn_ptr)->tcpstate;
-                if (i == SGIP_TCP_STATE_ESTABLISHED || i == SGIP_TCP_STATE_CLOSE_WAIT)
-                {
-                    retval = 0;
-                    break;
-                }
-                if (i == SGIP_TCP_STATE_CLOSED || i == SGIP_TCP_STATE_UNUSED
-                    || i == SGIP_TCP_STATE_LISTEN || i == SGIP_TCP_STATE_NODATA)
-                {
-                    retval =
-                        SGIP_ERROR(((sgIP_Record_TCP *)socketlist[socket].conn_ptr)->errorcode);
-                    break;
-                }
-                if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
-                {
-                    retval = -1;
-                    (void)SGIP_ERROR(EINPROGRESS);
-                    break;
-                }
-                SGIP_INTR_UNPROTECT();
-                SGIP_WAITEVENT();
-                SGIP_INTR_REPROTECT();
-            } while (1);
-        }
+            retval = wait_connected(socket, SGIP_INTR_STATE);
+    }
+    else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        // set the default destination, AF_UNSPEC removes it
+        if (addr->sa_family == AF_UNSPEC)
+            retval = sgIP_UDP_Connect((sgIP_Record_UDP *)socketlist[socket].conn_ptr, 0, 0);
+        else
+            retval = sgIP_UDP_Connect((sgIP_Record_UDP *)socketlist[socket].conn_ptr,
+                                      ((struct sockaddr_in *)addr)->sin_addr.s_addr,
+                                      ((struct sockaddr_in *)addr)->sin_port);
     }
     SGIP_INTR_UNPROTECT();
+    SGIP_UNLOCK(socketlist[socket].tx_mutex);
     return retval;
 }
 
@@ -296,13 +384,16 @@ int send(int socket, const void *data, int sendlength, int flags)
     if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
         return -1;
 
+    socket--;
+    SGIP_LOCK(socketlist[socket].tx_mutex);
+
     SGIP_INTR_PROTECT();
     int retval = SGIP_ERROR(EINVAL);
-    socket--;
 
     if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
     {
         SGIP_INTR_UNPROTECT();
+        SGIP_UNLOCK(socketlist[socket].tx_mutex);
         return SGIP_ERROR(EINVAL);
     }
 
@@ -318,12 +409,29 @@ int send(int socket, const void *data, int sendlength, int flags)
                 break;
             if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
                 break;
-            SGIP_INTR_UNPROTECT();
-            SGIP_WAITEVENT();
-            SGIP_INTR_REPROTECT();
+            if (wait_socket(socket, socketlist[socket].conn_ptr, SGIP_INTR_STATE) < 0)
+                break;
+        } while (1);
+    }
+    else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        do
+        {
+            retval = sgIP_UDP_Send((sgIP_Record_UDP *)socketlist[socket].conn_ptr, data,
+                                   sendlength, flags);
+            if (retval != -1)
+                break;
+            if (errno != EWOULDBLOCK)
+                break;
+            if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
+                break;
+            // wait until the rate limit allows sending
+            if (wait_socket(socket, socketlist[socket].conn_ptr, SGIP_INTR_STATE) < 0)
+                break;
         } while (1);
     }
     SGIP_INTR_UNPROTECT();
+    SGIP_UNLOCK(socketlist[socket].tx_mutex);
     return retval;
 }
 
@@ -332,12 +440,15 @@ int recv(int socket, void *data, int recvlength, int flags)
     if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
         return -1;
 
+    socket--;
+    SGIP_LOCK(socketlist[socket].rx_mutex);
+
     SGIP_INTR_PROTECT();
     int retval = SGIP_ERROR(EINVAL);
-    socket--;
     if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
     {
         SGIP_INTR_UNPROTECT();
+        SGIP_UNLOCK(socketlist[socket].rx_mutex);
         return SGIP_ERROR(EINVAL);
     }
     if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
@@ -352,12 +463,30 @@ int recv(int socket, void *data, int recvlength, int flags)
                 break;
             if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
                 break;
-            SGIP_INTR_UNPROTECT();
-            SGIP_WAITEVENT();
-            SGIP_INTR_REPROTECT();
+            if (wait_socket(socket, socketlist[socket].conn_ptr, SGIP_INTR_STATE) < 0)
+                break;
+        } while (1);
+    }
+    else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        unsigned long sender_ip;
+        unsigned short sender_port;
+        do
+        {
+            retval = sgIP_UDP_RecvFrom((sgIP_Record_UDP *)socketlist[socket].conn_ptr, data,
+                                       recvlength, flags, &sender_ip, &sender_port);
+            if (retval != -1)
+                break;
+            if (errno != EWOULDBLOCK)
+                break;
+            if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
+                break;
+            if (wait_socket(socket, socketlist[socket].conn_ptr, SGIP_INTR_STATE) < 0)
+                break;
         } while (1);
     }
     SGIP_INTR_UNPROTECT();
+    SGIP_UNLOCK(socketlist[socket].rx_mutex);
     return retval;
 }
 
@@ -371,26 +500,52 @@ int sendto(int socket, const void *data, int sendlength, int flags, const struct
     if (!addr)
         return -1;
 
+    socket--;
+    SGIP_LOCK(socketlist[socket].tx_mutex);
+
     SGIP_INTR_PROTECT();
     int retval = SGIP_ERROR(EINVAL);
-    socket--;
     if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
     {
         SGIP_INTR_UNPROTECT();
+        SGIP_UNLOCK(socketlist[socket].tx_mutex);
         return SGIP_ERROR(EINVAL);
     }
 
     if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
     {
+        if (flags & MSG_FASTOPEN)
+        {
+            // connect, sending the data in the SYN if we have a cookie for the server
+            retval = sgIP_TCP_FastOpen((sgIP_Record_TCP *)socketlist[socket].conn_ptr,
+                                       ((struct sockaddr_in *)addr)->sin_addr.s_addr,
+                                       ((struct sockaddr_in *)addr)->sin_port, data, sendlength);
+            if (retval >= 0 && wait_connected(socket, SGIP_INTR_STATE) < 0 && errno != EINPROGRESS)
+                retval = -1;
+        }
     }
     else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
     {
-        retval = sgIP_UDP_SendTo((sgIP_Record_UDP *)socketlist[socket].conn_ptr, data, sendlength,
-                                 flags, ((struct sockaddr_in *)addr)->sin_addr.s_addr,
-                                 ((struct sockaddr_in *)addr)->sin_port);
+        do
+        {
+            retval = sgIP_UDP_SendTo((sgIP_Record_UDP *)socketlist[socket].conn_ptr, data,
+                                     sendlength, flags,
+                                     ((struct sockaddr_in *)addr)->sin_addr.s_addr,
+                                     ((struct sockaddr_in *)addr)->sin_port);
+            if (retval != -1)
+                break;
+            if (errno != EWOULDBLOCK)
+                break;
+            if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
+                break;
+            // wait until the rate limit allows sending
+            if (wait_socket(socket, socketlist[socket].conn_ptr, SGIP_INTR_STATE) < 0)
+                break;
+        } while (1);
     }
 
     SGIP_INTR_UNPROTECT();
+    SGIP_UNLOCK(socketlist[socket].tx_mutex);
     return retval;
 }
 
@@ -402,12 +557,15 @@ int recvfrom(int socket, void *data, int recvlength, int flags, struct sockaddr
     if (!addr)
         return -1;
 
+    socket--;
+    SGIP_LOCK(socketlist[socket].rx_mutex);
+
     SGIP_INTR_PROTECT();
     int retval = SGIP_ERROR(EINVAL);
-    socket--;
     if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
     {
         SGIP_INTR_UNPROTECT();
+        SGIP_UNLOCK(socketlist[socket].rx_mutex);
         return SGIP_ERROR(EINVAL);
     }
 
@@ -428,17 +586,144 @@ int recvfrom(int socket, void *data, int recvlength, int flags, struct sockaddr
                 break;
             if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
                 break;
-            SGIP_INTR_UNPROTECT(); // give interrupts a chance to occur.
-            SGIP_WAITEVENT();      // don't just try again immediately
-            SGIP_INTR_REPROTECT();
+            if (wait_socket(socket, socketlist[socket].conn_ptr, SGIP_INTR_STATE) < 0)
+                break;
         } while (1);
         *addr_len = sizeof(struct sockaddr_in);
     }
 
     SGIP_INTR_UNPROTECT();
+    SGIP_UNLOCK(socketlist[socket].rx_mutex);
     return retval;
 }
 
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    (void)flags;
+
+    if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EINVAL);
+    if (!msgvec && vlen > 0)
+        return SGIP_ERROR(EINVAL);
+
+    socket--;
+    SGIP_LOCK(socketlist[socket].tx_mutex);
+
+    SGIP_INTR_PROTECT();
+    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID)
+        || (socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) != SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        SGIP_INTR_UNPROTECT();
+        SGIP_UNLOCK(socketlist[socket].tx_mutex);
+        return SGIP_ERROR(EINVAL);
+    }
+
+    // The ARM7 is notified once, after all the datagrams have been queued.
+    sgIP_Hub_BatchBegin();
+
+    sgIP_Record_UDP *rec = (sgIP_Record_UDP *)socketlist[socket].conn_ptr;
+    int sent             = 0;
+    int retval           = 0;
+    while ((unsigned int)sent < vlen)
+    {
+        struct msghdr *msg       = &msgvec[sent].msg_hdr;
+        struct sockaddr_in *addr = msg->msg_name;
+        unsigned long dest_ip    = 0;
+        int dest_port            = 0;
+        if (addr && msg->msg_namelen >= (int)sizeof(struct sockaddr_in))
+        {
+            dest_ip   = addr->sin_addr.s_addr;
+            dest_port = addr->sin_port;
+        }
+
+        retval = sgIP_UDP_SendMsg(rec, msg->msg_iov, msg->msg_iovlen, dest_ip, dest_port);
+        if (retval >= 0)
+        {
+            msgvec[sent].msg_len = retval;
+            sent++;
+            continue;
+        }
+
+        // Like in Linux, errors are only reported if no datagram has been sent.
+        if (errno != EWOULDBLOCK || sent > 0)
+            break;
+        if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
+            break;
+        // wait until the rate limit allows sending
+        if (wait_socket(socket, socketlist[socket].conn_ptr, SGIP_INTR_STATE) < 0)
+            break;
+    }
+
+    sgIP_Hub_BatchEnd();
+
+    SGIP_INTR_UNPROTECT();
+    SGIP_UNLOCK(socketlist[socket].tx_mutex);
+    return sent > 0 ? sent : retval;
+}
+
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timeval *timeout)
+{
+    (void)flags;
+
+    if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EINVAL);
+    if ((!msgvec && vlen > 0) || timeout)
+        return SGIP_ERROR(EINVAL);
+
+    socket--;
+    SGIP_LOCK(socketlist[socket].rx_mutex);
+
+    SGIP_INTR_PROTECT();
+    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID)
+        || (socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) != SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        SGIP_INTR_UNPROTECT();
+        SGIP_UNLOCK(socketlist[socket].rx_mutex);
+        return SGIP_ERROR(EINVAL);
+    }
+
+    sgIP_Record_UDP *rec = (sgIP_Record_UDP *)socketlist[socket].conn_ptr;
+    int received         = 0;
+    int retval           = 0;
+    while ((unsigned int)received < vlen)
+    {
+        struct msghdr *msg = &msgvec[received].msg_hdr;
+        unsigned long sender_ip;
+        unsigned short sender_port;
+
+        retval = sgIP_UDP_RecvMsg(rec, msg->msg_iov, msg->msg_iovlen, &msg->msg_flags,
+                                  &sender_ip, &sender_port);
+        if (retval >= 0)
+        {
+            struct sockaddr_in *addr = msg->msg_name;
+            if (addr && msg->msg_namelen >= (int)sizeof(struct sockaddr_in))
+            {
+                addr->sin_family      = AF_INET;
+                addr->sin_port        = sender_port;
+                addr->sin_addr.s_addr = sender_ip;
+                msg->msg_namelen      = sizeof(struct sockaddr_in);
+            }
+            msg->msg_controllen      = 0;
+            msgvec[received].msg_len = retval;
+            received++;
+            continue;
+        }
+
+        // Only wait for the first datagram, then return everything that is already queued.
+        if (errno != EWOULDBLOCK || received > 0)
+            break;
+        if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
+            break;
+        if (wait_socket(socket, socketlist[socket].conn_ptr, SGIP_INTR_STATE) < 0)
+            break;
+    }
+
+    SGIP_INTR_UNPROTECT();
+    SGIP_UNLOCK(socketlist[socket].rx_mutex);
+    return received > 0 ? received : retval;
+}
+
 int listen(int socket, int max_connections)
 {
     if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
@@ -465,16 +750,19 @@ int accept(int socket, struct sockaddr *addr, int *addr_len)
     if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS || !addr || !addr_len)
         return SGIP_ERROR(EINVAL);
 
+    socket--;
+    SGIP_LOCK(socketlist[socket].rx_mutex);
+
     SGIP_INTR_PROTECT();
     sgIP_Record_TCP *ret;
     int retval, s;
     retval = SGIP_ERROR0(EINVAL);
     ret    = 0;
-    socket--;
 
     if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
     {
         SGIP_INTR_UNPROTECT();
+        SGIP_UNLOCK(socketlist[socket].rx_mutex);
         return SGIP_ERROR(EINVAL);
     }
     if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
@@ -492,9 +780,8 @@ int accept(int socket, struct sockaddr *addr, int *addr_len)
                     break;
                 if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
                     break;
-                SGIP_INTR_UNPROTECT(); // give interrupts a chance to occur.
-                SGIP_WAITEVENT();      // don't just try again immediately
-                SGIP_INTR_REPROTECT();
+                if (wait_socket(socket, socketlist[socket].conn_ptr, SGIP_INTR_STATE) < 0)
+                    break;
             } while (1);
         }
         if (ret == 0)
@@ -516,6 +803,7 @@ int accept(int socket, struct sockaddr *addr, int *addr_len)
         }
     }
     SGIP_INTR_UNPROTECT();
+    SGIP_UNLOCK(socketlist[socket].rx_mutex);
     return retval;
 }
 
@@ -569,7 +857,7 @@ int ioctl(int socket, long cmd, void *arg)
             else
             {
                 socketlist[socket].flags &= ~SGIP_SOCKET_FLAG_NONBLOCKING;
-                if (*((unsigned long *)arg))
+                if (*((int *)arg))
                     socketlist[socket].flags |= SGIP_SOCKET_FLAG_NONBLOCKING;
             }
             break;
@@ -586,7 +874,7 @@ int ioctl(int socket, long cmd, void *arg)
                     i = ((sgIP_Record_TCP *)socketlist[socket].conn_ptr)->buf_rx_out
                         - ((sgIP_Record_TCP *)socketlist[socket].conn_ptr)->buf_rx_in;
                     if (i < 0)
-                        i += SGIP_TCP_RECEIVEBUFFERLENGTH;
+                        i += ((sgIP_Record_TCP *)socketlist[socket].conn_ptr)->buf_rx_size;
                     *((int *)arg) = i;
                 }
                 else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK)
@@ -599,7 +887,7 @@ int ioctl(int socket, long cmd, void *arg)
                     }
                     else
                     {
-                        i             = rec->incoming_queue->totallength - 12;
+                        i             = rec->incoming_queue->totallength - SGIP_UDP_QUEUEHEADER;
                         *((int *)arg) = i;
                     }
                 }
@@ -620,24 +908,56 @@ int ioctl(int socket, long cmd, void *arg)
 
 int setsockopt(int socket, int level, int option_name, const void *data, int data_len)
 {
-    (void)socket;
-    (void)level;
-    (void)option_name;
-    (void)data;
-    (void)data_len;
+    if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EBADF);
 
-    return 0;
+    SGIP_INTR_PROTECT();
+    int retval = 0;
+    socket--;
+    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(EBADF);
+    }
+    if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
+    {
+        retval = sgIP_TCP_SetOption((sgIP_Record_TCP *)socketlist[socket].conn_ptr, level,
+                                    option_name, data, data_len);
+    }
+    else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        retval = sgIP_UDP_SetOption((sgIP_Record_UDP *)socketlist[socket].conn_ptr, level,
+                                    option_name, data, data_len);
+    }
+    SGIP_INTR_UNPROTECT();
+    return retval;
 }
 
 int getsockopt(int socket, int level, int option_name, void *data, int *data_len)
 {
-    (void)socket;
-    (void)level;
-    (void)option_name;
-    (void)data;
-    (void)data_len;
+    if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EBADF);
 
-    return 0;
+    SGIP_INTR_PROTECT();
+    int retval = SGIP_ERROR(ENOPROTOOPT);
+    socket--;
+    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(EBADF);
+    }
+    if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
+    {
+        retval = sgIP_TCP_GetOption((sgIP_Record_TCP *)socketlist[socket].conn_ptr, level,
+                                    option_name, data, data_len);
+    }
+    else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        retval = sgIP_UDP_GetOption((sgIP_Record_UDP *)socketlist[socket].conn_ptr, level,
+                                    option_name, data, data_len);
+    }
+    SGIP_INTR_UNPROTECT();
+    return retval;
 }
 
 int getpeername(int socket, struct sockaddr *addr, int *addr_len)
@@ -677,6 +997,20 @@ int getpeername(int socket, struct sockaddr *addr, int *addr_len)
             }
         }
     }
+    else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        struct sockaddr_in *sain = (struct sockaddr_in *)addr;
+        sgIP_Record_UDP *rec     = (sgIP_Record_UDP *)socketlist[socket].conn_ptr;
+        if (rec->destip == 0)
+        {
+            SGIP_INTR_UNPROTECT();
+            return SGIP_ERROR(ENOTCONN);
+        }
+        sain->sin_addr.s_addr = rec->destip;
+        sain->sin_family      = AF_INET;
+        sain->sin_port        = rec->destport;
+        *addr_len             = sizeof(struct sockaddr_in);
+    }
     else
     {
         SGIP_INTR_UNPROTECT();
@@ -788,6 +1122,12 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct
             {
                 if (FD_ISSET(i + 1, readfds))
                 {
+                    if (!(socketlist[i].flags & SGIP_SOCKET_FLAG_VALID))
+                    {
+                        // Closed, maybe by another thread: the next call on it fails
+                        timeout_ms = 0;
+                        break;
+                    }
                     if ((socketlist[i].flags & SGIP_SOCKET_FLAG_TYPEMASK)
                         == SGIP_SOCKET_FLAG_TYPE_TCP)
                     {
@@ -815,7 +1155,7 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct
                              == SGIP_SOCKET_FLAG_TYPE_UDP)
                     {
                         urec = (sgIP_Record_UDP *)socketlist[i].conn_ptr;
-                        if (urec->incoming_queue)
+                        if (urec->incoming_queue || urec->errorcode)
                         {
                             timeout_ms = 0;
                             break;
@@ -833,6 +1173,12 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct
             {
                 if (FD_ISSET(i + 1, writefds))
                 {
+                    if (!(socketlist[i].flags & SGIP_SOCKET_FLAG_VALID))
+                    {
+                        // Closed, maybe by another thread: the next call on it fails
+                        timeout_ms = 0;
+                        break;
+                    }
                     if ((socketlist[i].flags & SGIP_SOCKET_FLAG_TYPEMASK)
                         == SGIP_SOCKET_FLAG_TYPE_TCP)
                     {
@@ -860,8 +1206,8 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct
         else
             timeout_ms -= temp;
         lasttime += temp;
-        SGIP_INTR_UNPROTECT(); // give interrupts a chance to occur.
-        SGIP_WAITEVENT();      // don't just try again immediately
+        SGIP_INTR_UNPROTECT();          // give interrupts a chance to occur.
+        SGIP_WAITEVENT(SGIP_EVENT_ANY); // don't just try again immediately
         SGIP_INTR_REPROTECT();
     }
     // markup fd sets and return
@@ -873,7 +1219,12 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct
         {
             if (FD_ISSET(i + 1, readfds))
             {
-                if ((socketlist[i].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
+                if (!(socketlist[i].flags & SGIP_SOCKET_FLAG_VALID))
+                {
+                    retval++;
+                }
+                else if ((socketlist[i].flags & SGIP_SOCKET_FLAG_TYPEMASK)
+                         == SGIP_SOCKET_FLAG_TYPE_TCP)
                 {
                     rec = (sgIP_Record_TCP *)socketlist[i].conn_ptr;
                     if (rec->tcpstate == SGIP_TCP_STATE_LISTEN && rec->listendata
@@ -900,7 +1251,7 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct
                          == SGIP_SOCKET_FLAG_TYPE_UDP)
                 {
                     urec = (sgIP_Record_UDP *)socketlist[i].conn_ptr;
-                    if (!urec->incoming_queue)
+                    if (!urec->incoming_queue && !urec->errorcode)
                     {
                         FD_CLR(i + 1, readfds);
                     }
@@ -920,7 +1271,12 @@ int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct
         {
             if (FD_ISSET(i + 1, writefds))
             {
-                if ((socketlist[i].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
+                if (!(socketlist[i].flags & SGIP_SOCKET_FLAG_VALID))
+                {
+                    retval++;
+                }
+                else if ((socketlist[i].flags & SGIP_SOCKET_FLAG_TYPEMASK)
+                         == SGIP_SOCKET_FLAG_TYPE_TCP)
                 {
                     rec = (sgIP_Record_TCP *)socketlist[i].conn_ptr;
                     j   = rec->buf_tx_in - 1;
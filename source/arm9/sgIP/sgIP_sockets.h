@@ -17,29 +17,25 @@ extern "C" {
 
 #include "arm9/sgIP/sgIP_Config.h"
 
-#define SGIP_SOCKET_FLAG_ALLOCATED    0x8000
-#define SGIP_SOCKET_FLAG_NONBLOCKING  0x4000
-#define SGIP_SOCKET_FLAG_VALID        0x2000
-#define SGIP_SOCKET_FLAG_CLOSING      0x1000
-#define SGIP_SOCKET_FLAG_TYPEMASK     0x0001
-#define SGIP_SOCKET_FLAG_TYPE_TCP     0x0001
-#define SGIP_SOCKET_FLAG_TYPE_UDP     0x0000
-#define SGIP_SOCKET_MASK_CLOSE_COUNT  0xFFFF0000
-#define SGIP_SOCKET_SHIFT_CLOSE_COUNT 16
-
-// Maybe define a better value for this in the future. But 5 minutes sounds ok.
-// TCP specification disagrees on this point, but this is a limited platform.
-// 5 minutes assuming 1000ms ticks = 300 = 0x12c
-#define SGIP_SOCKET_VALUE_CLOSE_COUNT (0x12c << SGIP_SOCKET_SHIFT_CLOSE_COUNT)
+#define SGIP_SOCKET_FLAG_ALLOCATED   0x8000
+#define SGIP_SOCKET_FLAG_NONBLOCKING 0x4000
+#define SGIP_SOCKET_FLAG_VALID       0x2000
+#define SGIP_SOCKET_FLAG_TYPEMASK    0x0001
+#define SGIP_SOCKET_FLAG_TYPE_TCP    0x0001
+#define SGIP_SOCKET_FLAG_TYPE_UDP    0x0000
 
 typedef struct SGIP_SOCKET_DATA
 {
     unsigned int flags;
     void *conn_ptr;
+    int waiters; // Number of calls that are waiting in wait_socket()
+#ifdef SGIP_MULTITHREADED_THREADING_MODEL
+    void *rx_mutex; // Held by threads receiving data or accepting connections
+    void *tx_mutex; // Held by threads sending data or connecting
+#endif
 } sgIP_socket_data;
 
 void sgIP_sockets_Init(void);
-void sgIP_sockets_Timer1000ms(void);
 
 // sys/socket.h
 int socket(int domain, int type, int protocol);
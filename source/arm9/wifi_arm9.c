@@ -56,12 +56,43 @@ const char *ASSOCSTATUS_STRINGS[] = {
 
 sgIP_Hub_HWInterface *wifi_hw;
 
+// Frames have been queued during a batch and the ARM7 hasn't been notified yet.
+static bool tx_sync_pending;
+
+static WifiWaitHandler wifi_wait_handler;
+static WifiNotifyHandler wifi_notify_handler;
+
+void Wifi_SetWaitHandlers(WifiWaitHandler wait, WifiNotifyHandler notify)
+{
+    int oldIME = enterCriticalSection();
+
+    wifi_wait_handler   = wait;
+    wifi_notify_handler = notify;
+
+    leaveCriticalSection(oldIME);
+}
+
 // This function is used in socket handling code when the user has selected
 // blocking mode. They are called after every retry to give interrupts a chance
 // to happen (interrupts are disabled in critical sections).
-void sgIP_IntrWaitEvent(void)
+void sgIP_IntrWaitEvent(const void *event)
 {
-    swiDelay(20000);
+    WifiWaitHandler wait = wifi_wait_handler;
+
+    if (wait)
+        wait(event);
+    else
+        swiDelay(20000);
+}
+
+// This is called by the stack (usually from an interrupt handler) when a
+// record that may have threads waiting on it has made progress.
+void sgIP_IntrNotifyEvent(const void *event)
+{
+    WifiNotifyHandler notify = wifi_notify_handler;
+
+    if (notify)
+        notify(event);
 }
 
 #ifdef SGIP_DEBUG
@@ -305,11 +336,26 @@ static int Wifi_TransmitFunction(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
     WifiData->stats[WSTAT_TXQUEUEDPACKETS]++;
     WifiData->stats[WSTAT_TXQUEUEDBYTES] += hdrlen + body_size;
 
-    Wifi_CallSyncHandler();
+    // When sgIP sends a batch of frames, notify the ARM7 once at the end of the batch.
+    if (sgIP_Hub_InBatch())
+        tx_sync_pending = true;
+    else
+        Wifi_CallSyncHandler();
 
     return 0;
 }
 
+static void Wifi_FlushFunction(sgIP_Hub_HWInterface *hw)
+{
+    (void)hw;
+
+    if (tx_sync_pending)
+    {
+        tx_sync_pending = false;
+        Wifi_CallSyncHandler();
+    }
+}
+
 static int Wifi_Interface_Init(sgIP_Hub_HWInterface *hw)
 {
     hw->MTU       = 2300;
@@ -319,7 +365,8 @@ static int Wifi_Interface_Init(sgIP_Hub_HWInterface *hw)
     hw->dns[0]    = (192) | (168 << 8) | (1 << 16) | (1 << 24);
     hw->hwaddrlen = 6;
     Wifi_CopyMacAddr(hw->hwaddr, WifiData->MacAddr);
-    hw->userdata = 0;
+    hw->userdata      = 0;
+    hw->FlushFunction = Wifi_FlushFunction;
     return 0;
 }
 
@@ -346,12 +393,13 @@ static void Wifi_sgIpHandlePacket(int base, int len)
 
     // With toDS=0, regardless of the value of fromDS, Address 1 is RA/DA
     // (Receiver Address / Destination Address), which is the final recipient of
-    // the frame. Only accept messages addressed to our MAC address or to all
-    // devices.
+    // the frame. Only accept messages addressed to our MAC address, to all
+    // devices, or to a multicast group that we have joined.
 
     // ethhdr_print('!', ieee->addr_1);
     if (!(Wifi_CmpMacAddr(ieee->addr_1, WifiData->MacAddr) ||
-          Wifi_CmpMacAddr(ieee->addr_1, (void *)&wifi_broadcast_addr)))
+          Wifi_CmpMacAddr(ieee->addr_1, (void *)&wifi_broadcast_addr) ||
+          sgIP_IGMP_IsMemberMAC((const unsigned char *)ieee->addr_1)))
         return;
 
     // Okay, the frame is addressed to us (or to everyone). Let's parse it.
@@ -458,9 +506,52 @@ void Wifi_SetIP(u32 IPaddr, u32 gateway, u32 subnetmask, u32 dns1, u32 dns2)
         wifi_hw->dns[1]  = dns2;
         // reset arp cache...
         sgIP_ARP_FlushInterface(wifi_hw);
+        // if we are already connected, the new configuration has to be announced now
+        if (IPaddr && (WifiData->flags9 & WFLAG_ARM9_NETREADY))
+            sgIP_ARP_Announce(wifi_hw);
     }
 }
 
+int Wifi_AddARPEntry(u32 IPaddr, const u8 *mac)
+{
+    if (!wifi_hw || !mac)
+        return -1;
+
+    return sgIP_ARP_AddEntry(wifi_hw, IPaddr, mac) ? 0 : -1;
+}
+
+int Wifi_CaptureStart(void *buffer, int size, int snaplen)
+{
+    return sgIP_Hub_CaptureStart(buffer, size, snaplen);
+}
+
+void Wifi_CaptureStop(void)
+{
+    sgIP_Hub_CaptureStop();
+}
+
+int Wifi_CaptureRead(void *dest, int size)
+{
+    return sgIP_Hub_CaptureRead(dest, size);
+}
+
+u32 Wifi_CaptureDropped(void)
+{
+    return sgIP_Hub_CaptureDropped();
+}
+
+void Wifi_CaptureFileHeader(void *dest, int snaplen)
+{
+    u32 *hdr = dest;
+
+    hdr[0] = 0xA1B2C3D4;    // Magic number (microsecond timestamps)
+    hdr[1] = 2 | (4 << 16); // Version 2.4
+    hdr[2] = 0;             // Timezone offset
+    hdr[3] = 0;             // Timestamp accuracy
+    hdr[4] = snaplen;
+    hdr[5] = 1; // LINKTYPE_ETHERNET
+}
+
 #endif // WIFI_USE_TCP_SGIP
 
 // Functions that behave differently with sgIP and without it
@@ -491,6 +582,10 @@ void Wifi_Update(void)
             sgIP_timems = WifiData->random; // hacky! but it should work just fine :)
         }
     }
+    // The ARM7 mixes the random number generator of the wifi hardware into this value all the
+    // time. Keep feeding it to the secrets of the stack.
+    if (WifiData->flags9 & WFLAG_ARM9_ARM7READY)
+        sgIP_Random_AddEntropy(WifiData->random);
     if (WifiData->authlevel != WIFI_AUTHLEVEL_ASSOCIATED && WifiData->flags9 & WFLAG_ARM9_NETUP)
     {
         WifiData->flags9 &= ~WFLAG_ARM9_NETUP;